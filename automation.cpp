@@ -0,0 +1,134 @@
+/*
+ *      automation.cpp
+ *
+ *      Mix automation (song / track vol and pan along the sequence) for xdrum
+ *
+ */
+
+#include <stdio.h>
+#include "SDL.h"
+#include "SDL_mixer.h"
+#include "platform.h"
+#include "pattern.h"
+#include "song.h"
+#include "tempomap.h"
+#include "spscqueue.h"
+#include "dynamics.h"
+#include "engine.h"
+#include "automation.h"
+
+// constructor
+AutomationPlayer::AutomationPlayer()
+{
+	m_active = false;
+}
+
+/// Send the bus gains for a tick to the engine (play thread, or an offline
+/// render)
+/// @param audio			Engine
+/// @param song				Song
+/// @param map				Tempo map of the song (song positions of the ticks)
+/// @param active			Play the automation? (false = all gains back to 1.0)
+/// @param tick				Tick of the song sequence
+/// @param timeNs			Time of the tick
+void AutomationPlayer::Update(AudioEngine* audio, const Song* song, const TempoMap* map, bool active, int tick, Uint64 timeNs)
+{
+	EngineGains gains;
+	if (!active)
+		{
+		// back to 1.0 (once)
+		if (m_active)
+			{
+			gains.SetUnity();
+			audio->SetGains(&gains, timeNs);
+			m_active = false;
+			}
+		return;
+		}
+
+	GetGains(song, map, tick, &gains);
+	audio->SetGains(&gains, timeNs);
+	m_active = true;
+}
+
+/// Get the value of a lane at a tick of the song sequence
+/// @param lane				Lane
+/// @param map				Tempo map of the song
+/// @param tick				Tick of the song sequence
+/// @return					Value (1/AUTOMATION_VALUE_SCALE units), or -1 if the lane
+///							has no points in the sequence
+int AutomationPlayer::GetValue(const AutomationLane* lane, const TempoMap* map, int tick)
+{
+	// points past the end of the sequence are not played (they are all
+	// at the end, as the points are in sequence order)
+	const AutomationPoint* points = lane->points;
+	int count = lane->numPoints;
+	while (count > 0 && map->GetStepTick(points[count - 1].songPos, points[count - 1].step) < 0)
+		count--;
+	if (0 == count)
+		return -1;
+
+	// last point at or before the tick
+	int low = -1;
+	int high = count - 1;
+	while (low < high)
+		{
+		int mid = (low + high + 1) / 2;
+		if (map->GetStepTick(points[mid].songPos, points[mid].step) <= tick)
+			low = mid;
+		else
+			high = mid - 1;
+		}
+
+	// before the first point / after the last point, the value stays the same
+	if (low < 0)
+		return points[0].value * AUTOMATION_VALUE_SCALE;
+	if (count - 1 == low)
+		return points[low].value * AUTOMATION_VALUE_SCALE;
+
+	int fromTick = map->GetStepTick(points[low].songPos, points[low].step);
+	int toTick = map->GetStepTick(points[low + 1].songPos, points[low + 1].step);
+	int from = points[low].value * AUTOMATION_VALUE_SCALE;
+	int to = points[low + 1].value * AUTOMATION_VALUE_SCALE;
+	if (toTick <= fromTick)
+		return to;
+	return from + (int)(((Sint64)(to - from) * (tick - fromTick)) / (toTick - fromTick));
+}
+
+/// Work out the bus gain of each track at a tick of the song sequence
+/// (settings that are not automated are already in the hits' volumes, so
+/// they are left at a gain of 1.0)
+/// @param song				Song
+/// @param map				Tempo map of the song
+/// @param tick				Tick of the song sequence
+/// @param gains			Gains to fill in
+void AutomationPlayer::GetGains(const Song* song, const TempoMap* map, int tick, EngineGains* gains)
+{
+	gains->SetUnity();
+	const int full = 255 * AUTOMATION_VALUE_SCALE;
+	const int centre = 128 * AUTOMATION_VALUE_SCALE;
+	int master = GetValue(&song->automation[AUTOMATION_MASTER_VOL], map, tick);
+	for (int track = 0; track < NUM_TRACKS && track < ENGINE_MAX_BUSES; track++)
+		{
+		int vol = GetValue(&song->automation[AUTOMATION_TRACK_VOL(track)], map, tick);
+		int pan = GetValue(&song->automation[AUTOMATION_TRACK_PAN(track)], map, tick);
+		if (master < 0 && vol < 0 && pan < 0)
+			continue;
+
+		Sint64 gain = ENGINE_UNITY_GAIN;
+		if (master >= 0)
+			gain = (gain * master) / full;
+		if (vol >= 0)
+			gain = (gain * vol) / full;
+		Sint64 left = gain;
+		Sint64 right = gain;
+		if (pan >= 0)
+			{
+			// (the same pan law as the engine's voices)
+			left = (gain * ((pan > centre) ? full - pan : centre)) / centre;
+			right = (gain * ((pan < centre) ? pan : centre)) / centre;
+			}
+		gains->left[track] = (unsigned short)left;
+		gains->right[track] = (unsigned short)right;
+		}
+}
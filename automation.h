@@ -0,0 +1,37 @@
+// xdrum mix automation
+//
+// Automation lanes (see AutomationLane in song.h) move the song vol and the
+// vol and pan of each track along the song sequence, in song mode. While a
+// lane has points, it replaces the setting it automates.
+// Automated settings are not applied to each hit, like the other mix
+// settings (when a step's triggers are compiled). Instead, the play thread
+// works out the gain of each track once per tick and sends it to the audio
+// engine, where each track plays on its own bus. The engine moves each
+// bus gain in a straight line, sample by sample, from one tick's gain to
+// the next, so the mix moves smoothly (no "zipper noise"), and the
+// triggers do not need compiling again as the settings move.
+// The points of a lane are at song positions, so a lane is evaluated with
+// the tempo map's song position table (and a binary search for the points
+// either side of the tick).
+// Automated pan is applied as a balance on the track's bus. Without the
+// 16 bit stereo engine (SDL_mixer channels), automation is not played.
+// Needs SDL.h, SDL_mixer.h, pattern.h, song.h, tempomap.h and engine.h
+// included first.
+
+#define AUTOMATION_VALUE_SCALE		256			// lane values are in 1/256 units
+
+/// Sends a song's mix automation to an audio engine
+class AutomationPlayer
+{
+public:
+	// constructor
+	AutomationPlayer();
+
+	void Update(AudioEngine* audio, const Song* song, const TempoMap* map, bool active, int tick, Uint64 timeNs);
+
+	static int GetValue(const AutomationLane* lane, const TempoMap* map, int tick);
+	static void GetGains(const Song* song, const TempoMap* map, int tick, EngineGains* gains);
+
+private:
+	bool m_active;							// were the last gains sent automated?
+};
@@ -31,7 +31,10 @@ Drum::~Drum()
 #define KIT_DEBUG	true
 
 /// Load a drumkit
-bool DrumKit::Load(const char* kitname, void (*progressCallback)(int))
+/// @param kitname			Name of the drumkit (folder in kits)
+/// @param progressCallback	Progress display
+/// @param loadSamples		Load the samples? (false = names and MIDI notes only)
+bool DrumKit::Load(const char* kitname, void (*progressCallback)(int), bool loadSamples)
 {
 	char scmd[200], stemp[200];
 	FILE *pfile;
@@ -179,10 +182,13 @@ bool DrumKit::Load(const char* kitname, void (*progressCallback)(int))
 									// TODO : safe name copy
 									strcpy(drums[i].name, sname);
 									// Load sample
-									if (drums[i].sampleData)
-										Mix_FreeChunk(drums[i].sampleData);
-									drums[i].sampleData = Mix_LoadWAV(samplePath);
-									if (KIT_DEBUG) printf("sampledata: %X\n", (unsigned int)drums[i].sampleData);
+									if (loadSamples)
+										{
+										if (drums[i].sampleData)
+											Mix_FreeChunk(drums[i].sampleData);
+										drums[i].sampleData = Mix_LoadWAV(samplePath);
+										if (KIT_DEBUG) printf("sampledata: %X\n", (unsigned int)drums[i].sampleData);
+										}
 
 									// update progress bar
 									progressCallback(trackNum * 10);
@@ -206,6 +212,20 @@ bool DrumKit::Load(const char* kitname, void (*progressCallback)(int))
 				
 			}	// end if track def
 
+		// MIDI note of a track? (note<n>=<MIDI note number>)
+		if(strstr(scmd, "note") == scmd)
+			{
+			validCmd = true;
+			int trackNum = 0;
+			int note = -1;
+			sscanf(scmd+4, "%d=%d", &trackNum, &note);
+			if (trackNum >= 1 && trackNum <= MAX_DRUMS_PER_KIT && note >= 0 && note <= 127)
+				{
+				validParam = true;
+				drums[trackNum - 1].midiNote = (unsigned char)note;
+				}
+			}
+
 		// drumkit name?
 		if(strstr(scmd, "name") == scmd)
 			{
@@ -9,6 +9,10 @@
 #define DRUMKIT_NAME_LEN	32
 #define MAX_DRUMS_PER_KIT	8
 
+// General MIDI drum notes for the standard kit (see doc/standard_kit.txt),
+// used for MIDI files unless the kit.cfg has note<n>= lines
+#define DEFAULT_MIDI_NOTES	{ 36, 38, 42, 46, 39, 45, 56, 69 }
+
 /// class representing a drum in a drumkit
 class Drum
 {
@@ -30,6 +34,7 @@ public:
 		};
 
 	unsigned char vol;
+	unsigned char midiNote;				// MIDI note number (MIDI file export / import)
 	unsigned char pan;
 	char name[DRUM_NAME_LEN];
 	Mix_Chunk* sampleData;
@@ -47,12 +52,16 @@ public:
 	
 	void Init()
 		{
+		static const unsigned char defaultNotes[MAX_DRUMS_PER_KIT] = DEFAULT_MIDI_NOTES;
 		name[0] = 0;
+		for (int i = 0; i < MAX_DRUMS_PER_KIT; i++)
+			drums[i].midiNote = defaultNotes[i];
 		};
 		
 	char name[DRUMKIT_NAME_LEN];
 	Drum drums[MAX_DRUMS_PER_KIT];
 	
-	bool Load(const char* kitname, void (*progressCallback)(int));
+	// Load the kit (loadSamples = false for just the names and MIDI notes)
+	bool Load(const char* kitname, void (*progressCallback)(int), bool loadSamples = true);
 };
 
@@ -0,0 +1,226 @@
+/*
+ *      dynamics.cpp
+ *
+ *      Master bus compressor and look-ahead limiter for xdrum
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+#include "SDL.h"
+#include "platform.h"
+#include "dynamics.h"
+
+// dB to linear (sample units - 32767 = 0 dBFS)
+#define DYNAMICS_DB_TO_LEVEL(db)	(32767.0f * powf(10.0f, (db) / 20.0f))
+
+// constructor
+MasterDynamics::MasterDynamics()
+{
+	m_limiterOn = true;
+	m_ceilingDb = -1;
+	m_compressorOn = false;
+	m_thresholdDb = -12;
+	m_ratio = 4;
+	m_version = 1;
+	m_coefVersion = 0;
+	m_coefRate = 0;
+	m_on = false;
+	m_ceiling = 32767.0f;
+	m_threshold = 32767.0f;
+	m_slope = 0.0f;
+	m_compAttack = 1.0f;
+	m_compRelease = 1.0f;
+	m_limitRelease = 1.0f;
+	Reset();
+}
+
+/// Set the limiter
+/// @param on				Limiter on?
+/// @param ceilingDb		Highest output level (dBFS, 0 or less)
+void MasterDynamics::SetLimiter(bool on, int ceilingDb)
+{
+	m_limiterOn = on;
+	m_ceilingDb = (ceilingDb < 0) ? ceilingDb : 0;
+	m_version++;
+}
+
+/// Set the compressor
+/// @param on				Compressor on?
+/// @param thresholdDb		Level the compressor starts turning the gain down at (dBFS)
+/// @param ratio			Compression ratio above the threshold (n:1)
+void MasterDynamics::SetCompressor(bool on, int thresholdDb, int ratio)
+{
+	m_compressorOn = on;
+	m_thresholdDb = (thresholdDb < 0) ? thresholdDb : 0;
+	m_ratio = (ratio > 1) ? ratio : 1;
+	m_version++;
+}
+
+/// Use the same settings as another MasterDynamics (eg: for an offline
+/// render)
+void MasterDynamics::CopySettings(const MasterDynamics* dynamics)
+{
+	SetLimiter(dynamics->m_limiterOn, dynamics->m_ceilingDb);
+	SetCompressor(dynamics->m_compressorOn, dynamics->m_thresholdDb, dynamics->m_ratio);
+}
+
+/// Get the delay through the dynamics
+/// @return					Delay (sample frames)
+int MasterDynamics::GetLatency() const
+{
+	return (m_limiterOn || m_compressorOn) ? (DYNAMICS_LOOKAHEAD + 1) * DYNAMICS_SUB_BLOCK : 0;
+}
+
+/// Work out the coefficients from the settings (audio thread)
+void MasterDynamics::Update(int rate)
+{
+	bool wasOn = m_on;
+	m_coefVersion = m_version;
+	m_coefRate = rate;
+	m_on = (m_limiterOn || m_compressorOn);
+	m_ceiling = DYNAMICS_DB_TO_LEVEL(m_ceilingDb);
+	m_threshold = m_compressorOn ? DYNAMICS_DB_TO_LEVEL(m_thresholdDb) : 32767.0f;
+	m_slope = m_compressorOn ? 1.0f / m_ratio - 1.0f : 0.0f;
+
+	// one pole coefficients, per sub-block
+	float subBlocksPerMs = (float)rate / (1000.0f * DYNAMICS_SUB_BLOCK);
+	m_compAttack = 1.0f - expf(-1.0f / (DYNAMICS_COMP_ATTACK_MS * subBlocksPerMs));
+	m_compRelease = 1.0f - expf(-1.0f / (DYNAMICS_COMP_RELEASE_MS * subBlocksPerMs));
+	m_limitRelease = 1.0f - expf(-1.0f / (DYNAMICS_LIMIT_RELEASE_MS * subBlocksPerMs));
+
+	// (start from silence when switched on)
+	if (m_on && !wasOn)
+		Reset();
+}
+
+/// Clear the delay and the gains
+void MasterDynamics::Reset()
+{
+	m_envelope = 0.0f;
+	m_compGain = 1.0f;
+	m_limitGain = 1.0f;
+	m_pending = 0;
+	memset(m_input, 0, sizeof(m_input));
+	memset(m_ready, 0, sizeof(m_ready));
+	m_slot = 0;
+	memset(m_delay, 0, sizeof(m_delay));
+	for (int i = 0; i <= DYNAMICS_LOOKAHEAD; i++)
+		m_target[i] = 1.0f;
+}
+
+/// Pass a mix through the dynamics (audio thread)
+/// @param mix				Mix (stereo, 16 bit range, not clipped)
+/// @param out				Output (16 bit stereo)
+/// @param frames			Length of the mix (sample frames)
+/// @param rate				Sample rate (Hz)
+void MasterDynamics::Process(const Sint32* mix, Sint16* out, int frames, int rate)
+{
+	if (m_coefVersion != m_version || m_coefRate != rate)
+		Update(rate);
+
+	// both off - just clip
+	if (!m_on)
+		{
+		for (int i = 0; i < frames * 2; i++)
+			{
+			Sint32 sample = mix[i];
+			out[i] = (Sint16)((sample > 32767) ? 32767 : ((sample < -32768) ? -32768 : sample));
+			}
+		return;
+		}
+
+	// fill the input sub-block while emptying the output sub-block (which
+	// is DYNAMICS_LOOKAHEAD sub-blocks behind it)
+	while (frames > 0)
+		{
+		int count = DYNAMICS_SUB_BLOCK - m_pending;
+		if (count > frames)
+			count = frames;
+		memcpy(&m_input[m_pending * 2], mix, count * 2 * sizeof(Sint32));
+		memcpy(out, &m_ready[m_pending * 2], count * 2 * sizeof(Sint16));
+		m_pending += count;
+		mix += count * 2;
+		out += count * 2;
+		frames -= count;
+		if (DYNAMICS_SUB_BLOCK == m_pending)
+			{
+			ProcessSubBlock();
+			m_pending = 0;
+			}
+		}
+}
+
+/// Compress the input sub-block into the delay, and limit the oldest
+/// sub-block in the delay into the output sub-block
+void MasterDynamics::ProcessSubBlock()
+{
+	// peak level (integer, so it vectorises)
+	Sint32 peak = 0;
+	for (int i = 0; i < DYNAMICS_SUB_BLOCK * 2; i++)
+		{
+		Sint32 sample = m_input[i];
+		Sint32 level = (sample < 0) ? -sample : sample;
+		peak = (level > peak) ? level : peak;
+		}
+	float level = (float)peak;
+
+	// compressor gain at the end of the sub-block (from the envelope)
+	float compStart = m_compGain;
+	float compEnd = 1.0f;
+	if (m_compressorOn)
+		{
+		m_envelope += (level - m_envelope) * ((level > m_envelope) ? m_compAttack : m_compRelease);
+		if (m_envelope > m_threshold)
+			compEnd = powf(m_envelope / m_threshold, m_slope);
+		}
+	m_compGain = compEnd;
+
+	// compress into the delay
+	m_slot = (m_slot < DYNAMICS_LOOKAHEAD) ? m_slot + 1 : 0;
+	float* dest = m_delay[m_slot];
+	float gain = compStart;
+	float step = (compEnd - compStart) / DYNAMICS_SUB_BLOCK;
+	for (int i = 0; i < DYNAMICS_SUB_BLOCK; i++)
+		{
+		gain += step;
+		dest[i * 2] = m_input[i * 2] * gain;
+		dest[i * 2 + 1] = m_input[i * 2 + 1] * gain;
+		}
+
+	// highest limiter gain that keeps it under the ceiling
+	float compLevel = level * ((compStart > compEnd) ? compStart : compEnd);
+	m_target[m_slot] = (m_limiterOn && compLevel > m_ceiling) ? m_ceiling / compLevel : 1.0f;
+
+	// limiter gain at the end of the oldest sub-block: under the oldest
+	// sub-block's target, and moving in a straight line to be under each
+	// later sub-block's target by the time it starts (else released
+	// towards 1.0)
+	int oldest = (m_slot < DYNAMICS_LOOKAHEAD) ? m_slot + 1 : 0;
+	float limitStart = m_limitGain;
+	float limitEnd = limitStart + (1.0f - limitStart) * m_limitRelease;
+	if (m_target[oldest] < limitEnd)
+		limitEnd = m_target[oldest];
+	int slot = oldest;
+	for (int d = 1; d <= DYNAMICS_LOOKAHEAD; d++)
+		{
+		slot = (slot < DYNAMICS_LOOKAHEAD) ? slot + 1 : 0;
+		float limit = limitStart + (m_target[slot] - limitStart) / d;
+		if (limit < limitEnd)
+			limitEnd = limit;
+		}
+	m_limitGain = limitEnd;
+
+	// limit the oldest sub-block into the output
+	const float* src = m_delay[oldest];
+	gain = limitStart;
+	step = (limitEnd - limitStart) / DYNAMICS_SUB_BLOCK;
+	for (int i = 0; i < DYNAMICS_SUB_BLOCK * 2; i += 2)
+		{
+		gain += step;
+		float left = src[i] * gain;
+		float right = src[i + 1] * gain;
+		m_ready[i] = (Sint16)((left > 32767.0f) ? 32767 : ((left < -32768.0f) ? -32768 : (int)left));
+		m_ready[i + 1] = (Sint16)((right > 32767.0f) ? 32767 : ((right < -32768.0f) ? -32768 : (int)right));
+		}
+}
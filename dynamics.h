@@ -0,0 +1,83 @@
+// xdrum master bus dynamics
+//
+// The audio engine mixes the voices into a 32 bit buffer (so the sum of
+// the voices does not clip), and then passes it through the master bus
+// dynamics on the way to the 16 bit output: an optional compressor, then
+// a look-ahead brickwall limiter, which keeps the output under the
+// ceiling without clipping.
+// The signal is float inside, and the work is done in sub-blocks of
+// DYNAMICS_SUB_BLOCK frames. The level of a sub-block is the peak of its
+// samples, found with an integer loop that compilers can vectorise. The
+// compressor's envelope and gain and the limiter's gain are only worked
+// out once per sub-block, and each gain moves in a straight line across
+// the sub-block's samples. So the per sample work is a few multiplies.
+// The limiter delays the signal by DYNAMICS_LOOKAHEAD sub-blocks, so it
+// can turn the gain down smoothly before a peak arrives. If both are off,
+// the signal is passed straight through (no delay).
+// The settings are changed by the UI thread, and picked up by the audio
+// thread at the start of the next block. An offline render has its own
+// MasterDynamics, with the same settings (see CopySettings()).
+// Needs SDL.h included first.
+
+#define DYNAMICS_SUB_BLOCK		16			// frames per sub-block
+#define DYNAMICS_LOOKAHEAD		4			// sub-blocks of look-ahead (limiter)
+#define DYNAMICS_LIMIT_RELEASE_MS	50		// limiter release time
+#define DYNAMICS_COMP_ATTACK_MS		5		// compressor attack time
+#define DYNAMICS_COMP_RELEASE_MS	100		// compressor release time
+
+/// Master bus compressor and look-ahead limiter
+class MasterDynamics
+{
+public:
+	// constructor
+	MasterDynamics();
+
+	// settings (UI thread)
+	void SetLimiter(bool on, int ceilingDb);
+	void SetCompressor(bool on, int thresholdDb, int ratio);
+	void CopySettings(const MasterDynamics* dynamics);
+	bool IsLimiterOn() const { return m_limiterOn; }
+	int GetCeiling() const { return m_ceilingDb; }
+	bool IsCompressorOn() const { return m_compressorOn; }
+	int GetThreshold() const { return m_thresholdDb; }
+	int GetRatio() const { return m_ratio; }
+	int GetLatency() const;
+
+	// audio thread
+	void Process(const Sint32* mix, Sint16* out, int frames, int rate);
+
+private:
+	void Update(int rate);
+	void Reset();
+	void ProcessSubBlock();
+
+	// settings
+	bool m_limiterOn;
+	int m_ceilingDb;						// limiter ceiling (dBFS)
+	bool m_compressorOn;
+	int m_thresholdDb;						// compressor threshold (dBFS)
+	int m_ratio;							// compressor ratio (n:1)
+	volatile Uint32 m_version;				// changed on every settings change
+
+	// coefficients (worked out from the settings, in the audio thread)
+	Uint32 m_coefVersion;
+	int m_coefRate;
+	bool m_on;								// limiter or compressor on?
+	float m_ceiling;						// (linear)
+	float m_threshold;						// (linear)
+	float m_slope;							// compressor gain exponent (1 / ratio - 1)
+	float m_compAttack;						// envelope coefficients (per sub-block)
+	float m_compRelease;
+	float m_limitRelease;
+
+	// state
+	float m_envelope;						// compressor level envelope
+	float m_compGain;						// compressor gain at the end of the last sub-block
+	float m_limitGain;						// limiter gain at the end of the last sub-block
+	int m_pending;							// frames in m_input (and read from m_ready)
+	Sint32 m_input[DYNAMICS_SUB_BLOCK * 2];	// sub-block being filled
+	Sint16 m_ready[DYNAMICS_SUB_BLOCK * 2];	// sub-block being output
+	int m_slot;								// newest sub-block in m_delay
+	float m_delay[DYNAMICS_LOOKAHEAD + 1][DYNAMICS_SUB_BLOCK * 2];	// compressed sub-blocks waiting for the limiter
+	float m_target[DYNAMICS_LOOKAHEAD + 1];	// max limiter gain of each of them
+};
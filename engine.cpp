@@ -0,0 +1,505 @@
+/*
+ *      engine.cpp
+ *
+ *      Sample accurate drum sample player for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "SDL_mixer.h"
+#include "platform.h"
+#include "hrtimer.h"
+#include "spscqueue.h"
+#include "dynamics.h"
+#include "engine.h"
+
+// constructor
+AudioEngine::AudioEngine()
+{
+	m_active = false;
+	m_rate = 44100;
+	m_delayFrames = 0;
+	m_activeVoices = 0;
+	m_dropped = 0;
+	for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+		m_voices[i].active = false;
+	m_sampleClock = 0;
+	m_mapSeq = 0;
+	m_mapTime = 0;
+	m_mapFrame = 0;
+	m_mapValid = false;
+	m_tickSeq = 0;
+	m_tick = 0;
+	m_tickTime = 0;
+	m_tickInterval = 0;
+	m_gainsFrom.SetUnity();
+	m_gainsFrom.frame = 0;
+	m_gainsTo = m_gainsFrom;
+	m_gains = m_gainsFrom;
+	for (int i = 0; i < ENGINE_MAX_BUSES; i++)
+		m_ramps[i].active = false;
+	m_dynamics = NULL;
+}
+
+/// Set up the engine for the audio device (call after Mix_OpenAudio())
+/// @param rate				Sample rate (Hz)
+/// @param format			Sample format
+/// @param channels			Number of channels
+/// @param bufferFrames		Audio buffer size (sample frames)
+/// @return					false if the engine cannot mix this format (hits are
+///							passed on to SDL_mixer instead)
+bool AudioEngine::Init(int rate, Uint16 format, int channels, int bufferFrames)
+{
+	m_rate = rate;
+	m_delayFrames = bufferFrames + (rate * ENGINE_SAFETY_MS) / 1000;
+	m_active = (AUDIO_S16SYS == format && 2 == channels);
+	if (!m_active)
+		printf("AudioEngine: unsupported audio format, using SDL_mixer channels\n");
+	return m_active;
+}
+
+/// Set up the engine to render into memory instead of the audio device
+/// (16 bit stereo, no delay - a hit at time t is mixed at sample t * rate)
+/// @param rate				Sample rate (Hz)
+void AudioEngine::InitOffline(int rate)
+{
+	m_rate = rate;
+	m_delayFrames = 0;
+	m_active = true;
+	m_sampleClock = 0;
+	m_mapTime = 0;
+	m_mapFrame = 0;
+	m_mapValid = true;
+}
+
+/// Play a sample
+/// @param source			Command queue of the calling thread (ES_xxx)
+/// @param chunk			Sample to play
+/// @param vol				Volume (0 to MIX_MAX_VOLUME)
+/// @param pan				Pan (0 = left, 128 = centre, 255 = right)
+/// @param bus				Bus to play on (drum track), or ENGINE_NO_BUS
+/// @param timeNs			Time of the hit (HrTimeNanos() time)
+/// @return					false if the hit was dropped
+bool AudioEngine::Play(int source, Mix_Chunk* chunk, int vol, int pan, int bus, Uint64 timeNs)
+{
+	if (!chunk)
+		return false;
+
+	if (!m_active)
+		{
+		Mix_VolumeChunk(chunk, vol);
+		return (-1 != Mix_PlayChannel(-1, chunk, 0));
+		}
+
+	EngineCommand command;
+	command.command = EngineCommand::EC_PLAY;
+	command.chunk = chunk;
+	command.vol = (unsigned char)vol;
+	command.pan = (unsigned char)pan;
+	command.bus = (bus >= 0 && bus < ENGINE_MAX_BUSES) ? (signed char)bus : ENGINE_NO_BUS;
+	command.frame = TimeToFrame(timeNs);
+	if (!m_queues[source].Push(command))
+		{
+		m_dropped++;
+		return false;
+		}
+	return true;
+}
+
+/// Stop a sample that is playing (cut note)
+/// @param source			Command queue of the calling thread (ES_xxx)
+/// @param chunk			Sample to stop
+/// @param timeNs			Time to stop it (HrTimeNanos() time)
+/// @return					false if the cut was dropped
+bool AudioEngine::Cut(int source, Mix_Chunk* chunk, Uint64 timeNs)
+{
+	if (!chunk)
+		return false;
+
+	if (!m_active)
+		{
+		// Find which channel (if any) this sample was last played on
+		for (int channel = 0; channel < MIX_CHANNELS; channel++)
+			{
+			if (Mix_GetChunk(channel) == chunk)
+				{
+				Mix_HaltChannel(channel);
+				break;
+				}
+			}
+		return true;
+		}
+
+	EngineCommand command;
+	command.command = EngineCommand::EC_CUT;
+	command.chunk = chunk;
+	command.vol = 0;
+	command.pan = 128;
+	command.bus = ENGINE_NO_BUS;
+	command.frame = TimeToFrame(timeNs);
+	if (!m_queues[source].Push(command))
+		{
+		m_dropped++;
+		return false;
+		}
+	return true;
+}
+
+/// Get the sample clock position that a hit at a given time will be heard at
+/// (includes the fixed delay)
+/// @param timeNs			Time of the hit (HrTimeNanos() time)
+/// @return					Sample clock position (0 = as soon as possible)
+Uint64 AudioEngine::TimeToFrame(Uint64 timeNs) const
+{
+	Uint64 mapTime;
+	Uint64 mapFrame;
+	bool mapValid;
+	unsigned int seq;
+	do
+		{
+		seq = m_mapSeq;
+		__sync_synchronize();
+		mapTime = m_mapTime;
+		mapFrame = m_mapFrame;
+		mapValid = m_mapValid;
+		__sync_synchronize();
+		} while ((seq & 1) || seq != m_mapSeq);
+
+	if (!mapValid)
+		return 0;					// audio not running yet
+
+	Sint64 frame = (Sint64)mapFrame + m_delayFrames + ((Sint64)(timeNs - mapTime) * m_rate) / 1000000000;
+	return (frame > 0) ? (Uint64)frame : 0;
+}
+
+/// Tell the engine when the sequencer played a tick (play thread)
+/// @param tick				Tick number (in the pattern)
+/// @param timeNs			Time the tick was due
+/// @param intervalNs		Time between ticks
+void AudioEngine::SetSequencerTick(int tick, Uint64 timeNs, Uint64 intervalNs)
+{
+	m_tickSeq++;
+	__sync_synchronize();
+	m_tick = tick;
+	m_tickTime = timeNs;
+	m_tickInterval = intervalNs;
+	__sync_synchronize();
+	m_tickSeq++;
+}
+
+/// Move a time forward to the next sequencer tick that is a multiple of
+/// a number of ticks (eg: TICKS_PER_STEP for 1/16 notes)
+/// @param timeNs			Time to quantise
+/// @param ticks			Quantise to multiples of this many ticks
+/// @return					Quantised time (or timeNs if the sequencer is not running)
+Uint64 AudioEngine::QuantiseTime(Uint64 timeNs, int ticks) const
+{
+	int tick;
+	Uint64 tickTime;
+	Uint64 interval;
+	unsigned int seq;
+	do
+		{
+		seq = m_tickSeq;
+		__sync_synchronize();
+		tick = m_tick;
+		tickTime = m_tickTime;
+		interval = m_tickInterval;
+		__sync_synchronize();
+		} while ((seq & 1) || seq != m_tickSeq);
+
+	if (0 == interval || ticks < 1)
+		return timeNs;
+
+	// number of ticks from the last tick to the next tick after the hit
+	Sint64 since = (Sint64)(timeNs - tickTime);
+	Sint64 n = (since > 0) ? (since + (Sint64)interval - 1) / (Sint64)interval : 0;
+	int rem = (int)((tick + n) % ticks);
+	if (rem > 0)
+		n += ticks - rem;
+
+	return tickTime + n * interval;
+}
+
+/// Set the gain of each bus at a time (play thread). Between settings, the
+/// gains move in a straight line (sample by sample); after the last one,
+/// they stay where they are.
+/// @param gains			Gains (the frame is filled in from the time)
+/// @param timeNs			Time the bus gains should be reached at
+/// @return					false if the setting was dropped
+bool AudioEngine::SetGains(const EngineGains* gains, Uint64 timeNs)
+{
+	if (!m_active)
+		return false;
+
+	EngineGains setting = *gains;
+	setting.frame = TimeToFrame(timeNs);
+	if (!m_gainQueue.Push(setting))
+		{
+		m_dropped++;
+		return false;
+		}
+	return true;
+}
+
+/// Stop all samples, and forget any queued commands (eg: before a drumkit
+/// is unloaded)
+void AudioEngine::StopAll()
+{
+	SDL_LockAudio();
+	for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+		m_voices[i].active = false;
+	for (int i = 0; i < ES_MAX; i++)
+		m_queues[i].Clear();
+	m_activeVoices = 0;
+	SDL_UnlockAudio();
+
+	Mix_HaltChannel(-1);
+}
+
+/// An audio buffer has started mixing (audio thread)
+void AudioEngine::BeginMix()
+{
+	m_mapSeq++;
+	__sync_synchronize();
+	m_mapTime = HrTimeNanos();
+	m_mapFrame = m_sampleClock;
+	m_mapValid = true;
+	__sync_synchronize();
+	m_mapSeq++;
+}
+
+/// Mix the voices into an audio buffer (audio thread, postmix)
+/// @param stream			Audio buffer (16 bit stereo)
+/// @param len				Length of the buffer (bytes)
+void AudioEngine::Mix(Uint8* stream, int len)
+{
+	if (!m_active)
+		return;
+
+	// new commands
+	EngineCommand command;
+	for (int i = 0; i < ES_MAX; i++)
+		{
+		while (m_queues[i].Pop(&command))
+			RunCommand(command);
+		}
+
+	// (in blocks that fit the mix buffer)
+	Sint16* samples = (Sint16*)stream;
+	int frames = len / 4;
+	while (frames > 0)
+		{
+		int count = (frames > ENGINE_MIX_FRAMES) ? ENGINE_MIX_FRAMES : frames;
+		MixBlock(samples, count);
+		samples += count * 2;
+		frames -= count;
+		}
+
+	int active = 0;
+	for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+		{
+		if (m_voices[i].active)
+			active++;
+		}
+	m_activeVoices = active;
+}
+
+/// Mix the voices into a block of the audio buffer, and pass it through
+/// the output stage
+/// @param stream			Block of the audio buffer (16 bit stereo)
+/// @param frames			Length of the block (up to ENGINE_MIX_FRAMES)
+void AudioEngine::MixBlock(Sint16* stream, int frames)
+{
+	// start from what SDL_mixer has mixed
+	for (int i = 0; i < frames * 2; i++)
+		m_mix[i] = stream[i];
+
+	Uint64 bufferStart = m_sampleClock;
+	UpdateBusRamps(bufferStart, frames);
+	for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+		{
+		EngineVoice* voice = &m_voices[i];
+		if (voice->active)
+			MixVoice(voice, m_mix, frames, bufferStart);
+		}
+
+	if (m_dynamics)
+		{
+		m_dynamics->Process(m_mix, stream, frames, m_rate);
+		}
+	else
+		{
+		for (int i = 0; i < frames * 2; i++)
+			{
+			Sint32 sample = m_mix[i];
+			stream[i] = (Sint16)((sample > 32767) ? 32767 : ((sample < -32768) ? -32768 : sample));
+			}
+		}
+
+	m_sampleClock += frames;
+}
+
+/// Carry out a command from one of the queues
+void AudioEngine::RunCommand(const EngineCommand& command)
+{
+	if (EngineCommand::EC_PLAY == command.command)
+		{
+		EngineVoice* voice = GetFreeVoice();
+		voice->active = true;
+		voice->chunk = command.chunk;
+		voice->pos = 0;
+		voice->volL = (command.vol * ((command.pan > 128) ? 255 - command.pan : 128)) / 128;
+		voice->volR = (command.vol * ((command.pan < 128) ? command.pan : 128)) / 128;
+		voice->bus = command.bus;
+		voice->startFrame = command.frame;
+		voice->cutFrame = 0;
+		}
+	else if (EngineCommand::EC_CUT == command.command)
+		{
+		// cut this sample where it started playing before the cut
+		for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+			{
+			EngineVoice* voice = &m_voices[i];
+			if (voice->active && voice->chunk == command.chunk && voice->startFrame < command.frame)
+				{
+				if (0 == voice->cutFrame || command.frame < voice->cutFrame)
+					voice->cutFrame = (command.frame > 0) ? command.frame : 1;
+				}
+			}
+		}
+}
+
+/// Get a voice to play a new sample on (if all voices are playing, the
+/// oldest one is stopped)
+EngineVoice* AudioEngine::GetFreeVoice()
+{
+	EngineVoice* oldest = &m_voices[0];
+	for (int i = 0; i < ENGINE_MAX_VOICES; i++)
+		{
+		EngineVoice* voice = &m_voices[i];
+		if (!voice->active)
+			return voice;
+		if (voice->startFrame < oldest->startFrame)
+			oldest = voice;
+		}
+	return oldest;
+}
+
+/// Work out the gain ramp of each bus for a block (audio thread): from
+/// the gains at the end of the last block to the gains at the end of this
+/// one (between the gain settings either side of it)
+/// @param bufferStart		Sample clock position of the start of the block
+/// @param frames			Length of the block (sample frames)
+void AudioEngine::UpdateBusRamps(Uint64 bufferStart, int frames)
+{
+	if (frames <= 0)
+		return;
+
+	// gain settings up to the end of the block (a setting that is already
+	// in the past when the next one arrives ramps on from the block start)
+	Uint64 bufferEnd = bufferStart + frames;
+	EngineGains setting;
+	while (m_gainsTo.frame <= bufferEnd && m_gainQueue.Pop(&setting))
+		{
+		m_gainsFrom = m_gainsTo;
+		if (m_gainsFrom.frame < bufferStart)
+			m_gainsFrom.frame = bufferStart;
+		m_gainsTo = setting;
+		}
+
+	// gains at the end of the block
+	Uint64 span = 0;
+	Uint64 pos = 0;
+	if (m_gainsTo.frame > bufferEnd && m_gainsTo.frame > m_gainsFrom.frame && bufferEnd > m_gainsFrom.frame)
+		{
+		span = m_gainsTo.frame - m_gainsFrom.frame;
+		pos = bufferEnd - m_gainsFrom.frame;
+		}
+	for (int bus = 0; bus < ENGINE_MAX_BUSES; bus++)
+		{
+		int left = m_gainsTo.left[bus];
+		int right = m_gainsTo.right[bus];
+		if (span > 0)
+			{
+			left = m_gainsFrom.left[bus] + (int)(((Sint64)(left - m_gainsFrom.left[bus]) * (Sint64)pos) / (Sint64)span);
+			right = m_gainsFrom.right[bus] + (int)(((Sint64)(right - m_gainsFrom.right[bus]) * (Sint64)pos) / (Sint64)span);
+			}
+		else if (m_gainsTo.frame > bufferEnd)
+			{
+			left = m_gainsFrom.left[bus];			// (next setting has not started yet)
+			right = m_gainsFrom.right[bus];
+			}
+
+		EngineBusRamp* ramp = &m_ramps[bus];
+		ramp->active = (ENGINE_UNITY_GAIN != left || ENGINE_UNITY_GAIN != right
+						|| ENGINE_UNITY_GAIN != m_gains.left[bus] || ENGINE_UNITY_GAIN != m_gains.right[bus]);
+		ramp->left = m_gains.left[bus] << 8;
+		ramp->right = m_gains.right[bus] << 8;
+		ramp->leftStep = ((left - m_gains.left[bus]) * 256) / frames;
+		ramp->rightStep = ((right - m_gains.right[bus]) * 256) / frames;
+		m_gains.left[bus] = (unsigned short)left;
+		m_gains.right[bus] = (unsigned short)right;
+		}
+}
+
+/// Mix a voice into a buffer
+/// @param voice			Voice to mix
+/// @param out				Mix buffer (stereo, not clipped)
+/// @param frames			Length of the buffer (sample frames)
+/// @param bufferStart		Sample clock position of the start of the buffer
+void AudioEngine::MixVoice(EngineVoice* voice, Sint32* out, int frames, Uint64 bufferStart)
+{
+	// not started yet?
+	if (voice->startFrame >= bufferStart + frames)
+		return;
+
+	int start = (voice->startFrame > bufferStart) ? (int)(voice->startFrame - bufferStart) : 0;
+	int end = frames;
+	bool cut = false;
+	if (voice->cutFrame > 0 && voice->cutFrame < bufferStart + frames)
+		{
+		end = (voice->cutFrame > bufferStart) ? (int)(voice->cutFrame - bufferStart) : 0;
+		cut = true;
+		}
+
+	Uint32 length = voice->chunk->alen / 4;
+	int count = end - start;
+	if (count > (int)(length - voice->pos))
+		count = (int)(length - voice->pos);
+
+	const Sint16* src = (const Sint16*)voice->chunk->abuf + voice->pos * 2;
+	Sint32* dest = out + start * 2;
+	if (voice->bus >= 0 && m_ramps[voice->bus].active)
+		{
+		// on a bus with a gain (moving from sample to sample)
+		const EngineBusRamp* ramp = &m_ramps[voice->bus];
+		int gainL = ramp->left + ramp->leftStep * start;
+		int gainR = ramp->right + ramp->rightStep * start;
+		for (int i = 0; i < count; i++)
+			{
+			dest[0] += (((src[0] * voice->volL) >> 7) * (gainL >> 8)) >> 15;
+			dest[1] += (((src[1] * voice->volR) >> 7) * (gainR >> 8)) >> 15;
+			src += 2;
+			dest += 2;
+			gainL += ramp->leftStep;
+			gainR += ramp->rightStep;
+			}
+		}
+	else
+		{
+		for (int i = 0; i < count; i++)
+			{
+			dest[0] += (src[0] * voice->volL) >> 7;
+			dest[1] += (src[1] * voice->volR) >> 7;
+			src += 2;
+			dest += 2;
+			}
+		}
+
+	voice->pos += (count > 0) ? count : 0;
+	if (cut || voice->pos >= length)
+		voice->active = false;
+}
@@ -0,0 +1,179 @@
+// xdrum audio engine
+//
+// Plays the drum samples with sample accurate timing. Instead of starting
+// an SDL_mixer channel (which can only start at the beginning of the next
+// audio buffer), a hit is sent to the audio thread with the time it should
+// be heard, and mixed into the stream (in the postmix callback) starting at
+// the matching sample.
+// Times are HrTimeNanos() times. They are turned into sample clock
+// positions using the time that the current audio buffer started mixing,
+// plus a fixed delay of one buffer (and a safety margin), so every hit has
+// the same latency, whenever it arrives.
+// Each thread that sends hits has its own lock-free command queue.
+// If the audio device is not 16 bit stereo, the engine passes the hits on
+// to SDL_mixer channels instead.
+// An engine can also render offline (InitOffline()): then times are ns from
+// the start of the render, and the caller calls Mix() for each block.
+// Voices can play on a bus (a drum track). Each bus has a gain, which
+// is moved in a straight line, sample by sample, from one gain setting
+// (see SetGains()) to the next, so mix automation is smooth.
+// The voices (and anything SDL_mixer has already mixed into the buffer) are
+// added up in a 32 bit buffer, so they do not clip, and then go through the
+// master bus dynamics (see SetDynamics() and dynamics.h) to the output.
+// Needs SDL.h, SDL_mixer.h, spscqueue.h and dynamics.h included first.
+
+#define ENGINE_MAX_VOICES		32
+#define ENGINE_QUEUE_SIZE		64			// commands per queue (power of 2)
+#define ENGINE_SAFETY_MS		3			// extra delay to allow for audio callback jitter
+#define ENGINE_MAX_BUSES		16			// buses with their own gain (drum tracks)
+#define ENGINE_NO_BUS			-1			// bus of voices with no gain (eg: previews)
+#define ENGINE_UNITY_GAIN		32768		// bus gain of 1.0
+#define ENGINE_GAIN_QUEUE_SIZE	16			// gain settings queued (power of 2)
+#define ENGINE_MIX_FRAMES		1024		// sample frames mixed at a time
+
+// command queues (one per thread that sends commands)
+enum ENGINE_SOURCES { ES_PLAY = 0,			// play thread (sequencer)
+					ES_UI,					// UI thread (live pads, previews)
+					ES_MAX
+};
+
+/// Command sent to the audio thread
+class EngineCommand
+{
+public:
+	enum COMMAND { EC_PLAY = 0, EC_CUT };
+
+	COMMAND command;
+	Mix_Chunk* chunk;
+	unsigned char vol;						// 0 to MIX_MAX_VOLUME
+	unsigned char pan;						// 0 (left) to 255 (right)
+	signed char bus;						// bus to play on (ENGINE_NO_BUS = none)
+	Uint64 frame;							// sample clock position to start / cut at
+};
+
+/// Gain of each bus at a sample clock position
+class EngineGains
+{
+public:
+	// All buses at a gain of 1.0
+	void SetUnity()
+		{
+		for (int i = 0; i < ENGINE_MAX_BUSES; i++)
+			{
+			left[i] = ENGINE_UNITY_GAIN;
+			right[i] = ENGINE_UNITY_GAIN;
+			}
+		}
+
+	Uint64 frame;
+	unsigned short left[ENGINE_MAX_BUSES];	// 0 to ENGINE_UNITY_GAIN
+	unsigned short right[ENGINE_MAX_BUSES];
+};
+
+/// Lock-free queues of engine commands and bus gain settings
+typedef SpscQueue<EngineCommand, ENGINE_QUEUE_SIZE> EngineQueue;
+typedef SpscQueue<EngineGains, ENGINE_GAIN_QUEUE_SIZE> EngineGainQueue;
+
+/// Gain of a bus in the block being mixed (per sample, 1/256 of a gain unit)
+class EngineBusRamp
+{
+public:
+	bool active;							// false = gain of 1.0 for the whole block
+	int left;								// gain at the start of the block
+	int right;
+	int leftStep;							// change per sample
+	int rightStep;
+};
+
+/// A sample being played
+class EngineVoice
+{
+public:
+	bool active;
+	Mix_Chunk* chunk;
+	Uint32 pos;								// next sample frame of the chunk to play
+	int volL;								// 0 to 128 per side
+	int volR;
+	int bus;								// ENGINE_NO_BUS = none
+	Uint64 startFrame;						// sample clock position to start at
+	Uint64 cutFrame;						// sample clock position to stop at (0 = play to end)
+};
+
+/// Sample accurate drum sample player
+class AudioEngine
+{
+public:
+	// constructor
+	AudioEngine();
+
+	bool Init(int rate, Uint16 format, int channels, int bufferFrames);
+	void InitOffline(int rate);
+	bool IsActive() const { return m_active; }
+	int GetRate() const { return m_rate; }
+	Uint32 GetDelayFrames() const { return m_delayFrames; }
+
+	// any thread (each thread must use its own source queue)
+	bool Play(int source, Mix_Chunk* chunk, int vol, int pan, int bus, Uint64 timeNs);
+	bool Cut(int source, Mix_Chunk* chunk, Uint64 timeNs);
+	Uint64 TimeToFrame(Uint64 timeNs) const;
+	int GetActiveVoices() const { return m_activeVoices; }
+	unsigned int GetDroppedCommands() const { return m_dropped; }
+
+	// sequencer timeline (for quantising live hits)
+	void SetSequencerTick(int tick, Uint64 timeNs, Uint64 intervalNs);
+	Uint64 QuantiseTime(Uint64 timeNs, int ticks) const;
+
+	// bus gains (play thread)
+	bool SetGains(const EngineGains* gains, Uint64 timeNs);
+
+	// master bus dynamics (set before mixing starts)
+	void SetDynamics(MasterDynamics* dynamics) { m_dynamics = dynamics; }
+
+	// UI thread
+	void StopAll();
+
+	// audio thread
+	void BeginMix();
+	void Mix(Uint8* stream, int len);
+
+private:
+	void MixBlock(Sint16* stream, int frames);
+	void RunCommand(const EngineCommand& command);
+	EngineVoice* GetFreeVoice();
+	void UpdateBusRamps(Uint64 bufferStart, int frames);
+	void MixVoice(EngineVoice* voice, Sint32* out, int frames, Uint64 bufferStart);
+
+	bool m_active;
+	int m_rate;
+	Uint32 m_delayFrames;					// fixed delay from the time of a hit to playing it
+
+	EngineQueue m_queues[ES_MAX];
+	EngineVoice m_voices[ENGINE_MAX_VOICES];
+	volatile int m_activeVoices;
+	volatile unsigned int m_dropped;		// commands lost because a queue was full
+
+	// bus gains (ramps from the gains at the end of the last block to the
+	// gains at the end of this block, worked out from the gain settings)
+	EngineGainQueue m_gainQueue;
+	EngineGains m_gainsFrom;				// setting before m_gainsTo
+	EngineGains m_gainsTo;					// latest setting taken off the queue
+	EngineGains m_gains;					// gains at the end of the last block
+	EngineBusRamp m_ramps[ENGINE_MAX_BUSES];
+
+	// output stage
+	Sint32 m_mix[ENGINE_MIX_FRAMES * 2];	// voices added up (not clipped)
+	MasterDynamics* m_dynamics;				// NULL = clip to 16 bits
+
+	// audio thread time <-> sample clock map (written by the audio thread)
+	Uint64 m_sampleClock;					// sample frames mixed so far
+	volatile unsigned int m_mapSeq;			// odd while the map is being written
+	Uint64 m_mapTime;						// time the current buffer started mixing
+	Uint64 m_mapFrame;						// sample clock at the start of the current buffer
+	bool m_mapValid;
+
+	// sequencer timeline (written by the play thread)
+	volatile unsigned int m_tickSeq;		// odd while the timeline is being written
+	int m_tick;								// last tick played
+	Uint64 m_tickTime;						// time the tick was due
+	Uint64 m_tickInterval;					// time between ticks (ns)
+};
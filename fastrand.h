@@ -0,0 +1,59 @@
+// xdrum fast random numbers
+//
+// Small xorshift generator for volrand and jitter. Each user (the play
+// thread, an offline render) has its own generator, so it is thread safe
+// without locks, and the hits are the same every time the song is played
+// from the same seed (unlike rand(), which is shared with the rest of the
+// process). xorshift only needs 32 bit shifts and xors, which is cheap on
+// the PSP's CPU.
+// Needs SDL.h included first.
+
+/// xorshift32 random number generator
+class FastRandom
+{
+public:
+	FastRandom()
+		{
+		Seed(1);
+		}
+
+	// Start a new sequence (the same seed always gives the same numbers)
+	void Seed(Uint32 seed)
+		{
+		// mix the bits, so that similar seeds give different sequences
+		seed = (seed ^ 61) ^ (seed >> 16);
+		seed *= 9;
+		seed ^= seed >> 4;
+		seed *= 0x27D4EB2D;
+		seed ^= seed >> 15;
+		m_state = seed ? seed : 0x9E3779B9;		// (0 would only ever give 0)
+		}
+
+	// Next number (any 32 bit value except 0)
+	Uint32 Next()
+		{
+		Uint32 x = m_state;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		m_state = x;
+		return x;
+		}
+
+	// Random number from 0 to n - 1 (0 if n is 0)
+	Uint32 Range(Uint32 n)
+		{
+		return (Uint32)(((Uint64)Next() * n) >> 32);
+		}
+
+	// Random number from -range to +range (0 if range is 0 or less)
+	int Spread(int range)
+		{
+		if (range <= 0)
+			return 0;
+		return (int)Range(2 * range + 1) - range;
+		}
+
+private:
+	Uint32 m_state;
+};
@@ -5,6 +5,7 @@
  *      
  */
 
+#include <string.h>
 #include "SDL.h"
 #include "platform.h"
 #include "fontengine.h"
@@ -29,21 +30,51 @@ FontEngine::FontEngine(const char* fontfile, int font_char_width, int font_char_
 		fontCharsPerline = 0;
 		printf("FontEngine: Failed to load font image!\n");
 		}
+
+	// work out glyph source rects once
+	for (int c = 0; c < 256; c++)
+		{
+		glyphRects[c].x = fontCharsPerline ? (c % fontCharsPerline) * fontCharWidth : 0;
+		glyphRects[c].y = fontCharsPerline ? (c / fontCharsPerline) * fontCharHeight : 0;
+		glyphRects[c].w = fontCharWidth;
+		glyphRects[c].h = fontCharHeight;
+		}
+
+	for (int i = 0; i < FONT_CACHE_ENTRIES; i++)
+		{
+		cache[i].surface = NULL;
+		cache[i].length = 0;
+		cache[i].lastUsed = 0;
+		}
+	cacheCounter = 0;
 }
 
+FontEngine::~FontEngine()
+{
+	FlushCache();
+	if (fontImg)
+		SDL_FreeSurface(fontImg);
+}
 
+/// Free all cached text runs
+void FontEngine::FlushCache()
+{
+	for (int i = 0; i < FONT_CACHE_ENTRIES; i++)
+		{
+		if (cache[i].surface)
+			{
+			SDL_FreeSurface(cache[i].surface);
+			cache[i].surface = NULL;
+			}
+		}
+}
 
 void FontEngine::DrawGlyph(SDL_Surface* surface, char c, int destx, int desty)
 {
 	if (fontImg)
 		{
-		// get src rect of character
-		SDL_Rect src;
-		src.x = (c % fontCharsPerline) * fontCharWidth;
-		src.y = (c / fontCharsPerline) * fontCharHeight;
-		src.w = fontCharWidth;
-		src.h = fontCharHeight;
 		// blit character to dest rect
+		SDL_Rect src = glyphRects[(unsigned char)c];
 		SDL_Rect dest;
 		dest.x = destx;
 		dest.y = desty;
@@ -53,26 +84,129 @@ void FontEngine::DrawGlyph(SDL_Surface* surface, char c, int destx, int desty)
 		}
 }
 
+/// Draw a run of glyphs (one blit per glyph)
+void FontEngine::DrawGlyphs(SDL_Surface* surface, const char *s, int length, int destx, int desty)
+{
+	SDL_Rect src;
+	SDL_Rect dest;
+	for (int i = 0; i < length; i++)
+		{
+		src = glyphRects[(unsigned char)s[i]];
+		dest.x = destx;
+		dest.y = desty;
+		dest.w = fontCharWidth;
+		dest.h = fontCharHeight;
+		SDL_BlitSurface(fontImg, &src, surface, &dest);
+		destx += fontCharWidth;
+		}
+}
+
+/// Get a string rendered to a surface (from the cache if possible)
+/// @param s				String to render
+/// @param length			Length of the string
+/// @return					Surface with the rendered string, or NULL if it could not be created
+SDL_Surface* FontEngine::GetTextRun(const char* s, int length)
+{
+	cacheCounter++;
+
+	// already rendered?
+	int lruEntry = 0;
+	for (int i = 0; i < FONT_CACHE_ENTRIES; i++)
+		{
+		FontCacheEntry* entry = &cache[i];
+		if (entry->surface && length == entry->length && 0 == memcmp(s, entry->text, length))
+			{
+			entry->lastUsed = cacheCounter;
+			return entry->surface;
+			}
+		if (!entry->surface)
+			lruEntry = i;
+		else if (cache[lruEntry].surface && entry->lastUsed < cache[lruEntry].lastUsed)
+			lruEntry = i;
+		}
+
+	// render into the least recently used entry
+	FontCacheEntry* entry = &cache[lruEntry];
+	if (entry->surface)
+		SDL_FreeSurface(entry->surface);
+	SDL_PixelFormat* fmt = fontImg->format;
+	entry->surface = SDL_CreateRGBSurface(SDL_SWSURFACE, length * fontCharWidth, fontCharHeight,
+										fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask);
+	if (!entry->surface)
+		return NULL;
+
+	// same palette / colour key as the font, so that blitting the run looks
+	// exactly the same as blitting the glyphs
+	if (fmt->palette)
+		SDL_SetColors(entry->surface, fmt->palette->colors, 0, fmt->palette->ncolors);
+	if (fontImg->flags & SDL_SRCCOLORKEY)
+		{
+		SDL_FillRect(entry->surface, NULL, fmt->colorkey);
+		SDL_SetColorKey(entry->surface, SDL_SRCCOLORKEY, fmt->colorkey);
+		}
+	DrawGlyphs(entry->surface, s, length, 0, 0);
+
+	memcpy(entry->text, s, length);
+	entry->text[length] = 0;
+	entry->length = length;
+	entry->lastUsed = cacheCounter;
+
+	return entry->surface;
+}
+
 /// Draw text to the specified surface
+/// Strings are rendered once and kept in a cache, so redrawing the same
+/// string is a single blit.
 /// @param surface			SDL surface to draw text to
 /// @param s				Character string to draw
 /// @param rect				Destination rectangle for the text
 /// @param clip				If true, clip the text output to the destination rect
 void FontEngine::DrawText(SDL_Surface* surface, const char *s, SDL_Rect& rect, bool clip)
+{
+	if (!fontImg)
+		return;
+
+	int length = (int)strlen(s);
+	if (0 == length)
+		return;
+
+	SDL_Surface* run = NULL;
+	if (length <= FONT_CACHE_MAX_TEXT)
+		run = GetTextRun(s, length);
+	if (!run)
+		{
+		DrawTextDirect(surface, s, rect, clip);
+		return;
+		}
+
+	if (clip)
+		SDL_SetClipRect(surface, &rect);
+
+	SDL_Rect dest;
+	dest.x = rect.x;
+	dest.y = rect.y;
+	dest.w = run->w;
+	dest.h = run->h;
+	SDL_BlitSurface(run, NULL, surface, &dest);
+
+	if (clip)
+		SDL_SetClipRect(surface, NULL);
+}
+
+/// Draw text to the specified surface, glyph by glyph (bypassing the cache)
+/// Use for strings that change all the time.
+/// @param surface			SDL surface to draw text to
+/// @param s				Character string to draw
+/// @param rect				Destination rectangle for the text
+/// @param clip				If true, clip the text output to the destination rect
+void FontEngine::DrawTextDirect(SDL_Surface* surface, const char *s, SDL_Rect& rect, bool clip)
 {
 	if (fontImg)
 		{
 		if (clip)
 			SDL_SetClipRect(surface, &rect);
 			
-		int destx = rect.x;
-		const char* p = s;
-		while (*p)
-			{
-			DrawGlyph(surface, *p, destx, rect.y);
-			destx += fontCharWidth;
-			p++;	
-			}
+		DrawGlyphs(surface, s, (int)strlen(s), rect.x, rect.y);
 
 		if (clip)
 			SDL_SetClipRect(surface, NULL);
@@ -9,22 +9,46 @@
 #define OUT_CHAR_HEIGHT		16
 */
 
+#define FONT_CACHE_ENTRIES		32			// number of text runs kept rendered
+#define FONT_CACHE_MAX_TEXT		64			// longer strings are not cached
+
+/// A string rendered to a surface (text run cache entry)
+class FontCacheEntry
+{
+public:
+	char text[FONT_CACHE_MAX_TEXT + 1];
+	int length;
+	SDL_Surface* surface;				// NULL = entry not used
+	unsigned int lastUsed;				// for LRU eviction
+};
+
 class FontEngine
 {
 public:
 	// constructor
 	FontEngine(const char* fontfile, int font_char_width, int font_char_height);
+	~FontEngine();
 	
 	// operations
 	void DrawGlyph(SDL_Surface* surface, char c, int destx, int desty);
 	void DrawText(SDL_Surface* surface, const char *s, SDL_Rect& rect, bool clip);
+	void DrawTextDirect(SDL_Surface* surface, const char *s, SDL_Rect& rect, bool clip);
+	void FlushCache();
 	int GetFontHeight()
 		{
 		return fontCharHeight;
 		}
 private:	
+	void DrawGlyphs(SDL_Surface* surface, const char *s, int length, int destx, int desty);
+	SDL_Surface* GetTextRun(const char* s, int length);
+
 	SDL_Surface *fontImg;
 	int fontCharsPerline;
 	int fontCharWidth;
 	int fontCharHeight;
+	SDL_Rect glyphRects[256];			// source rect of each char in fontImg
+
+	// text run cache
+	FontCacheEntry cache[FONT_CACHE_ENTRIES];
+	unsigned int cacheCounter;
 };
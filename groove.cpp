@@ -0,0 +1,175 @@
+/*
+ *      groove.cpp
+ *
+ *      Groove templates (swing, extracted grooves) for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "platform.h"
+#include "pattern.h"
+#include "groove.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Groove class
+///////////////////////////////////////////////////////////////////////////////
+
+// constructor
+Groove::Groove()
+{
+	m_version = 0;
+	Clear();
+}
+
+/// No groove (every step on time, at its own volume)
+void Groove::Clear()
+{
+	strcpy(m_name, "No swing");
+	m_length = 1;
+	for (int i = 0; i < GROOVE_MAX_STEPS; i++)
+		{
+		m_timing[i] = 0;
+		m_velocity[i] = 100;
+		}
+	m_swing = 50;
+	m_swingSteps = 2;
+	m_version++;
+}
+
+/// MPC style swing - the second note of each pair is delayed
+/// @param percent			Where the second note starts in the pair (50 to 75%, 50 = no swing)
+/// @param noteSteps		Steps per note (1 = swing 16th notes, 2 = swing 8th notes)
+void Groove::SetSwing(int percent, int noteSteps)
+{
+	if (percent < 50)
+		percent = 50;
+	else if (percent > 75)
+		percent = 75;
+	noteSteps = (noteSteps < 2) ? 1 : 2;
+
+	Clear();
+	m_length = noteSteps * 2;
+	m_timing[noteSteps] = (short)(((percent - 50) * 2 * noteSteps * GROOVE_STEP_UNITS) / 100);
+	m_swing = percent;
+	m_swingSteps = noteSteps;
+	if (percent > 50)
+		sprintf(m_name, "Sw%d %d%%", (2 == noteSteps) ? 8 : 16, percent);
+	m_version++;
+}
+
+/// Take the groove of a pattern - the average micro-timing and volume of
+/// the notes on each step (relative to the average volume of all notes)
+/// @param pattern			Pattern
+/// @param patternIndex		Index of the pattern (for the groove's name)
+/// @return					false if the pattern has no notes (the groove is not changed)
+bool Groove::Extract(const DrumPattern* pattern, int patternIndex)
+{
+	int length = pattern->GetLength();
+	int offsetSum[GROOVE_MAX_STEPS];
+	int volSum[GROOVE_MAX_STEPS];
+	int notes[GROOVE_MAX_STEPS];
+	int totalVol = 0;
+	int totalNotes = 0;
+	for (int step = 0; step < length; step++)
+		{
+		offsetSum[step] = 0;
+		volSum[step] = 0;
+		notes[step] = 0;
+		for (int track = 0; track < NUM_TRACKS; track++)
+			{
+			const DrumEvent* event = pattern->GetEvent(track, step);
+			if (event->vol > 1)
+				{
+				offsetSum[step] += event->offset;
+				volSum[step] += event->vol;
+				notes[step]++;
+				}
+			}
+		totalVol += volSum[step];
+		totalNotes += notes[step];
+		}
+	if (0 == totalNotes)
+		return false;
+
+	int averageVol = totalVol / totalNotes;
+	Clear();
+	m_length = length;
+	for (int step = 0; step < length; step++)
+		{
+		if (0 == notes[step])
+			continue;
+		m_timing[step] = (short)((offsetSum[step] * GROOVE_TICK_UNITS) / notes[step]);
+		int velocity = (volSum[step] * 100) / (notes[step] * averageVol);
+		if (velocity < GROOVE_MIN_VELOCITY)
+			velocity = GROOVE_MIN_VELOCITY;
+		else if (velocity > GROOVE_MAX_VELOCITY)
+			velocity = GROOVE_MAX_VELOCITY;
+		m_velocity[step] = (unsigned char)velocity;
+		}
+	m_swing = 50;
+	m_swingSteps = 0;
+	sprintf(m_name, "Groove P%d", patternIndex + 1);
+	m_version++;
+	return true;
+}
+
+/// Split a step's offset into whole sequencer ticks and the rest
+/// @param step				Step
+/// @param ticks			Ticks after the step's tick (- = before)
+/// @param units			Offset after those ticks (0 to GROOVE_TICK_UNITS - 1)
+void Groove::GetStepTiming(int step, int* ticks, int* units) const
+{
+	int timing = GetTiming(step);
+	if (timing < -GROOVE_MAX_EARLY)
+		timing = -GROOVE_MAX_EARLY;
+	else if (timing > GROOVE_MAX_LATE)
+		timing = GROOVE_MAX_LATE;
+
+	// (rounded down, so the rest is never negative)
+	*ticks = (timing >= 0) ? timing / GROOVE_TICK_UNITS : -((GROOVE_TICK_UNITS - 1 - timing) / GROOVE_TICK_UNITS);
+	*units = timing - *ticks * GROOVE_TICK_UNITS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GrooveTiming class
+///////////////////////////////////////////////////////////////////////////////
+
+// constructor
+GrooveTiming::GrooveTiming()
+{
+	m_valid = false;
+	m_version = 0;
+	m_interval = 0;
+	for (int i = 0; i < GROOVE_MAX_STEPS; i++)
+		{
+		m_ticks[i] = 0;
+		m_delayNs[i] = 0;
+		m_velocity[i] = 256;
+		}
+}
+
+/// Work out the timing of each step, if the groove or tempo has changed
+/// @param groove			Groove
+/// @param intervalNs		Time between sequencer ticks
+void GrooveTiming::Update(const Groove* groove, Uint64 intervalNs)
+{
+	Uint32 version = groove->GetVersion();
+	if (m_valid && version == m_version && intervalNs == m_interval)
+		return;
+
+	for (int step = 0; step < GROOVE_MAX_STEPS; step++)
+		{
+		int ticks;
+		int units;
+		groove->GetStepTiming(step, &ticks, &units);
+		m_ticks[step] = (signed char)ticks;
+		m_delayNs[step] = (Uint32)((units * intervalNs) / GROOVE_TICK_UNITS);
+		m_velocity[step] = (unsigned short)((groove->GetVelocity(step) * 256) / 100);
+		}
+
+	m_version = version;
+	m_interval = intervalNs;
+	m_valid = true;
+}
@@ -0,0 +1,102 @@
+// xdrum groove templates
+//
+// A groove moves each step of a pattern a little earlier or later, and
+// makes it louder or softer - eg: swing, or the feel of a played pattern.
+// The offsets repeat every "length" steps, and are in 1/GROOVE_STEP_UNITS
+// of a step, which is finer than the sequencer's ticks. Each offset is
+// split into whole ticks (the tick the note is triggered on) and the rest,
+// which the audio engine adds as a delay, so notes land to the sample.
+// The play thread does not work the offsets out on every tick: its
+// GrooveTiming is only updated when the groove or the tempo changes.
+// Swing uses the MPC definition: at 66%, the second 8th (or 16th) note of
+// each pair starts 66% of the way through the pair. The groove of a
+// pattern can also be extracted (from its micro-timing and accents) and
+// applied to other patterns.
+// Needs SDL.h and pattern.h included first.
+
+#define GROOVE_MAX_STEPS		MAX_STEPS_PER_PATTERN
+#define GROOVE_STEP_UNITS		96			// timing units per step
+#define GROOVE_TICK_UNITS		(GROOVE_STEP_UNITS / TICKS_PER_STEP)	// timing units per tick
+#define GROOVE_MAX_EARLY		(GROOVE_STEP_UNITS / 2)		// max units a step can move earlier
+#define GROOVE_MAX_LATE			GROOVE_STEP_UNITS			// max units a step can move later
+#define GROOVE_MIN_VELOCITY		25			// min velocity scale (percent)
+#define GROOVE_MAX_VELOCITY		200			// max velocity scale (percent)
+#define GROOVE_NAME_LEN			12
+
+/// Groove template (timing and velocity of each step)
+class Groove
+{
+public:
+	// constructor
+	Groove();
+
+	void Clear();
+	void SetSwing(int percent, int noteSteps);
+	bool Extract(const DrumPattern* pattern, int patternIndex);
+
+	const char* GetName() const { return m_name; }
+	int GetLength() const { return m_length; }
+	int GetSwing() const { return m_swing; }
+	int GetSwingSteps() const { return m_swingSteps; }
+	Uint32 GetVersion() const { return m_version; }
+
+	// Timing offset of a step (units, - = earlier)
+	int GetTiming(int step) const
+		{
+		return m_timing[step % m_length];
+		}
+
+	// Velocity scale of a step (percent)
+	int GetVelocity(int step) const
+		{
+		return m_velocity[step % m_length];
+		}
+
+	void GetStepTiming(int step, int* ticks, int* units) const;
+
+private:
+	char m_name[GROOVE_NAME_LEN];
+	int m_length;							// steps before the groove repeats
+	short m_timing[GROOVE_MAX_STEPS];		// offset of each step (units)
+	unsigned char m_velocity[GROOVE_MAX_STEPS];	// velocity scale of each step (percent)
+	int m_swing;							// swing percent (50 = none)
+	int m_swingSteps;						// steps per swung note (1 = 16ths, 2 = 8ths, 0 = extracted groove)
+	volatile Uint32 m_version;				// changed on every change
+};
+
+/// A groove's timing at the current tempo (worked out once, when the
+/// groove or tempo changes)
+class GrooveTiming
+{
+public:
+	// constructor
+	GrooveTiming();
+
+	void Update(const Groove* groove, Uint64 intervalNs);
+
+	// Ticks to trigger a step's notes after (or before) the step's tick
+	int GetTicks(int step) const
+		{
+		return m_ticks[step];
+		}
+
+	// Delay of a step's notes after the tick they are triggered on
+	Uint32 GetDelayNs(int step) const
+		{
+		return m_delayNs[step];
+		}
+
+	// Volume of a note on a step
+	int ApplyVelocity(int step, int vol) const
+		{
+		return (vol * m_velocity[step]) >> 8;
+		}
+
+private:
+	bool m_valid;
+	Uint32 m_version;						// groove version worked out
+	Uint64 m_interval;						// tick interval worked out (ns)
+	signed char m_ticks[GROOVE_MAX_STEPS];
+	Uint32 m_delayNs[GROOVE_MAX_STEPS];
+	unsigned short m_velocity[GROOVE_MAX_STEPS];	// velocity scale (1/256)
+};
@@ -13,8 +13,10 @@
 #include "fontengine.h"
 #include "joymap.h"
 #include "gui.h"
+#include "uisched.h"
 
 extern JoyMap joyMap;
+extern UiScheduler uiScheduler;
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -361,11 +363,12 @@ int Menu::DoMenu(SDL_Surface* screen, SDL_Rect* extents, FontEngine* font, const
 
 		SDL_Flip(screen);			// ?waits for vsync?
 
-		SDL_Delay(20);					// gives time to other threads
+		uiScheduler.WaitForFrame();		// sleep until input
 		} // wend done
 	
 	// Tidy up
 	SDL_FreeSurface(surface);
+	InvalidateScreen();
 	
 	// return id of selected item, or 
 	int selectedId = -1;
@@ -545,11 +548,12 @@ bool DoMessage(SDL_Surface* screen, FontEngine* font, const char *title, const c
 
 		SDL_Flip(screen);			// waits for vsync
 
-		SDL_Delay(20);					// gives time to other threads
+		uiScheduler.WaitForFrame();		// sleep until input
 		} // wend done
 	
 	// tidy up
 	SDL_FreeSurface(surface);
+	InvalidateScreen();
 	
 	return confirmYes;	
 }
@@ -589,7 +593,6 @@ bool DoTextInput(SDL_Surface* screen, FontEngine* font, const char* prompt, char
 
 	int itemHeight = (3 * font->GetFontHeight()) / 2;
 	
-	int counter = 0;
 	SDL_Rect rect;
 	SDL_Event event;
 	unsigned short keyCode;
@@ -745,11 +748,12 @@ bool DoTextInput(SDL_Surface* screen, FontEngine* font, const char* prompt, char
 		strcpy(s, text);
 		strcat(s, "_");
 		SetSDLRect(rect, 8, 40,  VIEW_WIDTH - 16, itemHeight);
-		font->DrawText(screen, s, rect, false);
+		font->DrawTextDirect(screen, s, rect, false);		// changes with every key, so don't cache
 
 		// Draw instructions
 		SetSDLRect(rect, 8, VIEW_HEIGHT - itemHeight, 0, 0);
-		if (0 == ((counter / 200) % 2))
+		// (instructions alternate every 4 seconds)
+		if (0 == ((SDL_GetTicks() / 4000) % 2))
 			{
 #ifdef PSP				
 			font->DrawText(screen, "Use DPAD to select char, X to input char.", rect, false);
@@ -788,11 +792,13 @@ bool DoTextInput(SDL_Surface* screen, FontEngine* font, const char* prompt, char
 */
 		SDL_Flip(screen);			// waits for vsync
 		
-		SDL_Delay(20);
-		
-		counter++;
+		// sleep until input (or the instructions change)
+		uiScheduler.RequestFrameIn(4000 - (SDL_GetTicks() % 4000));
+		uiScheduler.WaitForFrame();
 		} // wend done
 	
+	InvalidateScreen();
+
 	return (!escapePressed);	
 }
 
@@ -964,11 +970,13 @@ bool DoFileSelect(SDL_Surface* screen, FontEngine* font, const char* prompt, con
 
 		SDL_Flip(screen);			// waits for vsync
 		
-		SDL_Delay(20);
+		uiScheduler.WaitForFrame();		// sleep until input
 		
 		counter++;
 		} // wend done
 
+	InvalidateScreen();
+
 	// get selected filename
 	if (!escapePressed)
 		strcpy(filename, listnames[currentItem]);
@@ -1013,6 +1021,8 @@ bool ShowProgress(SDL_Surface* surface, FontEngine* font, const char* text, int
 	// Draw progress bar
 	SetSDLRect(rect, extents.x + 20, extents.y + PROGBOX_HEIGHT/2,  progress*2, 20);
 	SDL_FillRect(surface, &rect, g_highlightColour);
+
+	InvalidateScreen();
 		
 	return true;	
 }
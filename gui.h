@@ -21,6 +21,9 @@ extern Uint32 g_borderColour;
 extern Uint32 g_separatorColour;
 extern Uint32 g_highlightColour;
 
+// called when a dialog has drawn over the main screen (must be defined in main app)
+extern void InvalidateScreen();
+
 // GUI functions
 extern bool DoMessage(SDL_Surface* screen, FontEngine* font, const char *title, const char *prompt, bool confirm);
 extern bool DoTextInput(SDL_Surface* screen, FontEngine* font, const char* prompt, char* text, int maxlen);
@@ -0,0 +1,444 @@
+/*
+ *      history.cpp
+ *
+ *      Edit history (undo / redo) for xdrum songs
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "pattern.h"
+#include "song.h"
+#include "history.h"
+
+/// Construct empty history
+EditHistory::EditHistory()
+{
+	m_numSteps = 0;
+	m_undoCount = 0;
+	m_budget = HISTORY_DEFAULT_BUDGET;
+	m_memoryUsed = 0;
+	for (int i = 0; i < MAX_PATTERN; i++)
+		m_latest[i] = NULL;
+	m_groupDepth = 0;
+	m_group = NULL;
+	m_groupSongPos = -1;
+	m_lastNumChanged = 0;
+	m_lastChangedSongList = false;
+	m_patternChanged = NULL;
+	m_songListChanged = NULL;
+}
+
+EditHistory::~EditHistory()
+{
+	Clear();
+}
+
+/// Remove all undo / redo steps (eg: after loading a song)
+void EditHistory::Clear()
+{
+	if (m_group)
+		{
+		FreeStep(m_group);
+		m_group = NULL;
+		}
+	m_groupDepth = 0;
+
+	for (int i = 0; i < m_numSteps; i++)
+		FreeStep(m_steps[i]);
+	m_numSteps = 0;
+	m_undoCount = 0;
+
+	for (int i = 0; i < MAX_PATTERN; i++)
+		{
+		if (m_latest[i])
+			{
+			ReleaseSnapshot(m_latest[i]);
+			m_latest[i] = NULL;
+			}
+		}
+
+	m_lastNumChanged = 0;
+	m_lastChangedSongList = false;
+}
+
+/// Set functions to be called when an edit, undo or redo changes the song
+/// (eg: for journaling)
+/// @param patternChanged		Called with pattern index, old and new pattern
+/// @param songListChanged		Called with the song and the changed songlist range
+void EditHistory::SetChangeCallbacks(void (*patternChanged)(int, const DrumPattern*, const DrumPattern*),
+									 void (*songListChanged)(const Song&, int, int))
+{
+	m_patternChanged = patternChanged;
+	m_songListChanged = songListChanged;
+}
+
+/// Set the max amount of memory used for snapshots
+/// @param bytes		Memory budget in bytes
+void EditHistory::SetBudget(int bytes)
+{
+	m_budget = bytes;
+	EnforceBudget();
+}
+
+/// Get a snapshot of the pattern, sharing the latest snapshot of
+/// the pattern if it is still the same as the pattern
+PatternSnapshot* EditHistory::TakeSnapshot(const Song& song, int patternIndex)
+{
+	const DrumPattern* pattern = &song.patterns[patternIndex];
+	PatternSnapshot* latest = m_latest[patternIndex];
+	if (latest && latest->pattern.IsSameAs(pattern))
+		{
+		latest->refCount++;
+		return latest;
+		}
+
+	PatternSnapshot* snapshot = new PatternSnapshot;
+	snapshot->pattern.CopyFrom(pattern);
+	strcpy(snapshot->pattern.name, pattern->name);
+	m_memoryUsed += sizeof(PatternSnapshot) + snapshot->pattern.GetPageMemory();
+
+	// this is now the latest known state of the pattern
+	if (latest)
+		ReleaseSnapshot(latest);
+	snapshot->refCount++;
+	m_latest[patternIndex] = snapshot;
+
+	return snapshot;
+}
+
+/// Drop a reference to a snapshot (free it if no longer used)
+void EditHistory::ReleaseSnapshot(PatternSnapshot* snapshot)
+{
+	if (!snapshot)
+		return;
+
+	snapshot->refCount--;
+	if (snapshot->refCount <= 0)
+		{
+		m_memoryUsed -= sizeof(PatternSnapshot) + snapshot->pattern.GetPageMemory();
+		delete snapshot;
+		}
+}
+
+/// Free an undo step and release its snapshots
+void EditHistory::FreeStep(HistoryStep* step)
+{
+	for (int i = 0; i < step->numPatterns; i++)
+		{
+		ReleaseSnapshot(step->before[i]);
+		ReleaseSnapshot(step->after[i]);
+		}
+
+	if (step->songListBefore)
+		{
+		m_memoryUsed -= sizeof(SongListSlice) + step->songListBefore->count;
+		delete step->songListBefore;
+		}
+	if (step->songListAfter)
+		{
+		m_memoryUsed -= sizeof(SongListSlice) + step->songListAfter->count;
+		delete step->songListAfter;
+		}
+
+	delete step;
+}
+
+/// Start recording an undoable edit
+/// @param label		Short description of the edit (eg: "Clear track")
+void EditHistory::BeginGroup(const char* label)
+{
+	m_groupDepth++;
+	if (m_groupDepth > 1)
+		return;					// nested group is part of the outer group
+
+	m_group = new HistoryStep;
+	strncpy(m_group->label, label, HISTORY_LABEL_LEN);
+	m_group->label[HISTORY_LABEL_LEN - 1] = 0;
+	m_groupSongPos = -1;
+}
+
+/// Mark a pattern as about to be changed by the current group
+/// @return			false if no group open or too many patterns touched
+bool EditHistory::TouchPattern(const Song& song, int patternIndex)
+{
+	if (!m_group || patternIndex < 0 || patternIndex >= MAX_PATTERN)
+		return false;
+
+	// already touched?
+	for (int i = 0; i < m_group->numPatterns; i++)
+		{
+		if (patternIndex == m_group->patternIndex[i])
+			return true;
+		}
+
+	if (m_group->numPatterns >= HISTORY_MAX_TOUCHED)
+		{
+		printf("EditHistory: too many patterns in one edit!\n");
+		return false;
+		}
+
+	int n = m_group->numPatterns;
+	m_group->patternIndex[n] = patternIndex;
+	m_group->before[n] = TakeSnapshot(song, patternIndex);
+	m_group->after[n] = NULL;
+	m_group->numPatterns++;
+
+	return true;
+}
+
+/// Mark the songlist (sequence) as about to be changed by the current group
+/// @return			false if no group open
+bool EditHistory::TouchSongList(const Song& song)
+{
+	if (!m_group)
+		return false;
+
+	if (-1 == m_groupSongPos)
+		{
+		memcpy(m_groupSongList, song.songList, PATTERNS_PER_SONG);
+		m_groupSongPos = song.songPos;
+		}
+
+	return true;
+}
+
+/// Finish recording an edit
+/// Only the patterns / songlist entries that actually changed are kept.
+void EditHistory::EndGroup(const Song& song)
+{
+	if (0 == m_groupDepth)
+		return;
+
+	m_groupDepth--;
+	if (m_groupDepth > 0)
+		return;
+
+	HistoryStep* step = m_group;
+	m_group = NULL;
+
+	// keep "after" snapshots of changed patterns, drop unchanged ones
+	int n = 0;
+	for (int i = 0; i < step->numPatterns; i++)
+		{
+		int index = step->patternIndex[i];
+		if (step->before[i]->pattern.IsSameAs(&song.patterns[index]))
+			{
+			ReleaseSnapshot(step->before[i]);
+			continue;
+			}
+		step->patternIndex[n] = index;
+		step->before[n] = step->before[i];
+		step->after[n] = TakeSnapshot(song, index);
+		if (m_patternChanged)
+			m_patternChanged(index, &step->before[n]->pattern, &step->after[n]->pattern);
+		n++;
+		}
+	step->numPatterns = n;
+
+	// store only the changed range of the songlist
+	if (-1 != m_groupSongPos)
+		{
+		int first = 0;
+		while (first < PATTERNS_PER_SONG && m_groupSongList[first] == song.songList[first])
+			first++;
+		int last = PATTERNS_PER_SONG - 1;
+		while (last > first && m_groupSongList[last] == song.songList[last])
+			last--;
+		int count = (first < PATTERNS_PER_SONG) ? (last - first + 1) : 0;
+
+		if (count > 0 || m_groupSongPos != song.songPos)
+			{
+			step->songListBefore = new SongListSlice;
+			step->songListAfter = new SongListSlice;
+			step->songListBefore->start = step->songListAfter->start = first;
+			step->songListBefore->count = step->songListAfter->count = count;
+			step->songListBefore->songPos = m_groupSongPos;
+			step->songListAfter->songPos = song.songPos;
+			if (count > 0)
+				{
+				step->songListBefore->data = new unsigned char[count];
+				step->songListAfter->data = new unsigned char[count];
+				memcpy(step->songListBefore->data, &m_groupSongList[first], count);
+				memcpy(step->songListAfter->data, &song.songList[first], count);
+				}
+			m_memoryUsed += 2 * (sizeof(SongListSlice) + count);
+			if (m_songListChanged)
+				m_songListChanged(song, first, count);
+			}
+		m_groupSongPos = -1;
+		}
+
+	// nothing changed?
+	if (0 == step->numPatterns && NULL == step->songListBefore)
+		{
+		FreeStep(step);
+		return;
+		}
+
+	// new edit invalidates the redo steps
+	DropRedoSteps();
+
+	// make room if history is full
+	if (HISTORY_MAX_STEPS == m_numSteps)
+		{
+		FreeStep(m_steps[0]);
+		memmove(&m_steps[0], &m_steps[1], (HISTORY_MAX_STEPS - 1) * sizeof(HistoryStep*));
+		m_numSteps--;
+		m_undoCount--;
+		}
+
+	m_steps[m_numSteps++] = step;
+	m_undoCount = m_numSteps;
+
+	EnforceBudget();
+}
+
+/// Abandon the group being recorded, restoring the song to the state
+/// it was in when the (outermost) group began
+void EditHistory::CancelGroup(Song& song)
+{
+	if (!m_group)
+		return;
+
+	for (int i = 0; i < m_group->numPatterns; i++)
+		{
+		DrumPattern* pattern = &song.patterns[m_group->patternIndex[i]];
+		pattern->CopyFrom(&m_group->before[i]->pattern);
+		strcpy(pattern->name, m_group->before[i]->pattern.name);
+		}
+
+	if (-1 != m_groupSongPos)
+		{
+		memcpy(song.songList, m_groupSongList, PATTERNS_PER_SONG);
+		song.songPos = m_groupSongPos;
+		m_groupSongPos = -1;
+		}
+
+	FreeStep(m_group);
+	m_group = NULL;
+	m_groupDepth = 0;
+}
+
+/// Remove steps that have been undone (they can no longer be redone)
+void EditHistory::DropRedoSteps()
+{
+	for (int i = m_undoCount; i < m_numSteps; i++)
+		FreeStep(m_steps[i]);
+	m_numSteps = m_undoCount;
+}
+
+/// Drop the oldest steps until we are within the memory budget
+/// (the most recent step is always kept)
+void EditHistory::EnforceBudget()
+{
+	int drop = 0;
+	while (m_memoryUsed > m_budget && (m_numSteps - drop) > 1 && drop < m_undoCount)
+		{
+		FreeStep(m_steps[drop]);
+		drop++;
+		}
+
+	if (drop > 0)
+		{
+		memmove(&m_steps[0], &m_steps[drop], (m_numSteps - drop) * sizeof(HistoryStep*));
+		m_numSteps -= drop;
+		m_undoCount -= drop;
+		}
+
+	// still over budget? - drop cached snapshots that no step uses
+	for (int i = 0; i < MAX_PATTERN && m_memoryUsed > m_budget; i++)
+		{
+		if (m_latest[i] && 1 == m_latest[i]->refCount)
+			{
+			ReleaseSnapshot(m_latest[i]);
+			m_latest[i] = NULL;
+			}
+		}
+}
+
+/// Restore the before (undo) or after (redo) state of a step
+void EditHistory::ApplyStep(Song& song, HistoryStep* step, bool undo)
+{
+	m_lastNumChanged = step->numPatterns;
+	for (int i = 0; i < step->numPatterns; i++)
+		{
+		int index = step->patternIndex[i];
+		PatternSnapshot* snapshot = undo ? step->before[i] : step->after[i];
+		PatternSnapshot* replaced = undo ? step->after[i] : step->before[i];
+		if (m_patternChanged)
+			m_patternChanged(index, &replaced->pattern, &snapshot->pattern);
+		song.patterns[index].CopyFrom(&snapshot->pattern);
+		strcpy(song.patterns[index].name, snapshot->pattern.name);
+		m_lastChanged[i] = index;
+
+		// restored snapshot is now the latest state of the pattern
+		snapshot->refCount++;
+		if (m_latest[index])
+			ReleaseSnapshot(m_latest[index]);
+		m_latest[index] = snapshot;
+		}
+
+	m_lastChangedSongList = false;
+	SongListSlice* slice = undo ? step->songListBefore : step->songListAfter;
+	if (slice)
+		{
+		if (slice->count > 0)
+			memcpy(&song.songList[slice->start], slice->data, slice->count);
+		song.songPos = slice->songPos;
+		m_lastChangedSongList = true;
+		if (m_songListChanged)
+			m_songListChanged(song, slice->start, slice->count);
+		}
+}
+
+/// Get the description of the edit that would be undone
+const char* EditHistory::GetUndoLabel() const
+{
+	if (!CanUndo())
+		return "";
+	return m_steps[m_undoCount - 1]->label;
+}
+
+/// Get the description of the edit that would be redone
+const char* EditHistory::GetRedoLabel() const
+{
+	if (!CanRedo())
+		return "";
+	return m_steps[m_undoCount]->label;
+}
+
+/// Undo the last edit
+/// @return			false if nothing to undo
+bool EditHistory::Undo(Song& song)
+{
+	if (!CanUndo() || m_group)
+		return false;
+
+	m_undoCount--;
+	ApplyStep(song, m_steps[m_undoCount], true);
+	return true;
+}
+
+/// Redo the last undone edit
+/// @return			false if nothing to redo
+bool EditHistory::Redo(Song& song)
+{
+	if (!CanRedo() || m_group)
+		return false;
+
+	ApplyStep(song, m_steps[m_undoCount], false);
+	m_undoCount++;
+	return true;
+}
+
+/// Get index of a pattern changed by the last undo / redo
+/// @param index		0 to number of changed patterns - 1
+/// @return				Pattern index, or -1 if no more
+int EditHistory::GetLastChangedPattern(int index) const
+{
+	if (index < 0 || index >= m_lastNumChanged)
+		return -1;
+	return m_lastChanged[index];
+}
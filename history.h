@@ -0,0 +1,142 @@
+// xdrum edit history (undo / redo)
+//
+// Each undo step only stores the patterns and the songlist range that the
+// edit actually changed. Pattern snapshots are reference counted, so the
+// "after" state of one step is shared as the "before" state of the next
+// step that touches the same pattern.
+// Needs pattern.h and song.h included first.
+
+#define HISTORY_MAX_STEPS			256				// max undo steps kept
+#define HISTORY_MAX_TOUCHED			8				// max patterns changed by one step
+#define HISTORY_DEFAULT_BUDGET		(128 * 1024)	// max bytes of snapshot data kept
+#define HISTORY_LABEL_LEN			32
+
+/// Reference counted copy of a pattern (shared between undo steps)
+class PatternSnapshot
+{
+public:
+	PatternSnapshot()
+		{
+		refCount = 1;
+		};
+
+	int refCount;
+	DrumPattern pattern;
+};
+
+/// Copy of a range of the songlist
+class SongListSlice
+{
+public:
+	SongListSlice()
+		{
+		start = 0;
+		count = 0;
+		songPos = 0;
+		data = NULL;
+		};
+
+	~SongListSlice()
+		{
+		if (data)
+			delete [] data;
+		};
+
+	int start;								// first songlist entry in the slice
+	int count;								// number of entries in the slice
+	int songPos;							// song position at the time
+	unsigned char* data;					// songlist entries [start, start + count)
+};
+
+/// One undoable edit (possibly made up of several changes)
+class HistoryStep
+{
+public:
+	HistoryStep()
+		{
+		label[0] = 0;
+		numPatterns = 0;
+		songListBefore = NULL;
+		songListAfter = NULL;
+		};
+
+	char label[HISTORY_LABEL_LEN];
+	int numPatterns;
+	int patternIndex[HISTORY_MAX_TOUCHED];
+	PatternSnapshot* before[HISTORY_MAX_TOUCHED];
+	PatternSnapshot* after[HISTORY_MAX_TOUCHED];
+	SongListSlice* songListBefore;
+	SongListSlice* songListAfter;
+};
+
+/// Undo / redo history for a song
+/// Usage:
+///   BeginGroup() - TouchPattern() / TouchSongList() - <edit song> - EndGroup()
+/// Groups may be nested (eg: for scripted edit batches), only the outermost
+/// group creates an undo step. CancelGroup() rolls back the open group.
+class EditHistory
+{
+public:
+	// constructor
+	EditHistory();
+	~EditHistory();
+
+	void Clear();
+	void SetBudget(int bytes);
+	int GetMemoryUsed() const { return m_memoryUsed; }
+
+	// recording edits
+	void BeginGroup(const char* label);
+	bool TouchPattern(const Song& song, int patternIndex);
+	bool TouchSongList(const Song& song);
+	void EndGroup(const Song& song);
+	void CancelGroup(Song& song);
+
+	// undo / redo
+	bool CanUndo() const { return (m_undoCount > 0); }
+	bool CanRedo() const { return (m_undoCount < m_numSteps); }
+	const char* GetUndoLabel() const;
+	const char* GetRedoLabel() const;
+	bool Undo(Song& song);
+	bool Redo(Song& song);
+
+	// info about the last undo / redo (eg: for redrawing)
+	int GetLastChangedPattern(int index) const;
+	bool LastChangedSongList() const { return m_lastChangedSongList; }
+
+	// notification of committed changes (edit, undo and redo)
+	void SetChangeCallbacks(void (*patternChanged)(int, const DrumPattern*, const DrumPattern*),
+							void (*songListChanged)(const Song&, int, int));
+
+private:
+	PatternSnapshot* TakeSnapshot(const Song& song, int patternIndex);
+	void ReleaseSnapshot(PatternSnapshot* snapshot);
+	void FreeStep(HistoryStep* step);
+	void DropRedoSteps();
+	void EnforceBudget();
+	void ApplyStep(Song& song, HistoryStep* step, bool undo);
+
+	HistoryStep* m_steps[HISTORY_MAX_STEPS];
+	int m_numSteps;							// number of steps in history
+	int m_undoCount;						// number of steps that can be undone
+	int m_budget;							// max memory for snapshots (bytes)
+	int m_memoryUsed;						// current memory used by snapshots
+
+	// latest known snapshot of each pattern (for sharing)
+	PatternSnapshot* m_latest[MAX_PATTERN];
+
+	// group currently being recorded
+	int m_groupDepth;
+	HistoryStep* m_group;
+	unsigned char m_groupSongList[PATTERNS_PER_SONG];
+	int m_groupSongPos;
+
+	// last applied step
+	int m_lastChanged[HISTORY_MAX_TOUCHED];
+	int m_lastNumChanged;
+	bool m_lastChangedSongList;
+
+	// change callbacks
+	void (*m_patternChanged)(int index, const DrumPattern* before, const DrumPattern* after);
+	void (*m_songListChanged)(const Song& song, int start, int count);
+};
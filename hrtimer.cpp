@@ -0,0 +1,68 @@
+/*
+ *      hrtimer.cpp
+ *
+ *      High resolution clock and absolute deadline sleeps for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include "SDL.h"
+#include "platform.h"
+#include "hrtimer.h"
+
+#ifdef PSP
+	#include <pspkernel.h>
+#elif !defined(WIN32)
+	#include <time.h>
+	#include <errno.h>
+#endif
+
+/// Get the time from a monotonic clock
+/// @return					Time in nanoseconds (from an arbitrary start point)
+Uint64 HrTimeNanos()
+{
+#ifdef PSP
+	return (Uint64)sceKernelGetSystemTimeWide() * 1000;
+#elif defined(WIN32)
+	return (Uint64)SDL_GetTicks() * 1000000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// Sleep until an absolute time
+/// The thread sleeps until spinNanos before the deadline, then busy-waits
+/// up to the deadline (the OS wakes sleeping threads up late).
+/// @param deadline			Time to wake up (HrTimeNanos() time)
+/// @param spinNanos		Time to busy-wait at the end (0 = no busy-wait)
+/// @return					Time spent busy-waiting (ns)
+Uint32 HrSleepUntil(Uint64 deadline, Uint32 spinNanos)
+{
+	Uint64 wake = (deadline > spinNanos) ? deadline - spinNanos : 0;
+	Uint64 now = HrTimeNanos();
+
+	if (now < wake)
+		{
+#ifdef PSP
+		sceKernelDelayThread((SceUInt)((wake - now) / 1000));
+#elif defined(WIN32)
+		SDL_Delay((Uint32)((wake - now) / 1000000));
+#else
+		struct timespec ts;
+		ts.tv_sec = (time_t)(wake / 1000000000);
+		ts.tv_nsec = (long)(wake % 1000000000);
+		while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+			;
+#endif
+		}
+
+	// spin for the rest of the time
+	Uint64 spinStart = HrTimeNanos();
+	now = spinStart;
+	while (now < deadline)
+		now = HrTimeNanos();
+
+	return (now > spinStart) ? (Uint32)(now - spinStart) : 0;
+}
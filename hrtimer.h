@@ -0,0 +1,14 @@
+// xdrum high resolution timer
+//
+// Monotonic nanosecond clock and absolute deadline sleeps for the step
+// scheduler. Sleeping to an absolute deadline (instead of "sleep for N ms")
+// means the time taken to process a tick does not add up into drift, and the
+// clock is not limited to SDL_GetTicks()' 1ms resolution. The OS wakes us up
+// a little late, so the sleep can finish with a short busy-wait ("spin")
+// right up to the deadline.
+// Needs SDL.h included first.
+
+#define HRTIMER_DEFAULT_SPIN	200000		// ns to busy-wait at the end of a sleep
+
+Uint64 HrTimeNanos();
+Uint32 HrSleepUntil(Uint64 deadline, Uint32 spinNanos);
@@ -0,0 +1,522 @@
+/*
+ *      journal.cpp
+ *
+ *      Append-only edit journal for autosave and crash recovery
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "platform.h"
+#include "pattern.h"
+#include "song.h"
+#include "journal.h"
+
+static const char* slotFiles[2] = { JOURNAL_SLOT_FILE_0, JOURNAL_SLOT_FILE_1 };
+
+/// Progress callback for loading / saving without a display
+static void NoProgress(int progress)
+{
+}
+
+/// Construct closed journal
+Journal::Journal()
+{
+	m_pfile = NULL;
+	m_slot = 0;
+	m_sequence = 0;
+	m_size = 0;
+	m_compactThread = NULL;
+	m_compactDone = false;
+	m_compactSong = NULL;
+	m_compactOldSlot = 0;
+}
+
+Journal::~Journal()
+{
+	Close(false);
+	if (m_compactSong)
+		delete m_compactSong;
+}
+
+/// Read the sequence number from a journal file header
+/// @return			false if no (valid) journal file
+static bool ReadJournalHeader(FILE* pfile, unsigned int* sequence)
+{
+	unsigned char header[8];
+	if (1 != fread(header, 8, 1, pfile))
+		return false;
+	if (0 != memcmp(header, "XDJ1", 4))
+		return false;
+	*sequence = header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24);
+	return true;
+}
+
+/// Apply a journal record to the song
+/// @return			false if record is bad
+bool Journal::ApplyRecord(Song& song, int type, const unsigned char* data, int len)
+{
+	switch (type)
+		{
+		case JR_STEP :
+			{
+			if (len < 6 || data[0] >= MAX_PATTERN || data[1] >= NUM_TRACKS || data[2] >= MAX_STEPS_PER_PATTERN)
+				return false;
+			DrumEvent event;
+			event.vol = data[3];
+			event.pan = data[4];
+			event.offset = data[5];
+			song.patterns[data[0]].SetEvent(data[1], data[2], &event);
+			}
+			break;
+		case JR_PATTERN :
+			{
+			if (len < 2 || data[0] >= MAX_PATTERN)
+				return false;
+			DrumPattern* pattern = &song.patterns[data[0]];
+			pattern->Clear();
+			pattern->SetLength(data[1]);
+			for (const unsigned char* p = &data[2]; p + 5 <= data + len; p += 5)
+				{
+				if (p[0] >= NUM_TRACKS || p[1] >= MAX_STEPS_PER_PATTERN)
+					return false;
+				DrumEvent event;
+				event.vol = p[2];
+				event.pan = p[3];
+				event.offset = p[4];
+				pattern->SetEvent(p[0], p[1], &event);
+				}
+			}
+			break;
+		case JR_PATNAME :
+			{
+			if (len < 1 || len > PATTERN_NAME_LENGTH || data[0] >= MAX_PATTERN)
+				return false;
+			char* name = song.patterns[data[0]].name;
+			memcpy(name, &data[1], len - 1);
+			name[len - 1] = 0;
+			}
+			break;
+		case JR_SONGLIST :
+			{
+			if (len < 3 || data[0] >= PATTERNS_PER_SONG || data[1] + data[2] > PATTERNS_PER_SONG || len < 3 + data[2])
+				return false;
+			song.songPos = data[0];
+			memcpy(&song.songList[data[1]], &data[3], data[2]);
+			}
+			break;
+		case JR_TRACKMIX :
+			{
+			if (len < 5 || data[0] >= NUM_TRACKS)
+				return false;
+			TrackMixInfo* info = &song.trackMixInfo[data[0]];
+			info->vol = data[1];
+			info->pan = data[2];
+			info->state = data[3];
+			info->prevState = data[4];
+			}
+			break;
+		case JR_SONGPARAMS :
+			{
+			if (len < 3)
+				return false;
+			song.vol = data[0];
+			song.SetBPM(data[1]);
+			song.pitch = (char)data[2];
+			if (len >= 7)
+				song.seed = data[3] | (data[4] << 8) | (data[5] << 16) | ((unsigned int)data[6] << 24);
+			}
+			break;
+		case JR_TEMPOMAP :
+			song.numTempoPoints = 0;
+			for (int i = 0; i + 4 <= len; i += 4)
+				song.SetTempoPoint(data[i], data[i + 1], data[i + 2], (0 != data[i + 3]));
+			break;
+		case JR_AUTOMATION :
+			{
+			if (len < 1 || data[0] >= AUTOMATION_LANES)
+				return false;
+			AutomationLane* lane = &song.automation[data[0]];
+			lane->numPoints = 0;
+			for (int i = 1; i + 3 <= len; i += 3)
+				lane->SetPoint(data[i], data[i + 1], data[i + 2]);
+			}
+			break;
+		default :
+			// unknown record (from later version?) - skip it
+			break;
+		}
+
+	return true;
+}
+
+/// Replay any journal left over from a previous run (ie: after a crash)
+/// onto the song it was started from.
+/// @param song					Song to recover into
+/// @param progressCallback		Progress callback for loading base song
+/// @return						true if a previous session was recovered
+bool Journal::Recover(Song& song, void (*progressCallback)(int))
+{
+	// find journal slots, oldest first
+	FILE* files[2] = { NULL, NULL };
+	unsigned int sequence[2] = { 0, 0 };
+	int numFiles = 0;
+	for (int slot = 0; slot < 2; slot++)
+		{
+		FILE* pfile = fopen(slotFiles[slot], "rb");
+		if (!pfile)
+			continue;
+		if (ReadJournalHeader(pfile, &sequence[numFiles]))
+			files[numFiles++] = pfile;
+		else
+			fclose(pfile);
+		}
+	if (2 == numFiles && sequence[1] < sequence[0])
+		{
+		FILE* ptemp = files[0];
+		files[0] = files[1];
+		files[1] = ptemp;
+		}
+
+	int numRecords = 0;
+	bool baseLoaded = false;
+	bool ok = true;
+	for (int f = 0; f < numFiles && ok; f++)
+		{
+		unsigned char header[3];
+		unsigned char data[JOURNAL_MAX_RECORD];
+		while (1 == fread(header, 3, 1, files[f]))
+			{
+			int type = header[0];
+			int len = header[1] | (header[2] << 8);
+			if (len > JOURNAL_MAX_RECORD || (len > 0 && 1 != fread(data, len, 1, files[f])))
+				break;				// truncated record (crashed while writing)
+
+			if (JR_BASE == type)
+				{
+				// Only the base of the oldest journal counts. (Later journals
+				// are based on a compaction that may not have completed.)
+				if (0 == f && 0 == numRecords && len > 0)
+					{
+					char filename[200];
+					if (len >= (int)sizeof(filename))
+						len = sizeof(filename) - 1;
+					memcpy(filename, data, len);
+					filename[len] = 0;
+					printf("Journal: recovering from base song %s\n", filename);
+					baseLoaded = song.Load(filename, progressCallback);
+					if (!baseLoaded && 0 == strcmp(filename, JOURNAL_BASE_FILE))
+						{
+						// (compaction was interrupted between removing the
+						// base and renaming the new one - see CompactThreadFunc())
+						printf("Journal: base song missing, trying %s\n", JOURNAL_TEMP_FILE);
+						baseLoaded = song.Load(JOURNAL_TEMP_FILE, progressCallback);
+						}
+					if (!baseLoaded)
+						ok = false;
+					}
+				}
+			else
+				{
+				if (ApplyRecord(song, type, data, len))
+					numRecords++;
+				}
+			}
+		}
+
+	for (int f = 0; f < numFiles; f++)
+		fclose(files[f]);
+
+	if (numRecords > 0)
+		printf("Journal: recovered %d edits\n", numRecords);
+
+	return (ok && (baseLoaded || numRecords > 0));
+}
+
+/// Open a journal slot for writing
+bool Journal::OpenSlot(int slot, const char* baseFilename)
+{
+	m_pfile = fopen(slotFiles[slot], "wb");
+	if (!m_pfile)
+		{
+		printf("Journal: cannot open %s!\n", slotFiles[slot]);
+		return false;
+		}
+
+	m_slot = slot;
+	m_sequence++;
+	unsigned char header[8] = { 'X', 'D', 'J', '1',
+								(unsigned char)(m_sequence & 0xFF),
+								(unsigned char)((m_sequence >> 8) & 0xFF),
+								(unsigned char)((m_sequence >> 16) & 0xFF),
+								(unsigned char)((m_sequence >> 24) & 0xFF) };
+	fwrite(header, 8, 1, m_pfile);
+	m_size = 8;
+	AppendRecord(JR_BASE, (const unsigned char*)baseFilename, (int)strlen(baseFilename));
+
+	return true;
+}
+
+/// Start a new journal (eg: after the song has been loaded or saved)
+/// @param baseFilename		Song file the journal applies to ("" = new song)
+bool Journal::Start(const char* baseFilename)
+{
+	WaitForCompaction();
+	Close(true);
+	return OpenSlot(0, baseFilename);
+}
+
+/// Close the journal
+/// @param discard			If true, remove the journal files
+void Journal::Close(bool discard)
+{
+	WaitForCompaction();
+
+	if (m_pfile)
+		{
+		fclose(m_pfile);
+		m_pfile = NULL;
+		}
+
+	if (discard)
+		{
+		remove(JOURNAL_SLOT_FILE_0);
+		remove(JOURNAL_SLOT_FILE_1);
+		}
+}
+
+/// Append a record to the journal
+void Journal::AppendRecord(int type, const unsigned char* data, int len)
+{
+	if (!m_pfile)
+		return;
+
+	unsigned char header[3];
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)(len & 0xFF);
+	header[2] = (unsigned char)((len >> 8) & 0xFF);
+	fwrite(header, 3, 1, m_pfile);
+	if (len > 0)
+		fwrite(data, len, 1, m_pfile);
+	// get it out of our process (in case we crash)
+	fflush(m_pfile);
+
+	m_size += 3 + len;
+}
+
+/// Log the changes between two versions of a pattern
+/// (only changed steps are logged, unless a lot has changed)
+void Journal::LogPatternChange(int patternIndex, const DrumPattern* before, const DrumPattern* after)
+{
+	if (!m_pfile)
+		return;
+
+	unsigned char data[JOURNAL_MAX_RECORD];
+	if (0 != strcmp(before->name, after->name))
+		{
+		int len = (int)strlen(after->name);
+		data[0] = (unsigned char)patternIndex;
+		memcpy(&data[1], after->name, len);
+		AppendRecord(JR_PATNAME, data, len + 1);
+		}
+
+	// count changed steps (pages that are empty in both can be skipped)
+	int numChanged = 0;
+	for (int page = 0; page < MAX_PATTERN_PAGES; page++)
+		{
+		if (!before->HasPage(page) && !after->HasPage(page))
+			continue;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			for (int j = page * STEPS_PER_PAGE; j < (page + 1) * STEPS_PER_PAGE; j++)
+				{
+				if (!before->GetEvent(i, j)->IsSameAs(after->GetEvent(i, j)))
+					numChanged++;
+				}
+			}
+		}
+
+	if (numChanged > JOURNAL_MAX_STEP_RECORDS || before->GetLength() != after->GetLength())
+		{
+		// log whole pattern (non-empty events only)
+		unsigned char* p = data;
+		*p++ = (unsigned char)patternIndex;
+		*p++ = (unsigned char)after->GetLength();
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			for (int j = 0; j < MAX_STEPS_PER_PATTERN; j++)
+				{
+				const DrumEvent* event = after->GetEvent(i, j);
+				if (event->vol > 0)
+					{
+					*p++ = (unsigned char)i;
+					*p++ = (unsigned char)j;
+					*p++ = event->vol;
+					*p++ = event->pan;
+					*p++ = event->offset;
+					}
+				}
+			}
+		AppendRecord(JR_PATTERN, data, (int)(p - data));
+		return;
+		}
+
+	// log changed steps
+	for (int page = 0; page < MAX_PATTERN_PAGES && numChanged > 0; page++)
+		{
+		if (!before->HasPage(page) && !after->HasPage(page))
+			continue;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			for (int j = page * STEPS_PER_PAGE; j < (page + 1) * STEPS_PER_PAGE; j++)
+				{
+				const DrumEvent* event = after->GetEvent(i, j);
+				if (!before->GetEvent(i, j)->IsSameAs(event))
+					{
+					data[0] = (unsigned char)patternIndex;
+					data[1] = (unsigned char)i;
+					data[2] = (unsigned char)j;
+					data[3] = event->vol;
+					data[4] = event->pan;
+					data[5] = event->offset;
+					AppendRecord(JR_STEP, data, 6);
+					}
+				}
+			}
+		}
+}
+
+/// Log a change to a range of the songlist (and the song position)
+void Journal::LogSongList(const Song& song, int start, int count)
+{
+	unsigned char data[3 + PATTERNS_PER_SONG];
+	data[0] = (unsigned char)song.songPos;
+	data[1] = (unsigned char)start;
+	data[2] = (unsigned char)count;
+	memcpy(&data[3], &song.songList[start], count);
+	AppendRecord(JR_SONGLIST, data, 3 + count);
+}
+
+/// Log the mix settings of a track
+void Journal::LogTrackMix(const Song& song, int track)
+{
+	const TrackMixInfo* info = &song.trackMixInfo[track];
+	unsigned char data[5];
+	data[0] = (unsigned char)track;
+	data[1] = info->vol;
+	data[2] = info->pan;
+	data[3] = info->state;
+	data[4] = info->prevState;
+	AppendRecord(JR_TRACKMIX, data, 5);
+}
+
+/// Log song vol / BPM / pitch / seed
+void Journal::LogSongParams(const Song& song)
+{
+	unsigned char data[7];
+	data[0] = song.vol;
+	data[1] = song.BPM;
+	data[2] = (unsigned char)song.pitch;
+	data[3] = (unsigned char)song.seed;
+	data[4] = (unsigned char)(song.seed >> 8);
+	data[5] = (unsigned char)(song.seed >> 16);
+	data[6] = (unsigned char)(song.seed >> 24);
+	AppendRecord(JR_SONGPARAMS, data, 7);
+}
+
+/// Log the song's tempo changes (all of them)
+void Journal::LogTempoMap(const Song& song)
+{
+	unsigned char data[4 * SONG_MAX_TEMPO_POINTS];
+	for (int i = 0; i < song.numTempoPoints; i++)
+		{
+		const TempoPoint* point = &song.tempoPoints[i];
+		data[i * 4] = point->songPos;
+		data[i * 4 + 1] = point->step;
+		data[i * 4 + 2] = point->bpm;
+		data[i * 4 + 3] = point->ramp;
+		}
+	AppendRecord(JR_TEMPOMAP, data, 4 * song.numTempoPoints);
+}
+
+/// Log the points of an automation lane (all of them)
+void Journal::LogAutomation(const Song& song, int lane)
+{
+	const AutomationLane* automationLane = &song.automation[lane];
+	unsigned char data[1 + 3 * SONG_MAX_AUTOMATION_POINTS];
+	data[0] = (unsigned char)lane;
+	for (int i = 0; i < automationLane->numPoints; i++)
+		{
+		const AutomationPoint* point = &automationLane->points[i];
+		data[1 + i * 3] = point->songPos;
+		data[2 + i * 3] = point->step;
+		data[3 + i * 3] = point->value;
+		}
+	AppendRecord(JR_AUTOMATION, data, 1 + 3 * automationLane->numPoints);
+}
+
+/// Background compaction - save song copy as the new base, then remove the
+/// old journal (the new journal already applies to the new base).
+int Journal::CompactThreadFunc(void* data)
+{
+	Journal* journal = (Journal*)data;
+
+	// Save to temp file first, so that a crash never leaves a half-written
+	// base. Then rename() replaces the base in one step (POSIX). Where it
+	// cannot replace a file, the old base is removed first - if that is
+	// interrupted, Recover() finds the new base in the temp file.
+	if (journal->m_compactSong->Save(JOURNAL_TEMP_FILE, NoProgress))
+		{
+		bool renamed = (0 == rename(JOURNAL_TEMP_FILE, JOURNAL_BASE_FILE));
+		if (!renamed)
+			{
+			remove(JOURNAL_BASE_FILE);
+			renamed = (0 == rename(JOURNAL_TEMP_FILE, JOURNAL_BASE_FILE));
+			}
+		if (renamed)
+			remove(slotFiles[journal->m_compactOldSlot]);
+		}
+
+	journal->m_compactDone = true;
+	return 0;
+}
+
+/// Start background compaction if the journal has got too big
+/// (call from main loop, after logging edits)
+void Journal::Update(const Song& song)
+{
+	if (m_compactThread && m_compactDone)
+		WaitForCompaction();
+
+	if (!m_pfile || m_compactThread || m_size < JOURNAL_COMPACT_SIZE)
+		return;
+
+	// copy song (this is the only part done in the calling thread)
+	if (!m_compactSong)
+		m_compactSong = new Song;
+	*m_compactSong = song;
+
+	// switch to the other journal slot, based on the compacted song
+	m_compactOldSlot = m_slot;
+	fclose(m_pfile);
+	m_pfile = NULL;
+	if (!OpenSlot(m_slot ^ 1, JOURNAL_BASE_FILE))
+		return;
+
+	m_compactDone = false;
+	m_compactThread = SDL_CreateThread(CompactThreadFunc, this);
+	if (!m_compactThread)
+		printf("Journal: unable to create compaction thread: %s\n", SDL_GetError());
+}
+
+/// Wait for background compaction to finish
+void Journal::WaitForCompaction()
+{
+	if (m_compactThread)
+		{
+		SDL_WaitThread(m_compactThread, NULL);
+		m_compactThread = NULL;
+		}
+}
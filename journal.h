@@ -0,0 +1,76 @@
+// xdrum edit journal (autosave / crash recovery)
+//
+// Every committed edit is appended to a small binary journal file as it
+// happens. After a crash, the journal is replayed on top of the song it
+// was started from. When the journal grows too big, it is compacted into
+// a full save (autosave.xds) in a background thread.
+//
+// Journal file format:
+//   char[4]	"XDJ1"
+//   uint		sequence number
+//   records:	uchar type, ushort length (LSB first), uchar data[length]
+// The first record is always JR_BASE (the song file the journal applies to).
+// Needs pattern.h and song.h included first.
+
+#define JOURNAL_BASE_FILE		"autosave.xds"
+#define JOURNAL_TEMP_FILE		"autosave.tmp"
+#define JOURNAL_SLOT_FILE_0		"autosave0.xdj"
+#define JOURNAL_SLOT_FILE_1		"autosave1.xdj"
+#define JOURNAL_COMPACT_SIZE	(16 * 1024)		// compact when journal gets this big
+#define JOURNAL_MAX_STEP_RECORDS	16			// more changed steps than this = log whole pattern
+#define JOURNAL_MAX_RECORD		4096
+
+// journal record types
+enum JOURNAL_RECORD { JR_BASE = 1,			// char[] base song filename ("" = new song)
+					JR_STEP = 2,			// uchar pattern, track, step, vol, pan, offset
+					JR_PATTERN = 3,			// uchar pattern, length, (uchar track, step, vol, pan, offset)[]
+					JR_PATNAME = 4,			// uchar pattern, char[] name
+					JR_SONGLIST = 5,		// uchar songpos, start, count, uchar[count] entries
+					JR_TRACKMIX = 6,		// uchar track, vol, pan, state, prevState
+					JR_SONGPARAMS = 7,		// uchar vol, BPM, pitch, uint seed
+					JR_TEMPOMAP = 8,		// (uchar songpos, step, bpm, ramp)[] (all tempo changes)
+					JR_AUTOMATION = 9		// uchar lane, (uchar songpos, step, value)[] (all points of the lane)
+};
+
+/// Append-only journal of song edits
+class Journal
+{
+public:
+	// constructor
+	Journal();
+	~Journal();
+
+	bool Recover(Song& song, void (*progressCallback)(int));
+	bool Start(const char* baseFilename);
+	void Close(bool discard);
+	bool IsOpen() const { return (NULL != m_pfile); }
+
+	// log edits
+	void LogPatternChange(int patternIndex, const DrumPattern* before, const DrumPattern* after);
+	void LogSongList(const Song& song, int start, int count);
+	void LogTrackMix(const Song& song, int track);
+	void LogSongParams(const Song& song);
+	void LogTempoMap(const Song& song);
+	void LogAutomation(const Song& song, int lane);
+
+	// compact journal in the background if it has become too big
+	void Update(const Song& song);
+	void WaitForCompaction();
+
+private:
+	void AppendRecord(int type, const unsigned char* data, int len);
+	bool OpenSlot(int slot, const char* baseFilename);
+	bool ApplyRecord(Song& song, int type, const unsigned char* data, int len);
+	static int CompactThreadFunc(void* data);
+
+	FILE* m_pfile;
+	int m_slot;							// current journal slot (0 or 1)
+	unsigned int m_sequence;			// sequence number of current journal
+	int m_size;							// bytes written to current journal
+
+	// background compaction
+	SDL_Thread* m_compactThread;
+	volatile bool m_compactDone;
+	Song* m_compactSong;				// copy of song being saved
+	int m_compactOldSlot;				// journal slot to remove when done
+};
@@ -0,0 +1,286 @@
+/*
+ *      metrics.cpp
+ *
+ *      Performance metrics (frame, audio and sequencer timing) for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "platform.h"
+#include "metrics.h"
+#include "hrtimer.h"
+
+/// Clear the stats
+void MetricCounter::Reset()
+{
+	count = 0;
+	total = 0;
+	last = 0;
+	min = 0;
+	max = 0;
+	windowMax = 0;
+}
+
+/// Add a measurement
+void MetricCounter::Add(Uint32 value)
+{
+	if (0 == count || value < min)
+		min = value;
+	if (value > max)
+		max = value;
+	if (value > windowMax)
+		windowMax = value;
+	last = value;
+	total += value;
+	count++;
+}
+
+/// Clear the histogram
+void LatenessHistogram::Reset()
+{
+	for (int i = 0; i < LATENESS_BUCKETS; i++)
+		m_buckets[i] = 0;
+}
+
+/// Count a tick
+/// @param micros			How late the tick was played (us)
+void LatenessHistogram::Add(Uint32 micros)
+{
+	// bucket = number of bits needed for the value
+	int bucket = (0 == micros) ? 0 : 32 - __builtin_clz(micros);
+	if (bucket >= LATENESS_BUCKETS)
+		bucket = LATENESS_BUCKETS - 1;
+	m_buckets[bucket]++;
+}
+
+/// Get (roughly) the lateness that a percentage of ticks were within
+/// @param percent			Percentage of ticks (eg: 99)
+/// @return					Upper bound of the bucket that reaches the percentage (us)
+Uint32 LatenessHistogram::GetPercentile(int percent) const
+{
+	unsigned int total = 0;
+	for (int i = 0; i < LATENESS_BUCKETS; i++)
+		total += m_buckets[i];
+	if (0 == total)
+		return 0;
+
+	unsigned long long wanted = ((unsigned long long)total * percent + 99) / 100;
+	unsigned int sum = 0;
+	for (int i = 0; i < LATENESS_BUCKETS - 1; i++)
+		{
+		sum += m_buckets[i];
+		if (sum >= wanted)
+			return GetBucketStart(i + 1) - 1;
+		}
+	return GetBucketStart(LATENESS_BUCKETS - 1);
+}
+
+// constructor
+PerfMetrics::PerfMetrics()
+{
+	m_audioRate = 0;
+	m_audioChannels = 0;
+	m_audioBufferSamples = 0;
+	m_audioPeriod = 0;
+	Reset();
+}
+
+/// Clear all the stats
+void PerfMetrics::Reset()
+{
+	for (int i = 0; i < MET_MAX; i++)
+		{
+		m_counters[i].Reset();
+		m_prevCount[i] = 0;
+		m_prevTotal[i] = 0;
+		}
+	m_underruns = 0;
+	m_slowMixes = 0;
+	m_lateness.Reset();
+	m_missedTicks = 0;
+	m_missedSteps = 0;
+	m_frameStart = 0;
+	m_mixStart = 0;
+	m_lastMixStart = 0;
+	m_haveMixStart = false;
+	for (int i = 0; i < METRICS_OVERLAY_LINES; i++)
+		m_overlayText[i][0] = 0;
+	m_overlayKey = 0;
+}
+
+/// Set the audio device format (to work out the buffer period)
+/// @param rate				Sample rate (Hz)
+/// @param channels			Number of channels
+/// @param bufferSamples	Audio buffer size (samples per channel)
+void PerfMetrics::SetAudioSpec(int rate, int channels, int bufferSamples)
+{
+	m_audioRate = rate;
+	m_audioChannels = channels;
+	m_audioBufferSamples = bufferSamples;
+	m_audioPeriod = (rate > 0) ? (Uint32)(((unsigned long long)bufferSamples * 1000000) / rate) : 0;
+}
+
+/// UI has started drawing a frame
+void PerfMetrics::BeginFrame()
+{
+	m_frameStart = GetMicros();
+}
+
+/// UI has finished a frame
+/// @param redrawArea		Number of pixels sent to the display
+void PerfMetrics::EndFrame(int redrawArea)
+{
+	m_counters[MET_FRAMETIME].Add(GetMicros() - m_frameStart);
+	m_counters[MET_REDRAWAREA].Add(redrawArea);
+}
+
+/// The audio callback has started mixing a buffer
+void PerfMetrics::AudioMixStart()
+{
+	m_mixStart = GetMicros();
+	if (m_haveMixStart)
+		{
+		Uint32 interval = m_mixStart - m_lastMixStart;
+		m_counters[MET_AUDIOINTERVAL].Add(interval);
+		// buffer was not ready in time?
+		if (m_audioPeriod > 0 && interval > m_audioPeriod + m_audioPeriod / 2)
+			m_underruns++;
+		}
+	m_lastMixStart = m_mixStart;
+	m_haveMixStart = true;
+}
+
+/// The audio callback has finished mixing a buffer
+void PerfMetrics::AudioMixEnd()
+{
+	Uint32 mixTime = GetMicros() - m_mixStart;
+	m_counters[MET_AUDIOCALLBACK].Add(mixTime);
+	// the next buffer will be late
+	if (m_audioPeriod > 0 && mixTime > m_audioPeriod)
+		m_slowMixes++;
+}
+
+/// The sequencer has played a tick
+/// @param micros			How late the tick was played (us)
+/// @param onStep			true if it was the first tick of a step
+/// @param tickInterval		Time between ticks (us)
+void PerfMetrics::AddLateness(Uint32 micros, bool onStep, Uint32 tickInterval)
+{
+	m_counters[MET_LATENESS].Add(micros);
+	m_lateness.Add(micros);
+	if (micros >= tickInterval)
+		{
+		m_missedTicks++;
+		if (onStep)
+			m_missedSteps++;
+		}
+}
+
+/// Rebuild the metrics overlay text from the values measured since the
+/// last update (called by the UI every METRICS_UPDATE_INTERVAL)
+void PerfMetrics::UpdateOverlayText()
+{
+	Uint32 avg[MET_MAX];
+	Uint32 max[MET_MAX];
+	for (int i = 0; i < MET_MAX; i++)
+		{
+		MetricCounter* counter = &m_counters[i];
+		unsigned int count = counter->count;
+		unsigned long long total = counter->total;
+		if (count != m_prevCount[i])
+			avg[i] = (Uint32)((total - m_prevTotal[i]) / (count - m_prevCount[i]));
+		else
+			avg[i] = 0;
+		max[i] = counter->windowMax;
+		counter->windowMax = 0;
+		m_prevCount[i] = count;
+		m_prevTotal[i] = total;
+		}
+
+	sprintf(m_overlayText[0], "Frame  %6luus max %6luus", (unsigned long)avg[MET_FRAMETIME], (unsigned long)max[MET_FRAMETIME]);
+	sprintf(m_overlayText[1], "Redraw %6lupx", (unsigned long)avg[MET_REDRAWAREA]);
+	sprintf(m_overlayText[2], "Mix    %6luus of %6luus", (unsigned long)avg[MET_AUDIOCALLBACK], (unsigned long)m_audioPeriod);
+	sprintf(m_overlayText[3], "Late   %6luus max %6luus", (unsigned long)avg[MET_LATENESS], (unsigned long)max[MET_LATENESS]);
+	sprintf(m_overlayText[4], "Spin   %6luus/tick", (unsigned long)avg[MET_TIMERSPIN]);
+	sprintf(m_overlayText[5], "Voices %2lu  Underruns %lu", (unsigned long)m_counters[MET_VOICES].last, (unsigned long)(m_underruns + m_slowMixes));
+
+	// overlay only needs redrawing if the text has changed
+	int key = 0;
+	for (int i = 0; i < METRICS_OVERLAY_LINES; i++)
+		{
+		for (const char* p = m_overlayText[i]; *p; p++)
+			key = key * 31 + *p;
+		}
+	m_overlayKey = key;
+}
+
+/// Write all the stats to a text file
+/// @param filename			File to write
+/// @return					false if the file could not be written
+bool PerfMetrics::WriteFile(const char* filename) const
+{
+	static const char* names[MET_MAX] = {
+		"Frame time (us)",
+		"Redraw area (pixels)",
+		"Audio mix time (us)",
+		"Audio interval (us)",
+		"Step lateness (us)",
+		"Timer busy-wait (us)",
+		"Active voices"
+	};
+
+	FILE* pf = fopen(filename, "w");
+	if (!pf)
+		{
+		printf("Error - unable to write metrics file %s!\n", filename);
+		return false;
+		}
+
+	fprintf(pf, "PXDrum performance metrics\n\n");
+	fprintf(pf, "Audio: %d Hz, %d channels, %d sample buffer (%lu us)\n",
+			m_audioRate, m_audioChannels, m_audioBufferSamples, (unsigned long)m_audioPeriod);
+	fprintf(pf, "Underruns: %u late callbacks, %u slow mixes\n", m_underruns, m_slowMixes);
+	fprintf(pf, "Missed ticks: %u (%u on steps)\n\n", m_missedTicks, m_missedSteps);
+	fprintf(pf, "%-22s %10s %10s %10s %10s %10s\n", "", "count", "last", "min", "avg", "max");
+	for (int i = 0; i < MET_MAX; i++)
+		{
+		const MetricCounter* counter = &m_counters[i];
+		fprintf(pf, "%-22s %10u %10lu %10lu %10lu %10lu\n", names[i], counter->count,
+				(unsigned long)counter->last, (unsigned long)counter->min,
+				(unsigned long)counter->GetAverage(), (unsigned long)counter->max);
+		}
+
+	fprintf(pf, "\nStep lateness histogram\n");
+	fprintf(pf, "%10s %10s %10s\n", "from (us)", "to (us)", "ticks");
+	for (int i = 0; i < LATENESS_BUCKETS; i++)
+		{
+		Uint32 from = LatenessHistogram::GetBucketStart(i);
+		if (i < LATENESS_BUCKETS - 1)
+			fprintf(pf, "%10lu %10lu %10u\n", (unsigned long)from, (unsigned long)LatenessHistogram::GetBucketStart(i + 1) - 1, m_lateness.GetCount(i));
+		else
+			fprintf(pf, "%10lu %10s %10u\n", (unsigned long)from, "-", m_lateness.GetCount(i));
+		}
+	fprintf(pf, "99%% of ticks within %lu us\n", (unsigned long)m_lateness.GetPercentile(99));
+
+	fclose(pf);
+	return true;
+}
+
+/// Get a microsecond time stamp (wraps every 71 minutes, so only use
+/// it for differences)
+Uint32 PerfMetrics::GetMicros()
+{
+	return (Uint32)(HrTimeNanos() / 1000);
+}
+
+/// Print a short timing summary (eg: at exit)
+void PerfMetrics::PrintSummary() const
+{
+	printf("Timing: %u ticks, late avg %lu us, max %lu us, 99%% within %lu us\n",
+			m_counters[MET_LATENESS].count, (unsigned long)m_counters[MET_LATENESS].GetAverage(),
+			(unsigned long)m_counters[MET_LATENESS].max, (unsigned long)m_lateness.GetPercentile(99));
+	printf("Timing: %u missed ticks (%u steps), %u late audio callbacks, %u slow mixes\n",
+			m_missedTicks, m_missedSteps, m_underruns, m_slowMixes);
+}
@@ -0,0 +1,128 @@
+// xdrum performance metrics
+//
+// Cheap counters for frame time, redraw area, audio callback time vs. the
+// audio buffer period, sequencer step lateness, active voices and audio
+// underruns. Each counter is only updated by one thread (UI, SDL audio
+// callback or play thread), and is read without locking by the UI for the
+// metrics overlay or the metrics file. A value read while it is being
+// updated may be slightly out, which is fine for monitoring.
+// Needs SDL.h included first.
+
+#define METRICS_FILE			"metrics.txt"
+#define METRICS_UPDATE_INTERVAL	500			// ms between metrics overlay updates
+#define METRICS_OVERLAY_LINES	6
+#define LATENESS_BUCKETS		22			// 0us, then powers of 2 up to 1s+
+
+// measured values
+enum METRICS { MET_FRAMETIME = 0,			// UI frame draw time (us)
+				MET_REDRAWAREA,				// pixels sent to the display per frame
+				MET_AUDIOCALLBACK,			// time to mix an audio buffer (us)
+				MET_AUDIOINTERVAL,			// time between audio callbacks (us)
+				MET_LATENESS,				// how late the sequencer played a tick (us)
+				MET_TIMERSPIN,				// time the sequencer busy-waited for a tick (us)
+				MET_VOICES,					// active voices (sampled by the UI)
+				MET_MAX
+};
+
+/// Running stats of a measured value
+class MetricCounter
+{
+public:
+	MetricCounter() { Reset(); }
+
+	void Reset();
+	void Add(Uint32 value);
+	Uint32 GetAverage() const { return count ? (Uint32)(total / count) : 0; }
+
+	unsigned int count;
+	unsigned long long total;
+	Uint32 last;
+	Uint32 min;
+	Uint32 max;
+	Uint32 windowMax;						// max since the last overlay update
+};
+
+/// Histogram of how late the sequencer played its ticks
+/// Bucket 0 counts ticks that were on time, bucket N counts ticks that were
+/// 2^(N-1) to 2^N - 1 us late, and the last bucket counts anything later.
+/// Only the play thread writes to it, so no locking is needed.
+class LatenessHistogram
+{
+public:
+	LatenessHistogram() { Reset(); }
+
+	void Reset();
+	void Add(Uint32 micros);
+	unsigned int GetCount(int bucket) const { return m_buckets[bucket]; }
+	static Uint32 GetBucketStart(int bucket) { return (0 == bucket) ? 0 : (Uint32)1 << (bucket - 1); }
+	Uint32 GetPercentile(int percent) const;
+
+private:
+	volatile unsigned int m_buckets[LATENESS_BUCKETS];
+};
+
+/// Performance metrics for the UI, audio and play threads
+class PerfMetrics
+{
+public:
+	// constructor
+	PerfMetrics();
+
+	void Reset();
+	void SetAudioSpec(int rate, int channels, int bufferSamples);
+
+	// UI thread
+	void BeginFrame();
+	void EndFrame(int redrawArea);
+	void SetActiveVoices(int voices) { m_counters[MET_VOICES].Add(voices); }
+
+	// audio thread
+	void AudioMixStart();
+	void AudioMixEnd();
+
+	// play thread
+	void AddLateness(Uint32 micros, bool onStep, Uint32 tickInterval);
+	void AddTimerSpin(Uint32 micros) { m_counters[MET_TIMERSPIN].Add(micros); }
+
+	// reporting
+	const MetricCounter& GetCounter(int metric) const { return m_counters[metric]; }
+	const LatenessHistogram& GetLatenessHistogram() const { return m_lateness; }
+	unsigned int GetUnderruns() const { return m_underruns; }
+	unsigned int GetSlowMixes() const { return m_slowMixes; }
+	unsigned int GetMissedTicks() const { return m_missedTicks; }
+	unsigned int GetMissedSteps() const { return m_missedSteps; }
+	Uint32 GetAudioPeriod() const { return m_audioPeriod; }
+	void UpdateOverlayText();
+	const char* GetOverlayLine(int line) const { return m_overlayText[line]; }
+	int GetOverlayKey() const { return m_overlayKey; }
+	bool WriteFile(const char* filename) const;
+	void PrintSummary() const;
+
+	static Uint32 GetMicros();
+
+private:
+	MetricCounter m_counters[MET_MAX];
+	volatile unsigned int m_underruns;		// audio callback came too late
+	volatile unsigned int m_slowMixes;		// mixing took longer than the buffer lasts
+	LatenessHistogram m_lateness;
+	volatile unsigned int m_missedTicks;	// ticks played a whole tick late (or more)
+	volatile unsigned int m_missedSteps;	// ... that were the first tick of a step
+
+	// audio device
+	int m_audioRate;
+	int m_audioChannels;
+	int m_audioBufferSamples;
+	Uint32 m_audioPeriod;					// play time of one audio buffer (us)
+
+	// timestamps
+	Uint32 m_frameStart;
+	Uint32 m_mixStart;
+	Uint32 m_lastMixStart;
+	bool m_haveMixStart;
+
+	// overlay
+	unsigned int m_prevCount[MET_MAX];		// counts / totals at the last overlay update
+	unsigned long long m_prevTotal[MET_MAX];
+	char m_overlayText[METRICS_OVERLAY_LINES][48];
+	int m_overlayKey;
+};
@@ -0,0 +1,546 @@
+/*
+ *      midiclock.cpp
+ *
+ *      MIDI clock slave / master for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "platform.h"
+#include "hrtimer.h"
+#include "midiclock.h"
+
+#if !defined(PSP) && !defined(WIN32)
+	#define MIDICLOCK_DEVICES
+	#include <unistd.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/select.h>
+#endif
+
+// MIDI messages
+#define MIDI_SONG_POSITION		0xF2
+#define MIDI_CLOCK				0xF8
+#define MIDI_START				0xFA
+#define MIDI_CONTINUE			0xFB
+#define MIDI_STOP				0xFC
+
+// tempo range the PLL will lock to
+#define MIDICLOCK_MIN_BPM		20
+#define MIDICLOCK_MAX_BPM		300
+
+// constructor
+MidiClock::MidiClock()
+{
+	m_inFd = -1;
+	m_outFd = -1;
+	m_inThread = NULL;
+	m_outThread = NULL;
+	m_quit = false;
+	m_stateSeq = 0;
+	m_status = 0;
+	m_dataCount = 0;
+	m_lockClocks = 0;
+	m_firstClockTime = 0;
+	m_lastArrival = 0;
+	m_clocksReceived = 0;
+	m_relocks = 0;
+	m_latencyNs = 0;
+	m_masterStarts = 0;
+	m_masterPlaying = false;
+	m_masterStartStep = 0;
+	m_masterTick = 0;
+	m_masterTickTime = 0;
+	m_masterInterval = 0;
+	m_masterSeq = 0;
+}
+
+// destructor
+MidiClock::~MidiClock()
+{
+	Close();
+}
+
+/// Start following the MIDI clock from a raw MIDI device or named pipe
+/// @param path				Device node (eg: /dev/snd/midiC1D0) or named pipe
+/// @return					false if it could not be opened
+bool MidiClock::OpenInput(const char* path)
+{
+#ifdef MIDICLOCK_DEVICES
+	if (m_inFd >= 0)
+		return false;
+
+	// (a named pipe is opened read / write, so it stays open - no end of
+	//  file - while nothing is writing to it)
+	struct stat info;
+	bool pipe = (0 == stat(path, &info) && S_ISFIFO(info.st_mode));
+	int fd = open(path, (pipe ? O_RDWR : O_RDONLY) | O_NONBLOCK);
+	if (fd < 0)
+		{
+		printf("MidiClock: unable to open %s (%s)\n", path, strerror(errno));
+		return false;
+		}
+
+	m_state = MidiClockState();
+	m_sharedState = m_state;
+	m_status = 0;
+	m_dataCount = 0;
+	m_lockClocks = 0;
+	m_inFd = fd;
+	m_quit = false;
+	m_inThread = SDL_CreateThread(InputThreadFunc, this);
+	if (!m_inThread)
+		{
+		printf("MidiClock: unable to start input thread\n");
+		Close();
+		return false;
+		}
+
+	printf("MidiClock: following MIDI clock from %s\n", path);
+	return true;
+#else
+	printf("MidiClock: MIDI clock is not supported on this platform\n");
+	return false;
+#endif
+}
+
+/// Start sending MIDI clock (as the master) to a raw MIDI device or named pipe
+/// @param path				Device node (eg: /dev/snd/midiC1D0) or named pipe
+/// @return					false if it could not be opened
+bool MidiClock::OpenOutput(const char* path)
+{
+#ifdef MIDICLOCK_DEVICES
+	if (m_outFd >= 0)
+		return false;
+
+	// (read / write, so a named pipe can be opened before anything reads it)
+	int fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		fd = open(path, O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		{
+		printf("MidiClock: unable to open %s (%s)\n", path, strerror(errno));
+		return false;
+		}
+
+	m_masterPlaying = false;
+	m_masterInterval = 0;
+	m_outFd = fd;
+	m_quit = false;
+	m_outThread = SDL_CreateThread(OutputThreadFunc, this);
+	if (!m_outThread)
+		{
+		printf("MidiClock: unable to start output thread\n");
+		Close();
+		return false;
+		}
+
+	printf("MidiClock: sending MIDI clock to %s\n", path);
+	return true;
+#else
+	printf("MidiClock: MIDI clock is not supported on this platform\n");
+	return false;
+#endif
+}
+
+/// Stop following / sending MIDI clock
+void MidiClock::Close()
+{
+	m_quit = true;
+	if (m_inThread)
+		{
+		SDL_WaitThread(m_inThread, NULL);
+		m_inThread = NULL;
+		}
+	if (m_outThread)
+		{
+		SDL_WaitThread(m_outThread, NULL);
+		m_outThread = NULL;
+		}
+
+#ifdef MIDICLOCK_DEVICES
+	if (m_inFd >= 0)
+		close(m_inFd);
+	if (m_outFd >= 0)
+		close(m_outFd);
+#endif
+	m_inFd = -1;
+	m_outFd = -1;
+}
+
+/// Get the incoming clock (lock-free, so the play thread never waits for
+/// the input thread)
+/// @param state			State to fill in (locked = false if there is no clock)
+void MidiClock::GetState(MidiClockState* state)
+{
+	if (m_inFd < 0)
+		{
+		*state = MidiClockState();
+		return;
+		}
+
+	unsigned int seq;
+	do
+		{
+		seq = m_stateSeq;
+		__sync_synchronize();
+		*state = m_sharedState;
+		__sync_synchronize();
+		} while ((seq & 1) || seq != m_stateSeq);
+}
+
+/// Let the other threads see the changes to the clock state (input thread)
+void MidiClock::PublishState()
+{
+	m_stateSeq++;
+	__sync_synchronize();
+	m_sharedState = m_state;
+	__sync_synchronize();
+	m_stateSeq++;
+}
+
+/// Pass a sequencer tick to the output thread (play thread, once per tick)
+/// @param tickTime			Time the tick is due
+/// @param intervalNs		Time between ticks (at the current BPM)
+/// @param playing			Transport playing?
+/// @param step				Step being played (sent as the song position on start)
+void MidiClock::MasterTick(Uint64 tickTime, Uint64 intervalNs, bool playing, int step)
+{
+	if (m_outFd < 0)
+		return;
+
+	// (lock-free - the output thread reads it with a sequence count)
+	m_masterSeq++;
+	__sync_synchronize();
+	if (playing && !m_masterPlaying)
+		{
+		m_masterStarts++;
+		m_masterStartStep = step;
+		m_masterTick = 0;
+		}
+	else if (playing)
+		{
+		m_masterTick++;
+		}
+	m_masterPlaying = playing;
+	m_masterTickTime = tickTime;
+	m_masterInterval = intervalNs;
+	__sync_synchronize();
+	m_masterSeq++;
+}
+
+/// Input thread
+int MidiClock::InputThreadFunc(void* data)
+{
+	MidiClock* midiClock = (MidiClock*)data;
+	midiClock->RunInput();
+	return 0;
+}
+
+/// Output thread
+int MidiClock::OutputThreadFunc(void* data)
+{
+	MidiClock* midiClock = (MidiClock*)data;
+	midiClock->RunOutput();
+	return 0;
+}
+
+/// Input thread loop - read and parse the MIDI byte stream
+void MidiClock::RunInput()
+{
+#ifdef MIDICLOCK_DEVICES
+	unsigned char buffer[256];
+	while (!m_quit)
+		{
+		// wait for some bytes (or 50ms, to check for quit)
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(m_inFd, &readSet);
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 50000;
+		if (select(m_inFd + 1, &readSet, NULL, NULL, &timeout) > 0)
+			{
+			int length = (int)read(m_inFd, buffer, sizeof(buffer));
+			Uint64 now = HrTimeNanos();
+			if (length > 0)
+				{
+				for (int i = 0; i < length; i++)
+					ParseByte(buffer[i], now);
+				}
+			else if (length < 0 && EAGAIN != errno && EINTR != errno)
+				{
+				// device gone? (do not spin)
+				printf("MidiClock: read error (%s)\n", strerror(errno));
+				SDL_Delay(MIDICLOCK_TIMEOUT);
+				}
+			}
+
+		// clock stopped?
+		if (m_lockClocks > 0 && HrTimeNanos() - m_lastArrival > (Uint64)MIDICLOCK_TIMEOUT * 1000000)
+			{
+			m_state.locked = false;
+			m_lockClocks = 0;
+			PublishState();
+			}
+		}
+#endif
+}
+
+/// Parse a byte of the MIDI stream
+/// @param byte				Byte
+/// @param timeNs			Time it arrived
+void MidiClock::ParseByte(unsigned char byte, Uint64 timeNs)
+{
+	// real-time messages (can be in the middle of any other message)
+	if (byte >= 0xF8)
+		{
+		if (MIDI_CLOCK == byte)
+			{
+			ClockReceived(timeNs);
+			return;
+			}
+		if (MIDI_START == byte)
+			{
+			// the next clock is the first of the song
+			m_state.running = true;
+			m_state.starting = true;
+			m_state.clockPos = -1;
+			m_state.transportSeq++;
+			}
+		else if (MIDI_CONTINUE == byte)
+			{
+			// the next clock follows on from the last song position
+			m_state.running = true;
+			m_state.starting = true;
+			m_state.transportSeq++;
+			}
+		else if (MIDI_STOP == byte)
+			{
+			m_state.running = false;
+			m_state.starting = false;
+			m_state.transportSeq++;
+			}
+		PublishState();
+		return;
+		}
+
+	// status byte
+	if (byte & 0x80)
+		{
+		m_dataCount = 0;
+		if (byte < 0xF0 || 0xF1 == byte || MIDI_SONG_POSITION == byte || 0xF3 == byte)
+			m_status = byte;
+		else
+			m_status = 0;					// sysex (data skipped), tune request, end of sysex
+		return;
+		}
+
+	// data byte
+	if (0 == m_status)
+		return;
+	m_data[m_dataCount++] = byte;
+	int type = m_status & 0xF0;
+	int needed = (MIDI_SONG_POSITION == m_status || (m_status < 0xF0 && 0xC0 != type && 0xD0 != type)) ? 2 : 1;
+	if (m_dataCount < needed)
+		return;
+	m_dataCount = 0;
+
+	if (MIDI_SONG_POSITION == m_status)
+		{
+		// position in 1/16 notes - the next clock is at that position
+		int position = m_data[0] | (m_data[1] << 7);
+		m_state.clockPos = (Sint64)position * MIDICLOCK_CLOCKS_PER_STEP - 1;
+		m_state.transportSeq++;
+		PublishState();
+		}
+
+	// running status is only for channel messages
+	if (m_status >= 0xF0)
+		m_status = 0;
+}
+
+/// A clock has arrived - update the PLL and the song position
+/// @param timeNs			Time it arrived
+void MidiClock::ClockReceived(Uint64 timeNs)
+{
+	m_clocksReceived++;
+	MidiClockState& state = m_state;
+
+	if (0 == m_lockClocks)
+		m_firstClockTime = timeNs;
+	if (m_lockClocks <= MIDICLOCK_AVERAGE_CLOCKS)
+		m_lockClocks++;
+
+	if (state.locked)
+		{
+		// error between the arrival time and the predicted time
+		double error = (double)(Sint64)(timeNs - state.clockTime) - state.period;
+		if (fabs(error) > state.period / 2)
+			{
+			// lost a clock, or a big tempo jump - find the clock again
+			state.locked = false;
+			state.clockTime = timeNs;
+			m_firstClockTime = timeNs;
+			m_lockClocks = 1;
+			m_relocks++;
+			}
+		else
+			{
+			state.clockTime += (Sint64)(state.period + error / MIDICLOCK_PHASE_GAIN);
+			if (m_lockClocks <= MIDICLOCK_AVERAGE_CLOCKS)
+				state.period = (double)(timeNs - m_firstClockTime) / (m_lockClocks - 1);	// still settling
+			else
+				state.period += error / MIDICLOCK_PERIOD_GAIN;
+			}
+		}
+	else
+		{
+		// average the first few clock periods
+		state.clockTime = timeNs;
+		if (m_lockClocks > 1)
+			state.period = (double)(timeNs - m_firstClockTime) / (m_lockClocks - 1);
+		if (m_lockClocks > MIDICLOCK_LOCK_CLOCKS)
+			{
+			double bpm = state.GetBPM();
+			if (bpm >= MIDICLOCK_MIN_BPM && bpm <= MIDICLOCK_MAX_BPM)
+				state.locked = true;
+			else
+				m_lockClocks = 0;
+			}
+		}
+	m_lastArrival = timeNs;
+
+	// song position
+	if (state.running)
+		{
+		state.clockPos++;
+		state.starting = false;
+		}
+	PublishState();
+}
+
+/// Output thread loop - send the clocks (and start / stop) on time
+void MidiClock::RunOutput()
+{
+#ifdef MIDICLOCK_DEVICES
+	Uint32 starts = m_masterStarts;				// (32 bits - read in one go)
+	bool playing = false;
+	bool startPending = false;
+	Sint64 clock = 0;								// clocks since the start
+	Uint64 nextClock = HrTimeNanos();				// when stopped, the clock runs on at the current tempo
+
+	while (!m_quit)
+		{
+		Uint32 masterStarts;
+		bool masterPlaying;
+		int startStep;
+		Sint64 tick;
+		Uint64 tickTime;
+		Uint64 interval;
+		unsigned int seq;
+		do
+			{
+			seq = m_masterSeq;
+			__sync_synchronize();
+			masterStarts = m_masterStarts;
+			masterPlaying = m_masterPlaying;
+			startStep = m_masterStartStep;
+			tick = m_masterTick;
+			tickTime = m_masterTickTime;
+			interval = m_masterInterval;
+			__sync_synchronize();
+			} while ((seq & 1) || seq != m_masterSeq);
+
+		Uint64 now = HrTimeNanos();
+		if (0 == interval)
+			{
+			// play thread not running yet
+			HrSleepUntil(now + MIDICLOCK_OUTPUT_POLL, 0);
+			continue;
+			}
+
+		// stopped (or stopped and started again since we last looked)?
+		if (playing && (!masterPlaying || masterStarts != starts))
+			{
+			unsigned char stop = MIDI_STOP;
+			Send(&stop, 1);
+			playing = false;
+			}
+		if (!playing && masterPlaying && masterStarts != starts)
+			{
+			starts = masterStarts;
+			playing = true;
+			startPending = true;
+			clock = 0;
+			}
+
+		// when is the next clock due? (3 clocks every 2 ticks)
+		Uint64 due;
+		if (playing)
+			{
+			due = tickTime + m_latencyNs + (Sint64)(((double)clock * 16 / MIDICLOCK_PPQN - tick) * interval);
+			}
+		else
+			{
+			due = nextClock;
+			if ((Sint64)(now - due) > (Sint64)interval)
+				due = now;							// fell behind - do not send a burst
+			}
+		if ((Sint64)(due - now) > MIDICLOCK_OUTPUT_POLL)
+			{
+			HrSleepUntil(now + MIDICLOCK_OUTPUT_POLL, 0);
+			continue;
+			}
+		HrSleepUntil(due, 0);
+
+		// start goes just before the first clock
+		if (startPending)
+			{
+			if (startStep > 0)
+				{
+				unsigned char start[4] = { MIDI_SONG_POSITION, (unsigned char)(startStep & 0x7F),
+											(unsigned char)((startStep >> 7) & 0x7F), MIDI_CONTINUE };
+				Send(start, 4);
+				}
+			else
+				{
+				unsigned char start = MIDI_START;
+				Send(&start, 1);
+				}
+			startPending = false;
+			}
+
+		unsigned char midiClock = MIDI_CLOCK;
+		Send(&midiClock, 1);
+		if (playing)
+			clock++;
+		nextClock = due + (interval * 16) / MIDICLOCK_PPQN;
+		}
+
+	// leave the slaves stopped
+	if (playing)
+		{
+		unsigned char stop = MIDI_STOP;
+		Send(&stop, 1);
+		}
+#endif
+}
+
+/// Send bytes to the MIDI output (output thread)
+/// @param data				Bytes to send
+/// @param length			Number of bytes
+void MidiClock::Send(const unsigned char* data, int length)
+{
+#ifdef MIDICLOCK_DEVICES
+	// (if nothing is reading a named pipe, it fills up and the bytes are lost)
+	ssize_t written = write(m_outFd, data, length);
+	(void)written;
+#endif
+}
@@ -0,0 +1,139 @@
+// xdrum MIDI clock
+//
+// Slaves the transport and tempo to MIDI clock read from a raw MIDI device
+// node (eg: /dev/snd/midiC1D0) or a named pipe, or sends MIDI clock as the
+// master.
+// Slave: an input thread parses the byte stream (real-time messages can
+// arrive in the middle of other messages, running status and sysex are
+// skipped) and timestamps each clock (0xF8, 24 per beat) as it arrives.
+// The first few clock periods are averaged, to find the tempo quickly.
+// After that the arrival times jitter (USB polling, pipe buffering, OS
+// scheduling), so they are smoothed with a PLL: the time of each clock is
+// predicted from the last one and the current period, and the prediction
+// error corrects the phase (1/MIDICLOCK_PHASE_GAIN of it) and the period
+// (1/MIDICLOCK_PERIOD_GAIN of it). The play thread follows the smoothed
+// clock (see FollowMidiClock() in xdrum.cpp) the same way as network sync:
+// tempo from the period, and the next tick moved slightly earlier or later
+// to stay on the beat phase.
+// Start (0xFA), continue (0xFB), stop (0xFC) and song position pointer
+// (0xF2, in 1/16 notes - one xdrum step) are passed on with the clock.
+// Master: the play thread passes each tick to MasterTick(), and an output
+// thread sends the clocks in between (3 clocks every 2 ticks), delayed by
+// the audio output latency so they line up with what is heard.
+// Both are passed between the threads with sequence counts (like the audio
+// engine's clock map), so the play thread never waits for a lock.
+// Linux only. Needs SDL.h and SDL_thread.h included first.
+
+#define MIDICLOCK_PPQN				24			// clocks per beat
+#define MIDICLOCK_CLOCKS_PER_STEP	6			// song position pointer unit (1/16 note)
+#define MIDICLOCK_LOCK_CLOCKS		6			// clocks averaged before the tempo is known
+#define MIDICLOCK_AVERAGE_CLOCKS	96			// clocks averaged before the PLL takes over the period
+#define MIDICLOCK_PHASE_GAIN		16			// fraction of the clock time error applied to the phase (1/n)
+#define MIDICLOCK_PERIOD_GAIN		512			// fraction of the clock time error applied to the period (1/n)
+#define MIDICLOCK_TIMEOUT			500			// ms without a clock before the clock is lost
+#define MIDICLOCK_OUTPUT_POLL		1000000		// ns between output thread checks for start / stop
+
+/// The incoming MIDI clock (smoothed, in local clock time)
+class MidiClockState
+{
+public:
+	MidiClockState()
+		{
+		locked = false;
+		running = false;
+		starting = false;
+		transportSeq = 0;
+		clockPos = 0;
+		clockTime = 0;
+		period = 0.0;
+		}
+
+	// Sequencer tick (fractional) at a time (16 ticks per beat)
+	double GetTick(Uint64 timeNs) const
+		{
+		return ((double)clockPos + (double)(Sint64)(timeNs - clockTime) / period) * 16 / MIDICLOCK_PPQN;
+		}
+
+	// Time of a sequencer tick
+	Uint64 GetTickTime(Sint64 tick) const
+		{
+		return clockTime + (Sint64)(((double)tick * MIDICLOCK_PPQN / 16 - clockPos) * period);
+		}
+
+	// Tempo (exact)
+	double GetBPM() const
+		{
+		return 60000000000.0 / (period * MIDICLOCK_PPQN);
+		}
+
+	bool locked;							// clock period known
+	bool running;							// started / continued, and not stopped
+	bool starting;							// started / continued, waiting for the first clock
+	Uint32 transportSeq;					// incremented on every start / continue / stop / song position
+	Sint64 clockPos;						// song position of the last clock (clocks)
+	Uint64 clockTime;						// smoothed time of the last clock
+	double period;							// smoothed time between clocks (ns)
+};
+
+/// MIDI clock slave / master
+class MidiClock
+{
+public:
+	// constructor
+	MidiClock();
+	~MidiClock();
+
+	bool OpenInput(const char* path);
+	bool OpenOutput(const char* path);
+	void Close();
+	bool IsInputOpen() const { return (m_inFd >= 0); }
+	bool IsOutputOpen() const { return (m_outFd >= 0); }
+
+	// any thread
+	void GetState(MidiClockState* state);
+	unsigned int GetClocksReceived() const { return m_clocksReceived; }
+	unsigned int GetRelocks() const { return m_relocks; }
+
+	// play thread (master)
+	void SetOutputLatency(Uint64 latencyNs) { m_latencyNs = latencyNs; }
+	void MasterTick(Uint64 tickTime, Uint64 intervalNs, bool playing, int step);
+
+private:
+	static int InputThreadFunc(void* data);
+	static int OutputThreadFunc(void* data);
+	void RunInput();
+	void RunOutput();
+	void ParseByte(unsigned char byte, Uint64 timeNs);
+	void ClockReceived(Uint64 timeNs);
+	void PublishState();
+	void Send(const unsigned char* data, int length);
+
+	int m_inFd;
+	int m_outFd;
+	SDL_Thread* m_inThread;
+	SDL_Thread* m_outThread;
+	volatile bool m_quit;
+
+	// slave (input thread)
+	MidiClockState m_state;
+	volatile unsigned int m_stateSeq;		// odd while m_sharedState is being written
+	MidiClockState m_sharedState;			// copy of m_state for the other threads (see PublishState())
+	unsigned char m_status;					// status of the message being parsed (0 = none)
+	int m_dataCount;
+	unsigned char m_data[2];
+	int m_lockClocks;						// clocks since the clock was (re)found (up to MIDICLOCK_AVERAGE_CLOCKS + 1)
+	Uint64 m_firstClockTime;				// arrival time of the first of those
+	Uint64 m_lastArrival;					// arrival time of the last clock
+	volatile unsigned int m_clocksReceived;
+	volatile unsigned int m_relocks;		// times the PLL lost the clock and started again
+
+	// master (play thread -> output thread)
+	Uint64 m_latencyNs;
+	volatile unsigned int m_masterSeq;		// odd while the fields below are being written
+	Uint32 m_masterStarts;					// incremented on every start
+	bool m_masterPlaying;
+	int m_masterStartStep;					// step playback started from
+	Sint64 m_masterTick;					// ticks since the start
+	Uint64 m_masterTickTime;
+	Uint64 m_masterInterval;
+};
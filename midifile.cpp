@@ -0,0 +1,953 @@
+/*
+ *      midifile.cpp
+ *
+ *      Standard MIDI File export / import for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include "SDL.h"
+#include "SDL_mixer.h"
+#include "platform.h"
+#include "pattern.h"
+#include "song.h"
+#include "drumkit.h"
+#include "groove.h"
+#include "tempomap.h"
+#include "midifile.h"
+
+#define MIDIFILE_TRACK_START_SIZE	4096		// bytes (buffers grow as needed)
+
+// meta events
+#define MIDI_META_TRACK_NAME		0x03
+#define MIDI_META_MARKER			0x06
+#define MIDI_META_END_OF_TRACK		0x2F
+#define MIDI_META_TEMPO				0x51
+#define MIDI_META_TIME_SIGNATURE	0x58
+
+static void PutU32(unsigned char* p, Uint32 value)
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+/// Add a tempo meta event
+/// @param track			Track
+/// @param time				Time (MIDI ticks)
+/// @param intervalNs		Sequencer tick interval at the tempo
+static void AddTempo(MidiTrackBuffer* track, Uint32 time, Uint64 intervalNs)
+{
+	Uint32 tempo = (Uint32)((intervalNs * 16) / 1000);		// us per beat
+	unsigned char tempoData[3] = { (unsigned char)(tempo >> 16), (unsigned char)(tempo >> 8), (unsigned char)tempo };
+	track->AddMeta(time, MIDI_META_TEMPO, tempoData, 3);
+}
+
+static void no_progress(int progress)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MidiTrackBuffer class
+///////////////////////////////////////////////////////////////////////////////
+
+// constructor
+MidiTrackBuffer::MidiTrackBuffer()
+{
+	m_data = NULL;
+	m_length = 0;
+	m_capacity = 0;
+	m_time = 0;
+	m_status = 0;
+}
+
+// destructor
+MidiTrackBuffer::~MidiTrackBuffer()
+{
+	if (m_data)
+		delete [] m_data;
+}
+
+/// Start a new track (the buffer is kept)
+void MidiTrackBuffer::Reset()
+{
+	m_length = 0;
+	m_time = 0;
+	m_status = 0;
+}
+
+/// Add a channel event
+/// @param time				Time of the event (MIDI ticks, not before the last event)
+/// @param status			Status byte
+/// @param data1			First data byte
+/// @param data2			Second data byte
+void MidiTrackBuffer::AddEvent(Uint32 time, unsigned char status, unsigned char data1, unsigned char data2)
+{
+	AddDelta(time);
+	if (status != m_status)
+		AddByte(status);
+	m_status = status;
+	AddByte(data1);
+	AddByte(data2);
+}
+
+/// Add a meta event
+/// @param time				Time of the event (MIDI ticks, not before the last event)
+/// @param type				Meta event type
+/// @param data				Event data
+/// @param length			Length of the data (bytes, < 128)
+void MidiTrackBuffer::AddMeta(Uint32 time, unsigned char type, const void* data, int length)
+{
+	AddDelta(time);
+	AddByte(0xFF);
+	AddByte(type);
+	AddByte((unsigned char)length);
+	for (int i = 0; i < length; i++)
+		AddByte(((const unsigned char*)data)[i]);
+	m_status = 0;						// (meta events cancel running status)
+}
+
+/// Add the end of track event
+/// @param time				Time of the end of the track (MIDI ticks)
+void MidiTrackBuffer::AddEnd(Uint32 time)
+{
+	AddMeta(time, MIDI_META_END_OF_TRACK, NULL, 0);
+}
+
+/// Write the track chunk
+/// @return					false if the write failed
+bool MidiTrackBuffer::Write(FILE* pfile) const
+{
+	unsigned char header[8];
+	memcpy(header, "MTrk", 4);
+	PutU32(header + 4, (Uint32)m_length);
+	if (1 != fwrite(header, 8, 1, pfile))
+		return false;
+	return (0 == m_length || 1 == fwrite(m_data, m_length, 1, pfile));
+}
+
+/// Add the time since the last event (variable length quantity)
+void MidiTrackBuffer::AddDelta(Uint32 time)
+{
+	Uint32 delta = (time > m_time) ? time - m_time : 0;
+	m_time += delta;
+
+	unsigned char bytes[5];
+	int count = 0;
+	do
+		{
+		bytes[count++] = (unsigned char)(delta & 0x7F);
+		delta >>= 7;
+		} while (delta > 0);
+	while (count > 0)
+		{
+		count--;
+		AddByte(bytes[count] | (count > 0 ? 0x80 : 0));
+		}
+}
+
+/// Add a byte (growing the buffer if neccessary)
+void MidiTrackBuffer::AddByte(unsigned char value)
+{
+	if (m_length == m_capacity)
+		{
+		int capacity = (m_capacity > 0) ? m_capacity * 2 : MIDIFILE_TRACK_START_SIZE;
+		unsigned char* data = new unsigned char[capacity];
+		if (m_data)
+			{
+			memcpy(data, m_data, m_length);
+			delete [] m_data;
+			}
+		m_data = data;
+		m_capacity = capacity;
+		}
+	m_data[m_length++] = value;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MidiFileExporter class
+///////////////////////////////////////////////////////////////////////////////
+
+// constructor
+MidiFileExporter::MidiFileExporter()
+{
+	DrumKit kit;
+	for (int i = 0; i < NUM_TRACKS; i++)
+		sprintf(kit.drums[i].name, "Track %d", i + 1);
+	SetKit(&kit);
+	m_events = new MidiExportEvent[MIDIFILE_MAX_EVENTS];
+	m_tempoMap = new TempoMap;
+}
+
+// destructor
+MidiFileExporter::~MidiFileExporter()
+{
+	delete m_tempoMap;
+	delete [] m_events;
+}
+
+/// Use the drum names and MIDI notes of a drumkit
+void MidiFileExporter::SetKit(const DrumKit* kit)
+{
+	for (int i = 0; i < NUM_TRACKS; i++)
+		{
+		m_notes[i] = kit->drums[i].midiNote;
+		if (kit->drums[i].name[0])
+			strcpy(m_names[i], kit->drums[i].name);
+		else
+			sprintf(m_names[i], "Track %d", i + 1);
+		}
+}
+
+/// Export the song sequence (up to the first "no pattern")
+/// @param song				Song
+/// @param filename			MIDI file to write
+/// @return					false if the file could not be written
+bool MidiFileExporter::ExportSong(const Song* song, const char* filename)
+{
+	unsigned char sequence[PATTERNS_PER_SONG];
+	int count = 0;
+	while (count < PATTERNS_PER_SONG && song->songList[count] < MAX_PATTERN)
+		{
+		sequence[count] = song->songList[count];
+		count++;
+		}
+	m_tempoMap->Update(song);
+	return Export(song, sequence, count, m_tempoMap, filename);
+}
+
+/// Export one pattern
+/// @param song				Song
+/// @param patternIndex		Pattern to export
+/// @param filename			MIDI file to write
+/// @return					false if the file could not be written
+bool MidiFileExporter::ExportPattern(const Song* song, int patternIndex, const char* filename)
+{
+	if (patternIndex < 0 || patternIndex >= MAX_PATTERN)
+		return false;
+	unsigned char sequence[1];
+	sequence[0] = (unsigned char)patternIndex;
+	return Export(song, sequence, 1, NULL, filename);
+}
+
+/// Export every song (*.xds) in a folder - the sequence, or the current
+/// pattern if the song has no sequence
+/// @param folder			Folder of songs
+/// @param outFolder		Folder to write the MIDI files to (name.xds -> name.mid)
+/// @return					Number of songs exported, or -1 if the folder could not be read
+int MidiFileExporter::ExportFolder(const char* folder, const char* outFolder)
+{
+	DIR* d = opendir(folder);
+	if (!d)
+		{
+		printf("MidiFileExporter: unable to read folder %s\n", folder);
+		return -1;
+		}
+
+	Song* song = new Song;
+	int exported = 0;
+	struct dirent* dir;
+	while ((dir = readdir(d)) != NULL)
+		{
+		int nameLength = strlen(dir->d_name);
+		if (nameLength <= 4 || 0 != strcmp(dir->d_name + nameLength - 4, ".xds"))
+			continue;
+
+		char path[400];
+		char outPath[400];
+		snprintf(path, sizeof(path), "%s/%s", folder, dir->d_name);
+		snprintf(outPath, sizeof(outPath), "%s/%.*s.mid", outFolder, nameLength - 4, dir->d_name);
+		song->Init();
+		if (!song->Load(path, no_progress))
+			continue;
+
+		bool ok;
+		if (NO_PATTERN_INDEX != song->songList[0])
+			ok = ExportSong(song, outPath);
+		else
+			ok = ExportPattern(song, song->currentPatternIndex, outPath);
+		if (ok)
+			exported++;
+		else
+			printf("MidiFileExporter: unable to write %s\n", outPath);
+		}
+	closedir(d);
+	delete song;
+
+	return exported;
+}
+
+/// Write a sequence of patterns to a MIDI file
+/// @param song				Song
+/// @param sequence			Pattern indices
+/// @param count			Number of patterns in the sequence
+/// @param tempoMap			Tempo changes of the sequence (NULL = none)
+/// @param filename			MIDI file to write
+/// @return					false if the file could not be written
+bool MidiFileExporter::Export(const Song* song, const unsigned char* sequence, int count, const TempoMap* tempoMap, const char* filename)
+{
+	// length of the sequence (MIDI ticks)
+	Uint32 end = 0;
+	for (int i = 0; i < count; i++)
+		end += song->patterns[sequence[i]].GetLength() * TICKS_PER_STEP * MIDIFILE_TICK_SCALE;
+
+	// track 0 - song name, tempo, time signature and pattern markers
+	MidiTrackBuffer* conductor = &m_tracks[0];
+	conductor->Reset();
+	conductor->AddMeta(0, MIDI_META_TRACK_NAME, song->name, strlen(song->name));
+	Uint64 interval = (Uint64)60000000000ULL / (16 * (song->BPM > 0 ? song->BPM : 100));
+	if (tempoMap && !tempoMap->IsEmpty())
+		interval = tempoMap->GetInterval(0);
+	AddTempo(conductor, 0, interval);
+	unsigned char timeSignature[4] = { 4, 2, 24, 8 };		// 4/4
+	conductor->AddMeta(0, MIDI_META_TIME_SIGNATURE, timeSignature, 4);
+	Uint32 time = 0;
+	int tick = 0;							// (sequencer ticks)
+	for (int i = 0; i < count; i++)
+		{
+		const DrumPattern* pattern = &song->patterns[sequence[i]];
+		conductor->AddMeta(time, MIDI_META_MARKER, pattern->name, strlen(pattern->name));
+		int patternTicks = pattern->GetLength() * TICKS_PER_STEP;
+		if (tempoMap && !tempoMap->IsEmpty())
+			{
+			// tempo changes (checked every step)
+			for (int stepTick = 0; stepTick < patternTicks; stepTick += TICKS_PER_STEP)
+				{
+				Uint64 stepInterval = tempoMap->GetInterval(tick + stepTick);
+				if (stepInterval != interval)
+					{
+					interval = stepInterval;
+					AddTempo(conductor, time + stepTick * MIDIFILE_TICK_SCALE, interval);
+					}
+				}
+			}
+		tick += patternTicks;
+		time += patternTicks * MIDIFILE_TICK_SCALE;
+		}
+	conductor->AddEnd(end);
+
+	// a track for each drum with notes
+	int numTracks = 1;
+	for (int track = 0; track < NUM_TRACKS; track++)
+		{
+		MidiTrackBuffer* buffer = &m_tracks[track + 1];
+		buffer->Reset();
+		int numEvents = GetEvents(song, sequence, count, track);
+		if (0 == numEvents)
+			continue;
+
+		buffer->AddMeta(0, MIDI_META_TRACK_NAME, m_names[track], strlen(m_names[track]));
+		unsigned char note = m_notes[track];
+		Uint32 trackEnd = end;
+		for (int i = 0; i < numEvents; i++)
+			{
+			const MidiExportEvent* event = &m_events[i];
+			// cut, or another event on the same tick? (the last one wins)
+			if (1 == event->vol || (i + 1 < numEvents && m_events[i + 1].time == event->time))
+				continue;
+			// note off after the note length, or at the next note / cut
+			Uint32 off = event->time + MIDIFILE_NOTE_TICKS;
+			if (i + 1 < numEvents && m_events[i + 1].time < off)
+				off = m_events[i + 1].time;
+			unsigned char velocity = (event->vol > 127) ? 127 : event->vol;
+			buffer->AddEvent(event->time, 0x90 | MIDIFILE_DRUM_CHANNEL, note, velocity);
+			buffer->AddEvent(off, 0x90 | MIDIFILE_DRUM_CHANNEL, note, 0);
+			if (off > trackEnd)
+				trackEnd = off;
+			}
+		buffer->AddEnd(trackEnd);
+		numTracks++;
+		}
+
+	// write the file
+	FILE* pfile = fopen(filename, "wb");
+	if (!pfile)
+		return false;
+	unsigned char header[14];
+	memcpy(header, "MThd", 4);
+	PutU32(header + 4, 6);
+	header[8] = 0;
+	header[9] = 1;							// type 1 (several tracks, played together)
+	header[10] = (unsigned char)(numTracks >> 8);
+	header[11] = (unsigned char)numTracks;
+	header[12] = (unsigned char)(MIDIFILE_PPQN >> 8);
+	header[13] = (unsigned char)MIDIFILE_PPQN;
+	bool ok = (1 == fwrite(header, 14, 1, pfile));
+	for (int i = 0; i <= NUM_TRACKS && ok; i++)
+		{
+		if (!m_tracks[i].IsEmpty())
+			ok = m_tracks[i].Write(pfile);
+		}
+	if (0 != fclose(pfile))
+		ok = false;
+	return ok;
+}
+
+/// Get the notes and cuts of a drum track over a sequence, in time order
+/// @param song				Song
+/// @param sequence			Pattern indices
+/// @param count			Number of patterns in the sequence
+/// @param track			Drum track
+/// @return					Number of events (in m_events)
+int MidiFileExporter::GetEvents(const Song* song, const unsigned char* sequence, int count, int track)
+{
+	int numEvents = 0;
+	Uint32 start = 0;						// (sequencer ticks)
+	for (int i = 0; i < count; i++)
+		{
+		const DrumPattern* pattern = &song->patterns[sequence[i]];
+		int length = pattern->GetLength();
+		int patternTicks = length * TICKS_PER_STEP;
+		StepMask steps = (pattern->GetNoteMask(track) | pattern->GetCutMask(track)) & pattern->GetLengthMask();
+		for (int step = 0; steps != 0; step++)
+			{
+			if (!(steps & STEP_BIT(step)))
+				continue;
+			steps &= ~STEP_BIT(step);
+
+			// (as GetEventTick() and PlayTickEvents() in xdrum.cpp)
+			const DrumEvent* event = pattern->GetEvent(track, step);
+			int grooveTicks;
+			int grooveUnits;
+			m_groove.GetStepTiming(step, &grooveTicks, &grooveUnits);
+			int tick = step * TICKS_PER_STEP + event->offset + grooveTicks;
+			if (tick < 0)
+				tick = 0;
+			else if (tick >= patternTicks)
+				tick = patternTicks - 1;
+			int vol = event->vol;
+			if (vol > 1)
+				{
+				vol = (vol * m_groove.GetVelocity(step)) / 100;
+				if (vol < 2)
+					vol = 2;
+				else if (vol > 127)
+					vol = 127;
+				}
+
+			// insert in time order (only a moved note can be out of order)
+			MidiExportEvent newEvent;
+			newEvent.time = (start + tick) * MIDIFILE_TICK_SCALE + (grooveUnits * MIDIFILE_TICK_SCALE) / GROOVE_TICK_UNITS;
+			newEvent.vol = (unsigned char)vol;
+			int pos = numEvents;
+			while (pos > 0 && m_events[pos - 1].time > newEvent.time)
+				{
+				m_events[pos] = m_events[pos - 1];
+				pos--;
+				}
+			m_events[pos] = newEvent;
+			numEvents++;
+			}
+		start += patternTicks;
+		}
+	return numEvents;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MidiFileImporter class
+///////////////////////////////////////////////////////////////////////////////
+
+// Drums that can stand in for each other (General MIDI notes, 0 terminated)
+static const unsigned char drumFamilies[][12] = {
+	{ 35, 36, 0 },								// kicks
+	{ 37, 38, 40, 0 },							// snares, side stick
+	{ 39, 0 },									// clap
+	{ 42, 44, 0 },								// closed / pedal hi-hat
+	{ 46, 49, 51, 52, 53, 55, 57, 59, 0 },		// open hi-hat, cymbals
+	{ 41, 43, 45, 47, 48, 50, 0 },				// toms
+	{ 56, 0 },									// cowbell
+	{ 54, 69, 70, 82, 0 }						// tambourine, cabasa, maracas, shaker
+};
+#define NUM_DRUM_FAMILIES	(int)(sizeof(drumFamilies) / sizeof(drumFamilies[0]))
+
+/// Read a variable length quantity
+/// @return					false if it runs past the end of the data
+static bool GetVarLength(const unsigned char* data, int length, int* pos, Uint32* value)
+{
+	*value = 0;
+	for (int i = 0; i < 4; i++)
+		{
+		if (*pos >= length)
+			return false;
+		unsigned char byte = data[(*pos)++];
+		*value = (*value << 7) | (byte & 0x7F);
+		if (!(byte & 0x80))
+			return true;
+		}
+	return false;
+}
+
+static Uint32 GetU32(const unsigned char* p)
+{
+	return ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) | p[3];
+}
+
+/// Sort notes by time (qsort)
+static int CompareNotes(const void* a, const void* b)
+{
+	Uint32 timeA = ((const MidiImportNote*)a)->time;
+	Uint32 timeB = ((const MidiImportNote*)b)->time;
+	return (timeA < timeB) ? -1 : ((timeA > timeB) ? 1 : 0);
+}
+
+/// Hash of a pattern's length and events (for finding duplicates quickly)
+static Uint32 HashPattern(const DrumPattern* pattern)
+{
+	Uint32 hash = 2166136261u ^ pattern->GetLength();			// FNV-1a
+	for (int track = 0; track < NUM_TRACKS; track++)
+		{
+		StepMask steps = pattern->GetNoteMask(track) | pattern->GetCutMask(track);
+		for (int step = 0; steps != 0; step++)
+			{
+			if (!(steps & STEP_BIT(step)))
+				continue;
+			steps &= ~STEP_BIT(step);
+			const DrumEvent* event = pattern->GetEvent(track, step);
+			hash = (hash ^ (Uint32)((track << 24) | (step << 16) | (event->vol << 8) | event->offset)) * 16777619u;
+			}
+		}
+	return hash;
+}
+
+// constructor
+MidiFileImporter::MidiFileImporter()
+{
+	DrumKit kit;
+	SetKit(&kit);
+	m_microTiming = false;
+	m_data = NULL;
+	m_length = 0;
+	m_division = 0;
+	m_barSteps = 0;
+	m_bpm = 0;
+	m_notes = NULL;
+	m_numNotes = 0;
+	m_maxNotes = 0;
+	m_haveDrumChannel = false;
+	m_bars = 0;
+	m_droppedNotes = 0;
+	m_truncated = false;
+}
+
+// destructor
+MidiFileImporter::~MidiFileImporter()
+{
+	if (m_data)
+		delete [] m_data;
+	if (m_notes)
+		delete [] m_notes;
+}
+
+/// Map MIDI notes to the tracks of a drumkit - the track with the same
+/// note, or else the track with a similar drum
+void MidiFileImporter::SetKit(const DrumKit* kit)
+{
+	for (int note = 0; note < 128; note++)
+		m_noteTracks[note] = -1;
+	for (int track = 0; track < NUM_TRACKS; track++)
+		{
+		int note = kit->drums[track].midiNote & 0x7F;
+		if (m_noteTracks[note] < 0)
+			m_noteTracks[note] = track;
+		}
+
+	for (int i = 0; i < NUM_DRUM_FAMILIES; i++)
+		{
+		// a track with a drum from this family?
+		int familyTrack = -1;
+		for (int j = 0; drumFamilies[i][j] && familyTrack < 0; j++)
+			{
+			if (m_noteTracks[drumFamilies[i][j]] >= 0)
+				familyTrack = m_noteTracks[drumFamilies[i][j]];
+			}
+		if (familyTrack < 0)
+			continue;
+		for (int j = 0; drumFamilies[i][j]; j++)
+			{
+			if (m_noteTracks[drumFamilies[i][j]] < 0)
+				m_noteTracks[drumFamilies[i][j]] = familyTrack;
+			}
+		}
+}
+
+/// Import a MIDI file as a song (replacing all of the song's patterns and
+/// its sequence)
+/// @param filename			MIDI file
+/// @param song				Song to fill in
+/// @return					false if the file could not be read, or has no notes
+bool MidiFileImporter::Import(const char* filename, Song* song)
+{
+	m_bars = 0;
+	m_droppedNotes = 0;
+	m_truncated = false;
+	if (!ReadFile(filename))
+		return false;
+
+	// header
+	if (m_length < 14 || 0 != memcmp(m_data, "MThd", 4))
+		{
+		printf("MidiFileImporter: %s is not a MIDI file\n", filename);
+		return false;
+		}
+	Uint32 headerLength = GetU32(m_data + 4);
+	m_division = (m_data[12] << 8) | m_data[13];
+	if (headerLength < 6 || headerLength > (Uint32)m_length - 8)
+		{
+		printf("MidiFileImporter: %s has a bad header\n", filename);
+		return false;
+		}
+	if ((m_division & 0x8000) || 0 == m_division)
+		{
+		printf("MidiFileImporter: %s has SMPTE timing (not supported)\n", filename);
+		return false;
+		}
+
+	// tracks (type 2 files are read as if all the tracks play together)
+	m_barSteps = 0;
+	m_bpm = 0;
+	m_numNotes = 0;
+	m_haveDrumChannel = false;
+	Uint32 pos = 8 + headerLength;
+	while (pos <= (Uint32)m_length - 8)
+		{
+		Uint32 chunkLength = GetU32(m_data + pos + 4);
+		if (chunkLength > m_length - pos - 8)
+			chunkLength = m_length - pos - 8;			// (truncated file - read what is there)
+		if (0 == memcmp(m_data + pos, "MTrk", 4))
+			ParseTrack(m_data + pos + 8, (int)chunkLength);
+		pos += 8 + chunkLength;
+		}
+	if (0 == m_numNotes)
+		{
+		printf("MidiFileImporter: %s has no notes\n", filename);
+		return false;
+		}
+	qsort(m_notes, m_numNotes, sizeof(MidiImportNote), CompareNotes);
+
+	BuildSong(song);
+
+	// song name from the file name
+	const char* name = strrchr(filename, '/');
+	name = name ? name + 1 : filename;
+	int nameLength = strlen(name);
+	const char* ext = strrchr(name, '.');
+	if (ext)
+		nameLength = ext - name;
+	if (nameLength > SONG_NAME_LEN - 1)
+		nameLength = SONG_NAME_LEN - 1;
+	memcpy(song->name, name, nameLength);
+	song->name[nameLength] = 0;
+	return true;
+}
+
+/// Import every MIDI file (*.mid) in a folder, and save them as songs
+/// @param folder			Folder of MIDI files
+/// @param outFolder		Folder to save the songs in (name.mid -> name.xds)
+/// @return					Number of files imported, or -1 if the folder could not be read
+int MidiFileImporter::ImportFolder(const char* folder, const char* outFolder)
+{
+	DIR* d = opendir(folder);
+	if (!d)
+		{
+		printf("MidiFileImporter: unable to read folder %s\n", folder);
+		return -1;
+		}
+
+	Song* song = new Song;
+	int imported = 0;
+	struct dirent* dir;
+	while ((dir = readdir(d)) != NULL)
+		{
+		int nameLength = strlen(dir->d_name);
+		if (nameLength <= 4 || 0 != strcasecmp(dir->d_name + nameLength - 4, ".mid"))
+			continue;
+
+		char path[400];
+		char outPath[400];
+		snprintf(path, sizeof(path), "%s/%s", folder, dir->d_name);
+		snprintf(outPath, sizeof(outPath), "%s/%.*s.xds", outFolder, nameLength - 4, dir->d_name);
+		if (!Import(path, song))
+			continue;
+		if (m_truncated || m_droppedNotes > 0)
+			printf("MidiFileImporter: %s - %d bars%s, %d notes not mapped to a track\n", dir->d_name,
+					m_bars, m_truncated ? " (truncated)" : "", m_droppedNotes);
+
+		if (song->Save(outPath, no_progress))
+			imported++;
+		else
+			printf("MidiFileImporter: unable to write %s\n", outPath);
+		}
+	closedir(d);
+	delete song;
+
+	return imported;
+}
+
+/// Read a whole file into m_data
+/// @return					false if it could not be read
+bool MidiFileImporter::ReadFile(const char* filename)
+{
+	FILE* pfile = fopen(filename, "rb");
+	if (!pfile)
+		{
+		printf("MidiFileImporter: unable to open %s\n", filename);
+		return false;
+		}
+	fseek(pfile, 0, SEEK_END);
+	long size = ftell(pfile);
+	fseek(pfile, 0, SEEK_SET);
+	if (size <= 0 || size > MIDIFILE_MAX_FILE)
+		{
+		printf("MidiFileImporter: %s is empty or too big\n", filename);
+		fclose(pfile);
+		return false;
+		}
+
+	// (the buffer is kept for the next file)
+	if (size > m_length || !m_data)
+		{
+		if (m_data)
+			delete [] m_data;
+		m_data = new unsigned char[size];
+		}
+	m_length = (int)size;
+	bool ok = (1 == fread(m_data, m_length, 1, pfile));
+	fclose(pfile);
+	return ok;
+}
+
+/// Read the notes, tempo and time signature from a track chunk
+/// @param data				Track data
+/// @param length			Length of the track data (bytes)
+/// @return					false if the track is corrupt (the notes up to there are kept)
+bool MidiFileImporter::ParseTrack(const unsigned char* data, int length)
+{
+	Uint32 time = 0;
+	unsigned char status = 0;
+	int pos = 0;
+	while (pos < length)
+		{
+		Uint32 delta;
+		if (!GetVarLength(data, length, &pos, &delta) || pos >= length)
+			return false;
+		time += delta;
+
+		unsigned char byte = data[pos];
+		if (0xFF == byte)
+			{
+			// meta event
+			if (pos + 2 > length)
+				return false;
+			unsigned char type = data[pos + 1];
+			pos += 2;
+			Uint32 metaLength;
+			if (!GetVarLength(data, length, &pos, &metaLength) || metaLength > (Uint32)(length - pos))
+				return false;
+			const unsigned char* meta = data + pos;
+			if (0x51 == type && 3 == metaLength && 0 == m_bpm)
+				{
+				Uint32 usPerBeat = (meta[0] << 16) | (meta[1] << 8) | meta[2];
+				if (usPerBeat > 0)
+					m_bpm = (int)((60000000 + usPerBeat / 2) / usPerBeat);
+				}
+			else if (0x58 == type && metaLength >= 2 && 0 == m_barSteps && meta[1] <= 6)
+				{
+				int steps = (meta[0] * 16) >> meta[1];		// (4 steps per quarter note)
+				if (steps >= 1 && steps <= MAX_STEPS_PER_PATTERN)
+					m_barSteps = steps;
+				}
+			else if (0x2F == type)
+				{
+				return true;							// end of track
+				}
+			pos += metaLength;
+			continue;
+			}
+		if (0xF0 == byte || 0xF7 == byte)
+			{
+			// sysex (skipped)
+			pos++;
+			Uint32 sysexLength;
+			if (!GetVarLength(data, length, &pos, &sysexLength) || sysexLength > (Uint32)(length - pos))
+				return false;
+			pos += sysexLength;
+			status = 0;
+			continue;
+			}
+
+		// channel message (with running status)
+		if (byte & 0x80)
+			{
+			if (byte > 0xF0)
+				return false;
+			status = byte;
+			pos++;
+			}
+		else if (0 == status)
+			{
+			return false;
+			}
+		int type = status & 0xF0;
+		int dataBytes = (0xC0 == type || 0xD0 == type) ? 1 : 2;
+		if (pos + dataBytes > length)
+			return false;
+		if (0x90 == type && data[pos + 1] > 0)
+			AddNote(time, data[pos] & 0x7F, data[pos + 1] & 0x7F, MIDIFILE_DRUM_CHANNEL == (status & 0x0F));
+		pos += dataBytes;
+		}
+	return true;
+}
+
+/// Add a note (growing the note list if neccessary)
+void MidiFileImporter::AddNote(Uint32 time, unsigned char note, unsigned char velocity, bool drumChannel)
+{
+	if (m_numNotes == m_maxNotes)
+		{
+		int maxNotes = (m_maxNotes > 0) ? m_maxNotes * 2 : 1024;
+		MidiImportNote* notes = new MidiImportNote[maxNotes];
+		if (m_notes)
+			{
+			memcpy(notes, m_notes, m_numNotes * sizeof(MidiImportNote));
+			delete [] m_notes;
+			}
+		m_notes = notes;
+		m_maxNotes = maxNotes;
+		}
+
+	MidiImportNote* newNote = &m_notes[m_numNotes++];
+	newNote->time = time;
+	newNote->note = note;
+	newNote->velocity = velocity;
+	newNote->drumChannel = drumChannel;
+	if (drumChannel)
+		m_haveDrumChannel = true;
+}
+
+/// Make the patterns and sequence from the notes (sorted by time)
+void MidiFileImporter::BuildSong(Song* song)
+{
+	song->Init();
+	for (int i = 0; i < NUM_TRACKS; i++)
+		song->trackMixInfo[i].Init();
+	int barSteps = (m_barSteps > 0) ? m_barSteps : STEPS_PER_PATTERN;
+	for (int i = 0; i < MAX_PATTERN; i++)
+		{
+		song->patterns[i].Clear();
+		song->patterns[i].SetLength(barSteps);
+		}
+	if (m_bpm >= 20 && m_bpm <= 250)
+		song->BPM = (unsigned char)m_bpm;
+
+	// each bar is built in the next free pattern, then kept (if it is new),
+	// or cleared for the next bar (if it is the same as an earlier one)
+	int numPatterns = 0;
+	int bar = 0;
+	bool pastEnd = false;					// notes after the last bar of the song?
+	DrumPattern* pattern = &song->patterns[0];
+	for (int i = 0; i <= m_numNotes && !m_truncated; i++)
+		{
+		// next note (or the end), and the bar it is in
+		const MidiImportNote* note = NULL;
+		int tick = 0;						// sequencer ticks from the start
+		int step = 0;
+		if (i < m_numNotes)
+			{
+			note = &m_notes[i];
+			if (m_haveDrumChannel && !note->drumChannel)
+				continue;
+			Uint64 noteTick;
+			if (m_microTiming)
+				noteTick = ((Uint64)note->time * 4 * TICKS_PER_STEP + m_division / 2) / m_division;
+			else
+				noteTick = (((Uint64)note->time * 4 + m_division / 2) / m_division) * TICKS_PER_STEP;
+
+			// (checked before it is narrowed - the notes are in time order,
+			// so the song ends here)
+			if (noteTick / TICKS_PER_STEP >= (Uint64)PATTERNS_PER_SONG * barSteps)
+				{
+				note = NULL;
+				pastEnd = true;
+				}
+			else
+				{
+				tick = (int)noteTick;
+				step = tick / TICKS_PER_STEP;
+				}
+			}
+
+		// finish the bars before this note
+		while (!note || step >= (bar + 1) * barSteps)
+			{
+			if (bar >= PATTERNS_PER_SONG)
+				{
+				m_truncated = true;
+				break;
+				}
+			m_hashes[numPatterns] = HashPattern(pattern);
+			int index = FindSamePattern(song, numPatterns, numPatterns);
+			if (index >= 0)
+				{
+				pattern->Clear();
+				}
+			else if (numPatterns + 1 < MAX_PATTERN || !note)
+				{
+				index = numPatterns++;
+				if (numPatterns < MAX_PATTERN)
+					pattern = &song->patterns[numPatterns];
+				}
+			else
+				{
+				// out of patterns (the last one is still needed for the next bar)
+				pattern->Clear();
+				m_truncated = true;
+				break;
+				}
+			song->songList[bar] = (unsigned char)index;
+			bar++;
+			if (!note)
+				break;
+			}
+		if (!note || m_truncated)
+			break;
+
+		// add the note to the bar
+		int track = m_noteTracks[note->note];
+		if (track < 0)
+			{
+			m_droppedNotes++;
+			continue;
+			}
+		int barStep = step - bar * barSteps;
+		unsigned char vol = (note->velocity < 2) ? 2 : note->velocity;		// (1 would be a cut)
+		if (vol > pattern->GetVol(track, barStep))
+			{
+			pattern->SetVol(track, barStep, vol);
+			if (m_microTiming)
+				pattern->SetOffset(track, barStep, (unsigned char)(tick - step * TICKS_PER_STEP));
+			}
+		}
+
+	if (pastEnd)
+		m_truncated = true;
+	m_bars = bar;
+	song->currentPatternIndex = 0;
+	song->songPos = 0;
+}
+
+/// Find an earlier pattern with the same events
+/// @param song				Song
+/// @param count			Number of patterns to search
+/// @param index			Pattern to look for (its hash must be in m_hashes)
+/// @return					Index of the same pattern, or -1 if there is none
+int MidiFileImporter::FindSamePattern(const Song* song, int count, int index) const
+{
+	for (int i = 0; i < count; i++)
+		{
+		if (m_hashes[i] == m_hashes[index] && song->patterns[i].HasSameEvents(&song->patterns[index]))
+			return i;
+		}
+	return -1;
+}
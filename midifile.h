@@ -0,0 +1,148 @@
+// xdrum Standard MIDI File export / import
+//
+// Export writes a song's sequence (or one pattern) as a type 1 Standard MIDI
+// File, to carry arrangements into a DAW. Track 0 has the song name, tempo,
+// 4/4 time signature and a marker with the name of each pattern in the
+// sequence. Each drum track with notes gets its own MIDI track (named after
+// the drum) on the General MIDI drum channel, with the drum's note from the
+// kit (see DEFAULT_MIDI_NOTES in drumkit.h, and note<n>= in kit.cfg) and
+// the event's vol as the velocity. A cut ends the track's previous note.
+// Notes are placed like the sequencer plays them (micro-timing and groove).
+// A song sequence also gets the song's tempo changes (a ramp is written as
+// a tempo change on every step).
+// The track data is built in memory buffers that are kept between files, so
+// exporting a whole folder of songs (see ExportFolder()) only costs the song
+// loads and one write per track.
+// Import reads the drum channel notes of a type 0 or 1 file (or all notes,
+// if there are none on the drum channel), maps each note to the track with
+// that note in the kit (or a similar drum - eg: any tom to the tom track),
+// quantises them to steps and slices them into one pattern per bar (the
+// bar length comes from the file's first time signature). Bars with the
+// same notes share a pattern, and the song sequence plays the bars in order.
+// Needs pattern.h, song.h, SDL_mixer.h, drumkit.h, groove.h and tempomap.h
+// included first.
+
+#define MIDIFILE_PPQN				96			// MIDI ticks per beat
+#define MIDIFILE_TICK_SCALE			(MIDIFILE_PPQN / (4 * TICKS_PER_STEP))	// MIDI ticks per sequencer tick
+#define MIDIFILE_DRUM_CHANNEL		9			// General MIDI drums (channel 10)
+#define MIDIFILE_NOTE_TICKS			(TICKS_PER_STEP * MIDIFILE_TICK_SCALE)	// note length (MIDI ticks), unless cut sooner
+#define MIDIFILE_MAX_EVENTS			(PATTERNS_PER_SONG * MAX_STEPS_PER_PATTERN)	// per drum track
+#define MIDIFILE_MAX_FILE			(4 * 1024 * 1024)	// largest MIDI file imported (bytes)
+
+/// A MIDI track being built in memory
+class MidiTrackBuffer
+{
+public:
+	// constructor
+	MidiTrackBuffer();
+	~MidiTrackBuffer();
+
+	void Reset();
+	bool IsEmpty() const { return (0 == m_length); }
+	void AddEvent(Uint32 time, unsigned char status, unsigned char data1, unsigned char data2);
+	void AddMeta(Uint32 time, unsigned char type, const void* data, int length);
+	void AddEnd(Uint32 time);
+	bool Write(FILE* pfile) const;
+
+private:
+	void AddDelta(Uint32 time);
+	void AddByte(unsigned char value);
+
+	unsigned char* m_data;
+	int m_length;
+	int m_capacity;
+	Uint32 m_time;							// time of the last event (MIDI ticks)
+	unsigned char m_status;					// last status (running status)
+};
+
+/// A note of a drum track
+class MidiExportEvent
+{
+public:
+	Uint32 time;							// MIDI ticks from the start of the song
+	unsigned char vol;						// 1 = cut
+};
+
+/// Standard MIDI File exporter
+class MidiFileExporter
+{
+public:
+	// constructor
+	MidiFileExporter();
+	~MidiFileExporter();
+
+	void SetKit(const DrumKit* kit);
+	void SetGroove(const Groove* groove) { m_groove = *groove; }
+
+	bool ExportSong(const Song* song, const char* filename);
+	bool ExportPattern(const Song* song, int patternIndex, const char* filename);
+	int ExportFolder(const char* folder, const char* outFolder);
+
+private:
+	bool Export(const Song* song, const unsigned char* sequence, int count, const TempoMap* tempoMap, const char* filename);
+	int GetEvents(const Song* song, const unsigned char* sequence, int count, int track);
+
+	unsigned char m_notes[NUM_TRACKS];
+	char m_names[NUM_TRACKS][DRUM_NAME_LEN];
+	Groove m_groove;
+	TempoMap* m_tempoMap;					// of the song being exported
+	MidiTrackBuffer m_tracks[NUM_TRACKS + 1];
+	MidiExportEvent* m_events;				// notes of the track being exported
+};
+
+/// A note read from a MIDI file
+class MidiImportNote
+{
+public:
+	Uint32 time;							// MIDI ticks
+	unsigned char note;
+	unsigned char velocity;
+	bool drumChannel;
+};
+
+/// Standard MIDI File importer
+class MidiFileImporter
+{
+public:
+	// constructor
+	MidiFileImporter();
+	~MidiFileImporter();
+
+	void SetKit(const DrumKit* kit);
+	void SetMicroTiming(bool keep) { m_microTiming = keep; }
+
+	bool Import(const char* filename, Song* song);
+	int ImportFolder(const char* folder, const char* outFolder);
+
+	// results of the last import
+	int GetBars() const { return m_bars; }
+	int GetDroppedNotes() const { return m_droppedNotes; }
+	bool WasTruncated() const { return m_truncated; }
+
+private:
+	bool ReadFile(const char* filename);
+	bool ParseTrack(const unsigned char* data, int length);
+	void AddNote(Uint32 time, unsigned char note, unsigned char velocity, bool drumChannel);
+	void BuildSong(Song* song);
+	int FindSamePattern(const Song* song, int count, int index) const;
+
+	signed char m_noteTracks[128];			// track of each MIDI note (-1 = not mapped)
+	bool m_microTiming;						// keep the timing within a step (as micro-timing)?
+
+	// file being imported
+	unsigned char* m_data;
+	int m_length;
+	int m_division;							// MIDI ticks per beat
+	int m_barSteps;							// steps per bar (from the time signature)
+	int m_bpm;
+	MidiImportNote* m_notes;
+	int m_numNotes;
+	int m_maxNotes;
+	bool m_haveDrumChannel;					// any notes on the drum channel?
+
+	// results
+	int m_bars;
+	int m_droppedNotes;
+	bool m_truncated;
+	Uint32 m_hashes[MAX_PATTERN];			// of the patterns made so far (for finding duplicates)
+};
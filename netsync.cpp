@@ -0,0 +1,532 @@
+/*
+ *      netsync.cpp
+ *
+ *      Tempo / transport sync between xdrum instances over UDP multicast
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "platform.h"
+#include "hrtimer.h"
+#include "netsync.h"
+
+#if !defined(PSP) && !defined(WIN32)
+	#define NETSYNC_SOCKETS
+	#include <unistd.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+#endif
+
+// packet types
+enum SYNC_PACKETS { SP_BEACON = 1, SP_PING = 2, SP_PONG = 3 };
+
+#define NETSYNC_PROTOCOL_VERSION	1
+
+// Packet layout (big endian):
+//  0  "PXSY"
+//  4  protocol version, packet type, 2 bytes unused
+//  8  sender peer id
+// 12  sequence number
+// 16  send time (sender's clock, ns)
+// 24  beacon: timeline owner, version, BPM, flags (1 = playing),
+//             time of tick 0 (sender's clock)
+//     pong:   peer id of the pinger, unused, ping send time, ping receive time
+
+static void PutU32(unsigned char* p, Uint32 value)
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+static void PutU64(unsigned char* p, Uint64 value)
+{
+	PutU32(p, (Uint32)(value >> 32));
+	PutU32(p + 4, (Uint32)value);
+}
+
+static Uint32 GetU32(const unsigned char* p)
+{
+	return ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) | p[3];
+}
+
+static Uint64 GetU64(const unsigned char* p)
+{
+	return ((Uint64)GetU32(p) << 32) | GetU32(p + 4);
+}
+
+// constructor
+NetSync::NetSync()
+{
+	m_socket = -1;
+	m_groupAddr = 0;
+	m_port = NETSYNC_DEFAULT_PORT;
+	m_id = 0;
+	m_seq = 0;
+	m_thread = NULL;
+	m_quit = false;
+	m_beaconNow = false;
+	m_mutex = NULL;
+	m_timelineSeq = 0;
+	for (int i = 0; i < NETSYNC_MAX_PEERS; i++)
+		m_peers[i].id = 0;
+}
+
+// destructor
+NetSync::~NetSync()
+{
+	Close();
+}
+
+/// Join the sync group, and start the network thread
+/// @param group			Multicast group address (eg: NETSYNC_DEFAULT_GROUP)
+/// @param port				UDP port
+/// @param loopback			Use the loopback interface (instances on this host only)
+/// @return					false if the socket could not be set up
+bool NetSync::Open(const char* group, int port, bool loopback)
+{
+	Close();
+
+#ifdef NETSYNC_SOCKETS
+	struct in_addr groupAddr;
+	if (0 == inet_aton(group, &groupAddr) || !IN_MULTICAST(ntohl(groupAddr.s_addr)))
+		{
+		printf("NetSync: %s is not a multicast address\n", group);
+		return false;
+		}
+
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
+		{
+		printf("NetSync: unable to create socket (%s)\n", strerror(errno));
+		return false;
+		}
+
+	// several instances on one host share the port
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if (0 != bind(s, (struct sockaddr*)&addr, sizeof(addr)))
+		{
+		printf("NetSync: unable to bind to port %d (%s)\n", port, strerror(errno));
+		close(s);
+		return false;
+		}
+
+	struct in_addr ifAddr;
+	ifAddr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
+	struct ip_mreq mreq;
+	mreq.imr_multiaddr = groupAddr;
+	mreq.imr_interface = ifAddr;
+	if (0 != setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+		{
+		printf("NetSync: unable to join group %s (%s)\n", group, strerror(errno));
+		close(s);
+		return false;
+		}
+	if (loopback)
+		setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &ifAddr, sizeof(ifAddr));
+	unsigned char loop = 1;				// other instances on this host
+	setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	unsigned char ttl = 1;				// local network only
+	setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
+	m_socket = s;
+	m_groupAddr = groupAddr.s_addr;
+	m_port = port;
+	m_id = (Uint32)(HrTimeNanos() ^ ((Uint64)getpid() << 16));
+	if (0 == m_id)
+		m_id = 1;
+	m_timelineSeq = 0;
+	m_timeline = SyncTimeline();
+	for (int i = 0; i < NETSYNC_MAX_PEERS; i++)
+		m_peers[i].id = 0;
+
+	m_mutex = SDL_CreateMutex();
+	m_quit = false;
+	m_thread = SDL_CreateThread(ThreadFunc, this);
+	if (!m_thread)
+		{
+		printf("NetSync: unable to start network thread\n");
+		Close();
+		return false;
+		}
+
+	printf("NetSync: joined %s:%d%s as peer %08X\n", group, port, loopback ? " (loopback)" : "", m_id);
+	return true;
+#else
+	printf("NetSync: network sync is not supported on this platform\n");
+	return false;
+#endif
+}
+
+/// Leave the sync group
+void NetSync::Close()
+{
+	if (m_thread)
+		{
+		m_quit = true;
+		SDL_WaitThread(m_thread, NULL);
+		m_thread = NULL;
+		}
+
+#ifdef NETSYNC_SOCKETS
+	if (m_socket >= 0)
+		close(m_socket);
+#endif
+	m_socket = -1;
+
+	if (m_mutex)
+		{
+		SDL_DestroyMutex(m_mutex);
+		m_mutex = NULL;
+		}
+}
+
+/// Get the shared timeline (lock-free, so the play thread never waits for
+/// the network thread)
+/// @param timeline			Timeline to fill in (version 0 = none yet)
+void NetSync::GetTimeline(SyncTimeline* timeline)
+{
+	if (!m_mutex)
+		{
+		*timeline = SyncTimeline();
+		return;
+		}
+
+	unsigned int seq;
+	do
+		{
+		seq = m_timelineSeq;
+		__sync_synchronize();
+		*timeline = m_timeline;
+		__sync_synchronize();
+		} while ((seq & 1) || seq != m_timelineSeq);
+}
+
+/// Change the shared timeline (NB: call with the mutex locked, so there is
+/// only one writer)
+/// @param timeline			New timeline
+void NetSync::SetTimeline(const SyncTimeline& timeline)
+{
+	m_timelineSeq++;
+	__sync_synchronize();
+	m_timeline = timeline;
+	__sync_synchronize();
+	m_timelineSeq++;
+}
+
+/// Make a new version of the timeline (after a local tempo change, start or
+/// stop), which the other instances will follow
+/// @param bpm				Tempo
+/// @param playing			Playing?
+/// @param origin			Time of tick 0 (local clock)
+/// @return					Version number of the new timeline
+Uint32 NetSync::Publish(int bpm, bool playing, Uint64 origin)
+{
+	if (!m_mutex)
+		return 0;
+
+	SDL_LockMutex(m_mutex);
+	SyncTimeline timeline;
+	timeline.version = m_timeline.version + 1;
+	timeline.owner = m_id;
+	timeline.bpm = bpm;
+	timeline.playing = playing;
+	timeline.origin = origin;
+	SetTimeline(timeline);
+	SDL_UnlockMutex(m_mutex);
+	Uint32 version = timeline.version;
+
+	// let the others know straight away (from the network thread)
+	m_beaconNow = true;
+	return version;
+}
+
+/// Get the number of other instances we can hear
+int NetSync::GetPeerCount()
+{
+	if (!m_mutex)
+		return 0;
+
+	int count = 0;
+	SDL_LockMutex(m_mutex);
+	for (int i = 0; i < NETSYNC_MAX_PEERS; i++)
+		{
+		if (0 != m_peers[i].id)
+			count++;
+		}
+	SDL_UnlockMutex(m_mutex);
+	return count;
+}
+
+/// Network thread
+int NetSync::ThreadFunc(void* data)
+{
+	NetSync* netSync = (NetSync*)data;
+	netSync->Run();
+	return 0;
+}
+
+/// Network thread loop - receive packets, and send beacons and pings
+void NetSync::Run()
+{
+#ifdef NETSYNC_SOCKETS
+	Uint32 nextBeacon = SDL_GetTicks();
+	Uint32 nextPing = nextBeacon;
+	while (!m_quit)
+		{
+		// wait for a packet (or 10ms)
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(m_socket, &readSet);
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 10000;
+		if (select(m_socket + 1, &readSet, NULL, NULL, &timeout) > 0)
+			Receive();
+
+		Uint32 now = SDL_GetTicks();
+		if (m_beaconNow || (Sint32)(now - nextBeacon) >= 0)
+			{
+			m_beaconNow = false;
+			SendBeacon();
+			DropOldPeers();
+			nextBeacon = now + NETSYNC_BEACON_INTERVAL;
+			}
+		if ((Sint32)(now - nextPing) >= 0)
+			{
+			SendPing();
+			nextPing = now + NETSYNC_PING_INTERVAL;
+			}
+		}
+#endif
+}
+
+/// Handle the packets waiting on the socket
+void NetSync::Receive()
+{
+#ifdef NETSYNC_SOCKETS
+	unsigned char packet[NETSYNC_PACKET_SIZE];
+	while (NETSYNC_PACKET_SIZE == recv(m_socket, packet, NETSYNC_PACKET_SIZE, 0))
+		{
+		Uint64 receiveTime = HrTimeNanos();
+		Uint32 sender = GetU32(packet + 8);
+		if (0 != memcmp(packet, "PXSY", 4) || NETSYNC_PROTOCOL_VERSION != packet[4] || sender == m_id || 0 == sender)
+			continue;					// not for us (or our own packet looped back)
+
+		Uint64 sendTime = GetU64(packet + 16);
+		bool joined = false;
+		bool ping = false;
+		SDL_LockMutex(m_mutex);
+		SyncPeer* peer = GetPeer(sender, true, &joined);
+		if (!peer)
+			{
+			SDL_UnlockMutex(m_mutex);
+			continue;					// too many peers
+			}
+		peer->lastSeen = SDL_GetTicks();
+
+		int type = packet[5];
+		if (SP_BEACON == type)
+			{
+			Uint32 owner = GetU32(packet + 24);
+			Uint32 version = GetU32(packet + 28);
+			Uint32 bpm = GetU32(packet + 32);
+			// until we have pinged the peer, assume no network delay
+			Sint64 offset = peer->offsetValid ? peer->offset : (Sint64)(sendTime - receiveTime);
+			bool newer = (version > m_timeline.version || (version == m_timeline.version && owner > m_timeline.owner));
+			bool same = (version == m_timeline.version && owner == m_timeline.owner);
+			// (a tempo the song cannot play is not trusted - 0 would divide
+			// by zero in SyncTimeline::GetTickTime())
+			if (version > 0 && bpm >= NETSYNC_MIN_BPM && bpm <= NETSYNC_MAX_BPM
+				&& (newer || (same && sender == owner && peer->offsetValid)))
+				{
+				// new timeline (or a better estimate of the owner's one)
+				SyncTimeline timeline;
+				timeline.owner = owner;
+				timeline.version = version;
+				timeline.bpm = (int)bpm;
+				timeline.playing = (0 != (GetU32(packet + 36) & 1));
+				timeline.origin = GetU64(packet + 40) - offset;
+				SetTimeline(timeline);
+				}
+			}
+		else if (SP_PING == type)
+			{
+			ping = true;
+			}
+		else if (SP_PONG == type && GetU32(packet + 24) == m_id)
+			{
+			// NTP style offset estimate (t1 = ping sent, t2 = ping received,
+			// t3 = pong sent, t4 = pong received)
+			Uint64 t1 = GetU64(packet + 32);
+			Uint64 t2 = GetU64(packet + 40);
+			Uint64 t3 = sendTime;
+			Uint64 t4 = receiveTime;
+			Sint64 offset = ((Sint64)(t2 - t1) + (Sint64)(t3 - t4)) / 2;
+			Sint64 rtt = (Sint64)(t4 - t1) - (Sint64)(t3 - t2);
+			if (rtt >= 0)
+				AddOffsetSample(peer, offset, (Uint64)rtt);
+			}
+		SDL_UnlockMutex(m_mutex);
+
+		// (not with the mutex locked)
+		if (joined)
+			printf("NetSync: peer %08X joined\n", sender);
+		if (ping)
+			SendPong(sender, sendTime, receiveTime);
+		}
+#endif
+}
+
+/// Send our view of the timeline to the group
+void NetSync::SendBeacon()
+{
+	unsigned char packet[NETSYNC_PACKET_SIZE];
+	memset(packet, 0, NETSYNC_PACKET_SIZE);
+	SDL_LockMutex(m_mutex);
+	PutU32(packet + 24, m_timeline.owner);
+	PutU32(packet + 28, m_timeline.version);
+	PutU32(packet + 32, (Uint32)m_timeline.bpm);
+	PutU32(packet + 36, m_timeline.playing ? 1 : 0);
+	PutU64(packet + 40, m_timeline.origin);
+	SDL_UnlockMutex(m_mutex);
+	packet[5] = SP_BEACON;
+	Send(packet);
+}
+
+/// Ask all peers for their clock time
+void NetSync::SendPing()
+{
+	unsigned char packet[NETSYNC_PACKET_SIZE];
+	memset(packet, 0, NETSYNC_PACKET_SIZE);
+	packet[5] = SP_PING;
+	Send(packet);
+}
+
+/// Answer a ping
+/// @param toPeer			Peer that sent the ping
+/// @param pingTime			Time the ping was sent (peer's clock)
+/// @param receiveTime		Time the ping arrived (our clock)
+void NetSync::SendPong(Uint32 toPeer, Uint64 pingTime, Uint64 receiveTime)
+{
+	unsigned char packet[NETSYNC_PACKET_SIZE];
+	memset(packet, 0, NETSYNC_PACKET_SIZE);
+	packet[5] = SP_PONG;
+	PutU32(packet + 24, toPeer);
+	PutU64(packet + 32, pingTime);
+	PutU64(packet + 40, receiveTime);
+	Send(packet);
+}
+
+/// Fill in the packet header, timestamp the packet and send it to the group
+/// @return					false if it could not be sent
+bool NetSync::Send(unsigned char* packet)
+{
+#ifdef NETSYNC_SOCKETS
+	if (m_socket < 0)
+		return false;
+
+	memcpy(packet, "PXSY", 4);
+	packet[4] = NETSYNC_PROTOCOL_VERSION;
+	PutU32(packet + 8, m_id);
+	PutU32(packet + 12, m_seq++);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = m_groupAddr;
+	addr.sin_port = htons((unsigned short)m_port);
+	PutU64(packet + 16, HrTimeNanos());		// as late as possible
+	return (NETSYNC_PACKET_SIZE == sendto(m_socket, packet, NETSYNC_PACKET_SIZE, 0, (struct sockaddr*)&addr, sizeof(addr)));
+#else
+	return false;
+#endif
+}
+
+/// Find a peer (NB: call with the mutex locked)
+/// @param id				Peer id
+/// @param add				Add the peer if it is new
+/// @param added			Set to true if the peer was added
+/// @return					Peer (NULL if not found, or no room)
+SyncPeer* NetSync::GetPeer(Uint32 id, bool add, bool* added)
+{
+	SyncPeer* freePeer = NULL;
+	for (int i = 0; i < NETSYNC_MAX_PEERS; i++)
+		{
+		if (id == m_peers[i].id)
+			return &m_peers[i];
+		if (!freePeer && 0 == m_peers[i].id)
+			freePeer = &m_peers[i];
+		}
+
+	if (!add || !freePeer)
+		return NULL;
+
+	freePeer->id = id;
+	freePeer->offset = 0;
+	freePeer->offsetValid = false;
+	freePeer->samples = 0;
+	*added = true;
+	return freePeer;
+}
+
+/// Add a clock offset sample, and update the peer's offset estimate
+/// (the sample with the shortest round trip is the least delayed)
+void NetSync::AddOffsetSample(SyncPeer* peer, Sint64 offset, Uint64 rtt)
+{
+	peer->sampleOffset[peer->samples % NETSYNC_OFFSET_SAMPLES] = offset;
+	peer->sampleRtt[peer->samples % NETSYNC_OFFSET_SAMPLES] = rtt;
+	peer->samples++;
+
+	int count = (peer->samples < NETSYNC_OFFSET_SAMPLES) ? peer->samples : NETSYNC_OFFSET_SAMPLES;
+	int best = 0;
+	for (int i = 1; i < count; i++)
+		{
+		if (peer->sampleRtt[i] < peer->sampleRtt[best])
+			best = i;
+		}
+	peer->offset = peer->sampleOffset[best];
+	peer->offsetValid = true;
+}
+
+/// Forget peers we have not heard from for a while
+void NetSync::DropOldPeers()
+{
+	Uint32 now = SDL_GetTicks();
+	Uint32 dropped[NETSYNC_MAX_PEERS];
+	int count = 0;
+	SDL_LockMutex(m_mutex);
+	for (int i = 0; i < NETSYNC_MAX_PEERS; i++)
+		{
+		if (0 != m_peers[i].id && now - m_peers[i].lastSeen > NETSYNC_PEER_TIMEOUT)
+			{
+			dropped[count++] = m_peers[i].id;
+			m_peers[i].id = 0;
+			}
+		}
+	SDL_UnlockMutex(m_mutex);
+
+	// (not with the mutex locked)
+	for (int i = 0; i < count; i++)
+		printf("NetSync: peer %08X left\n", dropped[i]);
+}
@@ -0,0 +1,119 @@
+// xdrum network sync
+//
+// Shares tempo, beat phase and start / stop between PXDrum instances on a
+// network (or on one host over the loopback interface), peer to peer.
+// Every instance sends a beacon to a UDP multicast group 10 times a second,
+// with its view of the shared timeline: BPM, playing, and the time of tick 0
+// (in the sender's clock). Whoever changes the tempo or starts / stops
+// playback makes a new version of the timeline, and the newest version
+// wins. Each instance estimates the offset between its clock and each peer's
+// clock from timestamped ping / pong packets (the sample with the shortest
+// round trip out of the last few is used, like NTP), so the times in the
+// beacons can be turned into local times.
+// The play thread follows the timeline by making the tick interval slightly
+// shorter or longer (see FollowNetSync() in xdrum.cpp), so the sequencer
+// never jumps while it plays. It reads the timeline lock-free (a sequence
+// count, like the audio engine's clock map), so it never waits for the
+// network thread.
+// Needs SDL.h and SDL_thread.h included first.
+
+#define NETSYNC_DEFAULT_GROUP		"239.255.77.77"
+#define NETSYNC_DEFAULT_PORT		7477
+#define NETSYNC_MAX_PEERS			8
+#define NETSYNC_OFFSET_SAMPLES		8			// clock offset samples kept per peer
+#define NETSYNC_BEACON_INTERVAL		100			// ms
+#define NETSYNC_PING_INTERVAL		500			// ms
+#define NETSYNC_PEER_TIMEOUT		2000		// ms without a packet before a peer is dropped
+#define NETSYNC_PACKET_SIZE			48
+#define NETSYNC_MIN_BPM				20			// tempo range of a shared timeline (as song.BPM)
+#define NETSYNC_MAX_BPM				250
+
+/// The shared timeline (in local clock time)
+class SyncTimeline
+{
+public:
+	SyncTimeline()
+		{
+		owner = 0;
+		version = 0;
+		bpm = 0;
+		playing = false;
+		origin = 0;
+		}
+
+	// Sequencer tick (fractional) at a time
+	double GetTick(Uint64 timeNs) const
+		{
+		return ((double)(Sint64)(timeNs - origin) * bpm * 16) / 60000000000.0;
+		}
+
+	// Time of a sequencer tick
+	Uint64 GetTickTime(Sint64 tick) const
+		{
+		return origin + (Uint64)((tick * 60000000000LL) / (bpm * 16));
+		}
+
+	Uint32 owner;							// peer id of the instance that made this version
+	Uint32 version;							// 0 = no timeline yet
+	int bpm;
+	bool playing;
+	Uint64 origin;							// time of tick 0
+};
+
+/// Another instance on the network
+class SyncPeer
+{
+public:
+	Uint32 id;								// 0 = free slot
+	Uint32 lastSeen;						// SDL_GetTicks() of the last packet
+	Sint64 offset;							// best estimate of (peer clock - local clock) (ns)
+	bool offsetValid;						// false until the first pong
+	Sint64 sampleOffset[NETSYNC_OFFSET_SAMPLES];
+	Uint64 sampleRtt[NETSYNC_OFFSET_SAMPLES];
+	int samples;
+};
+
+/// Tempo / transport sync between instances over UDP multicast
+class NetSync
+{
+public:
+	// constructor
+	NetSync();
+	~NetSync();
+
+	bool Open(const char* group, int port, bool loopback);
+	void Close();
+	bool IsOpen() const { return (m_socket >= 0); }
+
+	// any thread
+	void GetTimeline(SyncTimeline* timeline);
+	Uint32 Publish(int bpm, bool playing, Uint64 origin);
+	int GetPeerCount();
+
+private:
+	static int ThreadFunc(void* data);
+	void Run();
+	void Receive();
+	void SendBeacon();
+	void SendPing();
+	void SendPong(Uint32 toPeer, Uint64 pingTime, Uint64 receiveTime);
+	bool Send(unsigned char* packet);
+	void SetTimeline(const SyncTimeline& timeline);
+	SyncPeer* GetPeer(Uint32 id, bool add, bool* added);
+	void AddOffsetSample(SyncPeer* peer, Sint64 offset, Uint64 rtt);
+	void DropOldPeers();
+
+	int m_socket;
+	unsigned int m_groupAddr;				// multicast group (network byte order)
+	int m_port;
+	Uint32 m_id;							// our peer id (random)
+	Uint32 m_seq;							// packets sent
+
+	SDL_Thread* m_thread;
+	volatile bool m_quit;
+	volatile bool m_beaconNow;				// send a beacon straight away (timeline changed)
+	SDL_mutex* m_mutex;						// protects the peers (and changes to the timeline)
+	volatile unsigned int m_timelineSeq;	// odd while the timeline is being written
+	SyncTimeline m_timeline;
+	SyncPeer m_peers[NETSYNC_MAX_PEERS];
+};
@@ -0,0 +1,319 @@
+/*
+ *      osc.cpp
+ *
+ *      OSC (Open Sound Control) remote control server for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "platform.h"
+#include "spscqueue.h"
+#include "uisched.h"
+#include "osc.h"
+
+#if !defined(PSP) && !defined(WIN32)
+	#define OSC_SOCKETS
+	#include <unistd.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <netinet/in.h>
+#endif
+
+/// OSC address of each command
+class OscAddress
+{
+public:
+	const char* address;
+	RemoteCommand::COMMAND command;
+	int minArgs;							// numeric args needed
+	bool needText;							// string arg needed
+};
+
+static const OscAddress oscAddresses[] = {
+	{ "/xdrum/play",	RemoteCommand::RC_PLAY,		0, false },
+	{ "/xdrum/stop",	RemoteCommand::RC_STOP,		0, false },
+	{ "/xdrum/rewind",	RemoteCommand::RC_REWIND,	0, false },
+	{ "/xdrum/bpm",		RemoteCommand::RC_BPM,		1, false },
+	{ "/xdrum/pattern",	RemoteCommand::RC_PATTERN,	1, false },
+	{ "/xdrum/step",	RemoteCommand::RC_STEP,		3, false },
+	{ "/xdrum/mute",	RemoteCommand::RC_MUTE,		1, false },
+	{ "/xdrum/solo",	RemoteCommand::RC_SOLO,		1, false },
+	{ "/xdrum/song",	RemoteCommand::RC_SONG,		0, true },
+	{ "/xdrum/kit",		RemoteCommand::RC_KIT,		0, true }
+};
+#define NUM_OSC_ADDRESSES	(int)(sizeof(oscAddresses) / sizeof(OscAddress))
+
+static Uint32 GetU32(const unsigned char* p)
+{
+	return ((Uint32)p[0] << 24) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 8) | p[3];
+}
+
+/// Get the length of an OSC string (including the 0 and padding)
+/// @return					Length, or -1 if the string is not terminated
+static int GetOscStringLength(const unsigned char* data, int length)
+{
+	for (int i = 0; i < length; i++)
+		{
+		if (0 == data[i])
+			return (i + 4) & ~3;
+		}
+	return -1;
+}
+
+// constructor
+OscServer::OscServer()
+{
+	m_socket = -1;
+	m_scheduler = NULL;
+	m_queue = NULL;
+	m_thread = NULL;
+	m_quit = false;
+	m_received = 0;
+	m_dropped = 0;
+	m_badMessages = 0;
+}
+
+// destructor
+OscServer::~OscServer()
+{
+	Close();
+	if (m_queue)
+		delete m_queue;
+}
+
+/// Start listening for OSC messages
+/// @param port				UDP port to listen on
+/// @param scheduler		UI scheduler to wake when commands arrive
+/// @return					false if the server could not be started
+bool OscServer::Open(int port, UiScheduler* scheduler)
+{
+	Close();
+
+#ifdef OSC_SOCKETS
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
+		{
+		printf("OscServer: unable to create socket (%s)\n", strerror(errno));
+		return false;
+		}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if (0 != bind(s, (struct sockaddr*)&addr, sizeof(addr)))
+		{
+		printf("OscServer: unable to bind to port %d (%s)\n", port, strerror(errno));
+		close(s);
+		return false;
+		}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
+	m_socket = s;
+	m_scheduler = scheduler;
+	if (!m_queue)
+		m_queue = new RemoteQueue;
+	m_quit = false;
+	m_thread = SDL_CreateThread(ThreadFunc, this);
+	if (!m_thread)
+		{
+		printf("OscServer: unable to start network thread\n");
+		Close();
+		return false;
+		}
+
+	printf("OscServer: listening on UDP port %d\n", port);
+	return true;
+#else
+	printf("OscServer: OSC remote control is not supported on this platform\n");
+	return false;
+#endif
+}
+
+/// Stop the server
+void OscServer::Close()
+{
+	if (m_thread)
+		{
+		m_quit = true;
+		SDL_WaitThread(m_thread, NULL);
+		m_thread = NULL;
+		}
+
+#ifdef OSC_SOCKETS
+	if (m_socket >= 0)
+		close(m_socket);
+#endif
+	m_socket = -1;
+}
+
+/// Get the next command to carry out (UI thread)
+/// @return					false if there are no commands waiting
+bool OscServer::Pop(RemoteCommand* command)
+{
+	if (!m_queue)
+		return false;
+	return m_queue->Pop(command);
+}
+
+/// Network thread
+int OscServer::ThreadFunc(void* data)
+{
+	OscServer* server = (OscServer*)data;
+	server->Run();
+	return 0;
+}
+
+/// Network thread loop - receive and parse packets
+void OscServer::Run()
+{
+#ifdef OSC_SOCKETS
+	unsigned char* packet = new unsigned char[OSC_MAX_PACKET];
+	while (!m_quit)
+		{
+		// wait for a packet (or 50ms, to check for quit)
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(m_socket, &readSet);
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 50000;
+		if (select(m_socket + 1, &readSet, NULL, NULL, &timeout) <= 0)
+			continue;
+
+		unsigned int received = m_received;
+		int length;
+		while ((length = (int)recv(m_socket, packet, OSC_MAX_PACKET, 0)) > 0)
+			ParsePacket(packet, length);
+
+		// new commands for the UI thread?
+		if (m_received != received && m_scheduler)
+			m_scheduler->Wake();
+		}
+	delete [] packet;
+#endif
+}
+
+/// Parse an OSC packet (message or bundle), and queue its commands
+/// @param data				Packet
+/// @param length			Length of the packet (bytes)
+void OscServer::ParsePacket(const unsigned char* data, int length)
+{
+	if (length >= 16 && 0 == memcmp(data, "#bundle", 8))
+		{
+		// bundle - 8 byte time tag, then (size, element) pairs
+		int pos = 16;
+		while (pos + 4 <= length)
+			{
+			int size = (int)GetU32(data + pos);
+			pos += 4;
+			if (size <= 0 || (size & 3) || pos + size > length)
+				{
+				m_badMessages++;
+				return;
+				}
+			ParsePacket(data + pos, size);
+			pos += size;
+			}
+		return;
+		}
+
+	RemoteCommand command;
+	if (!ParseMessage(data, length, &command))
+		{
+		m_badMessages++;
+		return;
+		}
+
+	if (m_queue->Push(command))
+		m_received++;
+	else
+		m_dropped++;
+}
+
+/// Parse an OSC message into a command
+/// @param data				Message
+/// @param length			Length of the message (bytes)
+/// @param command			Command to fill in
+/// @return					false if the message is not understood
+bool OscServer::ParseMessage(const unsigned char* data, int length, RemoteCommand* command)
+{
+	// address
+	int addressLength = GetOscStringLength(data, length);
+	if (addressLength < 0 || '/' != data[0])
+		return false;
+	const OscAddress* address = NULL;
+	for (int i = 0; i < NUM_OSC_ADDRESSES; i++)
+		{
+		if (0 == strcmp((const char*)data, oscAddresses[i].address))
+			address = &oscAddresses[i];
+		}
+	if (!address)
+		return false;
+
+	command->command = address->command;
+	command->argCount = 0;
+	command->text[0] = 0;
+	bool haveText = false;
+
+	// type tags (optional in old OSC senders - then no args)
+	int pos = addressLength;
+	if (pos < length && ',' == data[pos])
+		{
+		int tagLength = GetOscStringLength(data + pos, length - pos);
+		if (tagLength < 0)
+			return false;
+		const char* tags = (const char*)data + pos + 1;
+		pos += tagLength;
+		for (; 0 != *tags; tags++)
+			{
+			if ('i' == *tags || 'f' == *tags)
+				{
+				if (pos + 4 > length)
+					return false;
+				Uint32 bits = GetU32(data + pos);
+				pos += 4;
+				int value;
+				if ('i' == *tags)
+					value = (int)bits;
+				else
+					{
+					float f;
+					memcpy(&f, &bits, 4);
+					value = (int)(f + ((f < 0.0f) ? -0.5f : 0.5f));
+					}
+				if (command->argCount < OSC_MAX_ARGS)
+					command->args[command->argCount++] = value;
+				}
+			else if ('T' == *tags || 'F' == *tags)
+				{
+				if (command->argCount < OSC_MAX_ARGS)
+					command->args[command->argCount++] = ('T' == *tags) ? 1 : 0;
+				}
+			else if ('s' == *tags)
+				{
+				int textLength = GetOscStringLength(data + pos, length - pos);
+				if (textLength < 0)
+					return false;
+				if (!haveText)
+					{
+					strncpy(command->text, (const char*)data + pos, OSC_MAX_TEXT - 1);
+					command->text[OSC_MAX_TEXT - 1] = 0;
+					haveText = true;
+					}
+				pos += textLength;
+				}
+			else
+				return false;				// type we do not handle
+			}
+		}
+
+	return (command->argCount >= address->minArgs && (haveText || !address->needText));
+}
@@ -0,0 +1,79 @@
+// xdrum OSC remote control
+//
+// A UDP server (on its own thread) that takes OSC messages (and bundles)
+// to control xdrum remotely, eg: from a show control system:
+//   /xdrum/play [i]                 start (or stop if 0) playback
+//   /xdrum/stop                     stop playback
+//   /xdrum/rewind                   stop and go back to the start
+//   /xdrum/bpm i|f                  set the tempo
+//   /xdrum/pattern i                select pattern (queued in live mode)
+//   /xdrum/step track step vol      set a step of the current pattern
+//   /xdrum/step pattern track step vol
+//   /xdrum/mute track [i]           mute (or unmute if 0) a track
+//   /xdrum/solo track [i]           solo (or unsolo if 0) a track
+//   /xdrum/song s                   load a song from the songs folder
+//   /xdrum/kit s                    load a drumkit from the kits folder
+// Numbers can be int or float. Bundle time tags are ignored (messages are
+// carried out as soon as they arrive).
+// The network thread only parses the messages, and passes them to the UI
+// thread on a lock-free queue. The UI thread carries out a limited number
+// of them per frame (see ProcessRemoteCommands() in xdrum.cpp), the same
+// way as key presses, so the play and audio threads never wait for them.
+// Needs SDL.h, SDL_thread.h, spscqueue.h and uisched.h included first.
+
+#define OSC_DEFAULT_PORT		9000
+#define OSC_MAX_PACKET			8192		// bytes
+#define OSC_MAX_ARGS			4
+#define OSC_MAX_TEXT			32
+#define OSC_QUEUE_SIZE			4096		// commands (power of 2)
+#define OSC_MAX_PER_FRAME		1024		// commands carried out per UI frame
+
+/// A remote control command (parsed from an OSC message)
+class RemoteCommand
+{
+public:
+	enum COMMAND { RC_PLAY = 0, RC_STOP, RC_REWIND, RC_BPM, RC_PATTERN, RC_STEP,
+					RC_MUTE, RC_SOLO, RC_SONG, RC_KIT };
+
+	COMMAND command;
+	int argCount;							// number of numeric args
+	int args[OSC_MAX_ARGS];
+	char text[OSC_MAX_TEXT];				// string arg (song / kit name)
+};
+
+/// Lock-free queue of remote commands
+typedef SpscQueue<RemoteCommand, OSC_QUEUE_SIZE> RemoteQueue;
+
+/// OSC remote control server
+class OscServer
+{
+public:
+	// constructor
+	OscServer();
+	~OscServer();
+
+	bool Open(int port, UiScheduler* scheduler);
+	void Close();
+	bool IsOpen() const { return (m_socket >= 0); }
+
+	// UI thread
+	bool Pop(RemoteCommand* command);
+	unsigned int GetReceived() const { return m_received; }
+	unsigned int GetDropped() const { return m_dropped; }
+	unsigned int GetBadMessages() const { return m_badMessages; }
+
+private:
+	static int ThreadFunc(void* data);
+	void Run();
+	void ParsePacket(const unsigned char* data, int length);
+	bool ParseMessage(const unsigned char* data, int length, RemoteCommand* command);
+
+	int m_socket;
+	UiScheduler* m_scheduler;				// woken when commands arrive
+	RemoteQueue* m_queue;
+	SDL_Thread* m_thread;
+	volatile bool m_quit;
+	volatile unsigned int m_received;		// commands queued
+	volatile unsigned int m_dropped;		// commands lost because the queue was full
+	volatile unsigned int m_badMessages;	// messages not understood
+};
@@ -0,0 +1,258 @@
+/*
+ *      pattern.cpp
+ *
+ *      Bulk track operations for xdrum patterns
+ *      (done on the per-track step bitsets where possible),
+ *      and the step trigger lists used for playback
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pattern.h"
+
+/// Get the first step in a step bitset
+/// @param mask				Step bitset (must not be 0)
+/// @return					Lowest step number set in the mask
+static int FirstStep(StepMask mask)
+{
+	return __builtin_ctzll(mask);
+}
+
+/// Move the events at some steps of a track
+/// @param track			Track to change
+/// @param steps			Steps to move
+/// @param distance			Number of steps to move by (+ve = later)
+/// @param wrap				true to wrap around the pattern length, false to drop
+///							events that move outside it
+void DrumPattern::MoveTrackEvents(int track, StepMask steps, int distance, bool wrap)
+{
+	DrumEvent moved[MAX_STEPS_PER_PATTERN];
+	StepMask mask = steps;
+	while (mask)
+		{
+		int step = FirstStep(mask);
+		mask &= mask - 1;
+		moved[step].CopyFrom(GetEvent(track, step));
+		ClearEvent(track, step);
+		}
+
+	mask = steps;
+	while (mask)
+		{
+		int step = FirstStep(mask);
+		mask &= mask - 1;
+		int dest = step + distance;
+		if (wrap)
+			dest = ((dest % length) + length) % length;
+		else if (dest < 0 || dest >= length)
+			continue;
+		SetEvent(track, dest, &moved[step]);
+		}
+}
+
+/// Remove all events on a track (including any beyond the pattern length)
+/// @param track			Track to clear
+void DrumPattern::ClearTrack(int track)
+{
+	StepMask mask = noteMask[track] | cutMask[track];
+	while (mask)
+		{
+		ClearEvent(track, FirstStep(mask));
+		mask &= mask - 1;
+		}
+}
+
+/// Put a note on every Nth step of a track (existing notes are kept)
+/// @param track			Track to fill
+/// @param every			Step spacing of the notes
+/// @param vol				Volume of new notes
+void DrumPattern::FillTrack(int track, int every, unsigned char vol)
+{
+	if (every < 1)
+		return;
+
+	StepMask fill = 0;
+	for (int step = 0; step < length; step += every)
+		fill |= STEP_BIT(step);
+
+	StepMask mask = fill & ~noteMask[track];
+	while (mask)
+		{
+		SetVol(track, FirstStep(mask), vol);
+		mask &= mask - 1;
+		}
+}
+
+/// Spread a number of notes as evenly as possible over the track
+/// (Euclidean rhythm). Existing notes on the new steps are kept, all
+/// other events on the track are removed.
+/// @param track			Track to change
+/// @param pulses			Number of notes
+/// @param vol				Volume of new notes
+void DrumPattern::EuclidTrack(int track, int pulses, unsigned char vol)
+{
+	if (pulses > length)
+		pulses = length;
+
+	StepMask euclid = 0;
+	for (int step = 0; step < length; step++)
+		{
+		if ((step * pulses) % length < pulses)
+			euclid |= STEP_BIT(step);
+		}
+
+	StepMask mask = (noteMask[track] | cutMask[track]) & GetLengthMask() & ~euclid;
+	while (mask)
+		{
+		ClearEvent(track, FirstStep(mask));
+		mask &= mask - 1;
+		}
+
+	mask = euclid & ~noteMask[track];
+	while (mask)
+		{
+		SetVol(track, FirstStep(mask), vol);
+		mask &= mask - 1;
+		}
+}
+
+/// Rotate the events of a track (events wrap around the pattern length)
+/// @param track			Track to rotate
+/// @param steps			Number of steps to rotate by (+ve = later)
+void DrumPattern::RotateTrack(int track, int steps)
+{
+	MoveTrackEvents(track, (noteMask[track] | cutMask[track]) & GetLengthMask(), steps, true);
+}
+
+/// Shift the events of a track (events shifted out of the pattern are lost)
+/// @param track			Track to shift
+/// @param steps			Number of steps to shift by (+ve = later)
+void DrumPattern::ShiftTrack(int track, int steps)
+{
+	MoveTrackEvents(track, (noteMask[track] | cutMask[track]) & GetLengthMask(), steps, false);
+}
+
+/// Only keep the notes on a track that another track also has notes on
+/// @param track			Track to change
+/// @param otherTrack		Track to AND with
+void DrumPattern::AndTrack(int track, int otherTrack)
+{
+	StepMask mask = noteMask[track] & ~noteMask[otherTrack] & GetLengthMask();
+	while (mask)
+		{
+		ClearEvent(track, FirstStep(mask));
+		mask &= mask - 1;
+		}
+}
+
+/// Add the notes of another track to a track
+/// (where the track already has a note, it is kept)
+/// @param track			Track to change
+/// @param otherTrack		Track to OR with
+void DrumPattern::OrTrack(int track, int otherTrack)
+{
+	StepMask mask = noteMask[otherTrack] & ~noteMask[track] & GetLengthMask();
+	while (mask)
+		{
+		int step = FirstStep(mask);
+		mask &= mask - 1;
+		SetEvent(track, step, GetEvent(otherTrack, step));
+		}
+}
+
+/// Find the next step with an event (note or cut) on a track
+/// @param track			Track to search
+/// @param step				Step to search after (wraps around to the start)
+/// @return					Step of the next event, or -1 if the track is empty
+int DrumPattern::FindNextEvent(int track, int step) const
+{
+	StepMask used = (noteMask[track] | cutMask[track]) & GetLengthMask();
+	if (0 == used)
+		return -1;
+
+	StepMask later = 0;
+	if (step + 1 < MAX_STEPS_PER_PATTERN)
+		later = used & ~(STEP_BIT(step + 1) - 1);
+	return later ? FirstStep(later) : FirstStep(used);
+}
+
+/// Get the list of triggers to play on a step
+/// The list is rebuilt if the step has been edited or the mix has changed
+/// since it was last built.
+/// @param step				Step to get the triggers for
+/// @param mix				Current song / track mix settings
+/// @return					List of triggers (not valid after the next call)
+const StepTriggerList* DrumPattern::GetTriggers(int step, const TriggerMix* mix)
+{
+	static StepTriggerList emptyList;
+
+	// mix changed? (all steps need rebuilding)
+	if (!triggerMix.IsSameAs(mix))
+		{
+		triggerMix = *mix;
+		InvalidateTriggers();
+		}
+
+	if (!(GetUsedSteps() & STEP_BIT(step)))
+		return &emptyList;
+
+	// (the trigger lists are allocated with the events - see GetPage())
+	int page = step / STEPS_PER_PAGE;
+	if (!triggerPages[page])
+		return &emptyList;
+
+	StepTriggerList* list = &triggerPages[page]->steps[step % STEPS_PER_PAGE];
+	if (triggersDirty[step])
+		{
+		// clear the flag first, so an edit made while compiling is not lost
+		triggersDirty[step] = 0;
+		CompileTriggers(step, list);
+		}
+
+	return list;
+}
+
+/// Build the trigger list of a step (applying the track mix)
+/// @param step				Step to build the list for
+/// @param list				List to fill in
+void DrumPattern::CompileTriggers(int step, StepTriggerList* list)
+{
+	int count = 0;
+	for (int track = 0; track < NUM_TRACKS; track++)
+		{
+		StepTrigger* trigger = &list->triggers[count];
+		if (cutMask[track] & STEP_BIT(step))
+			{
+			// cut notes are applied even if the track is muted
+			trigger->vol = 0;
+			trigger->cut = true;
+			}
+		else if (noteMask[track] & STEP_BIT(step))
+			{
+			if (0 == triggerMix.trackVol[track])
+				continue;				// muted
+			const DrumEvent* event = GetEvent(track, step);
+			int vol = (triggerMix.songVol * triggerMix.trackVol[track] * event->vol) / (512 * 128);
+			if (0 == vol)
+				continue;				// inaudible
+			int pan = event->pan + triggerMix.trackPan[track] - 128;
+			if (pan < 0)
+				pan = 0;
+			else if (pan > 255)
+				pan = 255;
+			trigger->vol = (unsigned char)vol;
+			trigger->pan = (unsigned char)pan;
+			trigger->cut = false;
+			}
+		else
+			continue;
+
+		trigger->track = (unsigned char)track;
+		trigger->offset = GetEvent(track, step)->offset;
+		count++;
+		}
+
+	list->count = count;
+}
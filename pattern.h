@@ -1,9 +1,17 @@
 // xdrum pattern definition
 //
-#define STEPS_PER_PATTERN 16
+#define STEPS_PER_PATTERN 16				// steps per bar (default pattern length)
+#define MAX_STEPS_PER_PATTERN	64			// max pattern length in steps
+#define STEPS_PER_PAGE	16					// steps per storage page (and per grid page)
+#define MAX_PATTERN_PAGES	(MAX_STEPS_PER_PATTERN / STEPS_PER_PAGE)
+#define TICKS_PER_STEP	4					// sequencer ticks per step (16 ticks per beat)
 #define NUM_TRACKS	8
 #define PATTERN_NAME_LENGTH	32
 
+// Bitset of the steps in a track (bit n = step n)
+typedef unsigned long long StepMask;
+#define STEP_BIT(step)		((StepMask)1 << (step))
+
 class DrumEvent
 {
 public:
@@ -12,23 +20,106 @@ public:
 		{
 		Init();
 		};
-	
+
 	void Init()
 		{
 		vol = 0;
 		pan = 128;
+		offset = 0;
 		};
-		
+
 	void CopyFrom(const DrumEvent* event)
 		{
 		vol = event->vol;
-		pan = event->pan;	
+		pan = event->pan;
+		offset = event->offset;
+		}
+
+	bool IsSameAs(const DrumEvent* event) const
+		{
+		return (vol == event->vol && pan == event->pan && offset == event->offset);
 		}
 
 	unsigned char vol;
 	unsigned char pan;
+	unsigned char offset;				// micro-timing (ticks after the step, 0 to TICKS_PER_STEP-1)
+};
+
+/// A page of events (STEPS_PER_PAGE steps of all tracks)
+class DrumPatternPage
+{
+public:
+	DrumEvent events[NUM_TRACKS][STEPS_PER_PAGE];
+};
+
+/// Mix settings that are folded into the step trigger lists
+class TriggerMix
+{
+public:
+	TriggerMix()
+		{
+		songVol = 0;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			trackVol[i] = 0;
+			trackPan[i] = 128;
+			}
+		};
+
+	bool IsSameAs(const TriggerMix* mix) const
+		{
+		if (songVol != mix->songVol)
+			return false;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			if (trackVol[i] != mix->trackVol[i] || trackPan[i] != mix->trackPan[i])
+				return false;
+			}
+		return true;
+		}
+
+	unsigned char songVol;
+	unsigned char trackVol[NUM_TRACKS];		// 0 = muted
+	unsigned char trackPan[NUM_TRACKS];
+};
+
+/// A note (or note cut) to be played by the sequencer, with the track mix
+/// already applied
+class StepTrigger
+{
+public:
+	unsigned char track;
+	unsigned char vol;					// output (chunk) volume
+	unsigned char pan;
+	unsigned char offset;				// micro-timing (ticks)
+	bool cut;							// true = stop the track's sample instead
+};
+
+/// The triggers on one step of a pattern (only tracks that have an event)
+class StepTriggerList
+{
+public:
+	int count;
+	StepTrigger triggers[NUM_TRACKS];
+};
+
+/// Trigger lists for a page of steps
+class StepTriggerPage
+{
+public:
+	StepTriggerList steps[STEPS_PER_PAGE];
 };
 
+/// A drum pattern
+/// Events are stored in pages of STEPS_PER_PAGE steps, which are only
+/// allocated once something is written to them, so long (mostly empty)
+/// patterns stay small and empty pages can be skipped when scanning.
+/// Each track also has a "note on" and a "cut" bitset of its steps, so
+/// bulk track operations and scanning for events are word operations.
+/// For playback, each step has a list of triggers (see GetTriggers()),
+/// which is rebuilt when the step is edited or the mix changes.
+/// NB: Pages are never freed while the pattern exists (the play thread may
+///     be reading them), only cleared.
 class DrumPattern
 {
 public:
@@ -36,55 +127,261 @@ public:
 	DrumPattern()
 		{
 		name[0] = 0;
-/*			
-		for (int i = 0; i < NUM_TRACKS; i++)
+		length = STEPS_PER_PATTERN;
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
 			{
-			for (int j = 0; j < STEPS_PER_PATTERN; j++)
-				{
-				events[i][j].Init();
-				}
+			pages[p] = NULL;
+			triggerPages[p] = NULL;
 			}
-*/ 
+		ClearMasks();
+		InvalidateTriggers();
 		};
 
+	DrumPattern(const DrumPattern& pattern)
+		{
+		strcpy(name, pattern.name);
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			pages[p] = NULL;
+			triggerPages[p] = NULL;
+			}
+		ClearMasks();
+		CopyFrom(&pattern);
+		}
+
+	~DrumPattern()
+		{
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			if (pages[p])
+				delete pages[p];
+			if (triggerPages[p])
+				delete triggerPages[p];
+			}
+		}
+
+	DrumPattern& operator=(const DrumPattern& pattern)
+		{
+		if (this != &pattern)
+			{
+			strcpy(name, pattern.name);
+			CopyFrom(&pattern);
+			}
+		return *this;
+		}
+
 	void Clear()
 		{
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			if (pages[p])
+				ClearPage(p);
+			}
+		ClearMasks();
+		InvalidateTriggers();
+		}
+
+	// Copy events and length (but not name) from another pattern
+	void CopyFrom(const DrumPattern* pattern)
+		{
+		length = pattern->length;
 		for (int i = 0; i < NUM_TRACKS; i++)
 			{
-			for (int j = 0; j < STEPS_PER_PATTERN; j++)
-				{
-				events[i][j].Init();
-				}
+			noteMask[i] = pattern->noteMask[i];
+			cutMask[i] = pattern->cutMask[i];
 			}
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			if (pattern->pages[p])
+				*GetPage(p) = *pattern->pages[p];
+			else if (pages[p])
+				ClearPage(p);
+			}
+		InvalidateTriggers();
 		}
-		
-	void CopyFrom(DrumPattern* pattern)
+
+	// Compare pattern name, length and events with another pattern
+	bool IsSameAs(const DrumPattern* pattern) const
 		{
+		return (0 == strcmp(name, pattern->name) && HasSameEvents(pattern));
+		}
+
+	// Compare length and events (but not name) with another pattern
+	bool HasSameEvents(const DrumPattern* pattern) const
+		{
+		if (length != pattern->length)
+			return false;
 		for (int i = 0; i < NUM_TRACKS; i++)
 			{
-			for (int j = 0; j < STEPS_PER_PATTERN; j++)
+			if (noteMask[i] != pattern->noteMask[i] || cutMask[i] != pattern->cutMask[i])
+				return false;
+			}
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			if (!pages[p] && !pattern->pages[p])
+				continue;
+			for (int i = 0; i < NUM_TRACKS; i++)
 				{
-				events[i][j].CopyFrom(&pattern->events[i][j]);
+				for (int j = p * STEPS_PER_PAGE; j < (p + 1) * STEPS_PER_PAGE; j++)
+					{
+					if (!GetEvent(i, j)->IsSameAs(pattern->GetEvent(i, j)))
+						return false;
+					}
 				}
 			}
+		return true;
+		}
+
+	// Pattern length (in steps)
+	int GetLength() const
+		{
+		return length;
+		}
+
+	void SetLength(int steps)
+		{
+		if (steps < 1)
+			steps = 1;
+		else if (steps > MAX_STEPS_PER_PATTERN)
+			steps = MAX_STEPS_PER_PATTERN;
+		length = (unsigned char)steps;
+		}
+
+	// Mask of the steps inside the pattern length
+	StepMask GetLengthMask() const
+		{
+		return (length >= MAX_STEPS_PER_PATTERN) ? ~(StepMask)0 : STEP_BIT(length) - 1;
+		}
+
+	// Step bitsets of a track
+	StepMask GetNoteMask(int track) const
+		{
+		return noteMask[track];
+		}
+
+	StepMask GetCutMask(int track) const
+		{
+		return cutMask[track];
+		}
+
+	// Steps that have an event (note or cut) on any track
+	StepMask GetUsedSteps() const
+		{
+		StepMask used = 0;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			used |= noteMask[i] | cutMask[i];
+		return used;
+		}
+
+	// Does the page containing this step have any storage?
+	// (if not, all events in it are empty)
+	bool HasPage(int page) const
+		{
+		return (NULL != pages[page]);
+		}
+
+	// Allocate the pages inside the pattern length, and their trigger lists
+	// (so that another thread can write and play events without allocating,
+	// eg: live recording)
+	void AllocatePages()
+		{
+		for (int p = 0; p < (length + STEPS_PER_PAGE - 1) / STEPS_PER_PAGE; p++)
+			GetPage(p);
+		}
+
+	// Memory used by the allocated event pages (bytes)
+	int GetPageMemory() const
+		{
+		int bytes = 0;
+		for (int p = 0; p < MAX_PATTERN_PAGES; p++)
+			{
+			if (pages[p])
+				bytes += sizeof(DrumPatternPage);
+			}
+		return bytes;
+		}
+
+	// Get event (read only) - empty pages return an empty event
+	const DrumEvent* GetEvent(int track, int step) const
+		{
+		static const DrumEvent emptyEvent;
+		const DrumPatternPage* page = pages[step / STEPS_PER_PAGE];
+		if (!page)
+			return &emptyEvent;
+		return &page->events[track][step % STEPS_PER_PAGE];
+		}
+
+	unsigned char GetVol(int track, int step) const
+		{
+		return GetEvent(track, step)->vol;
+		}
+
+	// Set event data (allocates page if neccessary)
+	void SetEvent(int track, int step, const DrumEvent* event)
+		{
+		if (!pages[step / STEPS_PER_PAGE] && 0 == event->vol)
+			return;			// nothing to do
+		GetPage(step / STEPS_PER_PAGE)->events[track][step % STEPS_PER_PAGE].CopyFrom(event);
+		UpdateMasks(track, step, event->vol);
+		}
+
+	void SetVol(int track, int step, unsigned char vol)
+		{
+		if (!pages[step / STEPS_PER_PAGE] && 0 == vol)
+			return;			// nothing to do
+		GetPage(step / STEPS_PER_PAGE)->events[track][step % STEPS_PER_PAGE].vol = vol;
+		UpdateMasks(track, step, vol);
 		}
 
+	void SetOffset(int track, int step, unsigned char offset)
+		{
+		if (offset >= TICKS_PER_STEP)
+			offset = TICKS_PER_STEP - 1;
+		GetPage(step / STEPS_PER_PAGE)->events[track][step % STEPS_PER_PAGE].offset = offset;
+		triggersDirty[step] = 1;
+		}
+
+	void ClearEvent(int track, int step)
+		{
+		DrumPatternPage* page = pages[step / STEPS_PER_PAGE];
+		if (page)
+			page->events[track][step % STEPS_PER_PAGE].Init();
+		UpdateMasks(track, step, 0);
+		}
+
+	// Bulk track operations (see pattern.cpp)
+	// These only affect the steps inside the pattern length.
+	void ClearTrack(int track);
+	void FillTrack(int track, int every, unsigned char vol);
+	void EuclidTrack(int track, int pulses, unsigned char vol);
+	void RotateTrack(int track, int steps);
+	void ShiftTrack(int track, int steps);
+	void AndTrack(int track, int otherTrack);
+	void OrTrack(int track, int otherTrack);
+	int FindNextEvent(int track, int step) const;
+
+	// Playback (play thread only)
+	const StepTriggerList* GetTriggers(int step, const TriggerMix* mix);
+
+	// Read / write pattern in v1.2 song file format (first STEPS_PER_PATTERN
+	// steps, vol and pan only). Length, extra steps and micro-timing are
+	// stored in the song file's "PATX" extension chunk.
 	bool Read(FILE* pfile)
 		{
 		fread(&name, PATTERN_NAME_LENGTH * sizeof(char), 1, pfile);
+		Clear();
+		length = STEPS_PER_PATTERN;
 		for (int i = 0; i < NUM_TRACKS; i++)
 			{
 			for (int j = 0; j < STEPS_PER_PATTERN; j++)
 				{
-				unsigned char vol;
-				unsigned char pan;
-				fread(&vol, sizeof(char), 1, pfile);
-				fread(&pan, sizeof(char), 1, pfile);
-				events[i][j].vol = vol;
-				events[i][j].pan = pan;
+				DrumEvent event;
+				fread(&event.vol, sizeof(char), 1, pfile);
+				fread(&event.pan, sizeof(char), 1, pfile);
+				SetEvent(i, j, &event);
 				}
 			}
-			
+
 		return true;
 		}
 
@@ -95,16 +392,79 @@ public:
 			{
 			for (int j = 0; j < STEPS_PER_PATTERN; j++)
 				{
-				unsigned char vol = events[i][j].vol;
-				unsigned char pan = events[i][j].pan;
+				unsigned char vol = GetEvent(i, j)->vol;
+				unsigned char pan = GetEvent(i, j)->pan;
 				fwrite(&vol, sizeof(char), 1, pfile);
 				fwrite(&pan, sizeof(char), 1, pfile);
 				}
 			}
-			
+
 		}
 
 	char name[PATTERN_NAME_LENGTH];
-	DrumEvent events[NUM_TRACKS][STEPS_PER_PATTERN];
-	
+
+private:
+	DrumPatternPage* GetPage(int page)
+		{
+		if (!pages[page])
+			{
+			// (with the page's trigger lists, so the play thread never
+			// allocates - see GetTriggers())
+			if (!triggerPages[page])
+				triggerPages[page] = new StepTriggerPage;
+			pages[page] = new DrumPatternPage;
+			}
+		return pages[page];
+		}
+
+	void ClearMasks()
+		{
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			noteMask[i] = 0;
+			cutMask[i] = 0;
+			}
+		}
+
+	void UpdateMasks(int track, int step, unsigned char vol)
+		{
+		noteMask[track] &= ~STEP_BIT(step);
+		cutMask[track] &= ~STEP_BIT(step);
+		if (vol > 1)
+			noteMask[track] |= STEP_BIT(step);
+		else if (1 == vol)
+			cutMask[track] |= STEP_BIT(step);
+		triggersDirty[step] = 1;
+		}
+
+	void InvalidateTriggers()
+		{
+		for (int i = 0; i < MAX_STEPS_PER_PATTERN; i++)
+			triggersDirty[i] = 1;
+		}
+
+	void CompileTriggers(int step, StepTriggerList* list);
+
+	void MoveTrackEvents(int track, StepMask steps, int distance, bool wrap);
+
+	void ClearPage(int page)
+		{
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			for (int j = 0; j < STEPS_PER_PAGE; j++)
+				{
+				pages[page]->events[i][j].Init();
+				}
+			}
+		}
+
+	unsigned char length;						// pattern length in steps
+	DrumPatternPage* pages[MAX_PATTERN_PAGES];	// event pages (NULL = empty)
+	StepMask noteMask[NUM_TRACKS];				// steps with a note on (vol > 1)
+	StepMask cutMask[NUM_TRACKS];				// steps with a note cut (vol = 1)
+
+	// compiled step triggers (playback)
+	StepTriggerPage* triggerPages[MAX_PATTERN_PAGES];
+	volatile unsigned char triggersDirty[MAX_STEPS_PER_PATTERN];	// step needs recompiling
+	TriggerMix triggerMix;						// mix the triggers were compiled with
 };
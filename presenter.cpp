@@ -0,0 +1,198 @@
+/*
+ *      presenter.cpp
+ *
+ *      Dirty rectangle screen updates for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "platform.h"
+#include "presenter.h"
+
+/// Do two rects overlap (or touch)?
+static bool RectsTouch(const SDL_Rect& a, const SDL_Rect& b)
+{
+	return (a.x <= b.x + b.w && b.x <= a.x + a.w && a.y <= b.y + b.h && b.y <= a.y + a.h);
+}
+
+/// Do two rects overlap?
+static bool RectsOverlap(const SDL_Rect& a, const SDL_Rect& b)
+{
+	return (a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h);
+}
+
+/// Grow a rect to include another rect
+static void UnionRect(SDL_Rect& a, const SDL_Rect& b)
+{
+	int x1 = (a.x < b.x) ? a.x : b.x;
+	int y1 = (a.y < b.y) ? a.y : b.y;
+	int x2 = (a.x + a.w > b.x + b.w) ? a.x + a.w : b.x + b.w;
+	int y2 = (a.y + a.h > b.y + b.h) ? a.y + a.h : b.y + b.h;
+	a.x = x1;
+	a.y = y1;
+	a.w = x2 - x1;
+	a.h = y2 - y1;
+}
+
+// constructor
+ScreenPresenter::ScreenPresenter()
+{
+	m_numDirty = 0;
+	m_allDirty = true;
+	m_lastArea = 0;
+	for (int i = 0; i < OV_MAX; i++)
+		{
+		m_overlays[i].visible = false;
+		m_overlays[i].key = 0;
+		m_overlays[i].needsDraw = false;
+		m_prevOverlays[i] = m_overlays[i];
+		}
+}
+
+/// Mark an area of the background as changed
+/// @param rect			Changed area (is clipped to the screen)
+void ScreenPresenter::MarkDirty(const SDL_Rect& rect)
+{
+	AddRect(rect);
+}
+
+/// Mark the whole screen as changed (eg: after a dialog was shown)
+void ScreenPresenter::MarkAllDirty()
+{
+	m_allDirty = true;
+	m_numDirty = 0;
+}
+
+/// Set the state of an overlay for this frame
+/// @param overlay		Overlay (OV_xxx)
+/// @param rect			Screen area of the overlay (NULL = not shown)
+/// @param key			Anything else that changes the look of the overlay
+void ScreenPresenter::SetOverlay(int overlay, const SDL_Rect* rect, int key)
+{
+	OverlayState* state = &m_overlays[overlay];
+	state->visible = (NULL != rect);
+	if (rect)
+		state->rect = *rect;
+	state->key = key;
+	state->needsDraw = false;
+
+	// moved / changed / hidden? (old area must be restored)
+	const OverlayState* prev = &m_prevOverlays[overlay];
+	bool changed = (state->visible != prev->visible || state->key != prev->key);
+	if (state->visible && prev->visible)
+		{
+		if (state->rect.x != prev->rect.x || state->rect.y != prev->rect.y ||
+			state->rect.w != prev->rect.w || state->rect.h != prev->rect.h)
+			changed = true;
+		}
+	if (changed)
+		{
+		if (prev->visible)
+			AddRect(prev->rect);
+		if (state->visible)
+			AddRect(state->rect);
+		}
+}
+
+/// Copy the dirty areas of the background to the screen, and work out
+/// which overlays have to be (re)drawn
+/// @param background	Background buffer
+/// @param screen		Screen surface
+void ScreenPresenter::RestoreBackground(SDL_Surface* background, SDL_Surface* screen)
+{
+	if (m_allDirty)
+		{
+		SDL_BlitSurface(background, NULL, screen, NULL);
+		}
+	else
+		{
+		for (int i = 0; i < m_numDirty; i++)
+			{
+			SDL_Rect src = m_dirty[i];
+			SDL_Rect dest = m_dirty[i];
+			SDL_BlitSurface(background, &src, screen, &dest);
+			}
+		}
+
+	// overlays that touch a restored area must be redrawn (in drawing order,
+	// and a redrawn overlay can in turn cover the ones above it)
+	for (int i = 0; i < OV_MAX; i++)
+		{
+		OverlayState* state = &m_overlays[i];
+		if (!state->visible)
+			continue;
+		bool redraw = m_allDirty;
+		for (int j = 0; j < m_numDirty && !redraw; j++)
+			redraw = RectsOverlap(state->rect, m_dirty[j]);
+		if (redraw)
+			{
+			state->needsDraw = true;
+			if (!m_allDirty)
+				AddRect(state->rect);
+			}
+		}
+}
+
+/// Send the changed areas to the display
+/// @param screen		Screen surface
+void ScreenPresenter::Present(SDL_Surface* screen)
+{
+	if (m_allDirty)
+		{
+		SDL_UpdateRect(screen, 0, 0, 0, 0);
+		m_lastArea = VIEW_WIDTH * VIEW_HEIGHT;
+		}
+	else
+		{
+		if (m_numDirty > 0)
+			SDL_UpdateRects(screen, m_numDirty, m_dirty);
+		m_lastArea = 0;
+		for (int i = 0; i < m_numDirty; i++)
+			m_lastArea += m_dirty[i].w * m_dirty[i].h;
+		}
+
+	m_numDirty = 0;
+	m_allDirty = false;
+	for (int i = 0; i < OV_MAX; i++)
+		m_prevOverlays[i] = m_overlays[i];
+}
+
+/// Add a rect to the dirty list (merging it with any rect it touches)
+void ScreenPresenter::AddRect(SDL_Rect rect)
+{
+	if (m_allDirty)
+		return;
+
+	// clip to screen
+	int x1 = (rect.x < 0) ? 0 : rect.x;
+	int y1 = (rect.y < 0) ? 0 : rect.y;
+	int x2 = (rect.x + rect.w > VIEW_WIDTH) ? VIEW_WIDTH : rect.x + rect.w;
+	int y2 = (rect.y + rect.h > VIEW_HEIGHT) ? VIEW_HEIGHT : rect.y + rect.h;
+	if (x2 <= x1 || y2 <= y1)
+		return;
+	rect.x = x1;
+	rect.y = y1;
+	rect.w = x2 - x1;
+	rect.h = y2 - y1;
+
+	// merge with existing rects (the merged rect may now touch others)
+	for (int i = 0; i < m_numDirty; i++)
+		{
+		if (RectsTouch(rect, m_dirty[i]))
+			{
+			UnionRect(rect, m_dirty[i]);
+			m_dirty[i] = m_dirty[m_numDirty - 1];
+			m_numDirty--;
+			i = -1;
+			}
+		}
+
+	if (m_numDirty >= PRESENTER_MAX_RECTS)
+		{
+		MarkAllDirty();
+		return;
+		}
+	m_dirty[m_numDirty++] = rect;
+}
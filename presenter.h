@@ -0,0 +1,68 @@
+// xdrum screen presenter (dirty rectangle screen updates)
+//
+// The panels are drawn to the background buffer, and whatever draws to it
+// marks the changed area as dirty. Things that are drawn straight onto the
+// screen every frame (mouse cursor, grid cursor, playback bar, ...) are
+// "overlays". Each frame, only the dirty areas are copied from the
+// background to the screen, only the overlays that changed or were drawn
+// over are redrawn, and only those areas are sent to the display (with
+// SDL_UpdateRects()). If nothing changed, nothing is drawn.
+// Needs SDL.h included first.
+
+#define PRESENTER_MAX_RECTS		32			// more dirty rects than this = update whole screen
+
+// overlays (in drawing order)
+enum OVERLAYS { OV_BEATFLASH = 0,
+				OV_GRIDCURSOR,
+				OV_PLAYBAR,
+				OV_LEVEL,
+				OV_METRICS,
+				OV_MOUSE,
+				OV_MAX
+};
+
+/// Tracks damaged screen areas and updates only them
+/// Usage (every frame):
+///   MarkDirty() (while drawing the background) - SetOverlay() (for each overlay) -
+///   RestoreBackground() - draw the overlays where NeedsDraw() - Present()
+class ScreenPresenter
+{
+public:
+	// constructor
+	ScreenPresenter();
+
+	// background damage
+	void MarkDirty(const SDL_Rect& rect);
+	void MarkAllDirty();
+
+	// overlays
+	void SetOverlay(int overlay, const SDL_Rect* rect, int key);
+	bool NeedsDraw(int overlay) const { return m_overlays[overlay].needsDraw; }
+
+	// frame update
+	void RestoreBackground(SDL_Surface* background, SDL_Surface* screen);
+	void Present(SDL_Surface* screen);
+	bool HasChanges() const { return (m_allDirty || m_numDirty > 0); }
+	int GetLastArea() const { return m_lastArea; }			// pixels sent by the last Present()
+
+private:
+	/// State of an overlay in a frame
+	class OverlayState
+	{
+	public:
+		bool visible;
+		SDL_Rect rect;
+		int key;						// identifies the look of the overlay (eg: colour)
+		bool needsDraw;
+	};
+
+	void AddRect(SDL_Rect rect);
+
+	SDL_Rect m_dirty[PRESENTER_MAX_RECTS];
+	int m_numDirty;
+	bool m_allDirty;
+	int m_lastArea;
+
+	OverlayState m_overlays[OV_MAX];		// overlays this frame
+	OverlayState m_prevOverlays[OV_MAX];	// overlays as on the screen
+};
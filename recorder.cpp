@@ -0,0 +1,216 @@
+/*
+ *      recorder.cpp
+ *
+ *      Live step recording of pad hits into a pattern for xdrum
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "SDL.h"
+#include "platform.h"
+#include "spscqueue.h"
+#include "pattern.h"
+#include "recorder.h"
+
+// constructor
+LiveRecorder::LiveRecorder()
+{
+	m_pattern = NULL;
+	m_mode = RM_MERGE;
+	m_take = 0;
+	m_busy = false;
+	m_lastTake = 0;
+	for (int i = 0; i < NUM_TRACKS; i++)
+		{
+		m_skipMask[i] = 0;
+		m_keepMask[i] = 0;
+		m_replaceSteps[i] = 0;
+		}
+}
+
+/// Start recording into a pattern
+/// @param pattern			Pattern to record into
+void LiveRecorder::Start(DrumPattern* pattern)
+{
+	if (!pattern)
+		return;
+
+	// the play thread must never allocate pages while recording
+	pattern->AllocatePages();
+	m_take++;
+	__sync_synchronize();
+	m_pattern = pattern;
+}
+
+/// Stop recording (hits still in the queue are dropped)
+/// Waits for the play thread to finish the tick it is on, so that the
+/// pattern is not written to after this returns.
+void LiveRecorder::Stop()
+{
+	m_pattern = NULL;
+	__sync_synchronize();
+	while (m_busy)
+		SDL_Delay(1);
+}
+
+/// Queue a live pad hit to be recorded (UI thread)
+/// @param track			Track hit
+/// @param vol				Event volume (64 = note, 127 = accent)
+/// @param timeNs			Time of the hit (HrTimeNanos() time)
+/// @return					false if not recording, or the queue is full
+bool LiveRecorder::AddHit(int track, int vol, Uint64 timeNs)
+{
+	if (!m_pattern)
+		return false;
+
+	RecordHit hit;
+	hit.track = (unsigned char)track;
+	hit.vol = (unsigned char)vol;
+	hit.time = timeNs;
+	return m_queue.Push(hit);
+}
+
+/// Record the queued hits, and clear replaced notes (play thread, on every
+/// tick, before the tick's notes are played)
+/// @param pattern			Pattern being played
+/// @param tick				Tick being played (transport.patternPos)
+/// @param tickTime			Time the tick is due
+/// @param intervalNs		Time between ticks
+/// @param quantise			Live quantise (ticks, 0 = off - see transport.liveQuantise)
+void LiveRecorder::ProcessTick(DrumPattern* pattern, int tick, Uint64 tickTime, Uint64 intervalNs, int quantise)
+{
+	m_busy = true;
+	__sync_synchronize();
+
+	// new take? (forget the last take's steps)
+	if (m_take != m_lastTake)
+		{
+		m_lastTake = m_take;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			{
+			m_skipMask[i] = 0;
+			m_keepMask[i] = 0;
+			m_replaceSteps[i] = 0;
+			}
+		}
+
+	// only record while the pattern being recorded is playing
+	DrumPattern* target = m_pattern;
+	bool recording = (target && target == pattern && intervalNs > 0);
+	int patternTicks = pattern ? pattern->GetLength() * TICKS_PER_STEP : 0;
+
+	RecordHit hit;
+	while (m_queue.Pop(&hit))
+		{
+		if (!recording)
+			continue;
+
+		// ticks from this tick to the tick the hit was heard on
+		Sint64 since = (Sint64)(hit.time - tickTime);
+		Sint64 n;
+		if (quantise > 0)
+			{
+			// heard on the next quantised tick (see AudioEngine::QuantiseTime())
+			n = (since > 0) ? (since + (Sint64)intervalNs - 1) / (Sint64)intervalNs : 0;
+			int rem = (int)((tick + n) % quantise);
+			if (rem > 0)
+				n += quantise - rem;
+			}
+		else
+			{
+			// nearest tick
+			n = (since + ((since < 0) ? -(Sint64)intervalNs : (Sint64)intervalNs) / 2) / (Sint64)intervalNs;
+			}
+
+		// too old? (eg: made just before playback stopped)
+		if (n < -2 * TICKS_PER_STEP)
+			continue;
+
+		// loop over the pattern
+		int hitTick = (int)(((tick + n) % patternTicks + patternTicks) % patternTicks);
+		RecordHitAt(pattern, hit, hitTick, tick);
+		}
+
+	// on a step? (forget old skips, and clear the step of tracks being replaced)
+	if (pattern && patternTicks > 0 && 0 == (tick % TICKS_PER_STEP))
+		{
+		int length = pattern->GetLength();
+		int step = tick / TICKS_PER_STEP;
+		// triggers are played at most 2 steps after their step
+		int oldStep = (step + length - 2) % length;
+		for (int i = 0; i < NUM_TRACKS; i++)
+			m_skipMask[i] &= ~STEP_BIT(oldStep);
+		if (recording)
+			ClearReplacedStep(pattern, step);
+		}
+
+	__sync_synchronize();
+	m_busy = false;
+}
+
+/// Should the sequencer skip a trigger, because it was recorded from a hit
+/// that has already been heard? (play thread)
+/// @param track			Track of the trigger
+/// @param step				Step of the trigger
+/// @return					true to skip it (only once)
+bool LiveRecorder::SkipTrigger(int track, int step)
+{
+	if (!(m_skipMask[track] & STEP_BIT(step)))
+		return false;
+
+	m_skipMask[track] &= ~STEP_BIT(step);
+	return true;
+}
+
+/// Write a hit into the pattern
+/// @param pattern			Pattern to write to
+/// @param hit				Hit to write
+/// @param hitTick			Pattern tick it was heard on
+/// @param tick				Tick being played
+void LiveRecorder::RecordHitAt(DrumPattern* pattern, const RecordHit& hit, int hitTick, int tick)
+{
+	int step = hitTick / TICKS_PER_STEP;
+	if (!pattern->HasPage(step / STEPS_PER_PAGE))
+		return;					// pattern made longer while recording
+
+	DrumEvent event;
+	event.CopyFrom(pattern->GetEvent(hit.track, step));
+	event.vol = hit.vol;
+	event.offset = (unsigned char)(hitTick % TICKS_PER_STEP);
+	pattern->SetEvent(hit.track, step, &event);
+
+	// Don't play it again if the sequencer may still reach it this pass.
+	// (hits are recorded at most a step ahead of the playhead, and triggers
+	// can be delayed into the next step)
+	int length = pattern->GetLength();
+	int stepsBehind = (tick / TICKS_PER_STEP - step + length) % length;
+	if (stepsBehind < 2 || stepsBehind == length - 1)
+		m_skipMask[hit.track] |= STEP_BIT(step);
+
+	if (RM_REPLACE == m_mode)
+		{
+		// first hit on this track? (replace its notes for one pass)
+		if (0 == m_replaceSteps[hit.track] && 0 == m_keepMask[hit.track])
+			m_replaceSteps[hit.track] = length;
+		m_keepMask[hit.track] |= STEP_BIT(step);
+		}
+}
+
+/// Clear a step of the tracks being replaced (unless it was just recorded)
+/// @param pattern			Pattern being recorded into
+/// @param step				Step the playhead has reached
+void LiveRecorder::ClearReplacedStep(DrumPattern* pattern, int step)
+{
+	for (int i = 0; i < NUM_TRACKS; i++)
+		{
+		if (0 == m_replaceSteps[i])
+			continue;
+
+		if (!(m_keepMask[i] & STEP_BIT(step)))
+			pattern->ClearEvent(i, step);
+		m_replaceSteps[i]--;
+		if (0 == m_replaceSteps[i])
+			m_keepMask[i] = 0;
+		}
+}
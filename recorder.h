@@ -0,0 +1,69 @@
+// xdrum live step recorder
+//
+// Records live pad hits (keys 1 to 8, or controller buttons mapped to them)
+// into a pattern while it plays, looping over the pattern.
+// The UI thread only queues the hits (with the time they were made) on a
+// lock-free queue, like the audio engine's commands. The play thread takes
+// them off the queue on each tick, works out the tick they were heard on
+// (relative to transport.patternPos) and writes them into the pattern, so
+// recording never blocks playback, and the pattern is only written by one
+// thread while recording (the UI stops recording before it edits the
+// pattern itself, or lets a remote command edit it).
+// In merge mode, hits are added to the notes already in the pattern. In
+// replace mode, once a track is played, its old notes are cleared as the
+// playhead passes them (for one pass of the pattern).
+// Needs SDL.h, spscqueue.h and pattern.h included first.
+
+#define RECORD_QUEUE_SIZE		32			// hits (power of 2)
+
+/// A live pad hit to be recorded
+class RecordHit
+{
+public:
+	unsigned char track;
+	unsigned char vol;						// event volume (64 = note, 127 = accent)
+	Uint64 time;							// time of the hit (HrTimeNanos() time)
+};
+
+/// Lock-free queue of hits
+typedef SpscQueue<RecordHit, RECORD_QUEUE_SIZE> RecordQueue;
+
+/// Live step recorder
+class LiveRecorder
+{
+public:
+	// record mode
+	enum RECORD_MODE { RM_MERGE = 0, RM_REPLACE = 1 };
+
+	// constructor
+	LiveRecorder();
+
+	// UI thread
+	void Start(DrumPattern* pattern);
+	void Stop();
+	bool IsRecording() const { return (NULL != m_pattern); }
+	const DrumPattern* GetPattern() const { return m_pattern; }
+	void SetMode(RECORD_MODE mode) { m_mode = mode; }
+	RECORD_MODE GetMode() const { return m_mode; }
+	bool AddHit(int track, int vol, Uint64 timeNs);
+
+	// play thread
+	void ProcessTick(DrumPattern* pattern, int tick, Uint64 tickTime, Uint64 intervalNs, int quantise);
+	bool SkipTrigger(int track, int step);
+
+private:
+	void RecordHitAt(DrumPattern* pattern, const RecordHit& hit, int hitTick, int tick);
+	void ClearReplacedStep(DrumPattern* pattern, int step);
+
+	DrumPattern* volatile m_pattern;		// pattern being recorded into (NULL = not recording)
+	volatile RECORD_MODE m_mode;
+	volatile unsigned int m_take;			// incremented when recording starts
+	volatile bool m_busy;					// play thread is in ProcessTick()
+	RecordQueue m_queue;
+
+	// play thread only
+	unsigned int m_lastTake;				// take the masks below belong to
+	StepMask m_skipMask[NUM_TRACKS];		// recorded steps not to play again (already heard live)
+	StepMask m_keepMask[NUM_TRACKS];		// steps recorded during the replace pass
+	int m_replaceSteps[NUM_TRACKS];			// steps of the track still to be cleared (replace mode)
+};
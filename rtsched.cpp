@@ -0,0 +1,234 @@
+/*
+ *      rtsched.cpp
+ *
+ *      Real-time scheduling and memory locking for the xdrum audio path
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "SDL.h"
+#include "platform.h"
+#include "rtsched.h"
+
+#ifdef __linux__
+	#include <errno.h>
+	#include <pthread.h>
+	#include <sched.h>
+	#include <sys/mman.h>
+	#include <sys/resource.h>
+#endif
+
+// constructor
+RealtimeMode::RealtimeMode()
+{
+	m_enabled = false;
+	m_policy = RP_FIFO;
+	m_priority = RT_DEFAULT_PRIORITY;
+	m_problems = false;
+	m_lockFailed = false;
+	m_report[0] = 0;
+	for (int i = 0; i < RT_MAX_THREADS; i++)
+		{
+		m_promotions[i].done = false;
+		m_promotions[i].reported = false;
+		}
+	m_numPromotions = 0;
+}
+
+/// Turn on real-time mode (before the audio and play threads are started)
+/// @param policy			Scheduling policy (RP_FIFO or RP_RR)
+/// @param priority			Real-time priority (1 to 99 on Linux)
+void RealtimeMode::Enable(RT_POLICY policy, int priority)
+{
+	m_enabled = true;
+	m_policy = policy;
+	m_priority = priority;
+}
+
+/// Check that we are allowed to use real-time scheduling (by trying it on
+/// the calling thread, then putting it back)
+/// @return					false if real-time scheduling is not available
+bool RealtimeMode::CheckPrivileges()
+{
+	if (!m_enabled)
+		return false;
+
+#ifdef __linux__
+	int policy = (RP_RR == m_policy) ? SCHED_RR : SCHED_FIFO;
+	int minPriority = sched_get_priority_min(policy);
+	int maxPriority = sched_get_priority_max(policy);
+	if (m_priority < minPriority || m_priority > maxPriority)
+		{
+		Report(true, "Real-time priority %d out of range (%d to %d), using %d\n",
+				m_priority, minPriority, maxPriority, RT_DEFAULT_PRIORITY);
+		m_priority = RT_DEFAULT_PRIORITY;
+		}
+
+	int oldPolicy;
+	struct sched_param oldParam;
+	pthread_getschedparam(pthread_self(), &oldPolicy, &oldParam);
+	struct sched_param param;
+	param.sched_priority = m_priority;
+	int err = pthread_setschedparam(pthread_self(), policy, &param);
+	if (0 != err)
+		{
+		struct rlimit limit;
+		getrlimit(RLIMIT_RTPRIO, &limit);
+		Report(true, "No real-time scheduling: %s\n(rtprio limit is %d - need root, CAP_SYS_NICE\nor an rtprio limit of %d in limits.conf)\n",
+				strerror(err), (int)limit.rlim_cur, m_priority);
+		return false;
+		}
+	pthread_setschedparam(pthread_self(), oldPolicy, &oldParam);
+	return true;
+#else
+	Report(true, "Real-time mode is not supported on this platform\n");
+	return false;
+#endif
+}
+
+/// Make the calling thread real-time, and prefault its stack
+/// Safe to call from the audio callback: it does no I/O, the result is
+/// reported later by ReportPromotions().
+/// @param threadName		Name of the thread (for the report - must stay valid)
+/// @return					false if the thread could not be made real-time
+bool RealtimeMode::PromoteCurrentThread(const char* threadName)
+{
+	if (!m_enabled)
+		return false;
+
+	PrefaultStack();
+
+#ifdef __linux__
+	int policy = (RP_RR == m_policy) ? SCHED_RR : SCHED_FIFO;
+	struct sched_param param;
+	param.sched_priority = m_priority;
+	int err = pthread_setschedparam(pthread_self(), policy, &param);
+
+	int slot = __sync_fetch_and_add(&m_numPromotions, 1);
+	if (slot < RT_MAX_THREADS)
+		{
+		RealtimePromotion* promotion = &m_promotions[slot];
+		promotion->threadName = threadName;
+		promotion->error = err;
+		__sync_synchronize();			// result must be written before it is published
+		promotion->done = true;
+		}
+	return (0 == err);
+#else
+	return false;
+#endif
+}
+
+/// Report the threads made real-time (or not) since the last call
+/// (UI thread)
+void RealtimeMode::ReportPromotions()
+{
+	int count = (m_numPromotions < RT_MAX_THREADS) ? m_numPromotions : RT_MAX_THREADS;
+	for (int i = 0; i < count; i++)
+		{
+		RealtimePromotion* promotion = &m_promotions[i];
+		if (!promotion->done || promotion->reported)
+			continue;
+
+		__sync_synchronize();
+		promotion->reported = true;
+		const char* policy = (RP_RR == m_policy) ? "SCHED_RR" : "SCHED_FIFO";
+		if (0 != promotion->error)
+			Report(true, "%s thread: unable to set %s priority %d (%s)\n", promotion->threadName,
+					policy, m_priority, strerror(promotion->error));
+		else
+			Report(false, "%s thread: %s priority %d\n", promotion->threadName, policy, m_priority);
+		}
+}
+
+/// Lock all the memory the program is using now into RAM
+/// (code, static data, heap and the main thread's stack)
+/// @return					false if the memory could not be locked
+bool RealtimeMode::LockAllMemory()
+{
+	if (!m_enabled)
+		return false;
+
+#ifdef __linux__
+	// NB: not MCL_FUTURE - with a memlock limit, later allocations would fail
+	if (0 != mlockall(MCL_CURRENT))
+		{
+		struct rlimit limit;
+		getrlimit(RLIMIT_MEMLOCK, &limit);
+		Report(true, "Unable to lock program memory: %s\n(memlock limit is %luKB - need root, CAP_IPC_LOCK\nor a bigger memlock limit in limits.conf)\n",
+				strerror(errno), (unsigned long)(limit.rlim_cur / 1024));
+		return false;
+		}
+	Report(false, "Program memory locked\n");
+	return true;
+#else
+	return false;
+#endif
+}
+
+/// Lock a buffer (eg: a drum sample) into RAM
+/// @param data				Start of the buffer
+/// @param length			Length of the buffer (bytes)
+/// @return					false if the buffer could not be locked
+bool RealtimeMode::LockBuffer(const void* data, unsigned int length)
+{
+	if (!m_enabled || !data || 0 == length)
+		return false;
+
+#ifdef __linux__
+	if (0 != mlock(data, length))
+		{
+		// only report the first failure
+		if (!m_lockFailed)
+			Report(true, "Unable to lock sample memory: %s\n", strerror(errno));
+		m_lockFailed = true;
+		return false;
+		}
+	return true;
+#else
+	return false;
+#endif
+}
+
+/// Unlock a buffer locked with LockBuffer() (before it is freed)
+void RealtimeMode::UnlockBuffer(const void* data, unsigned int length)
+{
+	if (!m_enabled || !data || 0 == length)
+		return;
+
+#ifdef __linux__
+	munlock(data, length);
+#endif
+}
+
+/// Touch (and lock) the stack the calling thread will use, so that it never
+/// page faults while it is running in real time
+void __attribute__((noinline)) RealtimeMode::PrefaultStack()
+{
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	for (int i = 0; i < RT_STACK_PREFAULT; i += 256)
+		stack[i] = 0;
+
+#ifdef __linux__
+	mlock((const void*)stack, RT_STACK_PREFAULT);
+#endif
+}
+
+/// Add a line to the report (and print it)
+/// @param problem			true if something could not be done
+void RealtimeMode::Report(bool problem, const char* format, ...)
+{
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	printf("Realtime: %s", line);
+	if (problem)
+		m_problems = true;
+	int len = (int)strlen(m_report);
+	strncat(m_report, line, RT_REPORT_LEN - 1 - len);
+}
@@ -0,0 +1,70 @@
+// xdrum real-time audio mode
+//
+// Opt-in (-rt command line option). The play (sequencer) thread and the SDL
+// audio thread are moved to a real-time scheduling class (SCHED_FIFO or
+// SCHED_RR), so that other programs on a busy host cannot delay them. The
+// drum samples and the rest of the program's memory are locked into RAM, and
+// the stacks of the real-time threads are prefaulted, so that the audio path
+// never has to wait for a page to be swapped in.
+// Needs root, CAP_SYS_NICE / CAP_IPC_LOCK, or rtprio / memlock limits (see
+// /etc/security/limits.conf). Without them, xdrum carries on as normal and
+// reports what it could not do.
+// A thread that makes itself real-time (eg: in the SDL audio callback) only
+// records the result - the UI thread reports it (see ReportPromotions()).
+// Only supported on Linux.
+
+#define RT_DEFAULT_PRIORITY		70
+#define RT_STACK_PREFAULT		(64 * 1024)		// bytes of stack to prefault per real-time thread
+#define RT_REPORT_LEN			512
+#define RT_MAX_THREADS			4				// threads that can be made real-time
+
+/// Result of making a thread real-time (written by the thread, reported
+/// by the UI thread)
+class RealtimePromotion
+{
+public:
+	const char* threadName;
+	int error;								// 0 = real-time
+	volatile bool done;						// result written
+	bool reported;
+};
+
+/// Real-time scheduling and memory locking for the audio path
+class RealtimeMode
+{
+public:
+	// scheduling policy
+	enum RT_POLICY { RP_FIFO = 0, RP_RR = 1 };
+
+	// constructor
+	RealtimeMode();
+
+	void Enable(RT_POLICY policy, int priority);
+	bool IsEnabled() const { return m_enabled; }
+	bool CheckPrivileges();
+
+	// call from the thread to be made real-time (no I/O)
+	bool PromoteCurrentThread(const char* threadName);
+	void ReportPromotions();
+
+	// memory locking
+	bool LockAllMemory();
+	bool LockBuffer(const void* data, unsigned int length);
+	void UnlockBuffer(const void* data, unsigned int length);
+
+	bool HasProblems() const { return m_problems; }
+	const char* GetReport() const { return m_report; }
+
+private:
+	void PrefaultStack();
+	void Report(bool problem, const char* format, ...);
+
+	bool m_enabled;
+	RT_POLICY m_policy;
+	int m_priority;
+	bool m_problems;
+	bool m_lockFailed;						// don't report every failed buffer lock
+	char m_report[RT_REPORT_LEN];
+	RealtimePromotion m_promotions[RT_MAX_THREADS];
+	volatile int m_numPromotions;
+};
@@ -77,6 +77,10 @@ void Song::Init()
 	BPM = 100;
 	pitch = 0;
 	strcpy(name, "<empty>");
+	seed = SONG_DEFAULT_SEED;
+	numTempoPoints = 0;
+	for (int i = 0; i < AUTOMATION_LANES; i++)
+		automation[i].numPoints = 0;
 	songPos = 0;
 	currentPatternIndex = 0;
 
@@ -104,6 +108,232 @@ void Song::Init()
 	// DrumPattern patterns[numPatterns]
 	// uint numTracks
 	// TrackMixInfo trackMixInfo[numTracks]
+	// Extension chunks (ignored by v1.2):
+	//    char[4] chunk id
+	//    uint chunk length
+	//    uchar data[chunk length]
+
+// Extension chunk "PATX" - pattern length, steps beyond STEPS_PER_PATTERN
+// and micro-timing, for each pattern that needs it:
+	// uchar patternIndex
+	// uchar length
+	// ushort numEvents
+	// numEvents x (uchar track, uchar step, uchar vol, uchar pan, uchar offset)
+
+// Extension chunk "SEED" - random seed for volrand / jitter:
+	// uint seed
+
+// Extension chunk "TMAP" - tempo changes (in sequence order):
+	// ushort numPoints
+	// numPoints x (uchar songPos, uchar step, uchar bpm, uchar ramp)
+
+// Extension chunk "AUTO" - mix automation, for each lane with points:
+	// uchar lane
+	// ushort numPoints
+	// numPoints x (uchar songPos, uchar step, uchar value)
+
+/// Start writing an extension chunk
+/// @return			File position of the chunk (for EndChunk())
+static long BeginChunk(FILE* pf, const char* id)
+{
+	long start = ftell(pf);
+	fwrite(id, 4, 1, pf);
+	fwriteInt(pf, 0);				// length (filled in by EndChunk())
+	return start;
+}
+
+/// Finish writing an extension chunk (fill in the chunk length)
+static void EndChunk(FILE* pf, long start)
+{
+	long end = ftell(pf);
+	fseek(pf, start + 4, SEEK_SET);
+	fwriteInt(pf, (int)(end - start - 8));
+	fseek(pf, end, SEEK_SET);
+}
+
+/// Does the event need to go in the PATX chunk?
+static bool IsExtendedEvent(const DrumEvent* event, int step)
+{
+	return (event->vol > 0 && (step >= STEPS_PER_PATTERN || event->offset > 0));
+}
+
+/// Write the extension chunks
+void Song::SaveExtensions(FILE* pfile)
+{
+	long chunk = BeginChunk(pfile, "PATX");
+	for (int i = 0; i < MAX_PATTERN; i++)
+		{
+		DrumPattern* pattern = &patterns[i];
+		int length = pattern->GetLength();
+		int numEvents = 0;
+		for (int track = 0; track < NUM_TRACKS; track++)
+			{
+			for (int step = 0; step < length; step++)
+				{
+				if (IsExtendedEvent(pattern->GetEvent(track, step), step))
+					numEvents++;
+				}
+			}
+
+		if (STEPS_PER_PATTERN == length && 0 == numEvents)
+			continue;
+
+		fputc(i, pfile);
+		fputc(length, pfile);
+		fwriteShort(pfile, (short)numEvents);
+		for (int track = 0; track < NUM_TRACKS; track++)
+			{
+			for (int step = 0; step < length; step++)
+				{
+				const DrumEvent* event = pattern->GetEvent(track, step);
+				if (IsExtendedEvent(event, step))
+					{
+					fputc(track, pfile);
+					fputc(step, pfile);
+					fputc(event->vol, pfile);
+					fputc(event->pan, pfile);
+					fputc(event->offset, pfile);
+					}
+				}
+			}
+		}
+	EndChunk(pfile, chunk);
+
+	chunk = BeginChunk(pfile, "SEED");
+	fwriteInt(pfile, (int)seed);
+	EndChunk(pfile, chunk);
+
+	if (numTempoPoints > 0)
+		{
+		chunk = BeginChunk(pfile, "TMAP");
+		fwriteShort(pfile, (short)numTempoPoints);
+		for (int i = 0; i < numTempoPoints; i++)
+			{
+			const TempoPoint* point = &tempoPoints[i];
+			fputc(point->songPos, pfile);
+			fputc(point->step, pfile);
+			fputc(point->bpm, pfile);
+			fputc(point->ramp, pfile);
+			}
+		EndChunk(pfile, chunk);
+		}
+
+	if (HasAutomation())
+		{
+		chunk = BeginChunk(pfile, "AUTO");
+		for (int lane = 0; lane < AUTOMATION_LANES; lane++)
+			{
+			const AutomationLane* automationLane = &automation[lane];
+			if (automationLane->IsEmpty())
+				continue;
+			fputc(lane, pfile);
+			fwriteShort(pfile, (short)automationLane->numPoints);
+			for (int i = 0; i < automationLane->numPoints; i++)
+				{
+				const AutomationPoint* point = &automationLane->points[i];
+				fputc(point->songPos, pfile);
+				fputc(point->step, pfile);
+				fputc(point->value, pfile);
+				}
+			}
+		EndChunk(pfile, chunk);
+		}
+}
+
+/// Read the extension chunks (if any)
+void Song::LoadExtensions(FILE* pfile)
+{
+	char id[4];
+	while (1 == fread(id, 4, 1, pfile))
+		{
+		int length = freadInt(pfile);
+		if (length < 0 || feof(pfile))
+			break;
+		long next = ftell(pfile) + length;
+
+		if (0 == memcmp(id, "PATX", 4))
+			{
+			// (a truncated or corrupt chunk stops at the end of the chunk
+			// or file - fgetc() gives -1 there)
+			while (ftell(pfile) + 4 <= next && !feof(pfile))
+				{
+				int index = fgetc(pfile);
+				int patternLength = fgetc(pfile);
+				int numEvents = (unsigned short)freadShort(pfile);
+				if (feof(pfile))
+					break;
+				DrumPattern tempPat;
+				DrumPattern* pattern = (index >= 0 && index < MAX_PATTERN) ? &patterns[index] : &tempPat;
+				pattern->SetLength(patternLength);
+				for (int i = 0; i < numEvents && ftell(pfile) + 5 <= next; i++)
+					{
+					int track = fgetc(pfile);
+					int step = fgetc(pfile);
+					DrumEvent event;
+					event.vol = fgetc(pfile);
+					event.pan = fgetc(pfile);
+					event.offset = fgetc(pfile);
+					if (feof(pfile))
+						break;
+					if (track >= 0 && track < NUM_TRACKS && step >= 0 && step < MAX_STEPS_PER_PATTERN)
+						pattern->SetEvent(track, step, &event);
+					}
+				}
+			}
+		else if (0 == memcmp(id, "SEED", 4) && length >= 4)
+			{
+			seed = (unsigned int)freadInt(pfile);
+			}
+		else if (0 == memcmp(id, "TMAP", 4) && length >= 2)
+			{
+			int numPoints = (unsigned short)freadShort(pfile);
+			for (int i = 0; i < numPoints && ftell(pfile) + 4 <= next; i++)
+				{
+				int pos = fgetc(pfile);
+				int step = fgetc(pfile);
+				int bpm = fgetc(pfile);
+				int ramp = fgetc(pfile);
+				SetTempoPoint(pos, step, bpm, (0 != ramp));
+				}
+			}
+		else if (0 == memcmp(id, "AUTO", 4))
+			{
+			// (stops at the end of the file, if the chunk is truncated)
+			while (ftell(pfile) + 3 <= next && !feof(pfile))
+				{
+				int lane = fgetc(pfile);
+				int numPoints = (unsigned short)freadShort(pfile);
+				if (feof(pfile))
+					break;
+				AutomationLane tempLane;
+				AutomationLane* automationLane = (lane >= 0 && lane < AUTOMATION_LANES) ? &automation[lane] : &tempLane;
+				for (int i = 0; i < numPoints && ftell(pfile) + 3 <= next; i++)
+					{
+					int pos = fgetc(pfile);
+					int step = fgetc(pfile);
+					int value = fgetc(pfile);
+					if (feof(pfile))
+						break;
+					automationLane->SetPoint(pos, step, value);
+					}
+				}
+			}
+		// (unknown chunks are skipped)
+
+		fseek(pfile, next, SEEK_SET);
+		}
+}
+
+
+/// Show a song load warning (or print it, if there is no display - eg:
+/// batch MIDI export)
+static void LoadWarning(const char* message)
+{
+	if (screen)
+		DoMessage(screen, bigFont, "Song Load Warning", message, false);
+	else
+		printf("Song Load Warning: %s\n", message);
+}
 
 /// Load a songfrom disk	
 bool Song::Load(const char* filename, void (*progressCallback)(int))
@@ -122,6 +352,7 @@ bool Song::Load(const char* filename, void (*progressCallback)(int))
 	fread(&name, SONG_NAME_LEN * sizeof(char), 1, pfile);
 	fread(&vol, sizeof(char), 1, pfile);
 	fread(&BPM, sizeof(char), 1, pfile);
+	SetBPM(BPM);
 	fread(&pitch, sizeof(char), 1, pfile);
 	currentPatternIndex = freadInt(pfile);
 	songPos = freadInt(pfile);
@@ -131,7 +362,7 @@ bool Song::Load(const char* filename, void (*progressCallback)(int))
 	int songListLength = freadInt(pfile);
 	if (songListLength > PATTERNS_PER_SONG)
 		{
-		DoMessage(screen, bigFont, "Song Load Warning", "Song sequence length too long,\npossibly from later version.\n \nSong may be truncated.", false);
+		LoadWarning("Song sequence length too long,\npossibly from later version.\n \nSong may be truncated.");
 		fread(&songList[0], PATTERNS_PER_SONG * sizeof(char), 1, pfile);
 		// skip over extra
 		fseek(pfile, songListLength - PATTERNS_PER_SONG, SEEK_CUR);
@@ -146,7 +377,7 @@ bool Song::Load(const char* filename, void (*progressCallback)(int))
 	int numPatterns = freadInt(pfile);
 	if (numPatterns > MAX_PATTERN)
 		{
-		DoMessage(screen, bigFont, "Song Load Warning", "Too many patterns,\npossibly from later version.\n \nSome patterns may not be loaded.", false);
+		LoadWarning("Too many patterns,\npossibly from later version.\n \nSome patterns may not be loaded.");
 		for (int i = 0; i < MAX_PATTERN; i++)
 			patterns[i].Read(pfile);
 		// skip over extra
@@ -165,7 +396,7 @@ bool Song::Load(const char* filename, void (*progressCallback)(int))
 	int numTracks = freadInt(pfile);
 	if (numTracks > NUM_TRACKS)
 		{
-		DoMessage(screen, bigFont, "Song Load Warning", "Too many tracks!\nSome tracks may not be loaded.", false);
+		LoadWarning("Too many tracks!\nSome tracks may not be loaded.");
 		for (int i = 0; i < NUM_TRACKS; i++)
 			trackMixInfo[i].Read(pfile);
 		// skip over extra
@@ -178,6 +409,14 @@ bool Song::Load(const char* filename, void (*progressCallback)(int))
 		for (int i = 0; i < numTracks; i++)
 			trackMixInfo[i].Read(pfile);
 		}
+	progressCallback(80);
+
+	// read extension chunks (if any)
+	seed = SONG_DEFAULT_SEED;			// (older songs have no SEED chunk)
+	numTempoPoints = 0;
+	for (int i = 0; i < AUTOMATION_LANES; i++)
+		automation[i].numPoints = 0;
+	LoadExtensions(pfile);
 
 	progressCallback(100);
 	
@@ -217,13 +456,17 @@ bool Song::Save(const char* filename, void (*progressCallback)(int))
 
 	unsigned int numPatterns = MAX_PATTERN;
 	fwrite(&numPatterns, sizeof(int), 1, pfile);
-	fwrite(&patterns[0], numPatterns * sizeof(DrumPattern), 1, pfile);
+	for (unsigned int i = 0; i < numPatterns; i++)
+		patterns[i].Write(pfile);
 
 	progressCallback(60);
 
 	unsigned int numTracks = NUM_TRACKS;
 	fwrite(&numTracks, sizeof(int), 1, pfile);
 	fwrite(&trackMixInfo[0], numTracks * sizeof(TrackMixInfo), 1, pfile);
+	progressCallback(80);
+
+	SaveExtensions(pfile);
 
 	progressCallback(100);
 	
@@ -268,6 +511,156 @@ bool Song::RemovePattern()
 		}
 
 	songList[PATTERNS_PER_SONG-1] = NO_PATTERN_INDEX;
-	
+
 	return true;
 }
+
+/// Set the song tempo
+/// @param newBPM				New tempo (clamped to SONG_MIN_BPM to SONG_MAX_BPM)
+void Song::SetBPM(int newBPM)
+{
+	if (newBPM < SONG_MIN_BPM)
+		newBPM = SONG_MIN_BPM;
+	else if (newBPM > SONG_MAX_BPM)
+		newBPM = SONG_MAX_BPM;
+	BPM = (unsigned char)newBPM;
+}
+
+/// Add a tempo change at a step of the song sequence (or change the one
+/// that is already there)
+/// @param pos					Song position
+/// @param step					Step of the pattern at that position
+/// @param bpm					New tempo (clamped to SONG_MIN_BPM to SONG_MAX_BPM)
+/// @param ramp					Ramp to the new tempo from the previous change?
+/// @return						false if the song has too many tempo changes
+bool Song::SetTempoPoint(int pos, int step, int bpm, bool ramp)
+{
+	if (pos < 0 || pos >= PATTERNS_PER_SONG || step < 0 || step >= MAX_STEPS_PER_PATTERN)
+		return false;
+	if (bpm < SONG_MIN_BPM)
+		bpm = SONG_MIN_BPM;
+	else if (bpm > SONG_MAX_BPM)
+		bpm = SONG_MAX_BPM;
+
+	// find where it goes (the points are kept in sequence order)
+	int key = (pos << 8) | step;
+	int i = 0;
+	while (i < numTempoPoints && ((tempoPoints[i].songPos << 8) | tempoPoints[i].step) < key)
+		i++;
+
+	if (i == numTempoPoints || ((tempoPoints[i].songPos << 8) | tempoPoints[i].step) != key)
+		{
+		if (SONG_MAX_TEMPO_POINTS == numTempoPoints)
+			return false;
+		for (int j = numTempoPoints; j > i; j--)
+			tempoPoints[j] = tempoPoints[j - 1];
+		numTempoPoints++;
+		}
+
+	tempoPoints[i].songPos = (unsigned char)pos;
+	tempoPoints[i].step = (unsigned char)step;
+	tempoPoints[i].bpm = (unsigned char)bpm;
+	tempoPoints[i].ramp = ramp ? 1 : 0;
+	return true;
+}
+
+/// Remove the tempo change at a step of the song sequence (if any)
+void Song::RemoveTempoPoint(int pos, int step)
+{
+	for (int i = 0; i < numTempoPoints; i++)
+		{
+		if (tempoPoints[i].songPos == pos && tempoPoints[i].step == step)
+			{
+			numTempoPoints--;
+			for (int j = i; j < numTempoPoints; j++)
+				tempoPoints[j] = tempoPoints[j + 1];
+			return;
+			}
+		}
+}
+
+/// Get the tempo change at a step of the song sequence
+/// @return						NULL if there is no tempo change there
+const TempoPoint* Song::GetTempoPoint(int pos, int step) const
+{
+	for (int i = 0; i < numTempoPoints; i++)
+		{
+		if (tempoPoints[i].songPos == pos && tempoPoints[i].step == step)
+			return &tempoPoints[i];
+		}
+	return NULL;
+}
+
+/// Is any mix setting automated?
+bool Song::HasAutomation() const
+{
+	for (int i = 0; i < AUTOMATION_LANES; i++)
+		{
+		if (!automation[i].IsEmpty())
+			return true;
+		}
+	return false;
+}
+
+/// Add a point to an automation lane (or change the one that is already
+/// at that song position and step)
+/// @param pos					Song position
+/// @param step					Step of the pattern at that position
+/// @param value				Vol or pan (0 to 255)
+/// @return						false if the lane has too many points
+bool AutomationLane::SetPoint(int pos, int step, int value)
+{
+	if (pos < 0 || pos >= PATTERNS_PER_SONG || step < 0 || step >= MAX_STEPS_PER_PATTERN)
+		return false;
+	if (value < 0)
+		value = 0;
+	else if (value > 255)
+		value = 255;
+
+	// find where it goes (the points are kept in sequence order)
+	int key = (pos << 8) | step;
+	int i = 0;
+	while (i < numPoints && ((points[i].songPos << 8) | points[i].step) < key)
+		i++;
+
+	if (i == numPoints || ((points[i].songPos << 8) | points[i].step) != key)
+		{
+		if (SONG_MAX_AUTOMATION_POINTS == numPoints)
+			return false;
+		for (int j = numPoints; j > i; j--)
+			points[j] = points[j - 1];
+		numPoints++;
+		}
+
+	points[i].songPos = (unsigned char)pos;
+	points[i].step = (unsigned char)step;
+	points[i].value = (unsigned char)value;
+	return true;
+}
+
+/// Remove the point at a song position and step (if any)
+void AutomationLane::RemovePoint(int pos, int step)
+{
+	for (int i = 0; i < numPoints; i++)
+		{
+		if (points[i].songPos == pos && points[i].step == step)
+			{
+			numPoints--;
+			for (int j = i; j < numPoints; j++)
+				points[j] = points[j + 1];
+			return;
+			}
+		}
+}
+
+/// Get the point at a song position and step
+/// @return						NULL if there is no point there
+const AutomationPoint* AutomationLane::GetPoint(int pos, int step) const
+{
+	for (int i = 0; i < numPoints; i++)
+		{
+		if (points[i].songPos == pos && points[i].step == step)
+			return &points[i];
+		}
+	return NULL;
+}
@@ -4,6 +4,17 @@
 #define PATTERNS_PER_SONG	100			// max length of song in patterns
 #define MAX_PATTERN			50			// max number of patterns in a song
 #define NO_PATTERN_INDEX	0xFF		// marker for "no pattern" in songlist
+#define SONG_DEFAULT_SEED	1			// random seed of a new song
+#define SONG_MIN_BPM		20			// tempo range
+#define SONG_MAX_BPM		250
+#define SONG_MAX_TEMPO_POINTS	64		// max tempo changes in a song
+#define SONG_MAX_AUTOMATION_POINTS	64	// max points in an automation lane
+
+// automation lanes (see automation.h)
+#define AUTOMATION_MASTER_VOL		0						// song vol
+#define AUTOMATION_TRACK_VOL(track)	(1 + (track))			// track vol
+#define AUTOMATION_TRACK_PAN(track)	(1 + NUM_TRACKS + (track))	// track pan
+#define AUTOMATION_LANES			(1 + 2 * NUM_TRACKS)
 
 /// Class representing mix info for a track in a song
 class TrackMixInfo
@@ -47,6 +58,46 @@ public:
 	unsigned char prevState;	// state before last solo enable
 };
 
+/// A tempo change at a step of the song sequence (see tempomap.h)
+class TempoPoint
+{
+public:
+	unsigned char songPos;		// song position
+	unsigned char step;			// step of the pattern at that position
+	unsigned char bpm;			// new tempo
+	unsigned char ramp;			// 1 = ramp from the previous tempo, 0 = jump
+};
+
+/// A point of an automation lane (a mix setting at a step of the song
+/// sequence)
+class AutomationPoint
+{
+public:
+	unsigned char songPos;		// song position
+	unsigned char step;			// step of the pattern at that position
+	unsigned char value;		// vol or pan (0 to 255)
+};
+
+/// A mix setting that moves along the song sequence (in a straight line
+/// from one point to the next)
+class AutomationLane
+{
+public:
+	// constructor
+	AutomationLane()
+		{
+		numPoints = 0;
+		};
+
+	bool IsEmpty() const { return (0 == numPoints); }
+	bool SetPoint(int pos, int step, int value);
+	void RemovePoint(int pos, int step);
+	const AutomationPoint* GetPoint(int pos, int step) const;
+
+	AutomationPoint points[SONG_MAX_AUTOMATION_POINTS];	// (in sequence order)
+	int numPoints;
+};
+
 /// class representing a song
 class Song
 {
@@ -61,6 +112,7 @@ public:
 	unsigned char BPM;					// song current BPM
 	char pitch;							// song current pitch offset
 	char name[SONG_NAME_LEN];			// song name
+	unsigned int seed;					// random seed for volrand / jitter (same seed = same hits)
 	DrumPattern patterns[MAX_PATTERN];
 	int songPos;						// current song position
 	int currentPatternIndex;			// index of current pattern
@@ -69,6 +121,13 @@ public:
 	
 	// track mix info
 	TrackMixInfo trackMixInfo[NUM_TRACKS];
+
+	// tempo changes (in sequence order)
+	TempoPoint tempoPoints[SONG_MAX_TEMPO_POINTS];
+	int numTempoPoints;
+
+	// mix automation (AUTOMATION_xxx lanes)
+	AutomationLane automation[AUTOMATION_LANES];
 	
 	// member funcs
 	void Init();
@@ -80,5 +139,16 @@ public:
 	bool InsertPattern(int patternIndex);	
 	// Remove the songlist entry at the current song pos
 	bool RemovePattern();
+	// Set the tempo (clamped to SONG_MIN_BPM to SONG_MAX_BPM)
+	void SetBPM(int newBPM);
+	// Add / change / remove the tempo change at a song position and step
+	bool SetTempoPoint(int pos, int step, int bpm, bool ramp);
+	void RemoveTempoPoint(int pos, int step);
+	const TempoPoint* GetTempoPoint(int pos, int step) const;
+	// Is any mix setting automated?
+	bool HasAutomation() const;
+	// Read / write extension chunks (data not in the v1.2 file format)
+	void LoadExtensions(FILE* pfile);
+	void SaveExtensions(FILE* pfile);
 };
 
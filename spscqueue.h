@@ -0,0 +1,55 @@
+// xdrum lock-free queue
+//
+// Single producer / single consumer queue, for passing commands from one
+// thread to another without locking (eg: the play thread to the audio
+// callback). The producer only writes m_head, and the consumer only writes
+// m_tail, so neither thread ever waits for the other. The counts run on
+// and wrap around; the slot is the count modulo N, so N must be a power
+// of 2.
+// Needs SDL.h included first.
+
+/// Single producer / single consumer lock-free queue of N items of type T
+template <typename T, int N>
+class SpscQueue
+{
+public:
+	SpscQueue() { m_head = 0; m_tail = 0; }
+
+	/// Add an item to the queue (producer thread only)
+	/// @return					false if the queue is full
+	bool Push(const T& item)
+		{
+		unsigned int head = m_head;
+		if (head - m_tail >= N)
+			return false;
+
+		m_items[head & (N - 1)] = item;
+		__sync_synchronize();				// item must be written before it is published
+		m_head = head + 1;
+		return true;
+		}
+
+	/// Take the next item off the queue (consumer thread only)
+	/// @return					false if the queue is empty
+	bool Pop(T* item)
+		{
+		unsigned int tail = m_tail;
+		if (tail == m_head)
+			return false;
+
+		__sync_synchronize();
+		*item = m_items[tail & (N - 1)];
+		__sync_synchronize();				// item must be read before the slot is freed
+		m_tail = tail + 1;
+		return true;
+		}
+
+	/// Drop everything in the queue (when the producer is stopped, or
+	/// the consumer is locked out - eg: with SDL_LockAudio())
+	void Clear() { m_tail = m_head; }
+
+private:
+	T m_items[N];
+	volatile unsigned int m_head;			// next item to write (producer)
+	volatile unsigned int m_tail;			// next item to read (consumer)
+};
@@ -0,0 +1,202 @@
+/*
+ *      tempomap.cpp
+ *
+ *      Tempo map (tempo changes / ramps along the song sequence) for xdrum
+ *
+ */
+
+#include <stdio.h>
+#include "SDL.h"
+#include "platform.h"
+#include "pattern.h"
+#include "song.h"
+#include "tempomap.h"
+
+// Tick interval at a whole number tempo (ns) - exactly as the play thread
+// works it out without a tempo map
+#define TEMPOMAP_INTERVAL(bpm)		((Uint64)60000000000ULL / ((bpm) * 16))
+
+// constructor
+TempoMap::TempoMap()
+{
+	m_valid = false;
+	m_signature = 0;
+	m_numPoints = 0;
+	m_numPositions = 0;
+	m_numTicks = 0;
+	m_endInterval = TEMPOMAP_INTERVAL(100);
+	m_positionTick[0] = 0;
+	m_tickTime[0] = 0;
+}
+
+/// Hash of the song data the map depends on (sequence, pattern lengths,
+/// song.BPM and the tempo changes)
+Uint32 TempoMap::GetSignature(const Song* song)
+{
+	// FNV-1a
+	Uint32 hash = 2166136261U;
+	hash = (hash ^ song->BPM) * 16777619U;
+	for (int i = 0; i < song->numTempoPoints; i++)
+		{
+		const TempoPoint* point = &song->tempoPoints[i];
+		hash = (hash ^ point->songPos) * 16777619U;
+		hash = (hash ^ point->step) * 16777619U;
+		hash = (hash ^ point->bpm) * 16777619U;
+		hash = (hash ^ point->ramp) * 16777619U;
+		}
+	for (int pos = 0; pos < PATTERNS_PER_SONG && song->songList[pos] < MAX_PATTERN; pos++)
+		{
+		hash = (hash ^ song->songList[pos]) * 16777619U;
+		hash = (hash ^ song->patterns[song->songList[pos]].GetLength()) * 16777619U;
+		}
+	return hash ^ song->numTempoPoints;
+}
+
+/// Rebuild the map, if the song's sequence or tempo has changed since it
+/// was last built (cheap if nothing has changed)
+/// @param song				Song
+/// @return					true if the map was rebuilt
+bool TempoMap::Update(const Song* song)
+{
+	Uint32 signature = GetSignature(song);
+	if (m_valid && signature == m_signature)
+		return false;
+
+	Build(song);
+	m_signature = signature;
+	m_valid = true;
+	return true;
+}
+
+/// Work out the time of every tick of the song's sequence
+void TempoMap::Build(const Song* song)
+{
+	// first tick of each song position
+	int tick = 0;
+	int pos = 0;
+	while (pos < PATTERNS_PER_SONG && song->songList[pos] < MAX_PATTERN)
+		{
+		m_positionTick[pos] = tick;
+		tick += song->patterns[song->songList[pos]].GetLength() * TICKS_PER_STEP;
+		pos++;
+		}
+	m_positionTick[pos] = tick;
+	m_numPositions = pos;
+	m_numTicks = tick;
+
+	// tick of each tempo change in the sequence (changes past the end of
+	// the sequence, or past the end of their pattern, are not played)
+	int pointTick[SONG_MAX_TEMPO_POINTS];
+	int pointBPM[SONG_MAX_TEMPO_POINTS];
+	bool pointRamp[SONG_MAX_TEMPO_POINTS];
+	m_numPoints = 0;
+	for (int i = 0; i < song->numTempoPoints; i++)
+		{
+		const TempoPoint* point = &song->tempoPoints[i];
+		if (point->songPos >= m_numPositions
+			|| point->step >= song->patterns[song->songList[point->songPos]].GetLength())
+			continue;
+		pointTick[m_numPoints] = m_positionTick[point->songPos] + point->step * TICKS_PER_STEP;
+		pointBPM[m_numPoints] = (point->bpm > 0) ? point->bpm : 1;
+		pointRamp[m_numPoints] = (0 != point->ramp);
+		m_numPoints++;
+		}
+
+	// add up the tick intervals (a ramp changes the tempo every tick,
+	// from the tempo at the previous change)
+	int fromTick = 0;
+	int fromBPM = (song->BPM > 0) ? song->BPM : 1;
+	int next = 0;
+	Uint64 time = 0;
+	for (tick = 0; tick < m_numTicks; tick++)
+		{
+		while (next < m_numPoints && pointTick[next] <= tick)
+			{
+			fromTick = pointTick[next];
+			fromBPM = pointBPM[next];
+			next++;
+			}
+
+		m_tickTime[tick] = time;
+		if (next < m_numPoints && pointRamp[next])
+			{
+			double bpm = fromBPM + (double)(pointBPM[next] - fromBPM) * (tick - fromTick) / (pointTick[next] - fromTick);
+			time += (Uint64)(60000000000.0 / (bpm * 16));
+			}
+		else
+			{
+			time += TEMPOMAP_INTERVAL(fromBPM);
+			}
+		}
+	m_tickTime[m_numTicks] = time;
+	m_endInterval = TEMPOMAP_INTERVAL(fromBPM);
+}
+
+/// Get the first tick of a song position
+/// @param songPos			Song position (positions past the end of the sequence
+///							give the end of the sequence)
+int TempoMap::GetPositionTick(int songPos) const
+{
+	if (songPos <= 0)
+		return 0;
+	if (songPos > m_numPositions)
+		songPos = m_numPositions;
+	return m_positionTick[songPos];
+}
+
+/// Get the tick of a step of a song position
+/// @param songPos			Song position
+/// @param step				Step (steps past the end of the pattern give its last tick)
+/// @return					Tick, or -1 if the position is past the end of the sequence
+int TempoMap::GetStepTick(int songPos, int step) const
+{
+	if (songPos < 0 || songPos >= m_numPositions)
+		return -1;
+	int tick = m_positionTick[songPos] + step * TICKS_PER_STEP;
+	return (tick < m_positionTick[songPos + 1]) ? tick : m_positionTick[songPos + 1] - 1;
+}
+
+/// Get the song position a tick is in (binary search)
+int TempoMap::GetPosition(int tick) const
+{
+	// last position starting at or before the tick
+	int low = 0;
+	int high = m_numPositions - 1;
+	while (low < high)
+		{
+		int mid = (low + high + 1) / 2;
+		if (m_positionTick[mid] <= tick)
+			low = mid;
+		else
+			high = mid - 1;
+		}
+	return (low > 0) ? low : 0;
+}
+
+/// Get the tick playing at a time (binary search)
+/// @param timeNs			Time from the start of the sequence (ns)
+/// @return					Tick (the length of the sequence, if the time is after the end)
+int TempoMap::GetTick(Uint64 timeNs) const
+{
+	// last tick starting at or before the time
+	int low = 0;
+	int high = m_numTicks;
+	while (low < high)
+		{
+		int mid = (low + high + 1) / 2;
+		if (m_tickTime[mid] <= timeNs)
+			low = mid;
+		else
+			high = mid - 1;
+		}
+	return low;
+}
+
+/// Get the tempo at a tick (BPM, rounded)
+int TempoMap::GetBPM(int tick) const
+{
+	Uint64 interval = GetInterval(tick);
+	if (0 == interval)
+		return 0;
+	return (int)((60000000000ULL / 16 + interval / 2) / interval);
+}
@@ -0,0 +1,89 @@
+// xdrum tempo map
+//
+// A song can change tempo at any step of its sequence, either jumping to
+// the new tempo or ramping to it (linearly, per tick) from the previous
+// change. Until the first change the song plays at song.BPM. The changes
+// are stored in the song (see TempoPoint in song.h, and the "TMAP" chunk
+// in song.cpp), at a song position, so they stay where they are when
+// patterns are inserted into or removed from the sequence.
+// The map is not worked out on every tick: Update() rebuilds a table with
+// the time of every tick of the sequence only when the sequence, a pattern
+// length, song.BPM or the tempo changes have changed. Then the time of a
+// tick is a lookup, and the tick (or song position) at a time is a binary
+// search, so seeking, offline rendering and sync can turn song positions
+// into sample clock times (and back) without playing through the song.
+// The play thread never builds a map: the UI thread builds the next one in
+// a spare map and hands it over (see UpdatePlayTempoMap() in xdrum.cpp).
+// Tick times are whole ns, added up tick by tick exactly as the play
+// thread adds up its deadlines, so a render lands every tick on the same
+// sample as live playback.
+// Needs SDL.h, pattern.h and song.h included first.
+
+#define TEMPOMAP_MAX_TICKS		(PATTERNS_PER_SONG * MAX_STEPS_PER_PATTERN * TICKS_PER_STEP)
+
+/// Time of every tick of a song's sequence
+class TempoMap
+{
+public:
+	// constructor
+	TempoMap();
+
+	bool Update(const Song* song);
+
+	// Built from the song as it is now?
+	bool IsUpToDate(const Song* song) const
+		{
+		return (m_valid && GetSignature(song) == m_signature);
+		}
+
+	// Any tempo changes? (if not, the song plays at song.BPM)
+	bool IsEmpty() const { return (0 == m_numPoints); }
+
+	// Ticks in the sequence / sequence positions in the map
+	int GetTicks() const { return m_numTicks; }
+	int GetPositions() const { return m_numPositions; }
+
+	int GetPositionTick(int songPos) const;
+	int GetStepTick(int songPos, int step) const;
+	int GetPosition(int tick) const;
+	int GetTick(Uint64 timeNs) const;
+
+	// Time of a tick (ns from the start of the sequence)
+	Uint64 GetTickTime(int tick) const
+		{
+		return m_tickTime[ClampTick(tick)];
+		}
+
+	// Time from a tick to the next one (ns)
+	Uint64 GetInterval(int tick) const
+		{
+		tick = ClampTick(tick);
+		return (tick < m_numTicks) ? m_tickTime[tick + 1] - m_tickTime[tick] : m_endInterval;
+		}
+
+	// Sample frame of a tick (from the start of the sequence)
+	Uint64 GetTickFrame(int tick, int rate) const
+		{
+		return (GetTickTime(tick) * rate) / 1000000000ULL;
+		}
+
+	int GetBPM(int tick) const;
+
+private:
+	void Build(const Song* song);
+	static Uint32 GetSignature(const Song* song);
+
+	int ClampTick(int tick) const
+		{
+		return (tick < 0) ? 0 : ((tick > m_numTicks) ? m_numTicks : tick);
+		}
+
+	bool m_valid;
+	Uint32 m_signature;						// of the song data the map was built from
+	int m_numPoints;						// tempo changes in the sequence
+	int m_numPositions;						// sequence length (song positions)
+	int m_numTicks;							// sequence length (ticks)
+	Uint64 m_endInterval;					// tick interval at the end of the sequence (ns)
+	int m_positionTick[PATTERNS_PER_SONG + 1];	// first tick of each song position
+	Uint64 m_tickTime[TEMPOMAP_MAX_TICKS + 1];	// time of each tick (ns)
+};
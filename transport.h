@@ -16,21 +16,32 @@ public:
 		mode = PM_PATTERN;
 		patternPos = 0;
 		songPos = 0;
-		shuffle = 0;
 		jitter = 0;
 		volrand = 0;
 		flashOnBeat = false;
+		stepTimer = ST_HIRES_SPIN;
+		liveQuantise = 0;
+		tempo = 0;
 		}
 
 	// playback mode
 	enum PLAYBACK_MODE { PM_PATTERN = 0, PM_SONG = 1, PM_LIVE = 2 }; 
 
+	// how the play thread waits for the next tick
+	enum STEP_TIMER { ST_LEGACY = 0,		// SDL_GetTicks() + busy-wait (v1.2)
+					ST_HIRES = 1,			// ns clock + absolute deadline sleep
+					ST_HIRES_SPIN = 2		// as above, with a short busy-wait at the end
+	};
+
 	bool playing;					// whether playback running or not
 	PLAYBACK_MODE mode;				// playback mode
-	int patternPos;					// current "tick" in the pattern (0 to 63)
+	int patternPos;					// current "tick" in the pattern (0 to pattern length * TICKS_PER_STEP - 1)
 	int songPos;					// current position in song
-	int shuffle;					// shuffle amount
+	Groove groove;					// swing / groove template
 	int jitter;						// random "jitter" in millisecs
 	int volrand;					// random hit volume in percent
 	bool flashOnBeat;				// flash background on the beat
+	STEP_TIMER stepTimer;			// tick timing method
+	int liveQuantise;				// quantise live pad hits to this many ticks (0 = off)
+	int tempo;						// tempo being played, if the song's tempo map is followed (0 = song.BPM)
 };
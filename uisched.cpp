@@ -0,0 +1,222 @@
+/*
+ *      uisched.cpp
+ *
+ *      Event / timer driven frame scheduling for the xdrum UI
+ *
+ */
+
+#include <stdlib.h>
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "platform.h"
+#include "hrtimer.h"
+#include "uisched.h"
+
+// scheduler that the SDL event filter wakes up
+static UiScheduler* s_filterScheduler = NULL;
+
+// constructor
+UiScheduler::UiScheduler()
+{
+	m_sem = NULL;
+	m_wakePending = false;
+	m_eventThread = false;
+	m_pollInterval = UISCHED_DEFAULT_POLL_INTERVAL;
+	m_lastFrame = 0;
+	m_haveDeadline = false;
+	m_deadline = 0;
+	m_wakeups = 0;
+	m_frames = 0;
+	m_stampHead = 0;
+	m_stampTail = 0;
+	SetFrameBudget(UISCHED_DEFAULT_FPS);
+}
+
+UiScheduler::~UiScheduler()
+{
+	if (this == s_filterScheduler)
+		{
+		SDL_SetEventFilter(NULL);
+		s_filterScheduler = NULL;
+		}
+	if (m_sem)
+		SDL_DestroySemaphore(m_sem);
+}
+
+/// Set up the scheduler (call after SDL_Init())
+/// @param haveEventThread		true if SDL was started with SDL_INIT_EVENTTHREAD
+/// @return						false if the scheduler could not be set up
+bool UiScheduler::Init(bool haveEventThread)
+{
+	m_sem = SDL_CreateSemaphore(0);
+	if (!m_sem)
+		{
+		printf("UiScheduler: unable to create semaphore!\n");
+		return false;
+		}
+
+	m_eventThread = haveEventThread;
+	s_filterScheduler = this;
+	SDL_SetEventFilter(EventFilter);
+	m_lastFrame = SDL_GetTicks();
+
+	return true;
+}
+
+/// Set the max number of frames drawn per second
+void UiScheduler::SetFrameBudget(int framesPerSecond)
+{
+	if (framesPerSecond < 1)
+		framesPerSecond = 1;
+	else if (framesPerSecond > 100)
+		framesPerSecond = 100;
+	m_framesPerSecond = framesPerSecond;
+	m_frameInterval = 1000 / framesPerSecond;
+}
+
+/// Set how often input is polled when there is no SDL event thread
+void UiScheduler::SetInputPollInterval(int ms)
+{
+	m_pollInterval = (ms < 1) ? 1 : ms;
+}
+
+/// Wake up the UI thread (safe to call from any thread)
+void UiScheduler::Wake()
+{
+	// only post once until the UI has woken up
+	if (!m_wakePending && m_sem)
+		{
+		m_wakePending = true;
+		SDL_SemPost(m_sem);
+		}
+}
+
+/// Ask for a frame to be drawn within a given time
+/// (eg: for animation or a meter)
+/// @param ms				Max time until the frame (0 = as soon as the budget allows)
+void UiScheduler::RequestFrameIn(int ms)
+{
+	Uint32 due = SDL_GetTicks() + ms;
+	if (!m_haveDeadline || (Sint32)(due - m_deadline) < 0)
+		m_deadline = due;
+	m_haveDeadline = true;
+}
+
+/// Sleep until the next frame needs to be drawn
+void UiScheduler::WaitForFrame()
+{
+	m_frames++;
+
+	// keep to the frame budget
+	Uint32 now = SDL_GetTicks();
+	Sint32 wait = (Sint32)(m_lastFrame + m_frameInterval - now);
+	if (wait > 0)
+		SDL_Delay(wait);
+
+	// wait for something to do
+	while (!WorkPending())
+		{
+		Sint32 timeout = -1;
+		if (m_haveDeadline)
+			{
+			timeout = (Sint32)(m_deadline - SDL_GetTicks());
+			if (timeout < 0)
+				timeout = 0;
+			}
+		if (!m_eventThread && (timeout < 0 || timeout > m_pollInterval))
+			timeout = m_pollInterval;		// have to poll for input
+
+		if (!m_sem)
+			SDL_Delay(timeout < 0 ? m_pollInterval : timeout);
+		else if (timeout < 0)
+			SDL_SemWait(m_sem);
+		else
+			SDL_SemWaitTimeout(m_sem, timeout);
+		m_wakeups++;
+		}
+
+	// drain the wakeup semaphore
+	m_wakePending = false;
+	while (m_sem && 0 == SDL_SemTryWait(m_sem))
+		;
+	m_haveDeadline = false;
+	m_lastFrame = SDL_GetTicks();
+}
+
+/// Is there anything for the UI to do?
+bool UiScheduler::WorkPending()
+{
+	if (m_wakePending)
+		return true;
+
+	if (m_haveDeadline && (Sint32)(SDL_GetTicks() - m_deadline) >= 0)
+		return true;
+
+	// any input?
+	if (!m_eventThread)
+		SDL_PumpEvents();
+	SDL_Event event;
+	return (SDL_PeepEvents(&event, 1, SDL_PEEKEVENT, SDL_ALLEVENTS) > 0);
+}
+
+/// Get the time that a key / button press arrived
+/// (call for each press, in the order they come out of the event queue)
+/// @param event			Key or joystick button event
+/// @return					Time the event arrived (now, if not known)
+Uint64 UiScheduler::GetEventTime(const SDL_Event* event)
+{
+	Uint64 now = HrTimeNanos();
+	int code = GetStampCode(event);
+	if (code >= 0)
+		{
+		// skip the stamps of any events that were dropped (queue full), or
+		// were handled somewhere else (eg: in a dialog)
+		while (m_stampTail != m_stampHead)
+			{
+			__sync_synchronize();
+			InputStamp* stamp = &m_stamps[m_stampTail % UISCHED_MAX_STAMPS];
+			int stampCode = stamp->code;
+			Uint64 time = stamp->time;
+			__sync_synchronize();
+			m_stampTail++;
+			if (stampCode == code && now - time < (Uint64)UISCHED_MAX_STAMP_AGE * 1000000)
+				return time;
+			}
+		}
+
+	return now;
+}
+
+/// Get the code that identifies an event in the input time stamps
+/// @return					Key / button code, or -1 if the event is not stamped
+int UiScheduler::GetStampCode(const SDL_Event* event)
+{
+	if (SDL_KEYDOWN == event->type)
+		return event->key.keysym.sym;
+	else if (SDL_JOYBUTTONDOWN == event->type)
+		return 0x10000 + event->jbutton.button;
+	return -1;
+}
+
+/// SDL event filter - wakes the scheduler when an event is queued
+/// (called from the SDL event thread if there is one)
+int UiScheduler::EventFilter(const SDL_Event* event)
+{
+	if (s_filterScheduler)
+		{
+		// time stamp key / button presses
+		UiScheduler* sched = s_filterScheduler;
+		int code = GetStampCode(event);
+		if (code >= 0 && sched->m_stampHead - sched->m_stampTail < UISCHED_MAX_STAMPS)
+			{
+			InputStamp* stamp = &sched->m_stamps[sched->m_stampHead % UISCHED_MAX_STAMPS];
+			stamp->code = code;
+			stamp->time = HrTimeNanos();
+			__sync_synchronize();
+			sched->m_stampHead++;
+			}
+
+		sched->Wake();
+		}
+	return 1;				// keep the event
+}
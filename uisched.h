@@ -0,0 +1,78 @@
+// xdrum UI scheduler
+//
+// Instead of redrawing and sleeping a fixed 20ms, the main screen and the
+// dialogs call WaitForFrame() after each frame. It sleeps until there is
+// something to do: input has arrived, another thread has called Wake()
+// (eg: the play thread moved the playhead), or a frame that was asked for
+// with RequestFrameIn() is due. Frames are never closer together than the
+// frame budget allows.
+// If SDL runs an event thread, input wakes the scheduler directly. Otherwise
+// input is polled every "input poll interval" (which costs a wakeup, but not
+// a frame).
+// The event filter also records when each key / button press arrived, so
+// that live pad hits can be played at the time they were made (accurate
+// if SDL has an event thread, otherwise only to the input poll interval).
+// Needs SDL.h included first.
+
+#define UISCHED_DEFAULT_FPS				30		// default frame budget (max frames per second)
+#define UISCHED_DEFAULT_POLL_INTERVAL	30		// default input poll interval (ms)
+#define UISCHED_MAX_STAMPS				32		// key / button presses waiting to be processed
+#define UISCHED_MAX_STAMP_AGE			500		// ms before an unused time stamp is stale
+
+/// Event / timer driven frame scheduler for the UI thread
+class UiScheduler
+{
+public:
+	// constructor
+	UiScheduler();
+	~UiScheduler();
+
+	bool Init(bool haveEventThread);
+	void SetFrameBudget(int framesPerSecond);
+	int GetFrameBudget() const { return m_framesPerSecond; }
+	void SetInputPollInterval(int ms);
+
+	// wake the UI (can be called from any thread)
+	void Wake();
+	// ask for a frame no later than ms milliseconds from now
+	void RequestFrameIn(int ms);
+	// sleep until the next frame is needed
+	void WaitForFrame();
+
+	// time (HrTimeNanos()) that an input event arrived
+	Uint64 GetEventTime(const SDL_Event* event);
+
+	// stats
+	unsigned int GetWakeups() const { return m_wakeups; }
+	unsigned int GetFrames() const { return m_frames; }
+
+private:
+	bool WorkPending();
+	static int GetStampCode(const SDL_Event* event);
+	static int EventFilter(const SDL_Event* event);
+
+	/// Arrival time of an input event
+	class InputStamp
+	{
+	public:
+		int code;							// key / button (see GetStampCode())
+		Uint64 time;
+	};
+
+	SDL_sem* m_sem;
+	volatile bool m_wakePending;
+	bool m_eventThread;						// SDL event thread running?
+	int m_framesPerSecond;
+	int m_frameInterval;					// min ms between frames
+	int m_pollInterval;						// ms between input polls (no event thread)
+	Uint32 m_lastFrame;						// time the last frame started
+	bool m_haveDeadline;
+	Uint32 m_deadline;						// time a requested frame is due
+	unsigned int m_wakeups;
+	unsigned int m_frames;
+
+	// input time stamps (written by the event filter, read by the UI)
+	InputStamp m_stamps[UISCHED_MAX_STAMPS];
+	volatile unsigned int m_stampHead;
+	volatile unsigned int m_stampTail;
+};
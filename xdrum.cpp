@@ -2,6 +2,7 @@
 // Copyright James Higgs 2008/2009
 //
 #include <stdlib.h>
+#include <math.h>
 #include "SDL.h"
 #include "SDL_main.h"
 #include "SDL_mixer.h"
@@ -10,13 +11,32 @@
 #include "pattern.h"
 #include "drumkit.h"
 #include "song.h"
+#include "tempomap.h"
 #include "zones.h"
 #include "texmap.h"
 #include "fontengine.h"
 #include "gui.h"
+#include "groove.h"
 #include "transport.h"
 #include "joymap.h"
 #include "writewav.h"
+#include "history.h"
+#include "journal.h"
+#include "presenter.h"
+#include "uisched.h"
+#include "metrics.h"
+#include "hrtimer.h"
+#include "rtsched.h"
+#include "spscqueue.h"
+#include "dynamics.h"
+#include "engine.h"
+#include "automation.h"
+#include "fastrand.h"
+#include "recorder.h"
+#include "netsync.h"
+#include "osc.h"
+#include "midiclock.h"
+#include "midifile.h"
 
 #define XDRUM_VER	"1.2"
 
@@ -44,13 +64,104 @@ DrumPattern* currentPattern = NULL;			// currently playing pattern
 
 int livePatternIndex = 0;
 
+// Undo / redo
+EditHistory history;
+
+// Autosave journal
+Journal journal;
+
+// Dirty rect screen updates
+ScreenPresenter presenter;
+
+// UI frame scheduling (shared with gui.cpp dialogs)
+UiScheduler uiScheduler;
+#define METER_UPDATE_INTERVAL	50			// ms between level meter updates
+
+// Sample accurate drum sample player, and its master bus dynamics
+AudioEngine engine;
+MasterDynamics masterDynamics;
+#define LIVE_PAD_VOL			64			// volume of live pad hits
+#define LIVE_PAD_ACCENT_VOL		127			// volume of live pad hits with SHIFT held
+Uint64 inputEventTime = 0;					// time the key / button press being processed arrived
+
+// Volrand / jitter random numbers (play thread only, reseeded from song.seed
+// whenever playback starts)
+FastRandom playRandom;
+
+// Timing of transport.groove at the current tempo (play thread only)
+GrooveTiming playGroove;
+
+// Set while the play thread plays a tick (see StopPlayTick())
+volatile bool playTickBusy = false;
+
+// Tempo changes of the song sequence (built by the UI thread in the map the
+// play thread is not using, then handed over - see UpdatePlayTempoMap())
+TempoMap tempoMaps[2];
+TempoMap* volatile playTempoMap = &tempoMaps[0];		// map being played (play thread)
+TempoMap* volatile nextTempoMap = NULL;				// map to play from the next tick
+
+// Mix automation of the song sequence (play thread only)
+AutomationPlayer playAutomation;
+
+// Offline rendering to a WAV file
+#define RENDER_BLOCK_FRAMES		1024		// sample frames mixed at a time
+#define RENDER_MAX_TAIL			10			// max seconds of sample tails after the end
+bool RenderWav(char* filename);				// (with the play thread)
+
+// Live step recording of pad hits
+LiveRecorder recorder;
+DrumPattern recordJournalled;				// the pattern being recorded, as last journaled
+int recordPatternIndex = 0;
+
+// Following another tempo / transport (network or MIDI clock sync)
+#define SYNC_MAX_ERROR			TICKS_PER_STEP		// beat phase error (ticks) to jump instead of trimming
+#define SYNC_TRIM_GAIN			8					// fraction of the phase error removed per tick (1/n)
+#define SYNC_MAX_TRIM			32					// max tick interval change (1/n of the interval)
+volatile bool syncChanged = false;			// transport / BPM changed by another instance, the MIDI clock or the tempo map
+
+// Tempo / transport sync with other instances (-sync command line option)
+NetSync netSync;
+Uint32 netSyncVersion = 0;					// version of the shared timeline applied to the transport
+Uint32 netSyncOwner = 0;
+Sint64 netSyncTick = 0;						// shared timeline tick of the tick being played
+
+// MIDI clock slave / master (-midiin / -midiout command line options)
+MidiClock midiClock;
+#define MIDISYNC_START_POLL		2000000				// ns between checks for a MIDI start while stopped
+#define MIDISYNC_BPM_HYSTERESIS	0.6					// tempo change (BPM) before song.BPM follows the clock
+Uint32 midiSyncSeq = 0;						// MIDI start / stop / song position applied to the transport
+Sint64 midiSyncTick = 0;					// MIDI clock song position (ticks) of the tick being played
+
+// OSC remote control (-osc command line option)
+OscServer oscServer;
+
+// Real-time audio mode (-rt command line option)
+RealtimeMode realtime;
+
+// Frame / audio / sequencer timing metrics
+PerfMetrics metrics;
+bool showMetrics = false;					// show the metrics overlay?
+
 DrumPattern patternClipboard;
-DrumEvent trackClipboard[STEPS_PER_PATTERN];
+DrumEvent trackClipboard[MAX_STEPS_PER_PATTERN];
+int trackClipboardLength = STEPS_PER_PATTERN;
 
 int songListScrollPos = 0;
 int patListScrollPos = 0;
 int currentTrack = 0;						// pattern cursor y
-int currentStep = 0;						// pattern cursor x
+int currentStep = 0;						// pattern cursor x (step in pattern)
+int gridPage = 0;							// page of the pattern shown in the grid
+
+// What each cell of the pattern grid (in the background buffer) looks like
+enum GRIDCELLS { CELL_UNKNOWN = 0,			// not drawn yet (always redrawn)
+				CELL_BLANK,
+				CELL_NONOTEBEAT,
+				CELL_NONOTE,
+				CELL_NOTECUT,
+				CELL_ACCENT,
+				CELL_NOTEON
+		};
+unsigned char gridCells[NUM_TRACKS][STEPS_PER_PAGE];
 
 // Mouse cursor
 float cursorX = (VIEW_WIDTH / 2);
@@ -106,6 +217,19 @@ void SetSDLRect(SDL_Rect& rect, int x, int y,int w, int h)
 	rect.h = h;
 }
 
+/// Mark a screen zone as changed (if drawn to the background buffer)
+void MarkZoneDirty(SDL_Surface* surface, int zone)
+{
+	if (surface == backImg)
+		presenter.MarkDirty(zones[zone]);
+}
+
+/// Whole screen needs redrawing (eg: a dialog has drawn over it)
+void InvalidateScreen()
+{
+	presenter.MarkAllDirty();
+}
+
 /// Progress callback function
 void progress_callback(int progress)
 {
@@ -113,6 +237,11 @@ void progress_callback(int progress)
 	SDL_Flip(screen);
 }
 
+/// Progress callback function (no display)
+void no_progress_callback(int progress)
+{
+}
+
 /// Load a bitmap image and convert it to display format
 SDL_Surface* LoadImageConvertToDisplay(const char* filename, bool setColourKey)
 {
@@ -213,6 +342,9 @@ void SyncPatternPointer()
 // draw vol/bpm/pitch sliders
 void DrawSliders(SDL_Surface* surface)
 {
+	MarkZoneDirty(surface, ZONE_VOL);
+	MarkZoneDirty(surface, ZONE_BPM);
+	MarkZoneDirty(surface, ZONE_PITCH);
 	char s[32];
 	// draw vol slider box
 	SDL_Rect dest = zones[ZONE_VOL];
@@ -237,7 +369,7 @@ void DrawSliders(SDL_Surface* surface)
 	dest = zones[ZONE_BPM];
 	src = texmap[TM_BPM_BOX];
 	SDL_BlitSurface(textures, &src, surface, &dest);
-	sprintf(s, "%d", song.BPM);
+	sprintf(s, "%d", (transport.tempo > 0) ? transport.tempo : song.BPM);		// (the tempo map's tempo, when it is followed)
 	dest.x += (16 - (int)strlen(s) * 8 / 2);
 	dest.y += 2;
 	smallFont->DrawText(surface, s, dest, true);
@@ -286,6 +418,7 @@ void DrawSliders(SDL_Surface* surface)
 // draw track info
 void DrawTrackInfo(SDL_Surface* surface)
 {
+	MarkZoneDirty(surface, ZONE_TRACKINFO);
 	char trackName[DRUM_NAME_LEN];
 		
 	SDL_Rect src;
@@ -337,6 +470,7 @@ void DrawTrackInfo(SDL_Surface* surface)
 // draw song sequence list
 void DrawSequenceList(SDL_Surface* surface)
 {
+	MarkZoneDirty(surface, ZONE_SONGLIST);
 	char s[40];
 	char* patname;
 	char no_pat_name[32] = "---";
@@ -378,6 +512,8 @@ void DrawSequenceList(SDL_Surface* surface)
 // draw pattern list and "add pattern to song" button
 void DrawPatternList(SDL_Surface* surface)
 {
+	MarkZoneDirty(surface, ZONE_PATLIST);
+	MarkZoneDirty(surface, ZONE_ADDTOSONGBTN);
 	char s[40];
 	SDL_Rect src = texmap[TM_PATLIST_BOX];
 	SDL_Rect dest = zones[ZONE_PATLIST];
@@ -417,63 +553,121 @@ void DrawPatternList(SDL_Surface* surface)
 }
 
 
+/// Get the texture to draw for a grid cell class
+/// @param cell				Cell class (CELL_xxx)
+/// @return					Texture map index (0 = blank cell)
+static int GetGridCellTexture(int cell)
+{
+	switch (cell)
+		{
+		case CELL_NONOTEBEAT :	return TM_NONOTEBEAT;
+		case CELL_NONOTE :		return TM_NONOTE;
+		case CELL_NOTECUT :		return TM_NOTECUT;
+		case CELL_ACCENT :		return TM_ACCENT;
+		case CELL_NOTEON :		return TM_NOTEON;
+		}
+	return 0;
+}
+
+/// Force every grid cell to be redrawn by the next DrawPatternGrid()
+/// (eg: if something else has drawn over the grid)
+void InvalidatePatternGrid()
+{
+	memset(gridCells, CELL_UNKNOWN, sizeof(gridCells));
+}
+
 // draw drum pattern
+// Only the cells that look different to what was last drawn are redrawn
+// (switching to a similar pattern only redraws the differences)
 void DrawPatternGrid(SDL_Surface* surface, DrumPattern* pattern)
 {
-	if (!pattern)
-		return;
-		
+	// cells drawn somewhere other than the background are not tracked
+	if (surface != backImg)
+		InvalidatePatternGrid();
+
+	int firstStep = 0;
+	int length = 0;
+	if (NULL != pattern)
+		{
+		// pattern may have got shorter (or changed)
+		if (gridPage * STEPS_PER_PAGE >= pattern->GetLength())
+			gridPage = 0;
+		if (currentStep >= pattern->GetLength())
+			currentStep = pattern->GetLength() - 1;
+		firstStep = gridPage * STEPS_PER_PAGE;
+		length = pattern->GetLength();
+		}
+
+	// Draw the changed cells of the current grid page
+	// (steps beyond the end of the pattern, or with no pattern, are left blank)
 	SDL_Rect src = texmap[TM_NONOTE];
-	SDL_Rect src2 = texmap[TM_NONOTEBEAT];
 	SDL_Rect dest;
 	const int w = PATBOX.w;
 	const int h = PATBOX.h;
-	if (NULL == pattern)
+	int minRow = NUM_TRACKS, maxRow = -1, minCol = STEPS_PER_PAGE, maxCol = -1;
+	for (int i = 0; i < NUM_TRACKS; i++)
 		{
-		// Draw empty grid
-		for (int i = 0; i < NUM_TRACKS; i++)
+		StepMask notes = pattern ? pattern->GetNoteMask(i) : 0;
+		StepMask cuts = pattern ? pattern->GetCutMask(i) : 0;
+		for (int j = 0; j < STEPS_PER_PAGE; j++)
 			{
-			for (int j = 0; j < STEPS_PER_PATTERN; j++)
-				{ 
-				SetSDLRect(dest, 96 + j * w, 80 + i * h, w, h);
-				SDL_BlitSurface(textures, &src, surface, &dest);
+			int step = firstStep + j;
+			unsigned char cell;
+			if (step >= length)
+				cell = CELL_BLANK;
+			else if (cuts & STEP_BIT(step))				// mute drum (end note)
+				cell = CELL_NOTECUT;
+			else if (!(notes & STEP_BIT(step)))
+				cell = (0 == (j & 0x3)) ? CELL_NONOTEBEAT : CELL_NONOTE;
+			else if (pattern->GetVol(i, step) > 100)		// accent note
+				cell = CELL_ACCENT;
+			else										// trigger normal drum note
+				cell = CELL_NOTEON;
+
+			if (cell == gridCells[i][j])
+				continue;
+			gridCells[i][j] = cell;
+
+			SetSDLRect(dest, 96 + j * w, 80 + i * h, w, h);
+			int tex = GetGridCellTexture(cell);
+			if (0 == tex)
+				{
+				SDL_FillRect(surface, &dest, g_bgColour);
 				}
-			}
-		}
-	else
-		{
-		for (int i = 0; i < NUM_TRACKS; i++)
-			{
-			for (int j = 0; j < STEPS_PER_PATTERN; j++)
+			else
 				{
-				unsigned char vol = pattern->events[i][j].vol;
-				if (0 == vol)
-					{
-					if (0 == (j & 0x3))
-						src.x = texmap[TM_NONOTEBEAT].x;
-					else
-						src.x = texmap[TM_NONOTE].x;
-					}
-				else if (1 == vol)		// mute drum (end note)
-					src.x = texmap[TM_NOTECUT].x;
-				else if (vol > 100)		// accent note
-					src.x = texmap[TM_ACCENT].x;
-				else					// trigger normal drum note
-					src.x = texmap[TM_NOTEON].x;
-				SetSDLRect(dest, 96 + j * w, 80 + i * h, w, h);
+				src.x = texmap[tex].x;
 				SDL_BlitSurface(textures, &src, surface, &dest);
 				}
+
+			if (i < minRow) minRow = i;
+			if (i > maxRow) maxRow = i;
+			if (j < minCol) minCol = j;
+			if (j > maxCol) maxCol = j;
 			}
 		}
 
+	// send only the changed part of the grid to the screen
+	if (maxRow >= 0 && surface == backImg)
+		{
+		SetSDLRect(dest, 96 + minCol * w, 80 + minRow * h, (maxCol - minCol + 1) * w, (maxRow - minRow + 1) * h);
+		presenter.MarkDirty(dest);
+		}
+
 	// Draw pattern name
-	char s[200];
-	strcpy(s, "Pattern: ");
-	strcat(s, pattern->name);
+	MarkZoneDirty(surface, ZONE_PATNAME);
 	dest = 	zones[ZONE_PATNAME];
 	SDL_FillRect(surface, &dest, g_bgColour);
 	if (NULL != pattern)
+		{
+		char s[200];
+		strcpy(s, "Pattern: ");
+		strcat(s, pattern->name);
+		int numPages = (pattern->GetLength() + STEPS_PER_PAGE - 1) / STEPS_PER_PAGE;
+		if (numPages > 1)
+			sprintf(s + strlen(s), " [%d/%d]", gridPage + 1, numPages);
 		bigFont->DrawText(surface, s, dest, false);
+		}
 
 }
 
@@ -483,6 +677,10 @@ void DrawPatternGrid(SDL_Surface* surface, DrumPattern* pattern)
 /// - playback mode (song / pattern)
 void DrawGeneralInfo(SDL_Surface* surface)
 {
+	MarkZoneDirty(surface, ZONE_SONGNAME);
+	MarkZoneDirty(surface, ZONE_KITNAME);
+	MarkZoneDirty(surface, ZONE_OPTIONS);
+	MarkZoneDirty(surface, ZONE_MODE);
 	char s[200];
 	// draw song name
 	SDL_Rect dest = zones[ZONE_SONGNAME];
@@ -496,9 +694,9 @@ void DrawGeneralInfo(SDL_Surface* surface)
 	strcat(s, drumKit.name);
 	bigFont->DrawText(surface, s, dest, false);
 
-	// draw shuffle / volrand options values
+	// draw groove / volrand options values
 	dest = zones[ZONE_OPTIONS];
-	sprintf(s, "Shuffle %d  VolRand %d", transport.shuffle, transport.volrand);
+	sprintf(s, "%s VolRand %d", transport.groove.GetName(), transport.volrand);
 	//smallFont->DrawText(surface, s, dest, false);
 	bigFont->DrawText(surface, s, dest, false);
 
@@ -506,11 +704,14 @@ void DrawGeneralInfo(SDL_Surface* surface)
 	dest = zones[ZONE_MODE];
 	//SDL_FillRect(surface, &dest, g_bgColour);
 	if (Transport::PM_PATTERN == transport.mode)
-		bigFont->DrawText(surface, "Mode: Pattern", dest, false);
+		strcpy(s, "Mode: Pattern");
 	else if (Transport::PM_SONG == transport.mode)
-		bigFont->DrawText(surface, "Mode: Song", dest, false);
+		strcpy(s, "Mode: Song");
 	else
-		bigFont->DrawText(surface, "Mode: Live", dest, false);
+		strcpy(s, "Mode: Live");
+	if (recorder.IsRecording())
+		strcat(s, "  REC");
+	bigFont->DrawText(surface, s, dest, false);
 }
 	
 // draw cursor
@@ -537,7 +738,14 @@ void DrawCursor(int x, int y)
 void DrawAll()
 {
 	// clear background
-	SDL_FillRect(backImg, NULL, g_bgColour); //SDL_MapRGB(screen->format, 0, 0, 0));
+	// (not the pattern grid - it only redraws the cells that have changed)
+	SDL_Rect rect;
+	SetSDLRect(rect, 0, 0, VIEW_WIDTH, zones[ZONE_PATGRID].y);
+	SDL_FillRect(backImg, &rect, g_bgColour); //SDL_MapRGB(screen->format, 0, 0, 0));
+	presenter.MarkDirty(rect);
+	rect = zones[ZONE_TRACKINFO];
+	SDL_FillRect(backImg, &rect, g_bgColour);
+	presenter.MarkDirty(rect);
 	
 	// draw various elements
 	DrawSliders(backImg);
@@ -554,22 +762,6 @@ void DrawAll()
 	
 }
 
-// blit background buffer to screen
-void BlitBG()
-{
-	SDL_Rect src;
-	src.x = 0;
-	src.y = 0;
-	src.w = VIEW_WIDTH;
-	src.h = VIEW_HEIGHT;
-	SDL_Rect dest;
-	dest.x = 0;
-	dest.y = 0;
-	dest.w = VIEW_WIDTH;
-	dest.h = VIEW_HEIGHT;
-	SDL_BlitSurface(backImg, &src, screen, &dest);
-}
-
 /// Get the index of the solo'ed track
 /// @return		Index number of track that is solo, else -1
 int GetSoloTrack()
@@ -630,6 +822,211 @@ void SetTrackSolo(int track)
 		
 }
 
+/// Get the index of a pattern in the song
+int GetPatternIndex(const DrumPattern* pattern)
+{
+	return (int)(pattern - song.patterns);
+}
+
+/// Finish an undoable edit
+void EndEdit()
+{
+	history.EndGroup(song);
+}
+
+/// Stop live recording
+void StopRecording()
+{
+	if (!recorder.IsRecording())
+		return;
+
+	recorder.Stop();
+	EndEdit();
+	DrawAll();
+}
+
+/// Start an undoable edit of the current pattern (stopping live recording
+/// into it first - only the play thread writes the pattern being recorded)
+/// @param label		Description of the edit (shown in undo menu)
+void BeginPatternEdit(const char* label)
+{
+	if (currentPattern && currentPattern == recorder.GetPattern())
+		StopRecording();
+	history.BeginGroup(label);
+	if (currentPattern)
+		history.TouchPattern(song, GetPatternIndex(currentPattern));
+}
+
+/// Start an undoable edit of the song sequence
+/// @param label		Description of the edit (shown in undo menu)
+void BeginSequenceEdit(const char* label)
+{
+	history.BeginGroup(label);
+	history.TouchSongList(song);
+}
+
+/// Start live recording into the current pattern
+/// (the whole take is one undoable edit, but the notes are journaled as
+/// they are recorded - see JournalRecording())
+void StartRecording()
+{
+	if (!currentPattern || recorder.IsRecording())
+		return;
+
+	BeginPatternEdit("Record");
+	recordPatternIndex = GetPatternIndex(currentPattern);
+	recordJournalled = *currentPattern;
+	recorder.Start(currentPattern);
+	DrawAll();
+}
+
+/// Journal the notes recorded since the last call (UI thread, every frame
+/// while recording), so a crash during a take only loses the last moment
+/// of it. The undo history still gets the whole take when it stops.
+void JournalRecording()
+{
+	if (!recorder.IsRecording())
+		return;
+
+	DrumPattern* pattern = &song.patterns[recordPatternIndex];
+	if (!pattern->IsSameAs(&recordJournalled))
+		{
+		journal.LogPatternChange(recordPatternIndex, &recordJournalled, pattern);
+		recordJournalled = *pattern;
+		}
+}
+
+/// Edit history callback - record a committed pattern change in the journal
+void JournalPatternChanged(int index, const DrumPattern* before, const DrumPattern* after)
+{
+	journal.LogPatternChange(index, before, after);
+}
+
+/// Edit history callback - record a committed songlist change in the journal
+void JournalSongListChanged(const Song& changedSong, int start, int count)
+{
+	journal.LogSongList(changedSong, start, count);
+}
+
+/// Record the mix settings of all tracks in the journal
+/// (mute / solo can change more than one track)
+void JournalTrackMix()
+{
+	for (int i = 0; i < NUM_TRACKS; i++)
+		journal.LogTrackMix(song, i);
+}
+
+/// Undo (or redo) the last edit
+/// @param redo			If true, redo the last undone edit
+void UndoEdit(bool redo)
+{
+	StopRecording();
+	bool changed = redo ? history.Redo(song) : history.Undo(song);
+	if (changed)
+		DrawAll();
+}
+
+/// Stop playback, and wait for the play thread to finish the tick it is on
+/// (like LiveRecorder::Stop()), so the song or the kit can be replaced safely
+void StopPlayTick()
+{
+	transport.playing = false;
+	__sync_synchronize();
+	while (playTickBusy)
+		SDL_Delay(1);
+}
+
+/// Load a drumkit (locking the samples into RAM in real-time mode)
+/// NB: stops playback (the caller restarts it)
+/// @param kitname		Name of the drumkit
+/// @return				true if the drumkit loaded OK
+bool LoadDrumKit(const char* kitname)
+{
+	StopPlayTick();				// (so no more samples of the old kit are queued)
+	engine.StopAll();			// stop all samples playing
+
+	for (int i = 0; i < MAX_DRUMS_PER_KIT; i++)
+		{
+		Mix_Chunk* chunk = drumKit.drums[i].sampleData;
+		if (chunk)
+			realtime.UnlockBuffer(chunk->abuf, chunk->alen);
+		}
+
+	bool loaded = drumKit.Load(kitname, progress_callback);
+
+	for (int i = 0; i < MAX_DRUMS_PER_KIT; i++)
+		{
+		Mix_Chunk* chunk = drumKit.drums[i].sampleData;
+		if (chunk)
+			realtime.LockBuffer(chunk->abuf, chunk->alen);
+		}
+
+	return loaded;
+}
+
+/// Load a song from the songs folder (and start a new undo history and
+/// autosave journal for it)
+/// @param songname		Name of the song file
+/// @return				true if the song loaded OK
+bool LoadSong(const char* songname)
+{
+	StopRecording();			// loading replaces the patterns
+
+	char filename[200];
+	strcpy(filename, "songs/");
+	strcat(filename, songname);
+	//strcat(filename, ".xds");
+	bool loaded = song.Load(filename, progress_callback);
+	if (loaded)
+		{
+		// (else keep the history, and journal against the last good base)
+		history.Clear();
+		journal.Start(filename);
+		}
+	return loaded;
+}
+
+/// Import a MIDI file as the song (one pattern per bar, see MidiFileImporter)
+/// @param midiname		MIDI file in the midi folder
+/// @return				false if the file could not be imported
+bool ImportMidi(const char* midiname)
+{
+	StopRecording();			// importing replaces the patterns
+
+	char filename[200];
+	strcpy(filename, "midi/");
+	strcat(filename, midiname);
+
+	// NB: the play thread must not play the patterns while they are rebuilt
+	bool wasPlaying = transport.playing;
+	StopPlayTick();
+	MidiFileImporter importer;
+	importer.SetKit(&drumKit);
+	bool imported = importer.Import(filename, &song);
+	if (imported)
+		{
+		currentPatternIndex = song.songList[0];
+		SyncPatternPointer();
+		}
+	transport.playing = wasPlaying;
+	if (!imported)
+		return false;
+
+	// the imported song has no file yet, so journal edits against a copy
+	history.Clear();
+	song.Save(JOURNAL_BASE_FILE, progress_callback);
+	journal.Start(JOURNAL_BASE_FILE);
+
+	if (importer.WasTruncated() || importer.GetDroppedNotes() > 0)
+		{
+		char message[120];
+		sprintf(message, "%d bars imported%s.\n%d notes had no drum track.", importer.GetBars(),
+				importer.WasTruncated() ? " (song is full)" : "", importer.GetDroppedNotes());
+		DoMessage(screen, bigFont, "Import MIDI", message, false);
+		}
+	return true;
+}
+
 /// Prompt user to load a drumkit
 /// @return			true if drumkit selected and loaded OK
 bool PromptLoadDrumkit()
@@ -642,8 +1039,7 @@ bool PromptLoadDrumkit()
 		// NB: WE must stop playback while loading/unloading samples (chunks)
 		bool wasPlaying = transport.playing;
 		transport.playing = false;
-		Mix_HaltChannel(-1);			// stop all channels playing
-		loaded = drumKit.Load(kitname, progress_callback);
+		loaded = LoadDrumKit(kitname);
 		if (!loaded)
 			DoMessage(screen, bigFont, "Error", "Error loading drumkit!", false); 
 		transport.playing = wasPlaying;
@@ -652,31 +1048,191 @@ bool PromptLoadDrumkit()
 	return loaded;
 }
 
+/// Display the performance menu (timing / metrics) and process the result
+int DoPerformanceMenu()
+{
+	Menu menu;
+	menu.AddItem(1, "Step Timer", "Legacy|HiRes|HiRes+Spin", (int)transport.stepTimer, "Tick timing (compare with Show Metrics)");	
+	menu.AddItem(2, "Show Metrics", "No|Yes", showMetrics ? 1 : 0, "Show frame / audio timing overlay");	
+	menu.AddItem(3, "Save Metrics", "Write timing metrics to " METRICS_FILE);	
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Performance Menu", 0);
+
+	if (selectedId > -1)
+		{
+		transport.stepTimer = (Transport::STEP_TIMER)menu.GetItemSelectedOption(1);
+		showMetrics = (0 == menu.GetItemSelectedOption(2)) ? false : true;
+		}
+
+	if (3 == selectedId)
+		{
+		if (metrics.WriteFile(METRICS_FILE))
+			DoMessage(screen, bigFont, "Metrics", "Metrics written to " METRICS_FILE, false);
+		else
+			DoMessage(screen, bigFont, "Error", "Unable to write " METRICS_FILE "!", false);
+		}
+
+	return selectedId;
+}
+
+/// Display the live pads menu (quantise / recording) and process the result
+int DoLivePadsMenu()
+{
+	static const int quantiseTicks[] = { 0, TICKS_PER_STEP, 1 };
+	int selectedQuantiseOption = 0;
+	for (int i = 0; i < 3; i++)
+		{
+		if (quantiseTicks[i] == transport.liveQuantise)
+			selectedQuantiseOption = i;
+		}
+
+	Menu menu;
+	menu.AddItem(1, "Live Quantise", "Off|1/16|1/64", selectedQuantiseOption, "Quantise live pad hits (keys 1 to 8)");	
+	menu.AddItem(2, "Record Mode", "Merge|Replace", (int)recorder.GetMode(), "Add to or replace the notes of tracks played");	
+	menu.AddItem(3, "Record", "Off|On", recorder.IsRecording() ? 1 : 0, "Record live pads into current pattern (O key)");	
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Live Pads Menu", 0);
+
+	if (selectedId > -1)
+		{
+		transport.liveQuantise = quantiseTicks[menu.GetItemSelectedOption(1)];
+		recorder.SetMode((LiveRecorder::RECORD_MODE)menu.GetItemSelectedOption(2));
+		if (0 == menu.GetItemSelectedOption(3))
+			StopRecording();
+		else
+			StartRecording();
+		}
+
+	return selectedId;
+}
+
+/// Display the groove menu and process the result
+/// @return				Id of selected item, or -1 if menu escaped
+int DoGrooveMenu()
+{
+	static const int swingPercents[] = { 50, 54, 58, 62, 66, 71, 75 };
+	Groove* groove = &transport.groove;
+	int selectedTypeOption = (groove->GetSwingSteps() > 0) ? 2 - groove->GetSwingSteps() : 2;
+	int selectedSwingOption = 0;
+	for (int i = 0; i < 7; i++)
+		{
+		if (swingPercents[i] == groove->GetSwing())
+			selectedSwingOption = i;
+		}
+
+	char extractHelp[40];
+	sprintf(extractHelp, "Use the timing / accents of P%d", currentPatternIndex + 1);
+	Menu menu;
+	menu.AddItem(1, "Swing", "8ths|16ths|Pattern", selectedTypeOption, "Swing 8th or 16th notes, or pattern groove");	
+	menu.AddItem(2, "Swing (%)", "50|54|58|62|66|71|75", selectedSwingOption, "MPC style swing (50 = none, 66 = triplets)");	
+	menu.AddItem(3, "Extract Groove", extractHelp);	
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Groove Menu", 0);
+
+	if (3 == selectedId)
+		{
+		if (!currentPattern || !groove->Extract(currentPattern, currentPatternIndex))
+			DoMessage(screen, bigFont, "Groove", "The pattern has no notes.", false);
+		}
+	else if (selectedId > -1)
+		{
+		// (an extracted groove is kept until swing is chosen again)
+		int type = menu.GetItemSelectedOption(1);
+		int percent = swingPercents[menu.GetItemSelectedOption(2)];
+		if (type < 2)
+			groove->SetSwing(percent, 2 - type);
+		}
+
+	return selectedId;
+}
+
+/// Display the master dynamics menu and process the result
+/// @return				Id of selected item, or -1 if menu escaped
+int DoDynamicsMenu()
+{
+	static const int ceilings[] = { 0, -1, -3, -6 };
+	static const int thresholds[] = { -6, -12, -18, -24 };
+	static const int ratios[] = { 2, 3, 4, 8 };
+	int selectedLimiterOption = 0;
+	int selectedCompressorOption = 0;
+	int selectedRatioOption = 2;
+	for (int i = 0; i < 4; i++)
+		{
+		if (masterDynamics.IsLimiterOn() && ceilings[i] == masterDynamics.GetCeiling())
+			selectedLimiterOption = i + 1;
+		if (masterDynamics.IsCompressorOn() && thresholds[i] == masterDynamics.GetThreshold())
+			selectedCompressorOption = i + 1;
+		if (ratios[i] == masterDynamics.GetRatio())
+			selectedRatioOption = i;
+		}
+
+	Menu menu;
+	menu.AddItem(1, "Limiter (dB)", "Off|0|-1|-3|-6", selectedLimiterOption, "Keep the output under this level (no clipping)");	
+	menu.AddItem(2, "Compressor (dB)", "Off|-6|-12|-18|-24", selectedCompressorOption, "Compress the mix above this level");	
+	menu.AddItem(3, "Ratio", "2:1|3:1|4:1|8:1", selectedRatioOption, "Compression above the level");	
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Master Dynamics Menu", 0);
+
+	if (selectedId > -1)
+		{
+		int limiter = menu.GetItemSelectedOption(1);
+		int compressor = menu.GetItemSelectedOption(2);
+		masterDynamics.SetLimiter(limiter > 0, (limiter > 0) ? ceilings[limiter - 1] : masterDynamics.GetCeiling());
+		masterDynamics.SetCompressor(compressor > 0, (compressor > 0) ? thresholds[compressor - 1] : masterDynamics.GetThreshold(),
+									ratios[menu.GetItemSelectedOption(3)]);
+		}
+
+	return selectedId;
+}
+
 /// Display the options menu and process the result 
 int DoOptionsMenu()
 {
-	int selectedShuffleOption = transport.shuffle;
 	int selectedJitterOption = transport.jitter / 5;
 	int selectedVolrandOption = transport.volrand / 10;
 	int selectedFlashOption = transport.flashOnBeat ? 1 : 0; 
+	static const int frameRates[] = { 10, 15, 20, 30, 60 };
+	int selectedFrameRateOption = 3;
+	for (int i = 0; i < 5; i++)
+		{
+		if (frameRates[i] == uiScheduler.GetFrameBudget())
+			selectedFrameRateOption = i;
+		}
 
 	Menu menu;
-	menu.AddItem(1, "Shuffle", "0|1|2|3", selectedShuffleOption, "Set shuffle amount (2 = standard shuffle)");	
-	menu.AddItem(2, "Jitter (ms)", "0|5|10|15", selectedJitterOption, "!!! NOT IMPLEMENTED !!!"); // Randomise playback timing");	
+	menu.AddItem(1, "Groove", "Swing and groove templates");	
+	menu.AddItem(2, "Jitter (ms)", "0|5|10|15", selectedJitterOption, "Randomise playback timing");	
 	menu.AddItem(3, "VolRand (%)", "0|10|20|30|40|50", selectedVolrandOption, "Randomise hit volume");	
 	menu.AddItem(4, "Flash BG on Beat", "No|Yes", selectedFlashOption, "Flash pattern grid background on the beat");	
+	menu.AddItem(5, "Max Frame Rate", "10|15|20|30|60", selectedFrameRateOption, "Max screen updates per second");	
+	menu.AddItem(6, "Live Pads", "Live pad quantise and recording");	
+	menu.AddItem(7, "Performance", "Step timer and timing metrics");	
+	menu.AddItem(8, "Master Dynamics", "Output limiter and compressor");	
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Options Menu", 0);
 	
-	// Update shuffle and jitter from menu item data
+	// Update jitter and volrand from menu item data
 	if (selectedId > -1)
 		{
-		transport.shuffle = menu.GetItemSelectedOption(1);
 		transport.jitter = menu.GetItemSelectedOption(2) * 5;
 		transport.volrand = menu.GetItemSelectedOption(3) * 10;
 		transport.flashOnBeat = (0 == menu.GetItemSelectedOption(4)) ? false : true;
+		uiScheduler.SetFrameBudget(frameRates[menu.GetItemSelectedOption(5)]);
 		}
+
+	if (1 == selectedId)
+		DoGrooveMenu();
+	else if (6 == selectedId)
+		DoLivePadsMenu();
+	else if (7 == selectedId)
+		DoPerformanceMenu();
+	else if (8 == selectedId)
+		DoDynamicsMenu();
 	
 	DrawAll();
 	
@@ -688,10 +1244,12 @@ int DoVolBPMMenu(int initialSelection)
 {
 	int selectedVolOption = GetMainVolume() / 10;		// main vol 0 to 100
 	int selectedBPMOption = (song.BPM / 10) - 6;		// starts at 60
+	int selectedSeedOption = (song.seed - 1) % 16;		// seeds 1 to 16
 
 	Menu menu;
 	menu.AddItem(1, "Main Vol (%)", "Mute|10|20|30|40|50|60|70|80|90|100", selectedVolOption, "Set main volume");	
 	menu.AddItem(2, "BPM", "60|70|80|90|100|110|120|130|140|150|160|170|180", selectedBPMOption, "Set playback speed in BPM");	
+	menu.AddItem(3, "Random Seed", "1|2|3|4|5|6|7|8|9|10|11|12|13|14|15|16", selectedSeedOption, "VolRand / jitter (same seed = same hits)");	
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Volume/BPM Menu", initialSelection);
@@ -701,6 +1259,9 @@ int DoVolBPMMenu(int initialSelection)
 		{
 		SetMainVolume(menu.GetItemSelectedOption(1) * 10);
 		song.BPM = (menu.GetItemSelectedOption(2) * 10) + 60;
+		if (menu.GetItemSelectedOption(3) != selectedSeedOption)
+			song.seed = menu.GetItemSelectedOption(3) + 1;
+		journal.LogSongParams(song);
 		}
 	
 	DrawAll();
@@ -712,11 +1273,16 @@ int DoVolBPMMenu(int initialSelection)
 /// Display the song context menu and process the result 
 int DoFileMenu(int initialSelection)
 {
+	StopRecording();			// loading replaces the patterns
+
 	Menu menu;
 	menu.AddItem(1, "Load song", "Load a song from file");	
 	menu.AddItem(2, "Save song", "Save this song to a file");	
 	menu.AddItem(3, "Load DrumKit", "Load a different drumkit");
 	menu.AddItem(4, "Record to WAV", "Record next play to WAV file");
+	menu.AddItem(5, "Export MIDI", "Song (or pattern) to a MIDI file");
+	menu.AddItem(6, "Import MIDI", "Replace the song with a MIDI file");
+	menu.AddItem(7, "Render to WAV", "Song (or pattern) to a WAV file, fast");
 
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
@@ -730,11 +1296,7 @@ int DoFileMenu(int initialSelection)
 			strcpy(songname, song.name);
 			if (DoFileSelect(screen, bigFont, "Select song to load", "songs", songname))
 				{
-				char filename[200];
-				strcpy(filename, "songs/");
-				strcat(filename, songname);
-				//strcat(filename, ".xds");
-				if (!song.Load(filename, progress_callback))
+				if (!LoadSong(songname))
 					DoMessage(screen, bigFont, "Error", "Error loading song!", false); 
 				}
 			}
@@ -753,7 +1315,8 @@ int DoFileMenu(int initialSelection)
 				strcpy(filename, "songs/");
 				strcat(filename, songname);
 				strcat(filename, ".xds");
-				song.Save(filename, progress_callback);
+				if (song.Save(filename, progress_callback))
+					journal.Start(filename);
 				}
 			}
 			break;
@@ -777,6 +1340,58 @@ int DoFileMenu(int initialSelection)
 				}
 			}
 			break;
+		case 5 :		// EXPORT MIDI
+			{
+			// Get MIDI file name
+			char midiname[SONG_NAME_LEN];
+			strcpy(midiname, song.name);
+			if (DoTextInput(screen, bigFont, "Enter MIDI file name", midiname, SONG_NAME_LEN))
+				{
+				char filename[200];
+				strcpy(filename, "midi/");
+				strcat(filename, midiname);
+				strcat(filename, ".mid");
+				// the song sequence in song mode, else the current pattern
+				MidiFileExporter exporter;
+				exporter.SetKit(&drumKit);
+				exporter.SetGroove(&transport.groove);
+				bool exported;
+				if (Transport::PM_SONG == transport.mode)
+					exported = exporter.ExportSong(&song, filename);
+				else
+					exported = exporter.ExportPattern(&song, currentPatternIndex, filename);
+				if (!exported)
+					DoMessage(screen, bigFont, "Error", "Error writing MIDI file!", false);
+				}
+			}
+			break;
+		case 6 :		// IMPORT MIDI
+			{
+			char midiname[MAX_FILENAME_LEN];
+			strcpy(midiname, "");
+			if (DoFileSelect(screen, bigFont, "Select MIDI file to import", "midi", midiname))
+				{
+				if (!ImportMidi(midiname))
+					DoMessage(screen, bigFont, "Error", "Error importing MIDI file!", false);
+				}
+			}
+			break;
+		case 7 :		// RENDER TO WAV
+			{
+			// Get wav file name
+			char wavname[SONG_NAME_LEN];
+			strcpy(wavname, song.name);
+			if (DoTextInput(screen, bigFont, "Enter output file name", wavname, SONG_NAME_LEN))
+				{
+				char filename[200];
+				strcpy(filename, "wav/");
+				strcat(filename, wavname);
+				strcat(filename, ".wav");
+				if (!RenderWav(filename))
+					DoMessage(screen, bigFont, "Error", "Error rendering WAV file!", false);
+				}
+			}
+			break;
 		}
 
 	DrawAll();
@@ -784,20 +1399,170 @@ int DoFileMenu(int initialSelection)
 	return selectedId;
 }
 	
-/// Display the track context menu and process the result 
-/// @param track 		The track that we want to show menu for
-int DoTrackMenu(int track)
+/// Display the track tools menu and process the result
+/// @param track 		The track that we want to change
+/// @return				Id of selected item, or -1 if menu escaped
+int DoTrackToolsMenu(int track)
 {
+	if (!currentPattern)
+		return -1;
+
 	char menuTitle[64];
-	sprintf(menuTitle, "Track Menu [%s]", drumKit.drums[track].name);
+	sprintf(menuTitle, "Track Tools [%s]", drumKit.drums[track].name);
 
-	int selectedVolOption = (song.trackMixInfo[track].vol * 10) / 255;		// track vol 0 to 255
+	static const int fillSteps[] = { 2, 3, 4, 6, 8 };
+	static const int moveSteps[] = { -4, -1, 1, 4 };
+	const char* trackOptions = "1|2|3|4|5|6|7|8";
 
 	Menu menu;
-	menu.AddItem(1, "Track Vol (%)", "Mute|10|20|30|40|50|60|70|80|90|100", selectedVolOption, "Set track mix volume");	
-	menu.AddItem(2, "Copy track", "Copy the track data for this pattern");	
-	menu.AddItem(3, "Paste track", "Paste track data");	
-	menu.AddItem(4, "Clear track", "Remove all events on this track");
+	menu.AddItem(1, "Fill every", "2|3|4|6|8", 2, "Add a note every N steps");
+	menu.AddItem(2, "Euclid notes", "1|2|3|4|5|6|7|8|9|10|11|12|13|14|15|16", 4, "Spread N notes evenly over the pattern");
+	menu.AddItem(3, "Rotate", "<4|<1|>1|>4", 2, "Rotate notes (wrap around)");
+	menu.AddItem(4, "Shift", "<4|<1|>1|>4", 2, "Shift notes (drop notes off the end)");
+	menu.AddItem(5, "AND with track", trackOptions, track, "Keep notes that are also on track N");
+	menu.AddItem(6, "OR with track", trackOptions, track, "Add notes from track N");
+	menu.AddItem(7, "Find next note", "Move cursor to next note on this track");
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, menuTitle, 0);
+	// process result
+	switch (selectedId)
+		{
+		case 1 :		// FILL
+			BeginPatternEdit("Fill track");
+			currentPattern->FillTrack(track, fillSteps[menu.GetItemSelectedOption(1)], 64);
+			EndEdit();
+			break;
+		case 2 :		// EUCLID
+			BeginPatternEdit("Euclid track");
+			currentPattern->EuclidTrack(track, menu.GetItemSelectedOption(2) + 1, 64);
+			EndEdit();
+			break;
+		case 3 :		// ROTATE
+			BeginPatternEdit("Rotate track");
+			currentPattern->RotateTrack(track, moveSteps[menu.GetItemSelectedOption(3)]);
+			EndEdit();
+			break;
+		case 4 :		// SHIFT
+			BeginPatternEdit("Shift track");
+			currentPattern->ShiftTrack(track, moveSteps[menu.GetItemSelectedOption(4)]);
+			EndEdit();
+			break;
+		case 5 :		// AND
+			BeginPatternEdit("AND tracks");
+			currentPattern->AndTrack(track, menu.GetItemSelectedOption(5));
+			EndEdit();
+			break;
+		case 6 :		// OR
+			BeginPatternEdit("OR tracks");
+			currentPattern->OrTrack(track, menu.GetItemSelectedOption(6));
+			EndEdit();
+			break;
+		case 7 :		// FIND NEXT
+			{
+			int step = currentPattern->FindNextEvent(track, (track == currentTrack) ? currentStep : -1);
+			if (step >= 0)
+				{
+				currentTrack = track;
+				currentStep = step;
+				gridPage = step / STEPS_PER_PAGE;
+				}
+			}
+			break;
+		}
+
+	DrawPatternGrid(backImg, currentPattern);
+
+	return selectedId;
+}
+
+/// Add (or remove) the point of an automation lane at the grid cursor's
+/// step of the current song position
+/// @param lane			Lane (AUTOMATION_xxx)
+/// @param value		Value of the point (-1 = remove the point)
+void SetAutomationPoint(int lane, int value)
+{
+	AutomationLane* automationLane = &song.automation[lane];
+	if (value < 0)
+		automationLane->RemovePoint(song.songPos, currentStep);
+	else if (!automationLane->SetPoint(song.songPos, currentStep, value))
+		DoMessage(screen, bigFont, "Automation", "Too many points in this lane!", false);
+	journal.LogAutomation(song, lane);
+}
+
+/// Display the automation menu of a track and process the result (points
+/// go at the grid cursor's step of the current song position)
+/// @param track 		The track that we want to automate
+/// @return				Id of selected item, or -1 if menu escaped
+int DoTrackAutomationMenu(int track)
+{
+	char menuTitle[64];
+	sprintf(menuTitle, "Automation [%s] %d:%d", drumKit.drums[track].name, song.songPos + 1, currentStep + 1);
+
+	// points already here (option 0 = no point)
+	int volLane = AUTOMATION_TRACK_VOL(track);
+	int panLane = AUTOMATION_TRACK_PAN(track);
+	const AutomationPoint* point = song.automation[volLane].GetPoint(song.songPos, currentStep);
+	int volOption = point ? 1 + (point->value * 10 + 127) / 255 : 0;
+	point = song.automation[panLane].GetPoint(song.songPos, currentStep);
+	int panOption = point ? 1 + (point->value + 16) / 32 : 0;
+	point = song.automation[AUTOMATION_MASTER_VOL].GetPoint(song.songPos, currentStep);
+	int songVolOption = point ? 1 + (point->value * 10 + 127) / 255 : 0;
+	const char* volOptions = "None|Mute|10|20|30|40|50|60|70|80|90|100";
+
+	Menu menu;
+	menu.AddItem(1, "Track Vol (%)", volOptions, volOption, "Track vol at this step (song mode)");
+	menu.AddItem(2, "Track Pan", "None|L|L75|L50|L25|C|R25|R50|R75|R", panOption, "Track pan at this step (song mode)");
+	menu.AddItem(3, "Song Vol (%)", volOptions, songVolOption, "Song vol at this step (song mode)");
+	menu.AddItem(4, "Clear track", "Remove this track's vol and pan points");
+	menu.AddItem(5, "Clear song vol", "Remove the song vol points");
+	SDL_Rect r1;
+	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
+	int selectedId = menu.DoMenu(screen, &r1, bigFont, menuTitle, 0);
+	// process result
+	switch (selectedId)
+		{
+		case 1 :		// TRACK VOL
+			SetAutomationPoint(volLane, ((menu.GetItemSelectedOption(1) - 1) * 255) / 10);
+			break;
+		case 2 :		// TRACK PAN
+			{
+			int pan = (menu.GetItemSelectedOption(2) - 1) * 32;
+			SetAutomationPoint(panLane, (pan > 255) ? 255 : pan);
+			}
+			break;
+		case 3 :		// SONG VOL
+			SetAutomationPoint(AUTOMATION_MASTER_VOL, ((menu.GetItemSelectedOption(3) - 1) * 255) / 10);
+			break;
+		case 4 :		// CLEAR TRACK
+			song.automation[volLane].numPoints = 0;
+			song.automation[panLane].numPoints = 0;
+			journal.LogAutomation(song, volLane);
+			journal.LogAutomation(song, panLane);
+			break;
+		case 5 :		// CLEAR SONG VOL
+			song.automation[AUTOMATION_MASTER_VOL].numPoints = 0;
+			journal.LogAutomation(song, AUTOMATION_MASTER_VOL);
+			break;
+		}
+
+	return selectedId;
+}
+
+/// Display the track context menu and process the result 
+/// @param track 		The track that we want to show menu for
+int DoTrackMenu(int track)
+{
+	char menuTitle[64];
+	sprintf(menuTitle, "Track Menu [%s]", drumKit.drums[track].name);
+
+	int selectedVolOption = (song.trackMixInfo[track].vol * 10) / 255;		// track vol 0 to 255
+
+	Menu menu;
+	menu.AddItem(1, "Track Vol (%)", "Mute|10|20|30|40|50|60|70|80|90|100", selectedVolOption, "Set track mix volume");	
+	menu.AddItem(2, "Copy track", "Copy the track data for this pattern");	
+	menu.AddItem(3, "Paste track", "Paste track data");	
+	menu.AddItem(4, "Clear track", "Remove all events on this track");
 	if (TrackMixInfo::TS_MUTE != song.trackMixInfo[track].state)
 		menu.AddItem(5, "Mute track", "Mute this track");
 	else
@@ -806,6 +1571,8 @@ int DoTrackMenu(int track)
 		menu.AddItem(6, "Solo track", "Solo this track");
 	else
 		menu.AddItem(6, "Unsolo track", "Switch solo mode off");
+	menu.AddItem(7, "Track tools", "Fill, euclid, rotate, shift, combine");
+	menu.AddItem(8, "Automation", "Vol / pan along the song sequence");
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, menuTitle, 0);
@@ -817,41 +1584,53 @@ int DoTrackMenu(int track)
 			// ONLY CHANGE TRACK VOL IF IT IS SELECTED MENU ITEM
 			// (because it only goes in steps of 10%)
 			song.trackMixInfo[track].vol = (menu.GetItemSelectedOption(1) * 255) / 10;
+			journal.LogTrackMix(song, track);
 			}
 			break;
 		case 2 :		// COPY
 			{
-			for (int i = 0; i < STEPS_PER_PATTERN; i++)
+			trackClipboardLength = currentPattern->GetLength();
+			for (int i = 0; i < trackClipboardLength; i++)
 				{
-				trackClipboard[i].CopyFrom(&currentPattern->events[track][i]);
+				trackClipboard[i].CopyFrom(currentPattern->GetEvent(track, i));
 				}
 			}
 			break;
 		case 3 :		// PASTE
 			{
-			for (int i = 0; i < STEPS_PER_PATTERN; i++)
+			// paste as much as fits in this pattern
+			BeginPatternEdit("Paste track");
+			for (int i = 0; i < trackClipboardLength && i < currentPattern->GetLength(); i++)
 				{
-				currentPattern->events[track][i].CopyFrom(&trackClipboard[i]);
+				currentPattern->SetEvent(track, i, &trackClipboard[i]);
 				}
+			EndEdit();
 			}
 			DrawPatternGrid(backImg, currentPattern);
 			break;
 		case 4 :		// CLEAR
 			{
-			for (int i = 0; i < STEPS_PER_PATTERN; i++)
-				{
-				currentPattern->events[track][i].Init();
-				}
+			BeginPatternEdit("Clear track");
+			currentPattern->ClearTrack(track);
+			EndEdit();
 			}
 			DrawPatternGrid(backImg, currentPattern);
 			break;
 		case 5 :		// MUTE / UNMUTE
 			// Set / reset MUTE state
 			SetTrackMute(track);
+			JournalTrackMix();
 			break;
 		case 6 :		// SOLO
 			// Set / remove solo state
 			SetTrackSolo(track);
+			JournalTrackMix();
+			break;
+		case 7 :		// TRACK TOOLS
+			DoTrackToolsMenu(track);
+			break;
+		case 8 :		// AUTOMATION
+			DoTrackAutomationMenu(track);
 			break;
 		}
 
@@ -872,6 +1651,22 @@ int DoPatternMenu()
 	menu.AddItem(3, "Clear pattern", "Remove all events in this pattern");
 	menu.AddItem(4, "Rename pattern", "Change name of the pattern");
 	menu.AddItem(5, "Insert into song", "Insert current pattern into song");
+	char undoDescription[MAX_DESCRIPTION_LEN];
+	char redoDescription[MAX_DESCRIPTION_LEN];
+	sprintf(undoDescription, "Undo %s", history.CanUndo() ? history.GetUndoLabel() : "(nothing to undo)");
+	sprintf(redoDescription, "Redo %s", history.CanRedo() ? history.GetRedoLabel() : "(nothing to redo)");
+	menu.AddItem(6, "Undo", undoDescription);
+	menu.AddItem(7, "Redo", redoDescription);
+	// pattern length options
+	static const int lengthSteps[] = { 12, 16, 24, 32, 48, 64 };
+	const int numLengthOptions = sizeof(lengthSteps) / sizeof(int);
+	int selectedLengthOption = 1;
+	for (int i = 0; i < numLengthOptions; i++)
+		{
+		if (lengthSteps[i] == currentPattern->GetLength())
+			selectedLengthOption = i;
+		}
+	menu.AddItem(8, "Length (steps)", "12|16|24|32|48|64", selectedLengthOption, "Set pattern length (16 steps = 1 bar)");
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, menuTitle, 0);
@@ -882,10 +1677,14 @@ int DoPatternMenu()
 			patternClipboard.CopyFrom(currentPattern);
 			break;
 		case 2 :		// PASTE
+			BeginPatternEdit("Paste pattern");
 			currentPattern->CopyFrom(&patternClipboard);
+			EndEdit();
 			break;
 		case 3 :		// CLEAR
+			BeginPatternEdit("Clear pattern");
 			currentPattern->Clear();
+			EndEdit();
 			break;
 		case 4 :		// RENAME
 			{
@@ -895,12 +1694,27 @@ int DoPatternMenu()
 			if (DoTextInput(screen, bigFont, "Enter new pattern name", patname, PATTERN_NAME_LENGTH))
 				{
 				// TODO : Implement pattern->SetName() (safer!)
+				BeginPatternEdit("Rename pattern");
 				strcpy(currentPattern->name, patname);
+				EndEdit();
 				}
 			}
 			break;
 		case 5 :		// INSERT PATTERN
+			BeginSequenceEdit("Insert pattern");
 			song.InsertPattern(currentPatternIndex);
+			EndEdit();
+			break;
+		case 6 :		// UNDO
+			UndoEdit(false);
+			break;
+		case 7 :		// REDO
+			UndoEdit(true);
+			break;
+		case 8 :		// LENGTH
+			BeginPatternEdit("Pattern length");
+			currentPattern->SetLength(lengthSteps[menu.GetItemSelectedOption(8)]);
+			EndEdit();
 			break;
 		}
 
@@ -914,10 +1728,18 @@ int DoSequenceMenu()
 {
 	int currentPosOption = song.songPos / 10;		// track vol 0 to 255
 
+	// tempo change at the start of the current song position
+	const TempoPoint* point = song.GetTempoPoint(song.songPos, 0);
+	int tempoChangeOption = point ? (1 + point->ramp) : 0;
+	int tempoBPM = point ? point->bpm : song.BPM;
+	int tempoOption = (tempoBPM < 60) ? 0 : ((tempoBPM > 180) ? 12 : (tempoBPM - 60 + 5) / 10);		// starts at 60
+
 	Menu menu;
 	menu.AddItem(1, "Insert pattern", "Insert current pattern into song");
 	menu.AddItem(2, "Remove pattern", "Remove pattern from the song");
 	menu.AddItem(3, "Go to position", "1|11|21|31|41|51|61|71|81|91", currentPosOption, "Set current song position");	
+	menu.AddItem(4, "Tempo change", "None|Jump|Ramp", tempoChangeOption, "Tempo change at this song position");
+	menu.AddItem(5, "Tempo BPM", "60|70|80|90|100|110|120|130|140|150|160|170|180", tempoOption, "Tempo to change to");
 	SDL_Rect r1;
 	SetSDLRect(r1, 16, 16, VIEW_WIDTH - 32, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, "Sequence Menu", 0);
@@ -925,10 +1747,14 @@ int DoSequenceMenu()
 	switch (selectedId)
 		{
 		case 1 :		// INSERT
+			BeginSequenceEdit("Insert pattern");
 			song.InsertPattern(currentPatternIndex);
+			EndEdit();
 			break;
 		case 2 :		// REMOVE
+			BeginSequenceEdit("Remove pattern");
 			song.RemovePattern();
+			EndEdit();
 			break;
 		case 3 :		// SONG GOTO
 			// ONLY CHANGE SONG POS IF IT IS SELECTED MENU ITEM
@@ -937,6 +1763,14 @@ int DoSequenceMenu()
 			if (song.songPos > PATTERNS_PER_SONG)
 				song.songPos = 0;					// safety net
 			break;
+		case 4 :		// TEMPO CHANGE
+		case 5 :
+			if (0 == menu.GetItemSelectedOption(4))
+				song.RemoveTempoPoint(song.songPos, 0);
+			else if (!song.SetTempoPoint(song.songPos, 0, (menu.GetItemSelectedOption(5) * 10) + 60, (2 == menu.GetItemSelectedOption(4))))
+				DoMessage(screen, bigFont, "Tempo Change", "Too many tempo changes in this song!", false);
+			journal.LogTempoMap(song);
+			break;
 		}
 
 	DrawAll();
@@ -990,7 +1824,10 @@ int DoMainMenu()
 								"R to rewind\n" \
 								"M to change mode\n" \
 								"PGUP for previous pattern\n" \
-								"PGDOWN for next pattern";
+								"PGDOWN for next pattern\n" \
+								"Z to undo, Y to redo\n" \
+								"1 to 8 to play live drum pads\n" \
+								"O to record live drum pads";
 #endif								
 			DoMessage(screen, bigFont, "Help - Keys / Buttons", text, false);
 			}
@@ -1014,7 +1851,8 @@ int DoMainMenu()
 						strcpy(filename, "songs/");
 						strcat(filename, songname);
 						strcat(filename, ".xds");
-						song.Save(filename, progress_callback);
+						if (song.Save(filename, progress_callback))
+							journal.Start(filename);
 						}
 					}
 				}
@@ -1048,17 +1886,19 @@ int DoNoteMenu(int track, int step)
 	sprintf(menuTitle, "Note Menu [Track %d, Step %d]", track+1, step+1);
 
 	// TODO : Handle cut notes (do not display vol menu item?) 
-	int volPercent = (currentPattern->events[track][step].vol * 100) / 127;
+	int volPercent = (currentPattern->GetVol(track, step) * 100) / 127;
 	int selectedVolOption = (volPercent + 5) / 10;
 	int selectedDecayOption = 0;
 	int selectedCountOption = 0;
 	int selectedSpacingOption = 0;
+	int selectedOffsetOption = currentPattern->GetEvent(track, step)->offset;
 
 	Menu menu;
 	menu.AddItem(1, "Note Vol (%)", "0|10|20|30|40|50|60|70|80|90|100", selectedVolOption, "Set note volume (10 - 100)");	
 	menu.AddItem(2, "Repeat Decay (%)", "0|10|20|30|40|50|60|70|80|90", selectedDecayOption, "Volume decay between repeat notes");	
 	menu.AddItem(3, "Repeat Count", "0|1|2|3|4|5|6|7", selectedCountOption, "Number of repeat notes");
 	menu.AddItem(4, "Repeat Space", "1|2|3|4", selectedSpacingOption, "Steps between repeat notes");
+	menu.AddItem(5, "Micro timing", "0|1|2|3", selectedOffsetOption, "Delay note by 0 to 3 ticks (1/64 notes)");
 	SDL_Rect r1;
 	SetSDLRect(r1, 64, 16, VIEW_WIDTH - 72, VIEW_HEIGHT - 32);
 	int selectedId = menu.DoMenu(screen, &r1, bigFont, menuTitle, 0);
@@ -1068,29 +1908,41 @@ int DoNoteMenu(int track, int step)
 		{
 		case 1 : // note vol
 			selectedVolOption = menu.GetItemSelectedOption(1);
-			currentPattern->events[track][step].vol = (selectedVolOption * 127) / 10;
+			BeginPatternEdit("Note vol");
+			currentPattern->SetVol(track, step, (selectedVolOption * 127) / 10);
+			EndEdit();
 			break;
 		case 2 :
 		case 3 :
 		case 4 :
 			{
 			selectedDecayOption = menu.GetItemSelectedOption(2);
-			float repeatVol = (float)currentPattern->events[track][step].vol;
+			float repeatVol = (float)currentPattern->GetVol(track, step);
 			float decay = (float)selectedDecayOption * 0.1f;
 			int count = menu.GetItemSelectedOption(3);
 			int space = menu.GetItemSelectedOption(4) + 1;
 			int repeatStep = step;
+			BeginPatternEdit("Repeat notes");
 			for (int i = 0; i < count; i++)
 				{
 				repeatStep += space;
-				if (repeatStep < STEPS_PER_PATTERN)
+				if (repeatStep < currentPattern->GetLength())
 					{
 					repeatVol = repeatVol * (1.0f - decay);
-					currentPattern->events[track][repeatStep].vol = (unsigned char)repeatVol;
+					currentPattern->SetVol(track, repeatStep, (unsigned char)repeatVol);
 					}
 				}
+			EndEdit();
 			}
 			break;
+		case 5 : // micro timing
+			if (currentPattern->GetVol(track, step) > 0)
+				{
+				BeginPatternEdit("Micro timing");
+				currentPattern->SetOffset(track, step, (unsigned char)menu.GetItemSelectedOption(5));
+				EndEdit();
+				}
+			break;
 		}
 	
 	DrawAll();
@@ -1124,11 +1976,245 @@ int GetMouseZone(int x, int y, int mode)
 	return zone;
 }
 
+/// Show the grid page containing the pattern grid cursor
+void SetGridPageToCursor()
+{
+	int page = currentStep / STEPS_PER_PAGE;
+	if (page != gridPage)
+		{
+		gridPage = page;
+		DrawPatternGrid(backImg, currentPattern);
+		}
+}
+
+/// Show another page of the pattern in the grid (keeping the cursor column)
+/// @param page				Page to show (wraps around)
+void SetGridPage(int page)
+{
+	if (!currentPattern)
+		return;
+	int numPages = (currentPattern->GetLength() + STEPS_PER_PAGE - 1) / STEPS_PER_PAGE;
+	page = (page + numPages) % numPages;
+	currentStep = page * STEPS_PER_PAGE + (currentStep % STEPS_PER_PAGE);
+	if (currentStep >= currentPattern->GetLength())
+		currentStep = currentPattern->GetLength() - 1;
+	gridPage = page;
+	DrawPatternGrid(backImg, currentPattern);
+}
+
+/// Is the song's mix automation being played? (song mode only)
+bool IsAutomationOn()
+{
+	return (Transport::PM_SONG == transport.mode && song.HasAutomation());
+}
+
+/// Get the current song / track mix settings (settings with automation
+/// are left at full / centre - the engine's track gains apply them)
+/// @param mix			Mix settings to fill in
+void GetTriggerMix(TriggerMix* mix)
+{
+	bool automation = IsAutomationOn();
+	mix->songVol = (automation && !song.automation[AUTOMATION_MASTER_VOL].IsEmpty()) ? 255 : song.vol;
+	for (int track = 0; track < NUM_TRACKS; track++)
+		{
+		unsigned char vol = (automation && !song.automation[AUTOMATION_TRACK_VOL(track)].IsEmpty()) ? 255 : song.trackMixInfo[track].vol;
+		mix->trackVol[track] = (TrackMixInfo::TS_MUTE == song.trackMixInfo[track].state) ? 0 : vol;
+		mix->trackPan[track] = (automation && !song.automation[AUTOMATION_TRACK_PAN(track)].IsEmpty()) ? 128 : song.trackMixInfo[track].pan;
+		}
+}
+
+/// Play a live drum pad hit (at the time it was made, or at the next
+/// 1/16 or 1/64 tick if live quantise is on), and record it if recording
+/// @param track		Track to play
+/// @param timeNs		Time of the hit (HrTimeNanos() time)
+/// @param accent		Play (and record) an accent
+void LivePadHit(int track, Uint64 timeNs, bool accent)
+{
+	Mix_Chunk* chunk = drumKit.drums[track].sampleData;
+	if (!chunk)
+		return;
+
+	int eventVol = accent ? LIVE_PAD_ACCENT_VOL : LIVE_PAD_VOL;
+	if (transport.playing)
+		recorder.AddHit(track, eventVol, timeNs);
+
+	TriggerMix mix;
+	GetTriggerMix(&mix);
+	int vol = (mix.songVol * mix.trackVol[track] * eventVol) / (512 * 128);
+	if (0 == vol)
+		return;					// muted
+
+	if (transport.playing && transport.liveQuantise > 0)
+		timeNs = engine.QuantiseTime(timeNs, transport.liveQuantise);
+	engine.Play(ES_UI, chunk, vol, mix.trackPan[track], track, timeNs);
+}
+
+/// Check that a file name from the remote control is just a name (so it
+/// cannot reach outside the songs / kits folder)
+/// @param name			Name to check
+/// @return				true if the name is OK
+bool IsRemoteNameSafe(const char* name)
+{
+	if (0 == name[0] || '.' == name[0])
+		return false;
+	return (NULL == strchr(name, '/') && NULL == strchr(name, '\\'));
+}
+
+/// Carry out the commands that have arrived from the OSC remote control
+/// (UI thread, once per frame). At most OSC_MAX_PER_FRAME are carried out
+/// per frame, and all the step edits in a frame are one undoable edit (and
+/// one journal entry).
+/// @return				true if there may be more commands waiting
+bool ProcessRemoteCommands()
+{
+	bool editing = false;			// step edit group open?
+	bool redraw = false;
+	bool mixChanged = false;
+	bool paramsChanged = false;
+	int count = 0;
+	RemoteCommand command;
+	while (count < OSC_MAX_PER_FRAME && oscServer.Pop(&command))
+		{
+		count++;
+		switch (command.command)
+			{
+			case RemoteCommand::RC_PLAY :
+				transport.playing = (0 == command.argCount || 0 != command.args[0]);
+				break;
+			case RemoteCommand::RC_STOP :
+				transport.playing = false;
+				break;
+			case RemoteCommand::RC_REWIND :
+				transport.playing = false;
+				transport.patternPos = 0;
+				if (Transport::PM_SONG == transport.mode)
+					{
+					song.songPos = 0;
+					currentPatternIndex = song.songList[song.songPos];
+					SyncPatternPointer();
+					}
+				redraw = true;
+				break;
+			case RemoteCommand::RC_BPM :
+				if (command.args[0] >= 20 && command.args[0] <= 250)
+					{
+					song.BPM = (unsigned char)command.args[0];
+					paramsChanged = true;
+					redraw = true;
+					}
+				break;
+			case RemoteCommand::RC_PATTERN :
+				// in live mode, the pattern starts when the current one ends
+				if (command.args[0] >= 0 && command.args[0] < MAX_PATTERN)
+					{
+					currentPatternIndex = command.args[0];
+					if (Transport::PM_LIVE != transport.mode)
+						SyncPatternPointer();
+					redraw = true;
+					}
+				break;
+			case RemoteCommand::RC_STEP :
+				{
+				// [pattern] track step vol
+				int arg = 0;
+				int index = (command.argCount > 3) ? command.args[arg++] : currentPatternIndex;
+				int track = command.args[arg++];
+				int step = command.args[arg++];
+				int vol = command.args[arg++];
+				if (index < 0 || index >= MAX_PATTERN || track < 0 || track >= NUM_TRACKS || vol < 0 || vol > 127)
+					break;
+				DrumPattern* pattern = &song.patterns[index];
+				if (step < 0 || step >= pattern->GetLength())
+					break;
+				if (pattern == recorder.GetPattern())
+					{
+					// only the play thread writes the pattern being recorded,
+					// so finish the take first (the take's group is the outer
+					// group of any remote edit already made)
+					if (editing)
+						{
+						history.EndGroup(song);
+						editing = false;
+						}
+					StopRecording();
+					}
+				if (!editing)
+					{
+					history.BeginGroup("Remote edit");
+					editing = true;
+					}
+				if (!history.TouchPattern(song, index))
+					{
+					// too many patterns for one undo step - start another
+					history.EndGroup(song);
+					history.BeginGroup("Remote edit");
+					if (!history.TouchPattern(song, index))
+						break;			// (cannot be undone or journaled)
+					}
+				pattern->SetVol(track, step, (unsigned char)vol);
+				if (pattern == currentPattern)
+					redraw = true;
+				}
+				break;
+			case RemoteCommand::RC_MUTE :
+				if (command.args[0] >= 0 && command.args[0] < NUM_TRACKS)
+					{
+					int track = command.args[0];
+					bool mute = (command.argCount < 2 || 0 != command.args[1]);
+					if (mute != (TrackMixInfo::TS_MUTE == song.trackMixInfo[track].state))
+						SetTrackMute(track);
+					mixChanged = true;
+					}
+				break;
+			case RemoteCommand::RC_SOLO :
+				if (command.args[0] >= 0 && command.args[0] < NUM_TRACKS)
+					{
+					int track = command.args[0];
+					bool solo = (command.argCount < 2 || 0 != command.args[1]);
+					if (solo != (TrackMixInfo::TS_SOLO == song.trackMixInfo[track].state))
+						SetTrackSolo(solo ? track : -1);
+					mixChanged = true;
+					}
+				break;
+			case RemoteCommand::RC_SONG :
+				if (!IsRemoteNameSafe(command.text) || !LoadSong(command.text))
+					printf("Remote: unable to load song %s\n", command.text);
+				redraw = true;
+				break;
+			case RemoteCommand::RC_KIT :
+				{
+				// NB: WE must stop playback while loading/unloading samples (chunks)
+				bool wasPlaying = transport.playing;
+				transport.playing = false;
+				if (!IsRemoteNameSafe(command.text) || !LoadDrumKit(command.text))
+					printf("Remote: unable to load drumkit %s\n", command.text);
+				transport.playing = wasPlaying;
+				redraw = true;
+				}
+				break;
+			}
+		}
+
+	if (editing)
+		EndEdit();
+	if (mixChanged)
+		{
+		JournalTrackMix();
+		redraw = true;
+		}
+	if (paramsChanged)
+		journal.LogSongParams(song);
+	if (redraw)
+		DrawAll();
+
+	return (OSC_MAX_PER_FRAME == count);
+}
+
 /// Jump the mouse cursor to the pattern grid cursor
 void SetMouseToGridCursor()
 {
 	SDL_Rect rect = zones[ZONE_PATGRID];
-	cursorX = rect.x + (currentStep * PATBOX.w) + (PATBOX.x / 2);
+	cursorX = rect.x + ((currentStep - gridPage * STEPS_PER_PAGE) * PATBOX.w) + (PATBOX.x / 2);
 	cursorY = rect.y + (currentTrack * PATBOX.h) + (PATBOX.y / 2);
 	SDL_WarpMouse((Uint16)cursorX, (Uint16)cursorY);
 }
@@ -1175,6 +2261,7 @@ void ProcessKeyPress(SDLKey sym, int zone)
 		case SDLK_LEFT :
 			if (currentStep > 0)
 				currentStep--;
+			SetGridPageToCursor();
 #ifdef LOCK_MOUSE_TO_GRID_CURSOR				
 			// Lock mouse cursor to pattern grid current pos
 			if (ZONE_PATGRID == zone)
@@ -1183,8 +2270,9 @@ void ProcessKeyPress(SDLKey sym, int zone)
 			break;
 		case SDLK_RIGHT :
 			currentStep++;
-			if (currentStep >= STEPS_PER_PATTERN)
+			if (!currentPattern || currentStep >= currentPattern->GetLength())
 				currentStep = 0;			// wrap around
+			SetGridPageToCursor();
 #ifdef LOCK_MOUSE_TO_GRID_CURSOR				
 			if (ZONE_PATGRID == zone)
 				SetMouseToGridCursor();
@@ -1206,11 +2294,20 @@ void ProcessKeyPress(SDLKey sym, int zone)
 				SetMouseToGridCursor();
 #endif
 			break;
+		case SDLK_COMMA :
+			// previous grid page
+			SetGridPage(gridPage - 1);
+			break;
+		case SDLK_PERIOD :
+			// next grid page
+			SetGridPage(gridPage + 1);
+			break;
 		case SDLK_x :
 			// set note on
-			if (currentPattern)
+			if (currentPattern && currentStep < currentPattern->GetLength())
 				{
-				unsigned char vol = currentPattern->events[currentTrack][currentStep].vol;
+				BeginPatternEdit("Set note");
+				unsigned char vol = currentPattern->GetVol(currentTrack, currentStep);
 				if (0 == vol)
 					vol = 64;			// note on
 				else if (64 == vol)
@@ -1219,25 +2316,43 @@ void ProcessKeyPress(SDLKey sym, int zone)
 					vol = 1;			// cut
 				else
 					vol = 0;			// no note
-				currentPattern->events[currentTrack][currentStep].vol = vol;
+				currentPattern->SetVol(currentTrack, currentStep, vol);
+				EndEdit();
 				// play sample
 				if (vol > 1)
-					{
-					Mix_VolumeChunk(drumKit.drums[currentTrack].sampleData, vol);
-					Mix_PlayChannel(-1, drumKit.drums[currentTrack].sampleData, 0);
-					}
+					engine.Play(ES_UI, drumKit.drums[currentTrack].sampleData, vol, 128, ENGINE_NO_BUS, inputEventTime);
 				// redraw grid
 				DrawPatternGrid(backImg, currentPattern);								
 				}
 			break;
+		case SDLK_1 :
+		case SDLK_2 :
+		case SDLK_3 :
+		case SDLK_4 :
+		case SDLK_5 :
+		case SDLK_6 :
+		case SDLK_7 :
+		case SDLK_8 :
+			// live drum pads (SHIFT for accent)
+			LivePadHit(sym - SDLK_1, inputEventTime, 0 != (SDL_GetModState() & KMOD_SHIFT));
+			break;
+		case SDLK_o :
+			// start / stop live recording (overdub)
+			if (recorder.IsRecording())
+				StopRecording();
+			else
+				StartRecording();
+			break;
 		case SDLK_c :
 			// cut note
-			if (currentPattern)
+			if (currentPattern && currentStep < currentPattern->GetLength())
 				{
-				if (1 == currentPattern->events[currentTrack][currentStep].vol)
-					currentPattern->events[currentTrack][currentStep].vol = 0;
+				BeginPatternEdit("Cut note");
+				if (1 == currentPattern->GetVol(currentTrack, currentStep))
+					currentPattern->SetVol(currentTrack, currentStep, 0);
 				else
-					currentPattern->events[currentTrack][currentStep].vol = 1;
+					currentPattern->SetVol(currentTrack, currentStep, 1);
+				EndEdit();
 				// redraw grid
 				DrawPatternGrid(backImg, currentPattern);								
 				}
@@ -1317,6 +2432,14 @@ void ProcessKeyPress(SDLKey sym, int zone)
 				SyncPatternPointer();
 			DrawAll();	
 			break;
+		case SDLK_z :
+			// undo last edit
+			UndoEdit(false);
+			break;
+		case SDLK_y :
+			// redo last undone edit
+			UndoEdit(true);
+			break;
 		case SDLK_ESCAPE :
 			DoMainMenu();
 			break;
@@ -1356,6 +2479,7 @@ void ProcessLeftClick(int x, int y)
 				vol =  ((68 - y0) * 100) / 56;
 				
 			SetMainVolume(vol);
+			journal.LogSongParams(song);
 			DrawSliders(backImg);
 			}
 			break;
@@ -1364,12 +2488,13 @@ void ProcessLeftClick(int x, int y)
 			// BPM click
 			// BMP range 20 to 200
 			if (y0 <= 10)
-				song.BPM += 1;
+				song.SetBPM(song.BPM + 1);
 			else if (y0 >= 70)
-				song.BPM -= 1;
+				song.SetBPM(song.BPM - 1);
 			else if (x0 > 8 && x0 < 24)
-				song.BPM =  50 + ((68 - y0) * 2);
+				song.SetBPM(50 + ((68 - y0) * 2));
 				
+			journal.LogSongParams(song);
 			DrawSliders(backImg);
 			}		
 			break;
@@ -1382,6 +2507,7 @@ void ProcessLeftClick(int x, int y)
 			else if (y0 > 40 && song.pitch > -12)
 				song.pitch -= 1;
 
+			journal.LogSongParams(song);
 			DrawSliders(backImg);
 			}		
 			break;
@@ -1432,7 +2558,9 @@ void ProcessLeftClick(int x, int y)
 			}
 			break;
 		case ZONE_ADDTOSONGBTN :
+			BeginSequenceEdit("Insert pattern");
 			song.InsertPattern(currentPatternIndex);
+			EndEdit();
 			DrawSequenceList(backImg);
 			break;			
 		case ZONE_TRACKINFO :
@@ -1470,13 +2598,14 @@ void ProcessLeftClick(int x, int y)
 				song.trackMixInfo[track].vol = trackMixVol;
 				}	
 				
+			JournalTrackMix();
 			DrawTrackInfo(backImg);
 			}
 			break;
 		case ZONE_PATGRID :
 			{
 			// Pattern grid click
-			int event = x0 / PATBOX.w;
+			int event = gridPage * STEPS_PER_PAGE + x0 / PATBOX.w;
 			int track = y0 / PATBOX.h;
 			printf("Patgrid: track = %d, event = %d\n", track, event);
 			// update pattern cursor pos
@@ -1602,8 +2731,9 @@ void ProcessRightClick(int x, int y)
 			{
 			// Show Right-click Note Menu
 			int track = y0 / PATBOX.h;
-			int step = x0 / PATBOX.w;
-			DoNoteMenu(track, step);
+			int step = gridPage * STEPS_PER_PAGE + x0 / PATBOX.w;
+			if (currentPattern && step < currentPattern->GetLength())
+				DoNoteMenu(track, step);
 			}
 			break;
 		case ZONE_PATNAME :
@@ -1669,14 +2799,373 @@ bool beatFlash = false;
 // interval (msec) =  1000 / QBPS
 // eg: 100 BPM = 6.666 QBPS, therefore interval = 150 ms (per quarter-beat)
 
+/// Time between ticks at a tempo
+/// @param bpm				Tempo (raised to SONG_MIN_BPM, so never divides by 0)
+/// @return					Tick interval (ns)
+Uint64 GetBPMInterval(int bpm)
+{
+	if (bpm < SONG_MIN_BPM)
+		bpm = SONG_MIN_BPM;
+	return (Uint64)60000000000ULL / (bpm * 16);
+}
+
+/// Get the pattern tick that an event should be played on
+/// (the tick of it's step, plus groove and micro-timing offsets)
+/// @param step				Step the event is on
+/// @param offset			Micro-timing offset of the event (ticks)
+/// @param patternTicks		Length of the pattern in ticks
+/// @param groove			Groove timing
+/// @return					Tick to play the event on
+int GetEventTick(int step, int offset, int patternTicks, const GrooveTiming* groove)
+{
+	int tick = step * TICKS_PER_STEP + offset + groove->GetTicks(step);
+	// notes on the first step cannot move before the start of the pattern,
+	// and delayed notes on the last step must still play in this pattern
+	if (tick < 0)
+		tick = 0;
+	else if (tick >= patternTicks)
+		tick = patternTicks - 1;
+	return tick;
+}
+
+/// Play the notes and cuts of a pattern that are due on a tick (play thread,
+/// or an offline render)
+/// @param audio			Engine to play them on
+/// @param pattern			Pattern (NULL = no pattern)
+/// @param patternPos		Tick in the pattern
+/// @param tickTime			Time the tick is due
+/// @param mix				Song / track volumes and pans
+/// @param groove			Groove timing
+/// @param random			Random numbers for volrand / jitter
+/// @param live				Playing live (skip notes just recorded from live pad hits)
+void PlayTickEvents(AudioEngine* audio, DrumPattern* pattern, int patternPos, Uint64 tickTime, const TriggerMix* mix,
+					const GrooveTiming* groove, FastRandom* random, bool live)
+{
+	if (!pattern)
+		return;
+
+	// Events are played on their step's tick plus groove / micro-timing
+	// offsets (max 2 ticks early, 7 ticks late), so check the steps either
+	// side of the current step too
+	int patternTicks = pattern->GetLength() * TICKS_PER_STEP;
+	int currentEventStep = patternPos / TICKS_PER_STEP;
+	StepMask usedSteps = pattern->GetUsedSteps() & pattern->GetLengthMask();
+	Uint32 jitterNs = (Uint32)transport.jitter * 1000000;
+	for (int step = currentEventStep - 1; step <= currentEventStep + 1; step++)
+		{
+		// skip steps with no events
+		if (step < 0 || step >= MAX_STEPS_PER_PATTERN || !(usedSteps & STEP_BIT(step)))
+			continue;
+		// only go through the notes / cuts that are actually on this step
+		const StepTriggerList* triggers = pattern->GetTriggers(step, mix);
+		for (int i = 0; i < triggers->count; i++)
+			{
+			const StepTrigger* trigger = &triggers->triggers[i];
+			// do we have a note to play on this tick?
+			if (GetEventTick(step, trigger->offset, patternTicks, groove) != patternPos)
+				continue;
+			int track = trigger->track;
+			// just recorded from a live hit? (already heard)
+			if (live && recorder.SkipTrigger(track, step))
+				continue;
+			if (!trigger->cut)
+				{
+				int chunkVol = groove->ApplyVelocity(step, trigger->vol);
+				if (chunkVol >= MIX_MAX_VOLUME)
+					chunkVol = MIX_MAX_VOLUME - 1;
+				// randomise output vol if neccessary (+/- half the volrand %)
+				if (transport.volrand > 0)
+					{
+					chunkVol += random->Spread((chunkVol * transport.volrand) / 200);
+					if (chunkVol < 0)
+						chunkVol = 0;
+					else if (chunkVol >= MIX_MAX_VOLUME)
+						chunkVol = MIX_MAX_VOLUME - 1;
+					}
+				// play the sample at the exact time of the tick, plus the
+				// groove delay (and up to the jitter time), to the sample
+				Uint64 hitTime = tickTime + groove->GetDelayNs(step);
+				if (jitterNs > 0)
+					hitTime += random->Range(jitterNs + 1);
+				audio->Play(ES_PLAY, drumKit.drums[track].sampleData, chunkVol, trigger->pan, track, hitTime);
+				}
+			else
+				{
+				// cut note
+				audio->Cut(ES_PLAY, drumKit.drums[track].sampleData, tickTime + groove->GetDelayNs(step));
+				}
+			}
+		}
+}
+
+/// Keep the transport in step with the other instances on the network
+/// (play thread, once per tick, after waiting for the tick)
+/// Local tempo changes, starts and stops are published to the others, and
+/// theirs are applied here. While playing, the next tick is moved slightly
+/// earlier or later to pull the ticks onto the shared beat phase, so the
+/// sequencer follows the shared timeline without jumping.
+/// @param tickTime			Time the tick is due
+/// @param intervalNs		Time between ticks (at the current BPM)
+/// @param nextTickNs		Time of the next tick (NULL for the legacy timer - no beat phase)
+/// @return					false if this tick should not be played (waiting for
+///							the next tick of the shared timeline)
+bool FollowNetSync(Uint64 tickTime, Uint64 intervalNs, Uint64* nextTickNs)
+{
+	SyncTimeline timeline;
+	netSync.GetTimeline(&timeline);
+	DrumPattern* pattern = currentPattern;
+	int patternTicks = (pattern ? pattern->GetLength() : STEPS_PER_PATTERN) * TICKS_PER_STEP;
+
+	if (timeline.version == netSyncVersion && timeline.owner == netSyncOwner)
+		{
+		// changed here? (tempo changes are only shared once there is a timeline)
+		bool started = transport.playing && !timeline.playing;
+		bool stopped = !transport.playing && timeline.playing;
+		bool tempo = (timeline.version > 0 && song.BPM != timeline.bpm);
+		if (started || stopped || tempo)
+			{
+			Uint64 origin = timeline.origin;
+			if (started)
+				{
+				// this tick is tick patternPos of the new timeline
+				netSyncTick = transport.patternPos;
+				origin = tickTime - netSyncTick * intervalNs;
+				}
+			else if (transport.playing)
+				{
+				// new tempo from this tick on
+				origin = tickTime - netSyncTick * intervalNs;
+				}
+			netSync.Publish(song.BPM, transport.playing, origin);
+			netSync.GetTimeline(&timeline);
+			netSyncVersion = timeline.version;
+			netSyncOwner = timeline.owner;
+			}
+		}
+	else
+		{
+		// changed by another instance
+		netSyncVersion = timeline.version;
+		netSyncOwner = timeline.owner;
+		if (timeline.bpm > 0 && timeline.bpm != song.BPM)
+			{
+			song.BPM = (unsigned char)timeline.bpm;
+			intervalNs = GetBPMInterval(song.BPM);
+			syncChanged = true;
+			}
+		if (timeline.playing && !transport.playing)
+			{
+			// join in at the next tick of the shared timeline
+			Sint64 tick = (Sint64)ceil(timeline.GetTick(tickTime));
+			netSyncTick = tick;
+			transport.patternPos = (int)(((tick % patternTicks) + patternTicks) % patternTicks);
+			transport.playing = true;
+			syncChanged = true;
+			uiScheduler.Wake();
+			if (nextTickNs)
+				{
+				*nextTickNs = timeline.GetTickTime(tick);
+				return false;
+				}
+			}
+		else if (!timeline.playing && transport.playing)
+			{
+			transport.playing = false;
+			syncChanged = true;
+			uiScheduler.Wake();
+			}
+		}
+
+	if (!transport.playing || !timeline.playing)
+		return true;
+
+	// follow the shared beat phase
+	if (nextTickNs)
+		{
+		double error = timeline.GetTick(tickTime) - (double)netSyncTick;		// ticks (+ = we are behind)
+		if (error > SYNC_MAX_ERROR || error < -SYNC_MAX_ERROR)
+			{
+			// too far out to pull in smoothly - jump to the next shared tick
+			Sint64 tick = (Sint64)ceil(timeline.GetTick(tickTime));
+			int pos = (int)((transport.patternPos + (tick - netSyncTick)) % patternTicks);
+			transport.patternPos = (pos + patternTicks) % patternTicks;
+			netSyncTick = tick;
+			*nextTickNs = timeline.GetTickTime(tick);
+			return false;
+			}
+		Sint64 trim = (Sint64)(error * intervalNs) / SYNC_TRIM_GAIN;
+		Sint64 maxTrim = (Sint64)intervalNs / SYNC_MAX_TRIM;
+		if (trim > maxTrim)
+			trim = maxTrim;
+		else if (trim < -maxTrim)
+			trim = -maxTrim;
+		*nextTickNs -= trim;
+		}
+
+	netSyncTick++;
+	return true;
+}
+
+/// Follow the incoming MIDI clock (play thread, once per tick, after waiting
+/// for the tick)
+/// Start, continue, stop and song position are applied to the transport,
+/// and song.BPM follows the clock's tempo. While playing, the next tick is
+/// timed from the exact clock tempo (song.BPM is a whole number), and moved
+/// slightly earlier or later to pull the ticks onto the clock's beat phase.
+/// @param tickTime			Time the tick is due
+/// @param nextTickNs		Time of the next tick (NULL for the legacy timer - no beat phase)
+/// @return					false if this tick should not be played (waiting for
+///							the next tick of the clock)
+bool FollowMidiClock(Uint64 tickTime, Uint64* nextTickNs)
+{
+	MidiClockState clock;
+	midiClock.GetState(&clock);
+	DrumPattern* pattern = currentPattern;
+	int patternTicks = (pattern ? pattern->GetLength() : STEPS_PER_PATTERN) * TICKS_PER_STEP;
+
+	// tempo
+	if (clock.locked)
+		{
+		double bpm = clock.GetBPM();
+		if (bpm > song.BPM + MIDISYNC_BPM_HYSTERESIS || bpm < song.BPM - MIDISYNC_BPM_HYSTERESIS)
+			{
+			int newBPM = (int)(bpm + 0.5);
+			if (newBPM >= 20 && newBPM <= 250)
+				{
+				song.BPM = (unsigned char)newBPM;
+				syncChanged = true;
+				}
+			}
+		}
+	else
+		{
+		// no tempo yet (the master only sends clock while it plays?) - assume ours
+		clock.period = 60000000000.0 / (song.BPM * MIDICLOCK_PPQN);
+		}
+
+	// start / continue / stop / song position (once the first clock after a
+	// start or continue has arrived - it is the downbeat)
+	if (clock.transportSeq != midiSyncSeq && !clock.starting)
+		{
+		midiSyncSeq = clock.transportSeq;
+		if (clock.running)
+			{
+			// play the tick the clock is in now (a little late, rather than
+			// missing the downbeat)
+			Sint64 tick = (Sint64)floor(clock.GetTick(tickTime));
+			if (tick < 0)
+				tick = 0;
+			midiSyncTick = tick;
+			transport.patternPos = (int)(tick % patternTicks);
+			if (!transport.playing)
+				{
+				transport.playing = true;
+				uiScheduler.Wake();
+				}
+			syncChanged = true;
+			if (nextTickNs)
+				*nextTickNs = clock.GetTickTime(tick + 1);
+			midiSyncTick++;
+			return true;
+			}
+		else if (transport.playing)
+			{
+			transport.playing = false;
+			syncChanged = true;
+			uiScheduler.Wake();
+			}
+		}
+
+	if (!transport.playing)
+		{
+		// check for a start often (not just once per tick)
+		if (nextTickNs && *nextTickNs > tickTime + MIDISYNC_START_POLL)
+			*nextTickNs = tickTime + MIDISYNC_START_POLL;
+		return true;
+		}
+	if (!clock.running)
+		return true;
+
+	// follow the clock's beat phase
+	if (nextTickNs && clock.locked)
+		{
+		double error = clock.GetTick(tickTime) - (double)midiSyncTick;		// ticks (+ = we are behind)
+		if (error > SYNC_MAX_ERROR || error < -SYNC_MAX_ERROR)
+			{
+			// too far out to pull in smoothly - jump to the next tick of the clock
+			Sint64 tick = (Sint64)ceil(clock.GetTick(tickTime));
+			int pos = (int)((transport.patternPos + (tick - midiSyncTick)) % patternTicks);
+			transport.patternPos = (pos + patternTicks) % patternTicks;
+			midiSyncTick = tick;
+			*nextTickNs = clock.GetTickTime(tick);
+			return false;
+			}
+		Uint64 intervalNs = (Uint64)(clock.period * MIDICLOCK_PPQN / 16);
+		Sint64 trim = (Sint64)(error * intervalNs) / SYNC_TRIM_GAIN;
+		Sint64 maxTrim = (Sint64)intervalNs / SYNC_MAX_TRIM;
+		if (trim > maxTrim)
+			trim = maxTrim;
+		else if (trim < -maxTrim)
+			trim = -maxTrim;
+		*nextTickNs = tickTime + intervalNs - trim;
+		}
+
+	midiSyncTick++;
+	return true;
+}
+
+/// Rebuild the tempo map if the song's sequence or tempo has changed (UI
+/// thread). The new map is built in the map the play thread is not using,
+/// and it starts using it on its next tick. (Until then it plays the old
+/// map, so a rebuild never holds up a tick.)
+void UpdatePlayTempoMap()
+{
+	// (the last map built has not been picked up yet?)
+	if (nextTempoMap || playTempoMap->IsUpToDate(&song))
+		return;
+
+	TempoMap* spare = (playTempoMap == &tempoMaps[0]) ? &tempoMaps[1] : &tempoMaps[0];
+	spare->Update(&song);
+	__sync_synchronize();				// map must be built before it is handed over
+	nextTempoMap = spare;
+}
+
+/// Time from the tick being played to the next one - from the song's tempo
+/// map in song mode, unless another instance or the MIDI clock sets the
+/// tempo (play thread)
+Uint64 GetTickInterval()
+{
+	int tempo = 0;
+	Uint64 intervalNs = GetBPMInterval(song.BPM);
+	if (Transport::PM_SONG == transport.mode && !playTempoMap->IsEmpty()
+		&& !midiClock.IsInputOpen() && !netSync.IsOpen())
+		{
+		int tick = playTempoMap->GetPositionTick(song.songPos) + transport.patternPos;
+		intervalNs = playTempoMap->GetInterval(tick);
+		tempo = playTempoMap->GetBPM(tick);
+		}
+
+	// tempo display needs updating?
+	if (tempo != transport.tempo)
+		{
+		transport.tempo = tempo;
+		syncChanged = true;
+		}
+	return intervalNs;
+}
+
 // play thread
 // new "float" version (as of v1.2 25/4/2009)
 int play_thread_func(void *data)
 {
 	printf("Play thread starting...\n");
+	realtime.PromoteCurrentThread("Play");
 	
 	// set up timing
-	float nextTick = (float)SDL_GetTicks();
+	float nextTick = (float)SDL_GetTicks();			// legacy timer (ms)
+	Uint64 nextTickNs = HrTimeNanos();				// high res timer (ns)
+	Transport::STEP_TIMER timer = transport.stepTimer;
+	bool wasPlaying = false;
 	
     int last_value = 0;
     while ( global_data != -1 )
@@ -1687,100 +3176,132 @@ int play_thread_func(void *data)
             last_value = global_data;
         	}
 
-		// calc tick interval (in case BPM has changed)
-		// 16 ticks per beat = 64 ticks per pattern
-		float bps = (float)song.BPM / 60.0f;
-		float tps = bps * 16;
-		float interval = (1000.0 / tps);
+		// new tempo map from the UI thread?
+		TempoMap* tempoMap = nextTempoMap;
+		if (tempoMap)
+			{
+			playTempoMap = tempoMap;
+			__sync_synchronize();		// the old map is free once this is seen
+			nextTempoMap = NULL;
+			}
+
+		// calc tick interval (in case BPM has changed, or the song's tempo
+		// map changes it here) - 16 ticks per beat = 4 ticks per step
+		Uint64 intervalNs = GetTickInterval();
+		float interval = (float)intervalNs / 1000000.0f;		// (ms)
 
-		// check if CPU is struggling
-		global_data = (SDL_GetTicks() < (Uint32)nextTick) ? 0 : 1;			// 1 means CPU struggling
-		
-		// wait for next tick
-		// TODO: put delay inside while!
-		//SDL_Delay(10);		// !!! need this otherwise other thread will never process!
-		int remaining = (Uint32)nextTick - SDL_GetTicks();
-		if (remaining > 15)
-			SDL_Delay(remaining - 5); 
+		// timer changed? (restart timing from now)
+		if (timer != transport.stepTimer)
+			{
+			timer = transport.stepTimer;
+			nextTick = (float)SDL_GetTicks();
+			nextTickNs = HrTimeNanos();
+			}
+
+		Uint32 lateMicros;
+		Uint64 tickTime;				// time the tick is due (hits are played at this time)
+		if (Transport::ST_LEGACY == timer)
+			{
+			// check if CPU is struggling
+			global_data = (SDL_GetTicks() < (Uint32)nextTick) ? 0 : 1;			// 1 means CPU struggling
+			
+			// wait for next tick
+			// TODO: put delay inside while!
+			//SDL_Delay(10);		// !!! need this otherwise other thread will never process!
+			int remaining = (Uint32)nextTick - SDL_GetTicks();
+			if (remaining > 15)
+				SDL_Delay(remaining - 5); 
+			else
+				global_data = 1;
+			// note that we cannot use SDL_Delay() to wait for the next tick because
+			// it's granularity is 10ms on some systems!!!
+			Uint32 spinStart = PerfMetrics::GetMicros();
+			while (SDL_GetTicks() < (Uint32)nextTick) ;
+			metrics.AddTimerSpin(PerfMetrics::GetMicros() - spinStart);
+
+			float late = (float)SDL_GetTicks() - nextTick;
+			lateMicros = (late > 0.0f) ? (Uint32)(late * 1000.0f) : 0;
+			nextTick += interval;
+			tickTime = HrTimeNanos();
+			}
 		else
-			global_data = 1;
-		// note that we cannot use SDL_Delay() to wait for the next tick because
-		// it's granularity is 10ms on some systems!!!
-		while (SDL_GetTicks() < (Uint32)nextTick) ;
+			{
+			// check if CPU is struggling (already past the deadline)
+			global_data = (HrTimeNanos() < nextTickNs) ? 0 : 1;
+
+			// sleep until the tick is due (absolute deadline, so no drift)
+			Uint32 spin = (Transport::ST_HIRES_SPIN == timer) ? HRTIMER_DEFAULT_SPIN : 0;
+			metrics.AddTimerSpin(HrSleepUntil(nextTickNs, spin) / 1000);
+
+			lateMicros = (Uint32)((HrTimeNanos() - nextTickNs) / 1000);
+			tickTime = nextTickNs;
+			nextTickNs += intervalNs;
+			}
+
+		// timing stats (lateness histogram, missed ticks / steps)
+		bool onStep = transport.playing && (0 == (transport.patternPos % TICKS_PER_STEP));
+		metrics.AddLateness(lateMicros, onStep, (Uint32)(interval * 1000.0f));
+
+		// tempo / transport / beat phase from the MIDI clock, or shared
+		// with the other instances
+		Uint64* beatPhase = (Transport::ST_LEGACY == timer) ? NULL : &nextTickNs;
+		if (midiClock.IsInputOpen())
+			{
+			if (!FollowMidiClock(tickTime, beatPhase))
+				continue;
+			}
+		else if (netSync.IsOpen() && !FollowNetSync(tickTime, intervalNs, beatPhase))
+			continue;
+		intervalNs = GetTickInterval();			// (song.BPM may have followed them)
 
-		nextTick += interval;
+		// MIDI clock master (started from the step in the song, in song mode)
+		if (midiClock.IsOutputOpen())
+			{
+			int songTick = transport.patternPos;
+			if (Transport::PM_SONG == transport.mode)
+				songTick += playTempoMap->GetPositionTick(song.songPos);
+			midiClock.MasterTick(tickTime, intervalNs, transport.playing, songTick / TICKS_PER_STEP);
+			}
 			
 		// only process events if we are playing
+		playTickBusy = true;
+		__sync_synchronize();
 		if (transport.playing)
 			{
-			// are we on the next quarter-beat?
-			int beatPos = transport.patternPos & 0xF;
-			bool onEvent = false;
-			if (transport.shuffle > 0)
-				onEvent = (0 == beatPos || 4 == beatPos || (8 + transport.shuffle) == beatPos || 12 == beatPos);
-			else
-				onEvent = (0 == (beatPos & 0x3));
-			if (onEvent)
+			// the same volrand / jitter every time the song is played from
+			// the same place
+			if (!wasPlaying)
 				{
-				int event = transport.patternPos / 4;
-				// do we have a note to play?
-				if (currentPattern)
-					{
-					for (int track = 0; track < NUM_TRACKS; track++)
-						{
-						if (currentPattern->events[track][event].vol > 1)
-							{
-							// calculate output vol
-							int trackMixVol = (TrackMixInfo::TS_MUTE == song.trackMixInfo[track].state) ? 0 : song.trackMixInfo[track].vol;
-							if (trackMixVol > 0)
-								{
-								int chunkVol = (song.vol * trackMixVol * currentPattern->events[track][event].vol) / (512 * 128);
-								// randomise output vol if neccessary
-								if (transport.volrand > 0)
-									{
-									int range = (chunkVol * transport.volrand) / 100;
-									chunkVol += (rand() % range) - range / 2;
-									if (chunkVol < 0)
-										chunkVol = 0;
-									else if (chunkVol >= MIX_MAX_VOLUME)
-										chunkVol = MIX_MAX_VOLUME - 1;
-									}
-								// play the sample
-								if (drumKit.drums[track].sampleData)
-									{
-									Mix_VolumeChunk(drumKit.drums[track].sampleData, chunkVol);
-									Mix_PlayChannel(-1, drumKit.drums[track].sampleData, 0);
-									// FUTURE? - Set pan (get channel from Mix_Playchannel() return value)
-									//Mix_SetPanning(channel, 127, 127);	// channel, left, right
-									}
-								}
-							}
-						else if (1 == currentPattern->events[track][event].vol)
-							{
-							// cut note
-							// Find which channel (if any) this track's sample chunk was the last played on
-							for (int channel = 0; channel < MIX_CHANNELS; channel++)
-								{
-								Mix_Chunk* chunk = Mix_GetChunk(channel);
-								if (chunk && (chunk == drumKit.drums[track].sampleData))
-									{
-									//printf("cut track %d, channel %d\n", track, channel);
-									Mix_HaltChannel(channel);
-									channel = MIX_CHANNELS;
-									}
-								}
-							}
-						}
-					}
+				int startPos = (Transport::PM_SONG == transport.mode) ? (song.songPos << 16) : 0;
+				playRandom.Seed(song.seed ^ (Uint32)(startPos | transport.patternPos));
 				}
 
+			int beatPos = transport.patternPos & 0xF;
+			DrumPattern* pattern = currentPattern;
+			int patternTicks = pattern ? pattern->GetLength() * TICKS_PER_STEP : STEPS_PER_PATTERN * TICKS_PER_STEP;
+			engine.SetSequencerTick(transport.patternPos, tickTime, intervalNs);
+
+			// record live pad hits (before this tick is played)
+			recorder.ProcessTick(pattern, transport.patternPos, tickTime, intervalNs, transport.liveQuantise);
+
+			// play this tick's notes / cuts
+			TriggerMix mix;
+			GetTriggerMix(&mix);
+			playGroove.Update(&transport.groove, intervalNs);
+			PlayTickEvents(&engine, pattern, transport.patternPos, tickTime, &mix, &playGroove, &playRandom, true);
+
+			// mix automation at the next tick (the engine moves the track
+			// gains smoothly up to it)
+			int songTick = playTempoMap->GetPositionTick(song.songPos) + transport.patternPos;
+			playAutomation.Update(&engine, &song, playTempoMap, IsAutomationOn(), songTick + 1, tickTime + intervalNs);
+
 			// If on the beat, then set flash flag
 			if (transport.flashOnBeat && (0 == beatPos))
 				beatFlash = true;
 
 			// update current pattern tick pos
 			transport.patternPos++;
-			if (64 == transport.patternPos)
+			if (transport.patternPos >= patternTicks)
 				{
 				if (Transport::PM_SONG == transport.mode)
 					{
@@ -1806,8 +3327,13 @@ int play_thread_func(void *data)
 					}
 				transport.patternPos = 0;
 				}
-				
+
+			// playhead has moved, so UI needs updating
+			uiScheduler.Wake();
 			} // end if playing
+		wasPlaying = transport.playing;
+		__sync_synchronize();
+		playTickBusy = false;
         	
     	} // wend
     	
@@ -1816,10 +3342,141 @@ int play_thread_func(void *data)
     return(0);
 }
 
+/// Mix an offline render up to a sample clock position, and write it to
+/// the WAV file
+static void RenderFrames(AudioEngine* audio, WavWriter* writer, Sint16* block, Uint64* frame, Uint64 endFrame)
+{
+	while (*frame < endFrame)
+		{
+		int frames = (endFrame - *frame > RENDER_BLOCK_FRAMES) ? RENDER_BLOCK_FRAMES : (int)(endFrame - *frame);
+		memset(block, 0, frames * 4);
+		audio->Mix((Uint8*)block, frames * 4);
+		writer->AppendData(block, frames * 4);
+		*frame += frames;
+		}
+}
+
+/// Render the song sequence (in song mode) or the current pattern to a WAV
+/// file, faster than real time. It plays a copy of the song on its own
+/// engine, so playback and editing can carry on. Volrand / jitter start
+/// from the song's seed, so renders of the same song are always the same.
+/// @param filename		WAV file to write
+/// @return				false if the file could not be written
+bool RenderWav(char* filename)
+{
+	if (!engine.IsActive())
+		{
+		printf("RenderWav: needs a 16 bit stereo audio device\n");
+		return false;
+		}
+	WavWriter writer;
+	if (!writer.Open(filename))
+		return false;
+	writer.StartWriting();
+
+	// what to play
+	Song* renderSong = new Song;
+	*renderSong = song;
+	unsigned char sequence[PATTERNS_PER_SONG];
+	int count = 0;
+	if (Transport::PM_SONG == transport.mode)
+		{
+		while (count < PATTERNS_PER_SONG && renderSong->songList[count] < MAX_PATTERN)
+			{
+			sequence[count] = renderSong->songList[count];
+			count++;
+			}
+		}
+	else if (currentPatternIndex >= 0 && currentPatternIndex < MAX_PATTERN)
+		{
+		sequence[count++] = (unsigned char)currentPatternIndex;
+		}
+
+	// (through the same master bus dynamics as playback)
+	AudioEngine* audio = new AudioEngine;
+	audio->InitOffline(engine.GetRate());
+	MasterDynamics* dynamics = new MasterDynamics;
+	dynamics->CopySettings(&masterDynamics);
+	audio->SetDynamics(dynamics);
+	FastRandom random;
+	random.Seed(renderSong->seed);
+	TriggerMix mix;
+	GetTriggerMix(&mix);
+	Sint16* block = new Sint16[RENDER_BLOCK_FRAMES * 2];
+
+	// the song sequence follows the song's tempo changes
+	TempoMap* tempoMap = NULL;
+	if (Transport::PM_SONG == transport.mode)
+		{
+		tempoMap = new TempoMap;
+		tempoMap->Update(renderSong);
+		}
+
+	// play the ticks, and mix up to the next tick after each one
+	Uint64 intervalNs = GetBPMInterval(renderSong->BPM);
+	GrooveTiming groove;
+	AutomationPlayer automation;
+	bool automationOn = (NULL != tempoMap && IsAutomationOn());
+	Uint64 tickTime = 0;
+	Uint64 frame = 0;
+	int songTick = 0;
+	for (int i = 0; i < count; i++)
+		{
+		DrumPattern* pattern = &renderSong->patterns[sequence[i]];
+		int patternTicks = pattern->GetLength() * TICKS_PER_STEP;
+		for (int tick = 0; tick < patternTicks; tick++)
+			{
+			if (tempoMap)
+				intervalNs = tempoMap->GetInterval(songTick);
+			groove.Update(&transport.groove, intervalNs);
+			PlayTickEvents(audio, pattern, tick, tickTime, &mix, &groove, &random, false);
+			automation.Update(audio, renderSong, tempoMap, automationOn, songTick + 1, tickTime + intervalNs);
+			songTick++;
+			tickTime += intervalNs;
+			RenderFrames(audio, &writer, block, &frame, audio->TimeToFrame(tickTime));
+			}
+		}
+
+	// let the last samples ring out
+	Uint64 endFrame = frame + (Uint64)RENDER_MAX_TAIL * audio->GetRate();
+	while (audio->GetActiveVoices() > 0 && frame < endFrame)
+		RenderFrames(audio, &writer, block, &frame, frame + RENDER_BLOCK_FRAMES);
+	RenderFrames(audio, &writer, block, &frame, frame + dynamics->GetLatency());
+
+	writer.Close();
+	delete [] block;
+	delete tempoMap;
+	delete audio;
+	delete dynamics;
+	delete renderSong;
+	return true;
+}
+
+/// Music hook - SDL_mixer calls this before it mixes the channels, so it
+/// marks the start of the audio callback (PXDrum does not play music)
+void mixStartHook(void *udata, Uint8 *stream, int len)
+{
+	engine.BeginMix();
+
+	// make the SDL audio thread real-time (the first time it runs - the
+	// result is reported by the UI thread)
+	static bool promoted = false;
+	if (!promoted)
+		{
+		promoted = true;
+		realtime.PromoteCurrentThread("Audio");
+		}
+
+	metrics.AudioMixStart();
+}
+
 // TEST 	
 // make a passthru processor function that does nothing...
 void noEffect(void *udata, Uint8 *stream, int len)
 {
+	// mix in the drum samples (and limit the mix - see dynamics.h)
+	engine.Mix(stream, len);
+
     // Get current output "level"
 	short* samples = (short *)stream;
 	short maxval = 0;
@@ -1846,9 +3503,57 @@ void noEffect(void *udata, Uint8 *stream, int len)
 		{
 		wavWriter.AppendData(stream, len);
 		}
+
+	metrics.AudioMixEnd();
 }
 //END TEST
 
+/// Export every song in a folder to a MIDI file (-exportmidi command line option)
+/// @param folder		Folder of songs
+/// @param outFolder	Folder to write the MIDI files to
+/// @param kitname		Drumkit with the MIDI notes and track names
+/// @return				Exit code
+int ExportMidiFolder(const char* folder, const char* outFolder, const char* kitname)
+{
+	DrumKit kit;
+	if (!kit.Load(kitname, no_progress_callback, false))
+		printf("Unable to read drumkit '%s', using General MIDI notes\n", kitname);
+
+	Uint64 start = HrTimeNanos();
+	MidiFileExporter exporter;
+	exporter.SetKit(&kit);
+	int exported = exporter.ExportFolder(folder, outFolder);
+	if (exported < 0)
+		return 1;
+
+	printf("Exported %d songs from %s to %s in %u ms\n", exported, folder, outFolder,
+			(Uint32)((HrTimeNanos() - start) / 1000000));
+	return 0;
+}
+
+/// Import every MIDI file in a folder as a song (-importmidi command line option)
+/// @param folder		Folder of MIDI files
+/// @param outFolder	Folder to save the songs in
+/// @param kitname		Drumkit with the MIDI notes of the tracks
+/// @return				Exit code
+int ImportMidiFolder(const char* folder, const char* outFolder, const char* kitname)
+{
+	DrumKit kit;
+	if (!kit.Load(kitname, no_progress_callback, false))
+		printf("Unable to read drumkit '%s', using General MIDI notes\n", kitname);
+
+	Uint64 start = HrTimeNanos();
+	MidiFileImporter importer;
+	importer.SetKit(&kit);
+	int imported = importer.ImportFolder(folder, outFolder);
+	if (imported < 0)
+		return 1;
+
+	printf("Imported %d MIDI files from %s to %s in %u ms\n", imported, folder, outFolder,
+			(Uint32)((HrTimeNanos() - start) / 1000000));
+	return 0;
+}
+
 // required for PSP (but not Linux !?!?)
 #ifdef __cplusplus 
 extern "C"
@@ -1870,6 +3575,94 @@ int main(int argc, char *argv[])
 
 	printf("PXDRUM V%s - Copyright James Higgs 2009\n", XDRUM_VER);
 
+	// command line options
+	// -rt				real-time audio mode (SCHED_FIFO)
+	// -rtrr			real-time audio mode (SCHED_RR)
+	// -rtprio N		real-time priority (default 70)
+	// -sync			sync tempo / start / stop with other instances on the network
+	// -synclo			as -sync, with instances on this host (loopback interface)
+	// -syncgroup A		sync multicast group (default 239.255.77.77)
+	// -syncport N		sync UDP port (default 7477)
+	// -osc				OSC remote control server
+	// -oscport N		OSC UDP port (default 9000)
+	// -midiin P		follow MIDI clock from raw MIDI device / named pipe P
+	// -midiout P		send MIDI clock to raw MIDI device / named pipe P
+	// -exportmidi D	export every song in folder D to a MIDI file, and quit
+	// -exportto D		folder for the MIDI files (default: the song folder)
+	// -importmidi D	import every MIDI file in folder D as a song, and quit
+	// -importto D		folder for the songs (default: the MIDI file folder)
+	// -midikit K		drumkit for the MIDI notes and track names (default "default")
+	RealtimeMode::RT_POLICY rtPolicy = RealtimeMode::RP_FIFO;
+	int rtPriority = RT_DEFAULT_PRIORITY;
+	bool rtEnable = false;
+	bool syncEnable = false;
+	bool syncLoopback = false;
+	const char* syncGroup = NETSYNC_DEFAULT_GROUP;
+	int syncPort = NETSYNC_DEFAULT_PORT;
+	bool oscEnable = false;
+	int oscPort = OSC_DEFAULT_PORT;
+	const char* midiIn = NULL;
+	const char* midiOut = NULL;
+	const char* exportFolder = NULL;
+	const char* exportOutFolder = NULL;
+	const char* importFolder = NULL;
+	const char* importOutFolder = NULL;
+	const char* midiKit = "default";
+	for (int i = 1; i < argc; i++)
+		{
+		if (0 == strcmp(argv[i], "-rt"))
+			rtEnable = true;
+		else if (0 == strcmp(argv[i], "-rtrr"))
+			{
+			rtEnable = true;
+			rtPolicy = RealtimeMode::RP_RR;
+			}
+		else if (0 == strcmp(argv[i], "-rtprio") && i + 1 < argc)
+			rtPriority = atoi(argv[++i]);
+		else if (0 == strcmp(argv[i], "-sync"))
+			syncEnable = true;
+		else if (0 == strcmp(argv[i], "-synclo"))
+			{
+			syncEnable = true;
+			syncLoopback = true;
+			}
+		else if (0 == strcmp(argv[i], "-syncgroup") && i + 1 < argc)
+			syncGroup = argv[++i];
+		else if (0 == strcmp(argv[i], "-syncport") && i + 1 < argc)
+			syncPort = atoi(argv[++i]);
+		else if (0 == strcmp(argv[i], "-osc"))
+			oscEnable = true;
+		else if (0 == strcmp(argv[i], "-oscport") && i + 1 < argc)
+			{
+			oscEnable = true;
+			oscPort = atoi(argv[++i]);
+			}
+		else if (0 == strcmp(argv[i], "-midiin") && i + 1 < argc)
+			midiIn = argv[++i];
+		else if (0 == strcmp(argv[i], "-midiout") && i + 1 < argc)
+			midiOut = argv[++i];
+		else if (0 == strcmp(argv[i], "-exportmidi") && i + 1 < argc)
+			exportFolder = argv[++i];
+		else if (0 == strcmp(argv[i], "-exportto") && i + 1 < argc)
+			exportOutFolder = argv[++i];
+		else if (0 == strcmp(argv[i], "-importmidi") && i + 1 < argc)
+			importFolder = argv[++i];
+		else if (0 == strcmp(argv[i], "-importto") && i + 1 < argc)
+			importOutFolder = argv[++i];
+		else if (0 == strcmp(argv[i], "-midikit") && i + 1 < argc)
+			midiKit = argv[++i];
+		else
+			printf("Unknown option %s\n", argv[i]);
+		}
+	if (rtEnable)
+		realtime.Enable(rtPolicy, rtPriority);
+
+	// batch MIDI export / import (no display or audio needed)
+	if (exportFolder)
+		return ExportMidiFolder(exportFolder, exportOutFolder ? exportOutFolder : exportFolder, midiKit);
+	if (importFolder)
+		return ImportMidiFolder(importFolder, importOutFolder ? importOutFolder : importFolder, midiKit);
+
 	// init fonts
 	bigFont = new FontEngine("gfx/font_8x16.bmp", 8, 16);
 	if (!bigFont)
@@ -1887,20 +3680,33 @@ int main(int argc, char *argv[])
 
 	currentPatternIndex = 0;
 	currentPattern = &song.patterns[currentPatternIndex];
-	currentPattern->events[0][0].vol = 100;
-	currentPattern->events[0][4].vol = 60;
+	currentPattern->SetVol(0, 0, 100);
+	currentPattern->SetVol(0, 4, 60);
 
 	SDL_Joystick *joystick = NULL;
 
 	// initialize SDL for audio, video and joystick
-	if(SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_JOYSTICK) < 0)
-        {
-                printf("init error: %s\n", SDL_GetError());
-                return 1;
-        }
+	// (with an event thread if the platform supports it, so that the UI
+	//  can sleep until input arrives)
+	bool haveEventThread = true;
+	if(SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_JOYSTICK | SDL_INIT_EVENTTHREAD) < 0)
+		{
+		SDL_Quit();
+		haveEventThread = false;
+		if(SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_JOYSTICK) < 0)
+			{
+			printf("init error: %s\n", SDL_GetError());
+			return 1;
+			}
+		}
+
+	if (!uiScheduler.Init(haveEventThread))
+		printf("Warning - UI scheduler not available, polling\n");
 
 
-	if((screen = SDL_SetVideoMode(VIEW_WIDTH, VIEW_HEIGHT, 32, SDL_HWSURFACE | SDL_DOUBLEBUF)) == NULL)
+	// NB: Software surface, so that we can update only the changed parts
+	//     of the screen (see presenter.h)
+	if((screen = SDL_SetVideoMode(VIEW_WIDTH, VIEW_HEIGHT, 32, SDL_SWSURFACE)) == NULL)
         {
                 printf("SetVideoMode: %s\n", SDL_GetError());
                 return 1;
@@ -1937,6 +3743,9 @@ int main(int argc, char *argv[])
 	int bits = audio_format & 0xFF;
 	printf("Opened audio at %d Hz %d bit %s, %d bytes audio buffer\n", audio_rate,
 			bits, audio_channels > 1 ? "stereo" : "mono", audio_buffers );
+	metrics.SetAudioSpec(audio_rate, audio_channels, audio_buffers);
+	engine.Init(audio_rate, audio_format, audio_channels, audio_buffers);
+	engine.SetDynamics(&masterDynamics);
 
 
 	SDL_Delay(3000);
@@ -1954,7 +3763,7 @@ int main(int argc, char *argv[])
 */
 
 	// Load default drumkit
-	if (!drumKit.Load("default", progress_callback))
+	if (!LoadDrumKit("default"))
 		{
 		DoMessage(screen, bigFont, "Error", "Cannot load drumkit 'default'!\nPlease select a drumkit.", false);
 		if (!PromptLoadDrumkit())
@@ -1964,11 +3773,36 @@ int main(int argc, char *argv[])
 			}
 		}
 
+	// Real-time mode - lock everything loaded so far into RAM (the audio
+	// and play threads make themselves real-time when they start)
+	if (realtime.IsEnabled())
+		{
+		realtime.CheckPrivileges();
+		realtime.LockAllMemory();
+		realtime.ReportPromotions();
+		if (realtime.HasProblems())
+			DoMessage(screen, bigFont, "Real-time mode", realtime.GetReport(), false);
+		}
+
+	// Recover unsaved edits from the last session (if it crashed),
+	// and journal all edits from now on
+	history.SetChangeCallbacks(JournalPatternChanged, JournalSongListChanged);
+	if (journal.Recover(song, progress_callback))
+		{
+		DoMessage(screen, bigFont, "Autosave", "Unsaved changes from the last\nsession have been recovered.", false);
+		song.Save(JOURNAL_BASE_FILE, progress_callback);
+		journal.Start(JOURNAL_BASE_FILE);
+		}
+	else
+		{
+		journal.Start("");
+		}
+
 	// Initial draw of everything
 	DrawAll();
 	
 	// And play a corresponding sound
-	Mix_PlayChannel(0, drumKit.drums[0].sampleData, 0);
+	engine.Play(ES_UI, drumKit.drums[0].sampleData, MIX_MAX_VOLUME, 128, ENGINE_NO_BUS, HrTimeNanos());
 
 
 	if(SDL_NumJoysticks())
@@ -1986,10 +3820,32 @@ int main(int argc, char *argv[])
 		printf("No joystick detected\n");
         }
 
-	// register noEffect as a postmix processor
+	// register noEffect as a postmix processor, and time the mixing
+	Mix_HookMusic(mixStartHook, NULL);
 	Mix_SetPostMix(noEffect, NULL);
 
-	// Create thread to play beats in the background
+	// join the other instances (before the play thread starts following them)
+	if (syncEnable && !netSync.Open(syncGroup, syncPort, syncLoopback))
+		DoMessage(screen, bigFont, "Network Sync", "Unable to join the sync group!", false);
+
+	// MIDI clock (the MIDI clock is followed instead of the other instances)
+	if (midiIn && !midiClock.OpenInput(midiIn))
+		DoMessage(screen, bigFont, "MIDI Clock", "Unable to open the MIDI input!", false);
+	if (midiOut)
+		{
+		if (engine.GetRate() > 0)
+			midiClock.SetOutputLatency(((Uint64)engine.GetDelayFrames() * 1000000000) / engine.GetRate());
+		if (!midiClock.OpenOutput(midiOut))
+			DoMessage(screen, bigFont, "MIDI Clock", "Unable to open the MIDI output!", false);
+		}
+
+	// remote control
+	if (oscEnable && !oscServer.Open(oscPort, &uiScheduler))
+		DoMessage(screen, bigFont, "OSC", "Unable to start the OSC server!", false);
+
+	// Create thread to play beats in the background (with the song's tempo
+	// map ready)
+	UpdatePlayTempoMap();
 	SDL_Thread *playThread = SDL_CreateThread(play_thread_func, NULL);
 	if (!playThread)
 		{
@@ -1997,8 +3853,9 @@ int main(int argc, char *argv[])
 		return 1;
 		}
 
-	// start playing
-	transport.playing = true;
+	// start playing (unless syncing - then wait for the others / the MIDI
+	// clock, or the play key)
+	transport.playing = !netSync.IsOpen() && !midiClock.IsInputOpen();
 	
 	// for detecting pattern change (when playing song mode)
 	int displayedPatternIndex = currentPatternIndex;
@@ -2007,6 +3864,7 @@ int main(int argc, char *argv[])
 	SDL_ShowCursor(SDL_DISABLE);
 	//Uint32 lastTick = SDL_GetTicks();
 	int currentZone = 0;
+	Uint32 lastMetricsUpdate = 0;
 	SDL_Event event;
 	quit = false;
 	while(!quit)
@@ -2018,6 +3876,7 @@ int main(int argc, char *argv[])
 				case SDL_JOYBUTTONDOWN:
 					//printf("Pressed button %d\n", event.jbutton.button);
 					//SDL_Delay(1000);
+					inputEventTime = uiScheduler.GetEventTime(&event);
 					ProcessControllerButtonPress(event.jbutton.button, (int)cursorX, (int)cursorY);	
 					break;
 				case SDL_JOYBUTTONUP:
@@ -2066,6 +3925,7 @@ int main(int argc, char *argv[])
 					break;
 				case SDL_KEYDOWN:
 					//printf("Key pressed: %d\n", event.key.keysym.sym);
+					inputEventTime = uiScheduler.GetEventTime(&event);
 					ProcessKeyPress(event.key.keysym.sym, currentZone);
 					break;
                 case SDL_QUIT:
@@ -2074,9 +3934,34 @@ int main(int argc, char *argv[])
 				} // end switch
 			}
 
+		// frame time is from here (menus and dialogs run modally inside the
+		// event handling, and waiting for them is not frame time)
+		metrics.BeginFrame();
+
 		// get current zone
 		currentZone = GetMouseZone((int)cursorX, (int)cursorY, XM_MAIN);
 
+		// OSC remote control commands
+		bool remotePending = oscServer.IsOpen() && ProcessRemoteCommands();
+
+		// compact autosave journal (in the background) if neccessary
+		journal.Update(song);
+
+		// rebuild the play thread's tempo map if the song has changed
+		UpdatePlayTempoMap();
+
+		// report the audio / play threads going real-time (they cannot
+		// print themselves)
+		realtime.ReportPromotions();
+
+		// Tempo or transport changed by another instance, the MIDI clock or
+		// the song's tempo map?
+		if (syncChanged)
+			{
+			syncChanged = false;
+			DrawAll();
+			}
+
 		// If we have chaned the pattern we're playing, we need to redraw
 		if (currentPatternIndex != displayedPatternIndex)
 			{
@@ -2090,40 +3975,51 @@ int main(int argc, char *argv[])
 			displayedSongPos = song.songPos;
 			}
 
-		// blit BG "layer" to screen
-		BlitBG();
-		
-		// OPTIONAL - flash pattern bg on beat
-		if (beatFlash)
+		// Grid follows the playback position (unless we are editing in it)
+		if (transport.playing && currentPattern && ZONE_PATGRID != currentZone)
 			{
-			dest = zones[ZONE_PATGRID];
-			SDL_FillRect(screen, &dest, SDL_MapRGB(screen->format, 200, 255, 200));
-			beatFlash = false;
+			int playPage = transport.patternPos / (STEPS_PER_PAGE * TICKS_PER_STEP);
+			if (playPage != gridPage && playPage * STEPS_PER_PAGE < currentPattern->GetLength())
+				{
+				gridPage = playPage;
+				DrawPatternGrid(backImg, currentPattern);
+				}
+			}
+
+		// show (and journal) live recorded notes (only the cells that
+		// changed are redrawn)
+		if (transport.playing && recorder.IsRecording())
+			{
+			DrawPatternGrid(backImg, currentPattern);
+			JournalRecording();
 			}
 
+		// Work out where the overlays (drawn straight to the screen) are
+		// OPTIONAL - flash pattern bg on beat
+		SDL_Rect flashRect = zones[ZONE_PATGRID];
+		presenter.SetOverlay(OV_BEATFLASH, beatFlash ? &flashRect : NULL, 0);
+		beatFlash = false;
+
 #ifdef LOCK_MOUSE_TO_GRID_CURSOR
 		// Lock grid cursor to mouse if mouse is in grid
 		if (ZONE_PATGRID == currentZone)
 			{
-			currentStep	= ((int)cursorX - zones[ZONE_PATGRID].x) / PATBOX.w;
+			currentStep	= gridPage * STEPS_PER_PAGE + ((int)cursorX - zones[ZONE_PATGRID].x) / PATBOX.w;
 			currentTrack = ((int)cursorY - zones[ZONE_PATGRID].y) / PATBOX.h;
 			}
 #endif		
-		// Draw pattern cursor
-		if (ZONE_PATGRID == currentZone)
-			{
-			SetSDLRect(src, 24, 0, PATBOX.w, PATBOX.h);
-			SetSDLRect(dest, zones[ZONE_PATGRID].x + currentStep * PATBOX.w, zones[ZONE_PATGRID].y + currentTrack * PATBOX.h, PATBOX.w, PATBOX.h);
-			SDL_BlitSurface(cursorImg, &src, screen, &dest);
-			}
-
-		// Draw playback bar
-		// TODO : blit from textures		
-		SetSDLRect(dest, 96 + (transport.patternPos * PATBOX.w / 4), 80, 4, 192);
-		if (0 == global_data)
-			SDL_FillRect(screen, &dest, SDL_MapRGB(screen->format, 0, 255, 0));
-		else // CPU struggling!
-			SDL_FillRect(screen, &dest, SDL_MapRGB(screen->format, 255, 0, 0));
+		// pattern cursor
+		SDL_Rect gridCursorRect;
+		SetSDLRect(gridCursorRect, zones[ZONE_PATGRID].x + (currentStep - gridPage * STEPS_PER_PAGE) * PATBOX.w, zones[ZONE_PATGRID].y + currentTrack * PATBOX.h, PATBOX.w, PATBOX.h);
+		presenter.SetOverlay(OV_GRIDCURSOR, (ZONE_PATGRID == currentZone) ? &gridCursorRect : NULL, 0);
+
+		// playback bar (if the playing page is displayed)
+		SDL_Rect playBarRect;
+		int playPos = transport.patternPos - gridPage * STEPS_PER_PAGE * TICKS_PER_STEP;
+		SetSDLRect(playBarRect, 96 + (playPos * PATBOX.w / TICKS_PER_STEP), 80, 4, 192);
+		bool showPlayBar = (playPos >= 0 && playPos < STEPS_PER_PAGE * TICKS_PER_STEP);
+		int cpuStruggling = global_data;
+		presenter.SetOverlay(OV_PLAYBAR, showPlayBar ? &playBarRect : NULL, cpuStruggling);
 
 		// Update "joystick mouse" position
 		if (ZONE_PATGRID == currentZone)
@@ -2140,31 +4036,101 @@ int main(int argc, char *argv[])
 		if (cursorX > VIEW_WIDTH - 1) cursorX = VIEW_WIDTH - 1;
 		if (cursorY < 0) cursorY = 0;
 		if (cursorY > VIEW_HEIGHT -1) cursorY = VIEW_HEIGHT -1;
-		// Draw mouse cursor
-		DrawCursor((int)cursorX, (int)cursorY);
-
-		// Draw output sample level
-		SetSDLRect(dest, 72, 68 - (outputSample / 200), 16, outputSample / 200);
-		SDL_FillRect(screen, &dest, SDL_MapRGB(screen->format, 0, 255, 0));
+		// mouse cursor
+		SDL_Rect mouseRect;
+		bool recording = wavWriter.IsWriting();
+		SetSDLRect(mouseRect, (int)cursorX, (int)cursorY, recording ? 32 : 16, recording ? 24 : 16);
+		presenter.SetOverlay(OV_MOUSE, &mouseRect, recording);
+
+		// output sample level
+		SDL_Rect levelRect;
+		int level = outputSample / 200;
+		SetSDLRect(levelRect, 72, 68 - level, 16, level);
+		presenter.SetOverlay(OV_LEVEL, (level > 0) ? &levelRect : NULL, 0);
+
+		// timing metrics
+		SDL_Rect metricsRect;
+		SetSDLRect(metricsRect, 100, VIEW_HEIGHT - 4 - METRICS_OVERLAY_LINES * 10, 240, METRICS_OVERLAY_LINES * 10);
+		if (showMetrics && (Sint32)(SDL_GetTicks() - lastMetricsUpdate) >= METRICS_UPDATE_INTERVAL)
+			{
+			metrics.SetActiveVoices(engine.GetActiveVoices() + Mix_Playing(-1));
+			metrics.UpdateOverlayText();
+			lastMetricsUpdate = SDL_GetTicks();
+			}
+		presenter.SetOverlay(OV_METRICS, showMetrics ? &metricsRect : NULL, metrics.GetOverlayKey());
+
+		// Copy changed parts of the BG "layer" to the screen, and draw
+		// the overlays that need it
+		presenter.RestoreBackground(backImg, screen);
+		if (presenter.NeedsDraw(OV_BEATFLASH))
+			SDL_FillRect(screen, &flashRect, SDL_MapRGB(screen->format, 200, 255, 200));
+		if (presenter.NeedsDraw(OV_GRIDCURSOR))
+			{
+			SetSDLRect(src, 24, 0, PATBOX.w, PATBOX.h);
+			SDL_BlitSurface(cursorImg, &src, screen, &gridCursorRect);
+			}
+		// TODO : blit from textures		
+		if (presenter.NeedsDraw(OV_PLAYBAR))
+			{
+			if (0 == cpuStruggling)
+				SDL_FillRect(screen, &playBarRect, SDL_MapRGB(screen->format, 0, 255, 0));
+			else // CPU struggling!
+				SDL_FillRect(screen, &playBarRect, SDL_MapRGB(screen->format, 255, 0, 0));
+			}
+		if (presenter.NeedsDraw(OV_LEVEL))
+			SDL_FillRect(screen, &levelRect, SDL_MapRGB(screen->format, 0, 255, 0));
+		if (presenter.NeedsDraw(OV_METRICS))
+			{
+			SDL_FillRect(screen, &metricsRect, g_bgColour);
+			for (int i = 0; i < METRICS_OVERLAY_LINES; i++)
+				{
+				SetSDLRect(dest, metricsRect.x + 4, metricsRect.y + 1 + i * 10, metricsRect.w - 8, 8);
+				smallFont->DrawTextDirect(screen, metrics.GetOverlayLine(i), dest, true);
+				}
+			}
+		if (presenter.NeedsDraw(OV_MOUSE))
+			DrawCursor((int)cursorX, (int)cursorY);
 
-		SDL_Flip(screen);			// waits for vsync
+		// Send changed areas to the display
+		presenter.Present(screen);
+		metrics.EndFrame(presenter.GetLastArea());
 		
-		// control update rate of this loop
-		//Uint32 time_remaining = 30 - (SDL_GetTicks() - lastTick);
-		//if (time_remaining > 0)
-		//	SDL_Delay(time_remaining);
-		//lastTick = SDL_GetTicks();
-		SDL_Delay(20);					// gives time to other threads
+		// Sleep until there is something to update (input, playhead
+		// moved, or animation below)
+		if (cursorDX != 0.0f || cursorDY != 0.0f || remotePending)
+			uiScheduler.RequestFrameIn(0);			// "joystick mouse" moving / more remote commands
+		if (level > 0)
+			uiScheduler.RequestFrameIn(METER_UPDATE_INTERVAL);
+		if (showMetrics)
+			uiScheduler.RequestFrameIn(METRICS_UPDATE_INTERVAL);
+		uiScheduler.WaitForFrame();
         } // wend
 
 	// clean up
 	// stop playing and close playback thread
 	transport.playing = false;
 	SDL_KillThread(playThread);
+	netSync.Close();
+	if (midiClock.IsInputOpen())
+		printf("MIDI clock: %u clocks, lost %u times\n", midiClock.GetClocksReceived(), midiClock.GetRelocks());
+	midiClock.Close();
+	if (oscServer.IsOpen())
+		{
+		printf("OSC: %u commands, %u dropped, %u not understood\n", oscServer.GetReceived(),
+				oscServer.GetDropped(), oscServer.GetBadMessages());
+		oscServer.Close();
+		}
 
 	if (wavWriter.IsOpen())
 		wavWriter.Close();
 
+	// clean exit - autosave journal no longer needed
+	journal.Close(true);
+
+	// dump the timing stats
+	metrics.PrintSummary();
+	metrics.WriteFile(METRICS_FILE);
+
 	// close joystick
 	if (joystick)
 		{
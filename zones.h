@@ -28,7 +28,7 @@ SDL_Rect zones[ZONE_MAX] = {
 	{ 96, 80, 384, 192 },		// pattern grid
 	{ 98, 0, 172, 16 },			// song name
 	{ 98, 16, 172, 16 },		// drumkit name
-	{ 98, 32, 172, 16 },		// options display (shuffle / volrand)
+	{ 98, 32, 172, 16 },		// options display (groove / volrand)
 	{ 98, 48, 172, 16 },		// mode 
 	{ 98, 64, 172, 16 },		// pattern name
 };